@@ -35,10 +35,33 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <stdio.h> /* file handling */
 #endif /* LODEPNG_COMPILE_DISK */
 
+/*mmap is not part of C, so it is only used on the systems known to have it*/
+#if defined(LODEPNG_COMPILE_DISK) && defined(LODEPNG_COMPILE_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define LODEPNG_MMAP
+#include <fcntl.h> /* open */
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h> /* close */
+#endif /* LODEPNG_COMPILE_MMAP */
+
 #ifdef LODEPNG_COMPILE_ALLOCATORS
 #include <stdlib.h> /* allocations */
 #endif /* LODEPNG_COMPILE_ALLOCATORS */
 
+/*SSE2 is part of every x86-64 CPU, so it is selected at compile time without runtime CPU detection*/
+#if defined(LODEPNG_COMPILE_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LODEPNG_SSE2
+#include <emmintrin.h>
+#endif /* LODEPNG_COMPILE_SIMD */
+
+/*the tasks of parallel_for count their memory against one limit with compare-and-swap, where the compiler has it*/
+#if defined(__ATOMIC_RELAXED)
+#define LODEPNG_ATOMIC
+#elif defined(_MSC_VER) && (_MSC_VER >= 1400)
+#define LODEPNG_ATOMIC
+#include <intrin.h>
+#endif /* __ATOMIC_RELAXED */
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -90,12 +113,35 @@ static void lodepng_free(void* ptr) {
   free(ptr);
 }
 #else /*LODEPNG_COMPILE_ALLOCATORS*/
-/* TODO: support giving additional void* payload to the custom allocators */
+/*for allocators with a context pointer, see the allocator in LodePNGDecompressSettings and LodePNGCompressSettings*/
 void* lodepng_malloc(size_t size);
 void* lodepng_realloc(void* ptr, size_t new_size);
 void lodepng_free(void* ptr);
 #endif /*LODEPNG_COMPILE_ALLOCATORS*/
 
+/*The allocation functions for the memory of one call, which use the functions of allocator if it has them,
+and lodepng_malloc, lodepng_realloc and lodepng_free otherwise. allocator may be 0.*/
+static void* allocator_malloc(const LodePNGAllocator* allocator, size_t size) {
+  if(!allocator || !allocator->malloc_func) return lodepng_malloc(size);
+#ifdef LODEPNG_MAX_ALLOC
+  if(size > LODEPNG_MAX_ALLOC) return 0;
+#endif
+  return allocator->malloc_func(size, allocator->context);
+}
+
+static void* allocator_realloc(const LodePNGAllocator* allocator, void* ptr, size_t new_size) {
+  if(!allocator || !allocator->realloc_func) return lodepng_realloc(ptr, new_size);
+#ifdef LODEPNG_MAX_ALLOC
+  if(new_size > LODEPNG_MAX_ALLOC) return 0;
+#endif
+  return allocator->realloc_func(ptr, new_size, allocator->context);
+}
+
+static void allocator_free(const LodePNGAllocator* allocator, void* ptr) {
+  if(!allocator || !allocator->free_func) lodepng_free(ptr);
+  else allocator->free_func(ptr, allocator->context);
+}
+
 /* convince the compiler to inline a function, for use when this measurably improves performance */
 /* inline is not available in C90, but use it when supported by the compiler */
 #if (defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)) || (defined(__cplusplus) && (__cplusplus >= 199711L))
@@ -218,11 +264,12 @@ typedef struct uivector {
   unsigned* data;
   size_t size; /*size in number of unsigned longs*/
   size_t allocsize; /*allocated size in bytes*/
+  const LodePNGAllocator* allocator; /*allocator of data, 0 for lodepng_malloc*/
 } uivector;
 
 static void uivector_cleanup(void* p) {
   ((uivector*)p)->size = ((uivector*)p)->allocsize = 0;
-  lodepng_free(((uivector*)p)->data);
+  allocator_free(((uivector*)p)->allocator, ((uivector*)p)->data);
   ((uivector*)p)->data = NULL;
 }
 
@@ -231,7 +278,7 @@ static unsigned uivector_resize(uivector* p, size_t size) {
   size_t allocsize = size * sizeof(unsigned);
   if(allocsize > p->allocsize) {
     size_t newsize = allocsize + (p->allocsize >> 1u);
-    void* data = lodepng_realloc(p->data, newsize);
+    void* data = allocator_realloc(p->allocator, p->data, newsize);
     if(data) {
       p->allocsize = newsize;
       p->data = (unsigned*)data;
@@ -242,9 +289,10 @@ static unsigned uivector_resize(uivector* p, size_t size) {
   return 1; /*success*/
 }
 
-static void uivector_init(uivector* p) {
+static void uivector_init(uivector* p, const LodePNGAllocator* allocator) {
   p->data = NULL;
   p->size = p->allocsize = 0;
+  p->allocator = allocator;
 }
 
 /*returns 1 if success, 0 if failure ==> nothing done*/
@@ -263,13 +311,14 @@ typedef struct ucvector {
   unsigned char* data;
   size_t size; /*used size*/
   size_t allocsize; /*allocated size*/
+  const LodePNGAllocator* allocator; /*allocator of data, 0 for lodepng_malloc*/
 } ucvector;
 
 /*returns 1 if success, 0 if failure ==> nothing done*/
 static unsigned ucvector_reserve(ucvector* p, size_t size) {
   if(size > p->allocsize) {
     size_t newsize = size + (p->allocsize >> 1u);
-    void* data = lodepng_realloc(p->data, newsize);
+    void* data = allocator_realloc(p->allocator, p->data, newsize);
     if(data) {
       p->allocsize = newsize;
       p->data = (unsigned char*)data;
@@ -289,9 +338,345 @@ static ucvector ucvector_init(unsigned char* buffer, size_t size) {
   ucvector v;
   v.data = buffer;
   v.allocsize = v.size = size;
+  v.allocator = 0;
+  return v;
+}
+
+/*ucvector_init for a buffer of allocator, which is also used for its reallocations*/
+static ucvector ucvector_init_with(unsigned char* buffer, size_t size, const LodePNGAllocator* allocator) {
+  ucvector v = ucvector_init(buffer, size);
+  v.allocator = allocator;
   return v;
 }
 
+#if (defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_DECODER)) || \
+    (defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_ENCODER))
+static void ucvector_cleanup(ucvector* p) {
+  allocator_free(p->allocator, p->data);
+  p->data = 0;
+  p->size = p->allocsize = 0;
+}
+#endif /*PNG decoder or zlib encoder*/
+
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*the bookkeeping before each allocation of an arena: its size and the position of the allocation before it.
+It is a multiple of LODEPNG_ARENA_ALIGN bytes, so that the allocations stay aligned.*/
+#define LODEPNG_ARENA_ALIGN 16u
+#define LODEPNG_ARENA_HEADER LODEPNG_ARENA_ALIGN
+
+void lodepng_arena_init(LodePNGArena* arena, void* buffer, size_t size) {
+  /*the first allocation starts at an aligned address, the conversion to size_t is implementation-defined but
+  gives the address on all common platforms*/
+  size_t skip = (LODEPNG_ARENA_ALIGN - (size_t)buffer % LODEPNG_ARENA_ALIGN) % LODEPNG_ARENA_ALIGN;
+  if(!buffer || size < skip) skip = size;
+  arena->buffer = (unsigned char*)buffer + skip;
+  arena->size = size - skip;
+  lodepng_arena_reset(arena);
+}
+
+void lodepng_arena_reset(LodePNGArena* arena) {
+  arena->used = 0;
+  arena->last = 0;
+}
+
+static size_t* arena_header(unsigned char* ptr) {
+  return (size_t*)(void*)(ptr - LODEPNG_ARENA_HEADER);
+}
+
+static void* arena_malloc(size_t size, void* context) {
+  LodePNGArena* arena = (LodePNGArena*)context;
+  size_t available = arena->size - arena->used;
+  size_t padded = size + (LODEPNG_ARENA_ALIGN - size % LODEPNG_ARENA_ALIGN) % LODEPNG_ARENA_ALIGN;
+  unsigned char* ptr;
+  if(padded < size || available < LODEPNG_ARENA_HEADER || available - LODEPNG_ARENA_HEADER < padded) return 0;
+  ptr = arena->buffer + arena->used + LODEPNG_ARENA_HEADER;
+  arena_header(ptr)[0] = size;
+  arena_header(ptr)[1] = arena->last;
+  arena->last = arena->used;
+  arena->used += LODEPNG_ARENA_HEADER + padded;
+  return ptr;
+}
+
+static void arena_free(void* ptr, void* context) {
+  LodePNGArena* arena = (LodePNGArena*)context;
+  if(!ptr) return;
+  /*only the last allocation can give its memory back*/
+  if((unsigned char*)ptr == arena->buffer + arena->last + LODEPNG_ARENA_HEADER) {
+    arena->used = arena->last;
+    arena->last = arena_header((unsigned char*)ptr)[1];
+  }
+}
+
+static void* arena_realloc(void* ptr, size_t new_size, void* context) {
+  LodePNGArena* arena = (LodePNGArena*)context;
+  size_t old_size;
+  unsigned char* result;
+  if(!ptr) return arena_malloc(new_size, context);
+  old_size = arena_header((unsigned char*)ptr)[0];
+  if((unsigned char*)ptr == arena->buffer + arena->last + LODEPNG_ARENA_HEADER) {
+    /*the last allocation grows or shrinks where it is*/
+    size_t available = arena->size - arena->last - LODEPNG_ARENA_HEADER;
+    size_t padded = new_size + (LODEPNG_ARENA_ALIGN - new_size % LODEPNG_ARENA_ALIGN) % LODEPNG_ARENA_ALIGN;
+    if(padded < new_size || padded > available) return 0;
+    arena_header((unsigned char*)ptr)[0] = new_size;
+    arena->used = arena->last + LODEPNG_ARENA_HEADER + padded;
+    return ptr;
+  }
+  result = (unsigned char*)arena_malloc(new_size, context);
+  if(result) lodepng_memcpy(result, ptr, LODEPNG_MIN(old_size, new_size));
+  return result;
+}
+
+void lodepng_arena_allocator(LodePNGAllocator* allocator, LodePNGArena* arena) {
+  allocator->malloc_func = arena_malloc;
+  allocator->realloc_func = arena_realloc;
+  allocator->free_func = arena_free;
+  allocator->context = arena;
+}
+
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#if defined(LODEPNG_COMPILE_ENCODER) || (defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_DECODER))
+
+/*a live allocation counted by a MemoryBudget*/
+typedef struct BudgetEntry {
+  void* ptr;
+  size_t size;
+} BudgetEntry;
+
+/*how many live allocations a MemoryBudget counts without allocating memory for its bookkeeping*/
+#define LODEPNG_BUDGET_ENTRIES 64u
+
+/*Counts the bytes of the live allocations made with an allocator during one decode or encode, and makes them
+fail beyond a limit, see max_memory and peak_memory. The entries are not thread safe: the tasks of parallel_for
+each get a budget of their own, see budget_fork, but with LODEPNG_ATOMIC they count in the same counter.*/
+typedef struct MemoryBudget {
+  const LodePNGAllocator* allocator; /*does the allocations*/
+  struct MemoryBudget* counter; /*the budget whose limit, used and peak count the allocations, often itself*/
+  size_t limit; /*the maximum of used*/
+  size_t used; /*bytes of the live allocations*/
+  size_t peak; /*the highest that used was*/
+  unsigned exceeded; /*whether an allocation failed because of limit*/
+  BudgetEntry* entries; /*the live allocations, the most recent last*/
+  size_t count;
+  size_t capacity;
+  BudgetEntry fixed[LODEPNG_BUDGET_ENTRIES]; /*the entries, until there are more than fit in it*/
+} MemoryBudget;
+
+/*limit is the value of max_memory, where 0 means no limit*/
+static void budget_init(MemoryBudget* budget, const LodePNGAllocator* allocator, size_t limit) {
+  budget->allocator = allocator;
+  budget->counter = budget;
+  budget->limit = limit ? limit : (size_t)(-1);
+  budget->used = budget->peak = 0;
+  budget->exceeded = 0;
+  budget->entries = budget->fixed;
+  budget->count = 0;
+  budget->capacity = LODEPNG_BUDGET_ENTRIES;
+}
+
+static void budget_cleanup(MemoryBudget* budget) {
+  if(budget->entries != budget->fixed) allocator_free(budget->allocator, budget->entries);
+  budget->entries = budget->fixed;
+  budget->count = 0;
+  budget->capacity = LODEPNG_BUDGET_ENTRIES;
+}
+
+/*reads a value of a counter, which other tasks may change at the same time with LODEPNG_ATOMIC*/
+static size_t budget_load(const size_t* p) {
+#if defined(__ATOMIC_RELAXED)
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+#else /*volatile reads are atomic for aligned words in Visual Studio*/
+  return *(const volatile size_t*)p;
+#endif /* __ATOMIC_RELAXED */
+}
+
+/*sets *p to desired if it is still expected, atomically with LODEPNG_ATOMIC, returns whether it did*/
+static unsigned budget_cas(size_t* p, size_t expected, size_t desired) {
+#if defined(__ATOMIC_RELAXED)
+  return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#elif defined(LODEPNG_ATOMIC) && defined(_WIN64)
+  return _InterlockedCompareExchange64((volatile __int64*)p, (__int64)desired, (__int64)expected)
+         == (__int64)expected;
+#elif defined(LODEPNG_ATOMIC)
+  return _InterlockedCompareExchange((volatile long*)p, (long)desired, (long)expected) == (long)expected;
+#else /*only one task counts in a counter*/
+  if(*p != expected) return 0;
+  *p = desired;
+  return 1;
+#endif /* __ATOMIC_RELAXED */
+}
+
+/*counts size more bytes in the counter of budget if they are within its limit, returns whether they were*/
+static unsigned budget_charge(MemoryBudget* budget, size_t size) {
+  MemoryBudget* counter = budget->counter;
+  size_t used, peak;
+  do {
+    used = budget_load(&counter->used);
+    if(size > counter->limit - used) {
+      budget->exceeded = 1;
+      return 0;
+    }
+  } while(!budget_cas(&counter->used, used, used + size));
+  used += size;
+  do {
+    peak = budget_load(&counter->peak);
+  } while(peak < used && !budget_cas(&counter->peak, peak, used));
+  return 1;
+}
+
+/*counts size bytes less in the counter of budget*/
+static void budget_release(MemoryBudget* budget, size_t size) {
+  MemoryBudget* counter = budget->counter;
+  size_t used;
+  do {
+    used = budget_load(&counter->used);
+  } while(!budget_cas(&counter->used, used, used - size));
+}
+
+/*makes room for one more entry, returns 0 if that fails*/
+static unsigned budget_reserve(MemoryBudget* budget) {
+  BudgetEntry* entries;
+  if(budget->count != budget->capacity) return 1;
+  /*the bookkeeping uses the allocator of the call too, but is not counted itself*/
+  entries = (BudgetEntry*)allocator_malloc(budget->allocator, 2u * budget->capacity * sizeof(BudgetEntry));
+  if(!entries) return 0;
+  lodepng_memcpy(entries, budget->entries, budget->count * sizeof(BudgetEntry));
+  if(budget->entries != budget->fixed) allocator_free(budget->allocator, budget->entries);
+  budget->entries = entries;
+  budget->capacity *= 2u;
+  return 1;
+}
+
+/*adds an entry, there must be room for it. Its size must already be counted with budget_charge.*/
+static void budget_add(MemoryBudget* budget, void* ptr, size_t size) {
+  budget->entries[budget->count].ptr = ptr;
+  budget->entries[budget->count].size = size;
+  ++budget->count;
+}
+
+/*returns the index of the entry of ptr, or count if there is none. Searches from the most recent one, since
+those are usually freed first.*/
+static size_t budget_find(const MemoryBudget* budget, const void* ptr) {
+  size_t i = budget->count;
+  while(i != 0) {
+    --i;
+    if(budget->entries[i].ptr == ptr) return i;
+  }
+  return budget->count;
+}
+
+static void* budget_malloc(size_t size, void* context) {
+  MemoryBudget* budget = (MemoryBudget*)context;
+  void* ptr;
+  if(!budget_reserve(budget) || !budget_charge(budget, size)) return 0;
+  ptr = allocator_malloc(budget->allocator, size);
+  if(ptr) budget_add(budget, ptr, size);
+  else budget_release(budget, size);
+  return ptr;
+}
+
+static void* budget_realloc(void* ptr, size_t new_size, void* context) {
+  MemoryBudget* budget = (MemoryBudget*)context;
+  size_t i = ptr ? budget_find(budget, ptr) : budget->count;
+  size_t old_size = i != budget->count ? budget->entries[i].size : 0;
+  size_t grow = new_size > old_size ? new_size - old_size : 0;
+  void* result;
+  if(i == budget->count && !budget_reserve(budget)) return 0;
+  if(grow && !budget_charge(budget, grow)) return 0;
+  result = allocator_realloc(budget->allocator, ptr, new_size);
+  if(!result) {
+    if(grow) budget_release(budget, grow);
+    return 0;
+  }
+  if(i == budget->count) {
+    budget_add(budget, result, new_size);
+  } else {
+    if(!grow) budget_release(budget, old_size - new_size);
+    budget->entries[i].ptr = result;
+    budget->entries[i].size = new_size;
+  }
+  return result;
+}
+
+static void budget_free(void* ptr, void* context) {
+  MemoryBudget* budget = (MemoryBudget*)context;
+  size_t i;
+  if(!ptr) return;
+  i = budget_find(budget, ptr);
+  if(i != budget->count) {
+    budget_release(budget, budget->entries[i].size);
+    for(; i + 1u < budget->count; ++i) budget->entries[i] = budget->entries[i + 1u];
+    --budget->count;
+  }
+  allocator_free(budget->allocator, ptr);
+}
+
+/*the allocator that counts its allocations in budget*/
+static LodePNGAllocator budget_allocator(MemoryBudget* budget) {
+  LodePNGAllocator allocator;
+  allocator.malloc_func = budget_malloc;
+  allocator.realloc_func = budget_realloc;
+  allocator.free_func = budget_free;
+  allocator.context = budget;
+  return allocator;
+}
+
+#ifdef LODEPNG_COMPILE_ENCODER
+/*If allocator counts in a MemoryBudget, returns a budget for each of the count tasks of a parallel_for, which
+must allocate with the budget_allocator of their own one. With LODEPNG_ATOMIC they all count against the limit
+of allocator, otherwise each gets an equal share of what is left of it. Returns 0 if the tasks can use allocator
+itself, or on alloc fail, which sets *error.*/
+static MemoryBudget* budget_fork(const LodePNGAllocator* allocator, size_t count, unsigned* error) {
+  MemoryBudget* budget;
+  MemoryBudget* tasks;
+  size_t i;
+  if(allocator->malloc_func != budget_malloc) return 0;
+  budget = (MemoryBudget*)allocator->context;
+  tasks = (MemoryBudget*)allocator_malloc(allocator, count * sizeof(*tasks));
+  if(!tasks) {
+    *error = 83; /*alloc fail*/
+    return 0;
+  }
+  for(i = 0; i != count; ++i) {
+    budget_init(&tasks[i], budget->allocator, 0);
+#ifdef LODEPNG_ATOMIC
+    tasks[i].counter = budget->counter;
+#else /*LODEPNG_ATOMIC*/
+    tasks[i].limit = (budget->counter->limit - budget->counter->used) / count;
+#endif /*LODEPNG_ATOMIC*/
+  }
+  return tasks;
+}
+
+/*Moves the live allocations of the tasks of budget_fork to the budget of allocator and frees tasks. Tasks that
+counted by themselves are counted in it now, with their peaks added up as if they happened at the same time.
+Returns error 83 if not all could be moved.*/
+static unsigned budget_join(const LodePNGAllocator* allocator, MemoryBudget* tasks, size_t count) {
+  MemoryBudget* budget = (MemoryBudget*)allocator->context;
+  MemoryBudget* counter = budget->counter;
+  size_t i, j, peak = counter->used;
+  unsigned error = 0;
+  for(i = 0; i != count; ++i) {
+    unsigned own = tasks[i].counter == &tasks[i];
+    if(own) peak += tasks[i].peak;
+    if(tasks[i].exceeded) budget->exceeded = 1;
+    for(j = 0; j != tasks[i].count; ++j) {
+      if(own) counter->used += tasks[i].entries[j].size;
+      if(budget_reserve(budget)) budget_add(budget, tasks[i].entries[j].ptr, tasks[i].entries[j].size);
+      else error = 83; /*alloc fail*/
+    }
+    budget_cleanup(&tasks[i]);
+  }
+  if(peak > counter->peak) counter->peak = peak;
+  allocator_free(allocator, tasks);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
+#endif /*LODEPNG_COMPILE_ENCODER || (LODEPNG_COMPILE_PNG && LODEPNG_COMPILE_DECODER)*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -372,13 +757,62 @@ unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* fil
 
 /*write given buffer to the file, overwriting the file, it doesn't append to it.*/
 unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const char* filename) {
+  unsigned error = 0;
   FILE* file = fopen(filename, "wb" );
   if(!file) return 79;
-  fwrite(buffer, 1, buffersize, file);
-  fclose(file);
+  if(buffersize && fwrite(buffer, 1, buffersize, file) != buffersize) error = 79;
+  /*the data may only be written out when closing, e.g. when the disk is full*/
+  if(fclose(file) != 0) error = 79;
+  return error;
+}
+
+#ifdef LODEPNG_MMAP
+unsigned lodepng_map_file(const unsigned char** out, size_t* outsize, const char* filename) {
+  struct stat st;
+  void* data;
+  int fd = open(filename, O_RDONLY);
+  *out = 0;
+  *outsize = 0;
+  if(fd < 0) return 78;
+  /*only regular files can be mapped, and their size must fit in memory*/
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 0 || (off_t)(size_t)st.st_size != st.st_size) {
+    close(fd);
+    return 78;
+  }
+  if(st.st_size == 0) {
+    close(fd);
+    return 0; /*nothing to map*/
+  }
+  data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); /*the mapping stays valid without the file descriptor*/
+  if(data == MAP_FAILED) return 78;
+  *out = (const unsigned char*)data;
+  *outsize = (size_t)st.st_size;
   return 0;
 }
 
+void lodepng_unmap_file(const unsigned char* buffer, size_t buffersize) {
+  if(buffer) munmap((void*)buffer, buffersize);
+}
+#else /*LODEPNG_MMAP*/
+unsigned lodepng_map_file(const unsigned char** out, size_t* outsize, const char* filename) {
+  unsigned char* buffer = 0;
+  unsigned error = lodepng_load_file(&buffer, outsize, filename);
+  if(error) {
+    lodepng_free(buffer);
+    buffer = 0;
+    *outsize = 0;
+  }
+  *out = buffer;
+  return error;
+}
+
+void lodepng_unmap_file(const unsigned char* buffer, size_t buffersize) {
+  (void)buffersize;
+  lodepng_free((void*)buffer);
+}
+#endif /*LODEPNG_MMAP*/
+
 #endif /*LODEPNG_COMPILE_DISK*/
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -387,24 +821,35 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
 /* ////////////////////////////////////////////////////////////////////////// */
 /* ////////////////////////////////////////////////////////////////////////// */
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/*the hash tables of the LZ77 encoder, defined below with LODEPNG_COMPILE_ZLIB. The PNG encoder can keep
+one from one image to the next, see LodePNGEncoderContext.*/
+typedef struct Hash Hash;
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 #ifdef LODEPNG_COMPILE_ZLIB
 #ifdef LODEPNG_COMPILE_ENCODER
 
 typedef struct {
   ucvector* data;
   unsigned char bp; /*ok to overflow, indicates bit pos inside byte*/
+  unsigned error; /*83 if data could not grow, after which nothing more is written*/
 } LodePNGBitWriter;
 
 static void LodePNGBitWriter_init(LodePNGBitWriter* writer, ucvector* data) {
   writer->data = data;
   writer->bp = 0;
+  writer->error = 0;
 }
 
-/*TODO: this ignores potential out of memory errors*/
 #define WRITEBIT(writer, bit){\
   /* append new byte */\
   if(((writer->bp) & 7u) == 0) {\
-    if(!ucvector_resize(writer->data, writer->data->size + 1)) return;\
+    if(writer->error) return;\
+    if(!ucvector_resize(writer->data, writer->data->size + 1)) {\
+      writer->error = 83; /*alloc fail*/\
+      return;\
+    }\
     writer->data->data[writer->data->size - 1] = 0;\
   }\
   (writer->data->data[writer->data->size - 1]) |= (bit << ((writer->bp) & 7u));\
@@ -612,23 +1057,43 @@ typedef struct HuffmanTree {
   unsigned* lengths; /*the lengths of the huffman codes*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  unsigned capacity; /*allocated amount of codes and lengths, kept when the tree is made again*/
   /* for reading only */
   unsigned char* table_len; /*length of symbol from lookup table, or max length if secondary lookup needed*/
   unsigned short* table_value; /*value of symbol from lookup table, or pointer to secondary table if needed*/
+  size_t tablecapacity; /*allocated size of table_len and table_value*/
+  const LodePNGAllocator* allocator; /*allocator of the arrays, 0 for lodepng_malloc*/
 } HuffmanTree;
 
-static void HuffmanTree_init(HuffmanTree* tree) {
+static void HuffmanTree_init(HuffmanTree* tree, const LodePNGAllocator* allocator) {
   tree->codes = 0;
   tree->lengths = 0;
+  tree->capacity = 0;
   tree->table_len = 0;
   tree->table_value = 0;
+  tree->tablecapacity = 0;
+  tree->allocator = allocator;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree) {
-  lodepng_free(tree->codes);
-  lodepng_free(tree->lengths);
-  lodepng_free(tree->table_len);
-  lodepng_free(tree->table_value);
+  allocator_free(tree->allocator, tree->codes);
+  allocator_free(tree->allocator, tree->lengths);
+  allocator_free(tree->allocator, tree->table_len);
+  allocator_free(tree->allocator, tree->table_value);
+}
+
+/*makes room for numcodes codes and lengths. A tree that is made again, such as the trees of the inflator for
+every block, keeps its allocation when it is large enough. Returns error code.*/
+static unsigned HuffmanTree_reserve(HuffmanTree* tree, size_t numcodes) {
+  if(numcodes <= tree->capacity) return 0;
+  allocator_free(tree->allocator, tree->codes);
+  allocator_free(tree->allocator, tree->lengths);
+  tree->capacity = 0;
+  tree->codes = (unsigned*)allocator_malloc(tree->allocator, numcodes * sizeof(unsigned));
+  tree->lengths = (unsigned*)allocator_malloc(tree->allocator, numcodes * sizeof(unsigned));
+  if(!tree->codes || !tree->lengths) return 83; /*alloc fail, freeing is done at a higher scope*/
+  tree->capacity = (unsigned)numcodes;
+  return 0;
 }
 
 /* amount of bits for first huffman table lookup (aka root bits), see HuffmanTree_makeTable and huffmanDecodeSymbol.*/
@@ -644,8 +1109,7 @@ static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
   static const unsigned headsize = 1u << FIRSTBITS; /*size of the first table*/
   static const unsigned mask = (1u << FIRSTBITS) /*headsize*/ - 1u;
   size_t i, numpresent, pointer, size; /*total table size*/
-  unsigned* maxlens = (unsigned*)lodepng_malloc(headsize * sizeof(unsigned));
-  if(!maxlens) return 83; /*alloc fail*/
+  unsigned maxlens[1u << FIRSTBITS];
 
   /* compute maxlens: max total bit length of symbols sharing prefix in the first table*/
   lodepng_memset(maxlens, 0, headsize * sizeof(*maxlens));
@@ -664,12 +1128,15 @@ static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
     unsigned l = maxlens[i];
     if(l > FIRSTBITS) size += (((size_t)1) << (l - FIRSTBITS));
   }
-  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(*tree->table_len));
-  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(*tree->table_value));
-  if(!tree->table_len || !tree->table_value) {
-    lodepng_free(maxlens);
+  if(size > tree->tablecapacity) {
+    allocator_free(tree->allocator, tree->table_len);
+    allocator_free(tree->allocator, tree->table_value);
+    tree->tablecapacity = 0;
+    tree->table_len = (unsigned char*)allocator_malloc(tree->allocator, size * sizeof(*tree->table_len));
+    tree->table_value = (unsigned short*)allocator_malloc(tree->allocator, size * sizeof(*tree->table_value));
     /* freeing tree->table values is done at a higher scope */
-    return 83; /*alloc fail*/
+    if(!tree->table_len || !tree->table_value) return 83; /*alloc fail*/
+    tree->tablecapacity = size;
   }
   /*initialize with an invalid length to indicate unused entries*/
   for(i = 0; i < size; ++i) tree->table_len[i] = 16;
@@ -683,7 +1150,6 @@ static unsigned HuffmanTree_makeTable(HuffmanTree* tree) {
     tree->table_value[i] = (unsigned short)pointer;
     pointer += (((size_t)1) << (l - FIRSTBITS));
   }
-  lodepng_free(maxlens);
 
   /*fill in the first table for short symbols, or secondary table for long symbols*/
   numpresent = 0;
@@ -762,39 +1228,28 @@ numcodes, lengths and maxbitlen must already be filled in correctly. return
 value is error.
 */
 static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree) {
-  unsigned* blcount;
-  unsigned* nextcode;
-  unsigned error = 0;
+  /*deflate codes are at most 15 bits long, the maxbitlen of all trees is 15 or 7*/
+  unsigned blcount[16];
+  unsigned nextcode[16];
   unsigned bits, n;
 
-  tree->codes = (unsigned*)lodepng_malloc(tree->numcodes * sizeof(unsigned));
-  blcount = (unsigned*)lodepng_malloc((tree->maxbitlen + 1) * sizeof(unsigned));
-  nextcode = (unsigned*)lodepng_malloc((tree->maxbitlen + 1) * sizeof(unsigned));
-  if(!tree->codes || !blcount || !nextcode) error = 83; /*alloc fail*/
-
-  if(!error) {
-    for(n = 0; n != tree->maxbitlen + 1; n++) blcount[n] = nextcode[n] = 0;
-    /*step 1: count number of instances of each code length*/
-    for(bits = 0; bits != tree->numcodes; ++bits) ++blcount[tree->lengths[bits]];
-    /*step 2: generate the nextcode values*/
-    for(bits = 1; bits <= tree->maxbitlen; ++bits) {
-      nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1u;
-    }
-    /*step 3: generate all the codes*/
-    for(n = 0; n != tree->numcodes; ++n) {
-      if(tree->lengths[n] != 0) {
-        tree->codes[n] = nextcode[tree->lengths[n]]++;
-        /*remove superfluous bits from the code*/
-        tree->codes[n] &= ((1u << tree->lengths[n]) - 1u);
-      }
+  for(n = 0; n != 16; n++) blcount[n] = nextcode[n] = 0;
+  /*step 1: count number of instances of each code length*/
+  for(bits = 0; bits != tree->numcodes; ++bits) ++blcount[tree->lengths[bits]];
+  /*step 2: generate the nextcode values*/
+  for(bits = 1; bits <= tree->maxbitlen; ++bits) {
+    nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1u;
+  }
+  /*step 3: generate all the codes*/
+  for(n = 0; n != tree->numcodes; ++n) {
+    if(tree->lengths[n] != 0) {
+      tree->codes[n] = nextcode[tree->lengths[n]]++;
+      /*remove superfluous bits from the code*/
+      tree->codes[n] &= ((1u << tree->lengths[n]) - 1u);
     }
   }
 
-  lodepng_free(blcount);
-  lodepng_free(nextcode);
-
-  if(!error) error = HuffmanTree_makeTable(tree);
-  return error;
+  return HuffmanTree_makeTable(tree);
 }
 
 /*
@@ -805,8 +1260,7 @@ return value is error.
 static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* bitlen,
                                             size_t numcodes, unsigned maxbitlen) {
   unsigned i;
-  tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
-  if(!tree->lengths) return 83; /*alloc fail*/
+  CERROR_TRY_RETURN(HuffmanTree_reserve(tree, numcodes));
   for(i = 0; i != numcodes; ++i) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   tree->maxbitlen = maxbitlen;
@@ -869,10 +1323,11 @@ static BPMNode* bpmnode_create(BPMLists* lists, int weight, unsigned index, BPMN
   return result;
 }
 
-/*sort the leaves with stable mergesort*/
-static void bpmnode_sort(BPMNode* leaves, size_t num) {
-  BPMNode* mem = (BPMNode*)lodepng_malloc(sizeof(*leaves) * num);
+/*sort the leaves with stable mergesort, returns error code*/
+static unsigned bpmnode_sort(BPMNode* leaves, size_t num, const LodePNGAllocator* allocator) {
+  BPMNode* mem = (BPMNode*)allocator_malloc(allocator, sizeof(*leaves) * num);
   size_t width, counter = 0;
+  if(!mem) return 83; /*alloc fail*/
   for(width = 1; width < num; width *= 2) {
     BPMNode* a = (counter & 1) ? mem : leaves;
     BPMNode* b = (counter & 1) ? leaves : mem;
@@ -889,7 +1344,8 @@ static void bpmnode_sort(BPMNode* leaves, size_t num) {
     counter++;
   }
   if(counter & 1) lodepng_memcpy(leaves, mem, sizeof(*leaves) * num);
-  lodepng_free(mem);
+  allocator_free(allocator, mem);
+  return 0;
 }
 
 /*Boundary Package Merge step, numpresent is the amount of leaves, and c is the current chain.*/
@@ -918,8 +1374,9 @@ static void boundaryPM(BPMLists* lists, BPMNode* leaves, size_t numpresent, int
   }
 }
 
-unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
-                                      size_t numcodes, unsigned maxbitlen) {
+/*lodepng_huffman_code_lengths with the working memory from allocator, which may be 0*/
+static unsigned huffman_code_lengths(unsigned* lengths, const unsigned* frequencies, size_t numcodes,
+                                     unsigned maxbitlen, const LodePNGAllocator* allocator) {
   unsigned error = 0;
   unsigned i;
   size_t numpresent = 0; /*number of symbols with non-zero frequency*/
@@ -928,7 +1385,7 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
   if(numcodes == 0) return 80; /*error: a tree of 0 symbols is not supposed to be made*/
   if((1u << maxbitlen) < (unsigned)numcodes) return 80; /*error: represent all symbols*/
 
-  leaves = (BPMNode*)lodepng_malloc(numcodes * sizeof(*leaves));
+  leaves = (BPMNode*)allocator_malloc(allocator, numcodes * sizeof(*leaves));
   if(!leaves) return 83; /*alloc fail*/
 
   for(i = 0; i != numcodes; ++i) {
@@ -955,16 +1412,16 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
     BPMLists lists;
     BPMNode* node;
 
-    bpmnode_sort(leaves, numpresent);
+    error = bpmnode_sort(leaves, numpresent, allocator);
 
     lists.listsize = maxbitlen;
     lists.memsize = 2 * maxbitlen * (maxbitlen + 1);
     lists.nextfree = 0;
     lists.numfree = lists.memsize;
-    lists.memory = (BPMNode*)lodepng_malloc(lists.memsize * sizeof(*lists.memory));
-    lists.freelist = (BPMNode**)lodepng_malloc(lists.memsize * sizeof(BPMNode*));
-    lists.chains0 = (BPMNode**)lodepng_malloc(lists.listsize * sizeof(BPMNode*));
-    lists.chains1 = (BPMNode**)lodepng_malloc(lists.listsize * sizeof(BPMNode*));
+    lists.memory = (BPMNode*)allocator_malloc(allocator, lists.memsize * sizeof(*lists.memory));
+    lists.freelist = (BPMNode**)allocator_malloc(allocator, lists.memsize * sizeof(BPMNode*));
+    lists.chains0 = (BPMNode**)allocator_malloc(allocator, lists.listsize * sizeof(BPMNode*));
+    lists.chains1 = (BPMNode**)allocator_malloc(allocator, lists.listsize * sizeof(BPMNode*));
     if(!lists.memory || !lists.freelist || !lists.chains0 || !lists.chains1) error = 83; /*alloc fail*/
 
     if(!error) {
@@ -986,27 +1443,31 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
       }
     }
 
-    lodepng_free(lists.memory);
-    lodepng_free(lists.freelist);
-    lodepng_free(lists.chains0);
-    lodepng_free(lists.chains1);
+    allocator_free(allocator, lists.chains1);
+    allocator_free(allocator, lists.chains0);
+    allocator_free(allocator, lists.freelist);
+    allocator_free(allocator, lists.memory);
   }
 
-  lodepng_free(leaves);
+  allocator_free(allocator, leaves);
   return error;
 }
 
+unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
+                                      size_t numcodes, unsigned maxbitlen) {
+  return huffman_code_lengths(lengths, frequencies, numcodes, maxbitlen, 0);
+}
+
 /*Create the Huffman tree given the symbol frequencies*/
 static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigned* frequencies,
                                                 size_t mincodes, size_t numcodes, unsigned maxbitlen) {
   unsigned error = 0;
   while(!frequencies[numcodes - 1] && numcodes > mincodes) --numcodes; /*trim zeroes*/
-  tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
-  if(!tree->lengths) return 83; /*alloc fail*/
+  CERROR_TRY_RETURN(HuffmanTree_reserve(tree, numcodes));
   tree->maxbitlen = maxbitlen;
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
 
-  error = lodepng_huffman_code_lengths(tree->lengths, frequencies, numcodes, maxbitlen);
+  error = huffman_code_lengths(tree->lengths, frequencies, numcodes, maxbitlen, tree->allocator);
   if(!error) error = HuffmanTree_makeFromLengths2(tree);
   return error;
 }
@@ -1014,9 +1475,8 @@ static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigne
 
 /*get the literal and length code tree of a deflated block with fixed tree, as per the deflate specification*/
 static unsigned generateFixedLitLenTree(HuffmanTree* tree) {
-  unsigned i, error = 0;
-  unsigned* bitlen = (unsigned*)lodepng_malloc(NUM_DEFLATE_CODE_SYMBOLS * sizeof(unsigned));
-  if(!bitlen) return 83; /*alloc fail*/
+  unsigned i;
+  unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
 
   /*288 possible codes: 0-255=literals, 256=endcode, 257-285=lengthcodes, 286-287=unused*/
   for(i =   0; i <= 143; ++i) bitlen[i] = 8;
@@ -1024,24 +1484,17 @@ static unsigned generateFixedLitLenTree(HuffmanTree* tree) {
   for(i = 256; i <= 279; ++i) bitlen[i] = 7;
   for(i = 280; i <= 287; ++i) bitlen[i] = 8;
 
-  error = HuffmanTree_makeFromLengths(tree, bitlen, NUM_DEFLATE_CODE_SYMBOLS, 15);
-
-  lodepng_free(bitlen);
-  return error;
+  return HuffmanTree_makeFromLengths(tree, bitlen, NUM_DEFLATE_CODE_SYMBOLS, 15);
 }
 
 /*get the distance code tree of a deflated block with fixed tree, as specified in the deflate specification*/
 static unsigned generateFixedDistanceTree(HuffmanTree* tree) {
-  unsigned i, error = 0;
-  unsigned* bitlen = (unsigned*)lodepng_malloc(NUM_DISTANCE_SYMBOLS * sizeof(unsigned));
-  if(!bitlen) return 83; /*alloc fail*/
+  unsigned i;
+  unsigned bitlen[NUM_DISTANCE_SYMBOLS];
 
   /*there are 32 distance codes, but 30-31 are unused*/
   for(i = 0; i != NUM_DISTANCE_SYMBOLS; ++i) bitlen[i] = 5;
-  error = HuffmanTree_makeFromLengths(tree, bitlen, NUM_DISTANCE_SYMBOLS, 15);
-
-  lodepng_free(bitlen);
-  return error;
+  return HuffmanTree_makeFromLengths(tree, bitlen, NUM_DISTANCE_SYMBOLS, 15);
 }
 
 #ifdef LODEPNG_COMPILE_DECODER
@@ -1063,6 +1516,26 @@ static unsigned huffmanDecodeSymbol(LodePNGBitReader* reader, const HuffmanTree*
     return codetree->table_value[value];
   }
 }
+
+/*
+Decodes the symbol at the start of the nbits bits given in code, the way huffmanDecodeSymbol does from
+the bit reader, and outputs its length in bits to *len. Returns INVALIDSYMBOL if the symbol is longer
+than nbits bits or not valid.
+*/
+static unsigned huffmanPeekSymbol(const HuffmanTree* codetree, unsigned code, unsigned nbits, unsigned* len) {
+  unsigned index = code & ((1u << FIRSTBITS) - 1u);
+  unsigned l = codetree->table_len[index];
+  unsigned value = codetree->table_value[index];
+  if(l > FIRSTBITS) {
+    if(l > nbits) return INVALIDSYMBOL; /*not enough bits for the secondary table index*/
+    value += (code >> FIRSTBITS) & ((1u << (l - FIRSTBITS)) - 1u);
+    l = codetree->table_len[value];
+    value = codetree->table_value[value];
+  }
+  if(l > nbits) return INVALIDSYMBOL;
+  *len = l;
+  return value;
+}
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_DECODER
@@ -1079,19 +1552,19 @@ static unsigned getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d) {
   return generateFixedDistanceTree(tree_d);
 }
 
-/*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
+/*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree,
+which is made in tree_cl (the code tree for code length codes, the huffman tree for compressed huffman trees)*/
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, HuffmanTree* tree_cl,
                                       LodePNGBitReader* reader) {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
-  unsigned* bitlen_ll = 0; /*lit,len code lengths*/
-  unsigned* bitlen_d = 0; /*dist code lengths*/
+  unsigned bitlen_ll[NUM_DEFLATE_CODE_SYMBOLS]; /*lit,len code lengths*/
+  unsigned bitlen_d[NUM_DISTANCE_SYMBOLS]; /*dist code lengths*/
   /*code length code lengths ("clcl"), the bit lengths of the huffman tree used to compress bitlen_ll and bitlen_d*/
-  unsigned* bitlen_cl = 0;
-  HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
+  unsigned bitlen_cl[NUM_CODE_LENGTH_CODES];
 
   if(reader->bitsize - reader->bp < 14) return 49; /*error: the bit pointer is or will go past the memory*/
   ensureBits17(reader, 14);
@@ -1103,11 +1576,6 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
   HCLEN = readBits(reader, 4) + 4;
 
-  bitlen_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(unsigned));
-  if(!bitlen_cl) return 83 /*alloc fail*/;
-
-  HuffmanTree_init(&tree_cl);
-
   while(!error) {
     /*read the code length codes out of 3 * (amount of code length codes) bits*/
     if(lodepng_gtofl(reader->bp, HCLEN * 3, reader->bitsize)) {
@@ -1121,13 +1589,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       bitlen_cl[CLCL_ORDER[i]] = 0;
     }
 
-    error = HuffmanTree_makeFromLengths(&tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
+    error = HuffmanTree_makeFromLengths(tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
     if(error) break;
 
     /*now we can use this tree to read the lengths for the tree that this function will return*/
-    bitlen_ll = (unsigned*)lodepng_malloc(NUM_DEFLATE_CODE_SYMBOLS * sizeof(unsigned));
-    bitlen_d = (unsigned*)lodepng_malloc(NUM_DISTANCE_SYMBOLS * sizeof(unsigned));
-    if(!bitlen_ll || !bitlen_d) ERROR_BREAK(83 /*alloc fail*/);
     lodepng_memset(bitlen_ll, 0, NUM_DEFLATE_CODE_SYMBOLS * sizeof(*bitlen_ll));
     lodepng_memset(bitlen_d, 0, NUM_DISTANCE_SYMBOLS * sizeof(*bitlen_d));
 
@@ -1136,7 +1601,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     while(i < HLIT + HDIST) {
       unsigned code;
       ensureBits25(reader, 22); /* up to 15 bits for huffman code, up to 7 extra bits below*/
-      code = huffmanDecodeSymbol(reader, &tree_cl);
+      code = huffmanDecodeSymbol(reader, tree_cl);
       if(code <= 15) /*a length code*/ {
         if(i < HLIT) bitlen_ll[i] = code;
         else bitlen_d[i - HLIT] = code;
@@ -1205,35 +1670,260 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     break; /*end of error-while*/
   }
 
-  lodepng_free(bitlen_cl);
-  lodepng_free(bitlen_ll);
-  lodepng_free(bitlen_d);
-  HuffmanTree_cleanup(&tree_cl);
-
   return error;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree. btype must be 1 or 2.*/
-static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
-                                    unsigned btype, size_t max_output_size) {
+/*inflator modes, see Inflator*/
+#define INFLATE_BLOCK_HEADER 0u /*at the start of a block*/
+#define INFLATE_STORED 1u /*inside a block without compression*/
+#define INFLATE_HUFFMAN 2u /*inside a block with fixed or dynamic huffman codes*/
+#define INFLATE_DONE 3u /*the final block has ended*/
+
+/*
+State of the inflator between calls of inflator_run. Inflating can be suspended in the
+middle of a block, either because the input ran out (when more input may still follow,
+as in the streaming PNG decoder) or because the requested amount of output is reached.
+*/
+typedef struct Inflator {
+  unsigned mode; /*one of the INFLATE_ modes*/
+  unsigned bfinal; /*whether the current block is the last one*/
+  size_t stored_left; /*remaining bytes of the current block without compression*/
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes of the current block*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes of the current block*/
+  HuffmanTree tree_cl; /*the huffman tree for the code lengths of tree_ll and tree_d*/
+  unsigned* table_fast; /*multi-symbol lookup table for tree_ll, see inflateMakeFastTable. Kept for the next blocks.*/
+  const LodePNGAllocator* allocator; /*allocator of the trees and table_fast, 0 for lodepng_malloc*/
+} Inflator;
+
+static void inflator_init(Inflator* inflator, const LodePNGAllocator* allocator) {
+  inflator->mode = INFLATE_BLOCK_HEADER;
+  inflator->bfinal = 0;
+  inflator->stored_left = 0;
+  HuffmanTree_init(&inflator->tree_ll, allocator);
+  HuffmanTree_init(&inflator->tree_d, allocator);
+  HuffmanTree_init(&inflator->tree_cl, allocator);
+  inflator->table_fast = 0;
+  inflator->allocator = allocator;
+}
+
+static void inflator_cleanup(Inflator* inflator) {
+  HuffmanTree_cleanup(&inflator->tree_ll);
+  HuffmanTree_cleanup(&inflator->tree_d);
+  HuffmanTree_cleanup(&inflator->tree_cl);
+  allocator_free(inflator->allocator, inflator->table_fast);
+}
+
+#ifdef LODEPNG_COMPILE_PNG
+/*prepares the inflator for a new deflate stream, keeping the memory of its trees and tables*/
+static void inflator_reset(Inflator* inflator) {
+  inflator->mode = INFLATE_BLOCK_HEADER;
+  inflator->bfinal = 0;
+  inflator->stored_left = 0;
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
+/*goes to the next block. The trees keep their memory, the next block makes them again.*/
+static void inflator_end_block(Inflator* inflator) {
+  inflator->mode = inflator->bfinal ? INFLATE_DONE : INFLATE_BLOCK_HEADER;
+}
+
+/*amount of bits for the lookup in table_fast. Each entry decodes up to two literals, or a length code
+together with its extra bits, as long as they fit in these bits.*/
+#define FASTBITS 12u
+
+/*
+The entries of table_fast: the lowest 5 bits are the amount of bits to advance, the next 3 bits the kind
+of entry, and the bits from bit 8 the value: one literal, two literals (the first in bits 8-15, the
+second in bits 16-23), or a length of 3-258 including its extra bits. FAST_SLOW means the symbol must be
+decoded with huffmanDecodeSymbol instead.
+*/
+#define FAST_SLOW 0u
+#define FAST_LITERAL 1u
+#define FAST_TWO_LITERALS 2u
+#define FAST_LENGTH 3u
+
+static void inflateMakeFastTable(unsigned* table, const HuffmanTree* tree_ll) {
+  unsigned i;
+  for(i = 0; i != (1u << FASTBITS); ++i) {
+    unsigned len, len2;
+    unsigned symbol = huffmanPeekSymbol(tree_ll, i, FASTBITS, &len);
+    unsigned entry = FAST_SLOW;
+    if(symbol <= 255) {
+      unsigned symbol2 = huffmanPeekSymbol(tree_ll, i >> len, FASTBITS - len, &len2);
+      if(symbol2 <= 255) entry = (len + len2) | (FAST_TWO_LITERALS << 5u) | (symbol << 8u) | (symbol2 << 16u);
+      else entry = len | (FAST_LITERAL << 5u) | (symbol << 8u);
+    } else if(symbol >= FIRST_LENGTH_CODE_INDEX && symbol <= LAST_LENGTH_CODE_INDEX) {
+      unsigned numextrabits = LENGTHEXTRA[symbol - FIRST_LENGTH_CODE_INDEX];
+      if(len + numextrabits <= FASTBITS) {
+        unsigned length = LENGTHBASE[symbol - FIRST_LENGTH_CODE_INDEX] + ((i >> len) & ((1u << numextrabits) - 1u));
+        entry = (len + numextrabits) | (FAST_LENGTH << 5u) | (length << 8u);
+      }
+    }
+    table[i] = entry;
+  }
+}
+
+/*
+Copies the match of length bytes at distance back to position start, which may overlap. Copies 8 or 16
+bytes at a time, so it can write up to 15 bytes past the end of the match, which must be allocated. Those
+bytes are not part of the output yet, the next symbols overwrite them.
+*/
+static void inflateCopyMatch(unsigned char* data, size_t start, size_t distance, size_t length) {
+  unsigned char* dst = data + start;
+  unsigned char* end = dst + length;
+  const unsigned char* src = dst - distance;
+  if(distance >= 16) {
+    do {
+      lodepng_memcpy(dst, src, 16);
+      dst += 16;
+      src += 16;
+    } while(dst < end);
+  } else if(distance == 1) {
+    /*a run of the same byte, very common in filtered PNG data*/
+    unsigned char value = *src;
+    do {
+      lodepng_memset(dst, value, 16);
+      dst += 16;
+    } while(dst < end);
+  } else {
+    /*extend the repeating pattern byte per byte, until a multiple of distance of at least 8 bytes
+    is available, then copy the pattern from that multiple back, 8 bytes at a time*/
+    size_t distance2 = distance * ((7 + distance) / distance);
+    unsigned char* pattern_end = dst + distance2 - distance;
+    while(dst < pattern_end) *dst++ = *src++;
+    src = dst - distance2;
+    while(dst < end) {
+      lodepng_memcpy(dst, src, 8);
+      dst += 8;
+      src += 8;
+    }
+  }
+}
+
+/*
+Fast path of inflateHuffmanBlock, for while there is enough input and output space to not need
+the bounds checks per symbol: decodes symbols until out->size reaches out_end, which must leave
+space for a maximum length match and what inflateCopyMatch writes past it in the allocated size,
+or until the input is nearly used up.
+Stops before the end code or an invalid symbol, leaving those to inflateHuffmanBlock.
+*/
+static unsigned inflateHuffmanFast(const Inflator* inflator, ucvector* out, LodePNGBitReader* reader,
+                                   size_t out_end) {
   unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  const size_t reserved_size = 260; /* must be at least 258 for max length, and a few extra for adding a few extra literals */
-  int done = 0;
+  const unsigned* table = inflator->table_fast;
+  HuffmanTree tree_ll = inflator->tree_ll;
+  HuffmanTree tree_d = inflator->tree_d;
+  /*local copy, so the compiler knows writing output does not change it*/
+  LodePNGBitReader r = *reader;
+  unsigned char* data = out->data;
+  size_t size = out->size;
+  /*a symbol with its distance is at most 48 bits, and ensureBits32 reads up to 5 bytes*/
+  size_t in_end = r.size > 12u ? r.size - 12u : 0;
+
+  while(size < out_end && (r.bp >> 3u) < in_end) {
+    unsigned entry, kind, code_d, distance, numextrabits_d;
+    size_t length;
+    ensureBits32(&r, 32);
+    entry = table[peekBits(&r, FASTBITS)];
+    kind = (entry >> 5u) & 7u;
+    if(kind == FAST_LITERAL || kind == FAST_TWO_LITERALS) {
+      /*literals are the most common, decode a second entry from the 32 ensured bits*/
+      advanceBits(&r, entry & 31u);
+      data[size] = (unsigned char)(entry >> 8u);
+      data[size + 1] = (unsigned char)(entry >> 16u);
+      size += kind;
+      entry = table[peekBits(&r, FASTBITS)];
+      kind = (entry >> 5u) & 7u;
+      if(kind == FAST_LITERAL || kind == FAST_TWO_LITERALS) {
+        advanceBits(&r, entry & 31u);
+        data[size] = (unsigned char)(entry >> 8u);
+        data[size + 1] = (unsigned char)(entry >> 16u);
+        size += kind;
+        continue;
+      }
+    }
+    /*at least 20 of the ensured bits remain here, enough for the length code*/
+    if(kind == FAST_LENGTH) {
+      advanceBits(&r, entry & 31u);
+      length = entry >> 8u;
+    } else {
+      size_t bp = r.bp;
+      unsigned code_ll = huffmanDecodeSymbol(&r, &tree_ll);
+      if(code_ll <= 255) {
+        data[size++] = (unsigned char)code_ll;
+        continue;
+      } else if(code_ll < FIRST_LENGTH_CODE_INDEX || code_ll > LAST_LENGTH_CODE_INDEX) {
+        r.bp = bp; /*the end code or an invalid symbol*/
+        break;
+      }
+      length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
+      if(LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX] != 0) {
+        ensureBits25(&r, 5);
+        length += readBits(&r, LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX]);
+      }
+    }
 
-  if(!ucvector_reserve(out, out->size + reserved_size)) return 83; /*alloc fail*/
+    ensureBits32(&r, 28); /* up to 15 for the huffman symbol, up to 13 for the extra bits */
+    code_d = huffmanDecodeSymbol(&r, &tree_d);
+    if(code_d > 29) {
+      if(code_d <= 31) {
+        ERROR_BREAK(18); /*error: invalid distance code (30-31 are never used)*/
+      } else /* if(code_d == INVALIDSYMBOL) */{
+        ERROR_BREAK(16); /*error: tried to read disallowed huffman symbol*/
+      }
+    }
+    distance = DISTANCEBASE[code_d];
+    numextrabits_d = DISTANCEEXTRA[code_d];
+    if(numextrabits_d != 0) distance += readBits(&r, numextrabits_d);
+    if(distance > size) ERROR_BREAK(52); /*too long backward distance*/
+    inflateCopyMatch(data, size, distance, length);
+    size += length;
+  }
+
+  *reader = r;
+  out->size = size;
+  return error;
+}
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+/*Whether the error happened due to reading past the end of the available input, rather
+than due to invalid data. If more input can still come, this means: wait for more input.*/
+static int inflate_out_of_input(unsigned error, const LodePNGBitReader* reader) {
+  if(error == 83) return 0; /*alloc fail*/
+  return error == 49 || error == 50 || reader->bp > reader->bitsize;
+}
 
-  if(btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
-  else /*if(btype == 2)*/ error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
+/*decode the symbols of a block with dynamic or fixed Huffman tree, until the end code, or
+until out->size reaches out_limit, or until the input ran out*/
+static unsigned inflateHuffmanBlock(Inflator* inflator, ucvector* out, LodePNGBitReader* reader,
+                                    size_t out_limit, unsigned more_input, size_t max_output_size) {
+  unsigned error = 0;
+  /*local copies that share the tables, so the compiler knows writing output does not change them*/
+  HuffmanTree tree_ll = inflator->tree_ll; /*the huffman tree for literal and length codes*/
+  HuffmanTree tree_d = inflator->tree_d; /*the huffman tree for distance codes*/
+  /* must be at least 258 for max length, plus 15 that inflateCopyMatch may write past it, and a few extra for adding
+  a few extra literals */
+  const size_t reserved_size = 276;
+  /*position of the last symbol, to undo it if it turns out to be incomplete*/
+  size_t symbol_bp = reader->bp, symbol_size = out->size;
 
+  if(!ucvector_reserve(out, out->size + reserved_size)) return 83; /*alloc fail*/
 
-  while(!error && !done) /*decode all symbols until end reached, breaks at end code*/ {
+  for(;;) /*decode all symbols until end reached, breaks at end code*/ {
     /*code_ll is literal, length or end code*/
     unsigned code_ll;
+    size_t out_end = out->allocsize - reserved_size;
+    if(out_limit && out->size >= out_limit) break;
+    if(out_limit && out_limit < out_end) out_end = out_limit;
+    if(max_output_size && max_output_size < out_end) out_end = max_output_size;
+    /*most symbols are decoded by the fast path, this loop does the ones near the ends of the buffers*/
+    error = inflateHuffmanFast(inflator, out, reader, out_end);
+    if(error) break;
+    if(out_limit && out->size >= out_limit) break;
+    if(out->allocsize - out->size < reserved_size) {
+      if(!ucvector_reserve(out, out->size + reserved_size)) ERROR_BREAK(83); /*alloc fail*/
+    }
+    symbol_bp = reader->bp;
+    symbol_size = out->size;
     /* ensure enough bits for 2 huffman code reads (15 bits each): if the first is a literal, a second literal is read at once. This
     appears to be slightly faster, than ensuring 20 bits here for 1 huffman symbol and the potential 5 extra bits for the length symbol.*/
     ensureBits32(reader, 30);
@@ -1248,7 +1938,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
     } else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/ {
       unsigned code_d, distance;
       unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, backward, length;
+      size_t start, length;
 
       /*part 1: get length base*/
       length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
@@ -1283,21 +1973,13 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
       /*part 5: fill in all the out[n] values based on the length and dist*/
       start = out->size;
       if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
-
+      inflateCopyMatch(out->data, start, distance, length);
       out->size += length;
-      if(distance < length) {
-        size_t forward;
-        lodepng_memcpy(out->data + start, out->data + backward, distance);
-        start += distance;
-        for(forward = distance; forward < length; ++forward) {
-          out->data[start++] = out->data[backward++];
-        }
-      } else {
-        lodepng_memcpy(out->data + start, out->data + backward, length);
-      }
     } else if(code_ll == 256) {
-      done = 1; /*end code, finish the loop*/
+      /*end code, finish the loop*/
+      if(reader->bp > reader->bitsize) ERROR_BREAK(51); /*error, bit pointer jumps past memory*/
+      inflator_end_block(inflator);
+      break;
     } else /*if(code_ll == INVALIDSYMBOL)*/ {
       ERROR_BREAK(16); /*error: tried to read disallowed huffman symbol*/
     }
@@ -1316,69 +1998,140 @@ static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader,
     }
   }
 
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
+  if(error && more_input && inflate_out_of_input(error, reader)) {
+    /*the last symbol is incomplete: undo it, and continue from there once more input is available*/
+    reader->bp = symbol_bp;
+    out->size = symbol_size;
+    error = 0;
+  }
 
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader,
-                                     const LodePNGDecompressSettings* settings) {
-  size_t bytepos;
-  size_t size = reader->size;
-  unsigned LEN, NLEN, error = 0;
-
-  /*go to first boundary of byte*/
-  bytepos = (reader->bp + 7u) >> 3u;
-
-  /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(bytepos + 4 >= size) return 52; /*error, bit pointer will jump past memory*/
-  LEN = (unsigned)reader->data[bytepos] + ((unsigned)reader->data[bytepos + 1] << 8u); bytepos += 2;
-  NLEN = (unsigned)reader->data[bytepos] + ((unsigned)reader->data[bytepos + 1] << 8u); bytepos += 2;
+/*copy (part of) the data of a block without compression*/
+static unsigned inflateNoCompression(Inflator* inflator, ucvector* out, LodePNGBitReader* reader,
+                                     size_t out_limit, unsigned more_input) {
+  size_t bytepos = reader->bp >> 3u; /*the bit pointer is at a byte boundary in stored blocks*/
+  size_t available = reader->size - bytepos;
+  size_t amount = inflator->stored_left;
 
-  /*check if 16-bit NLEN is really the one's complement of LEN*/
-  if(!settings->ignore_nlen && LEN + NLEN != 65535) {
-    return 21; /*error: NLEN is not one's complement of LEN*/
+  if(amount > available) {
+    if(!more_input) return 23; /*error: reading outside of in buffer*/
+    amount = available;
   }
+  if(out_limit && out->size < out_limit && amount > out_limit - out->size) amount = out_limit - out->size;
 
-  if(!ucvector_resize(out, out->size + LEN)) return 83; /*alloc fail*/
+  if(!ucvector_resize(out, out->size + amount)) return 83; /*alloc fail*/
+  /*out->data can be NULL (when amount is zero), and arithmetics on NULL ptr is undefined*/
+  if(amount) {
+    lodepng_memcpy(out->data + out->size - amount, reader->data + bytepos, amount);
+    bytepos += amount;
+  }
+  reader->bp = bytepos << 3u;
 
-  /*read the literal data: LEN bytes are now stored in the out buffer*/
-  if(bytepos + LEN > size) return 23; /*error: reading outside of in buffer*/
+  inflator->stored_left -= amount;
+  if(inflator->stored_left == 0) inflator_end_block(inflator);
+  return 0;
+}
 
-  /*out->data can be NULL (when LEN is zero), and arithmetics on NULL ptr is undefined*/
-  if (LEN) {
-    lodepng_memcpy(out->data + out->size - LEN, reader->data + bytepos, LEN);
-    bytepos += LEN;
+/*read the header of a block, including the huffman trees of a dynamic block, and go to the corresponding mode*/
+static unsigned inflateBlockHeader(Inflator* inflator, LodePNGBitReader* reader, unsigned more_input,
+                                   const LodePNGDecompressSettings* settings) {
+  unsigned error = 0;
+  unsigned BTYPE;
+  size_t header_bp = reader->bp;
+
+  if(reader->bitsize - reader->bp < 3) {
+    return more_input ? 0 : 52; /*error, bit pointer will jump past memory*/
+  }
+  ensureBits9(reader, 3);
+  inflator->bfinal = readBits(reader, 1);
+  BTYPE = readBits(reader, 2);
+
+  if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
+  else if(BTYPE == 0) /*no compression*/ {
+    size_t bytepos = (reader->bp + 7u) >> 3u; /*go to first boundary of byte*/
+    unsigned LEN, NLEN;
+    /*read LEN (2 bytes) and NLEN (2 bytes)*/
+    if(bytepos + 4 >= reader->size) {
+      if(!more_input) return 52; /*error, bit pointer will jump past memory*/
+      reader->bp = header_bp; /*wait for more input*/
+      return 0;
+    }
+    LEN = (unsigned)reader->data[bytepos] + ((unsigned)reader->data[bytepos + 1] << 8u);
+    NLEN = (unsigned)reader->data[bytepos + 2] + ((unsigned)reader->data[bytepos + 3] << 8u);
+    /*check if 16-bit NLEN is really the one's complement of LEN*/
+    if(!settings->ignore_nlen && LEN + NLEN != 65535) {
+      return 21; /*error: NLEN is not one's complement of LEN*/
+    }
+    reader->bp = (bytepos + 4) << 3u;
+    inflator->stored_left = LEN;
+    inflator->mode = INFLATE_STORED;
+  } else /*compression, BTYPE 01 or 10*/ {
+    if(BTYPE == 1) error = getTreeInflateFixed(&inflator->tree_ll, &inflator->tree_d);
+    else /*if(BTYPE == 2)*/ {
+      error = getTreeInflateDynamic(&inflator->tree_ll, &inflator->tree_d, &inflator->tree_cl, reader);
+    }
+    if(!error && !inflator->table_fast) {
+      size_t size = sizeof(*inflator->table_fast) << FASTBITS;
+      inflator->table_fast = (unsigned*)allocator_malloc(inflator->allocator, size);
+      if(!inflator->table_fast) error = 83; /*alloc fail*/
+    }
+    if(!error) inflateMakeFastTable(inflator->table_fast, &inflator->tree_ll);
+    if(error) {
+      inflator->mode = INFLATE_BLOCK_HEADER;
+      if(more_input && inflate_out_of_input(error, reader)) {
+        reader->bp = header_bp;
+        error = 0;
+      }
+      return error;
+    }
+    inflator->mode = INFLATE_HUFFMAN;
   }
+  return 0;
+}
 
-  reader->bp = bytepos << 3u;
-
+/*
+Inflates from the reader into out, until the final block ended, out->size reached out_limit
+(0 for no limit, checked per symbol so it can be exceeded by up to 258 bytes), or the input ran out.
+If more_input is true, the input in the reader does not have to be the entire remainder of the
+deflate stream: reading stops before an incomplete symbol or block header at the end of the input,
+and the next call can continue from reader->bp with more input appended. Otherwise reaching the end
+of the input before the end of the final block is an error.
+Returns error code.
+*/
+static unsigned inflator_run(Inflator* inflator, ucvector* out, LodePNGBitReader* reader, size_t out_limit,
+                             unsigned more_input, const LodePNGDecompressSettings* settings) {
+  unsigned error = 0;
+  while(!error && inflator->mode != INFLATE_DONE) {
+    size_t bp = reader->bp, size = out->size;
+    unsigned mode = inflator->mode;
+    if(out_limit && out->size >= out_limit) break;
+    if(mode == INFLATE_BLOCK_HEADER) {
+      error = inflateBlockHeader(inflator, reader, more_input, settings);
+    } else if(mode == INFLATE_STORED) {
+      error = inflateNoCompression(inflator, out, reader, out_limit, more_input);
+    } else {
+      error = inflateHuffmanBlock(inflator, out, reader, out_limit, more_input, settings->max_output_size);
+    }
+    if(!error && settings->max_output_size && out->size > settings->max_output_size) error = 109;
+    if(inflator->mode == mode && reader->bp == bp && out->size == size) break; /*no progress: out of input*/
+  }
   return error;
 }
 
 static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
                                  const LodePNGDecompressSettings* settings) {
-  unsigned BFINAL = 0;
+  Inflator inflator;
   LodePNGBitReader reader;
   unsigned error = LodePNGBitReader_init(&reader, in, insize);
 
   if(error) return error;
 
-  while(!BFINAL) {
-    unsigned BTYPE;
-    if(reader.bitsize - reader.bp < 3) return 52; /*error, bit pointer will jump past memory*/
-    ensureBits9(&reader, 3);
-    BFINAL = readBits(&reader, 1);
-    BTYPE = readBits(&reader, 2);
-
-    if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, &reader, settings); /*no compression*/
-    else error = inflateHuffmanBlock(out, &reader, BTYPE, settings->max_output_size); /*compression, BTYPE 01 or 10*/
-    if(!error && settings->max_output_size && out->size > settings->max_output_size) error = 109;
-    if(error) break;
-  }
+  inflator_init(&inflator, &settings->allocator);
+  error = inflator_run(&inflator, out, &reader, 0, 0, settings);
+  inflator_cleanup(&inflator);
 
   return error;
 }
@@ -1386,7 +2139,7 @@ static unsigned lodepng_inflatev(ucvector* out,
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGDecompressSettings* settings) {
-  ucvector v = ucvector_init(*out, *outsize);
+  ucvector v = ucvector_init_with(*out, *outsize, &settings->allocator);
   unsigned error = lodepng_inflatev(&v, in, insize, settings);
   *out = v.data;
   *outsize = v.size;
@@ -1464,8 +2217,10 @@ bytes as input because 3 is the minimum match length for deflate*/
 static const unsigned HASH_NUM_VALUES = 65536;
 static const unsigned HASH_BIT_MASK = 65535; /*HASH_NUM_VALUES - 1, but C90 does not like that as initializer*/
 
-typedef struct Hash {
-  int* head; /*hash value to head circular pos - can be outdated if went around window*/
+struct Hash {
+  /*hash value to head circular pos plus genbase - can be outdated if went around window, or from earlier
+  input if below genbase*/
+  int* head;
   /*circular pos to prev circular pos*/
   unsigned short* chain;
   int* val; /*circular pos to hash value*/
@@ -1475,17 +2230,26 @@ typedef struct Hash {
   int* headz; /*similar to head, but for chainz*/
   unsigned short* chainz; /*those with same amount of zeros*/
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
-} Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize) {
-  unsigned i;
-  hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
-  hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
-  hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+  unsigned windowsize; /*size of the tables of the window, 0 if they are not allocated*/
+  int genbase; /*added to the positions in head, increased by hash_reuse to invalidate all of head at once*/
+  size_t used; /*amount of positions at the start of the window that were used since the tables were reset*/
+  const LodePNGAllocator* allocator; /*allocator of the tables, and of the Hash itself if from hash_create*/
+};
 
-  hash->zeros = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
-  hash->headz = (int*)lodepng_malloc(sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
-  hash->chainz = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
+static unsigned hash_init(Hash* hash, unsigned windowsize, const LodePNGAllocator* allocator) {
+  unsigned i;
+  hash->windowsize = 0;
+  hash->genbase = 0;
+  hash->used = 0;
+  hash->allocator = allocator;
+  hash->head = (int*)allocator_malloc(allocator, sizeof(int) * HASH_NUM_VALUES);
+  hash->val = (int*)allocator_malloc(allocator, sizeof(int) * windowsize);
+  hash->chain = (unsigned short*)allocator_malloc(allocator, sizeof(unsigned short) * windowsize);
+
+  hash->zeros = (unsigned short*)allocator_malloc(allocator, sizeof(unsigned short) * windowsize);
+  hash->headz = (int*)allocator_malloc(allocator, sizeof(int) * (MAX_SUPPORTED_DEFLATE_LENGTH + 1));
+  hash->chainz = (unsigned short*)allocator_malloc(allocator, sizeof(unsigned short) * windowsize);
 
   if(!hash->head || !hash->chain || !hash->val  || !hash->headz|| !hash->chainz || !hash->zeros) {
     return 83; /*alloc fail*/
@@ -1499,20 +2263,70 @@ static unsigned hash_init(Hash* hash, unsigned windowsize) {
   for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
   for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
 
+  hash->windowsize = windowsize;
   return 0;
 }
 
 static void hash_cleanup(Hash* hash) {
-  lodepng_free(hash->head);
-  lodepng_free(hash->val);
-  lodepng_free(hash->chain);
+  allocator_free(hash->allocator, hash->head);
+  allocator_free(hash->allocator, hash->val);
+  allocator_free(hash->allocator, hash->chain);
 
-  lodepng_free(hash->zeros);
-  lodepng_free(hash->headz);
-  lodepng_free(hash->chainz);
+  allocator_free(hash->allocator, hash->zeros);
+  allocator_free(hash->allocator, hash->headz);
+  allocator_free(hash->allocator, hash->chainz);
 }
 
+/*
+Prepares a Hash that was used before for new input, like hash_init but keeping its tables if they have the
+same windowsize. Instead of filling head again, its entries are invalidated by increasing genbase past them,
+and of the tables of the window only the used positions are reset, which makes this cheap for small inputs.
+Returns error code.
+*/
+static unsigned hash_reuse(Hash* hash, unsigned windowsize) {
+  size_t i;
+  if(!hash->windowsize || hash->windowsize != windowsize) {
+    hash_cleanup(hash);
+    return hash_init(hash, windowsize, hash->allocator);
+  }
+  for(i = 0; i != hash->used; ++i) {
+    hash->val[i] = -1;
+    hash->chain[i] = (unsigned short)i;
+    hash->chainz[i] = (unsigned short)i;
+  }
+  hash->used = 0;
+  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
+  /*positions are below 32768, so the positions of every genbase up to 65535 * 32768 fit in an int*/
+  if(hash->genbase < 2147450880) {
+    hash->genbase += 32768;
+  } else {
+    for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+    hash->genbase = 0;
+  }
+  return 0;
+}
 
+#ifdef LODEPNG_COMPILE_PNG
+/*allocates a Hash without tables with allocator, which may be 0, the first deflate that uses it allocates
+them. Returns 0 if alloc fail.*/
+static Hash* hash_create(const LodePNGAllocator* allocator) {
+  Hash* hash = (Hash*)allocator_malloc(allocator, sizeof(Hash));
+  if(!hash) return 0;
+  hash->head = hash->val = hash->headz = 0;
+  hash->chain = hash->chainz = hash->zeros = 0;
+  hash->windowsize = 0;
+  hash->genbase = 0;
+  hash->used = 0;
+  hash->allocator = allocator;
+  return hash;
+}
+
+static void hash_destroy(Hash* hash) {
+  if(!hash) return;
+  hash_cleanup(hash);
+  allocator_free(hash->allocator, hash);
+}
+#endif /*LODEPNG_COMPILE_PNG*/
 
 static unsigned getHash(const unsigned char* data, size_t size, size_t pos) {
   unsigned result = 0;
@@ -1546,8 +2360,8 @@ static unsigned countZeros(const unsigned char* data, size_t size, size_t pos) {
 /*wpos = pos & (windowsize - 1)*/
 static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned short numzeros) {
   hash->val[wpos] = (int)hashval;
-  if(hash->head[hashval] != -1) hash->chain[wpos] = hash->head[hashval];
-  hash->head[hashval] = (int)wpos;
+  if(hash->head[hashval] >= hash->genbase) hash->chain[wpos] = (unsigned short)(hash->head[hashval] - hash->genbase);
+  hash->head[hashval] = (int)wpos + hash->genbase;
 
   hash->zeros[wpos] = numzeros;
   if(hash->headz[numzeros] != -1) hash->chainz[wpos] = hash->headz[numzeros];
@@ -1804,6 +2618,7 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   unsigned* bitlen_lld = 0; /*lit,len,dist code lengths (int bits), literally (without repeat codes).*/
   unsigned* bitlen_lld_e = 0; /*bitlen_lld encoded with repeat codes (this is a rudimentary run length compression)*/
   size_t datasize = dataend - datapos;
+  const LodePNGAllocator* allocator = &settings->allocator;
 
   /*
   If we could call "bitlen_cl" the the code length code lengths ("clcl"), that is the bit lengths of codes to represent
@@ -1819,14 +2634,14 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   size_t numcodes_ll, numcodes_d, numcodes_lld, numcodes_lld_e, numcodes_cl;
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
-  HuffmanTree_init(&tree_cl);
+  uivector_init(&lz77_encoded, allocator);
+  HuffmanTree_init(&tree_ll, allocator);
+  HuffmanTree_init(&tree_d, allocator);
+  HuffmanTree_init(&tree_cl, allocator);
   /* could fit on stack, but >1KB is on the larger side so allocate instead */
-  frequencies_ll = (unsigned*)lodepng_malloc(286 * sizeof(*frequencies_ll));
-  frequencies_d = (unsigned*)lodepng_malloc(30 * sizeof(*frequencies_d));
-  frequencies_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
+  frequencies_ll = (unsigned*)allocator_malloc(allocator, 286 * sizeof(*frequencies_ll));
+  frequencies_d = (unsigned*)allocator_malloc(allocator, 30 * sizeof(*frequencies_d));
+  frequencies_cl = (unsigned*)allocator_malloc(allocator, NUM_CODE_LENGTH_CODES * sizeof(*frequencies_cl));
 
   if(!frequencies_ll || !frequencies_d || !frequencies_cl) error = 83; /*alloc fail*/
 
@@ -1869,9 +2684,9 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
     numcodes_d = LODEPNG_MIN(tree_d.numcodes, 30);
     /*store the code lengths of both generated trees in bitlen_lld*/
     numcodes_lld = numcodes_ll + numcodes_d;
-    bitlen_lld = (unsigned*)lodepng_malloc(numcodes_lld * sizeof(*bitlen_lld));
+    bitlen_lld = (unsigned*)allocator_malloc(allocator, numcodes_lld * sizeof(*bitlen_lld));
     /*numcodes_lld_e never needs more size than bitlen_lld*/
-    bitlen_lld_e = (unsigned*)lodepng_malloc(numcodes_lld * sizeof(*bitlen_lld_e));
+    bitlen_lld_e = (unsigned*)allocator_malloc(allocator, numcodes_lld * sizeof(*bitlen_lld_e));
     if(!bitlen_lld || !bitlen_lld_e) ERROR_BREAK(83); /*alloc fail*/
     numcodes_lld_e = 0;
 
@@ -1990,11 +2805,11 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
-  lodepng_free(frequencies_ll);
-  lodepng_free(frequencies_d);
-  lodepng_free(frequencies_cl);
-  lodepng_free(bitlen_lld);
-  lodepng_free(bitlen_lld_e);
+  allocator_free(allocator, frequencies_ll);
+  allocator_free(allocator, frequencies_d);
+  allocator_free(allocator, frequencies_cl);
+  allocator_free(allocator, bitlen_lld);
+  allocator_free(allocator, bitlen_lld_e);
 
   return error;
 }
@@ -2010,8 +2825,8 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   unsigned error = 0;
   size_t i;
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+  HuffmanTree_init(&tree_ll, &settings->allocator);
+  HuffmanTree_init(&tree_d, &settings->allocator);
 
   error = generateFixedLitLenTree(&tree_ll);
   if(!error) error = generateFixedDistanceTree(&tree_d);
@@ -2023,7 +2838,7 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
 
     if(settings->use_lz77) /*LZ77 encoded*/ {
       uivector lz77_encoded;
-      uivector_init(&lz77_encoded);
+      uivector_init(&lz77_encoded, &settings->allocator);
       error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
                          settings->minmatch, settings->nicematch, settings->lazymatching);
       if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
@@ -2044,67 +2859,188 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings) {
+/*
+Adds the positions from start to end to the hash the way encodeLZ77 does, so that a following
+encodeLZ77 from end on can find matches in them, as if it had encoded them. Used to start
+deflating in the middle of the input with the preceding bytes as dictionary.
+*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t start, size_t end, unsigned windowsize) {
+  size_t pos;
+  unsigned numzeros = 0;
+  for(pos = start; pos < end; ++pos) {
+    unsigned hashval = getHash(in, end, pos);
+    if(hashval == 0) {
+      if(numzeros == 0) numzeros = countZeros(in, end, pos);
+      else if(pos + numzeros > end || in[pos + numzeros - 1] != 0) --numzeros;
+    } else {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, (unsigned short)numzeros);
+  }
+}
+
+/*
+Deflates in[start, end) with blocks of blocksize bytes, using the window before start as
+dictionary. If final is false, the last block is not marked as final but followed by an empty
+block without compression, which ends the output at a byte boundary so more deflate data can
+be appended to it. If reuse is not 0, its tables are used rather than allocating new ones, see hash_reuse.
+*/
+static unsigned deflateRange(ucvector* out, const unsigned char* in, size_t start, size_t end,
+                             size_t blocksize, unsigned final, const LodePNGCompressSettings* settings,
+                             Hash* reuse) {
   unsigned error = 0;
-  size_t i, blocksize, numdeflateblocks;
-  Hash hash;
+  size_t i, numdeflateblocks = blocksize ? (end - start + blocksize - 1) / blocksize : 1;
+  Hash local;
+  Hash* hash = reuse ? reuse : &local;
   LodePNGBitWriter writer;
 
   LodePNGBitWriter_init(&writer, out);
-
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
-  else /*if(settings->btype == 2)*/ {
-    /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
-    blocksize = insize / 8u + 8;
-    if(blocksize < 65536) blocksize = 65536;
-    if(blocksize > 262144) blocksize = 262144;
-  }
-
-  numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
+  error = reuse ? hash_reuse(hash, settings->windowsize)
+                : hash_init(hash, settings->windowsize, &settings->allocator);
+
+  if(!error && start > 0) {
+    if(settings->windowsize == 0 || settings->windowsize > 32768) error = 60; /*see encodeLZ77*/
+    else if((settings->windowsize & (settings->windowsize - 1)) != 0) error = 90;
+    else hash_prime(hash, in, start - LODEPNG_MIN(start, settings->windowsize), start, settings->windowsize);
+  }
 
   if(!error) {
     for(i = 0; i != numdeflateblocks && !error; ++i) {
-      unsigned final = (i == numdeflateblocks - 1);
-      size_t start = i * blocksize;
-      size_t end = start + blocksize;
-      if(end > insize) end = insize;
+      unsigned last = final && (i == numdeflateblocks - 1);
+      size_t blockstart = start + i * blocksize;
+      size_t blockend = blockstart + blocksize;
+      if(blockend > end) blockend = end;
 
-      if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
-      else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
+      if(settings->btype == 1) error = deflateFixed(&writer, hash, in, blockstart, blockend, settings, last);
+      else if(settings->btype == 2) error = deflateDynamic(&writer, hash, in, blockstart, blockend, settings, last);
+      if(!error) error = writer.error;
     }
   }
 
-  hash_cleanup(&hash);
+  if(!error && !final) {
+    /*empty block without compression: BFINAL 0 and BTYPE 00, then at the next byte LEN 0 and NLEN 65535*/
+    writeBits(&writer, 0, 3);
+    if(writer.error || !ucvector_resize(out, out->size + 4)) error = 83; /*alloc fail*/
+    else lodepng_set32bitInt(&out->data[out->size - 4], 0x0000ffffu);
+  }
 
-  return error;
-}
+  /*every position below end may have been used, up to the whole window*/
+  if(hash->windowsize) hash->used = LODEPNG_MIN(end, (size_t)hash->windowsize);
+  if(!reuse) hash_cleanup(hash);
 
-unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
-                         const unsigned char* in, size_t insize,
-                         const LodePNGCompressSettings* settings) {
-  ucvector v = ucvector_init(*out, *outsize);
-  unsigned error = lodepng_deflatev(&v, in, insize, settings);
-  *out = v.data;
-  *outsize = v.size;
   return error;
 }
 
-static unsigned deflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGCompressSettings* settings) {
-  if(settings->custom_deflate) {
-    unsigned error = settings->custom_deflate(out, outsize, in, insize, settings);
-    /*the custom deflate is allowed to have its own error codes, however, we translate it to code 111*/
-    return error ? 111 : 0;
-  } else {
-    return lodepng_deflate(out, outsize, in, insize, settings);
+/*the input segments that are deflated on multiple threads, see parallel_for*/
+typedef struct DeflateSegments {
+  const unsigned char* in;
+  size_t insize;
+  size_t segmentsize;
+  size_t blocksize;
+  const LodePNGCompressSettings* settings;
+  LodePNGCompressSettings* tasksettings; /*if not 0, the settings of each segment, with its own allocator*/
+  ucvector* outs; /*the deflated data of each segment*/
+  unsigned* errors; /*the error of each segment*/
+} DeflateSegments;
+
+static void deflateSegmentTask(void* data, size_t i) {
+  DeflateSegments* segments = (DeflateSegments*)data;
+  size_t start = i * segments->segmentsize;
+  size_t end = LODEPNG_MIN(start + segments->segmentsize, segments->insize);
+  const LodePNGCompressSettings* settings = segments->tasksettings ? &segments->tasksettings[i] : segments->settings;
+  segments->errors[i] = deflateRange(&segments->outs[i], segments->in, start, end, segments->blocksize,
+                                     end == segments->insize, settings, 0);
+}
+
+/*deflates the segments of the input with parallel_for and appends them to out*/
+static unsigned deflateParallel(ucvector* out, const unsigned char* in, size_t insize, size_t blocksize,
+                                const LodePNGCompressSettings* settings) {
+  unsigned error = 0;
+  size_t i, count = (insize + settings->parallel_segment_size - 1) / settings->parallel_segment_size;
+  DeflateSegments segments;
+  MemoryBudget* budgets = 0;
+  segments.in = in;
+  segments.insize = insize;
+  segments.segmentsize = settings->parallel_segment_size;
+  segments.blocksize = blocksize;
+  segments.settings = settings;
+  segments.tasksettings = 0;
+  segments.outs = (ucvector*)allocator_malloc(&settings->allocator, count * sizeof(*segments.outs));
+  segments.errors = (unsigned*)allocator_malloc(&settings->allocator, count * sizeof(*segments.errors));
+  if(!segments.outs || !segments.errors) error = 83; /*alloc fail*/
+  if(!error) budgets = budget_fork(&settings->allocator, count, &error);
+  if(budgets) {
+    segments.tasksettings = (LodePNGCompressSettings*)allocator_malloc(&settings->allocator,
+                                                                       count * sizeof(*segments.tasksettings));
+    if(!segments.tasksettings) error = 83; /*alloc fail*/
+    for(i = 0; i != count && !error; ++i) {
+      segments.tasksettings[i] = *settings;
+      segments.tasksettings[i].allocator = budget_allocator(&budgets[i]);
+    }
+  }
+
+  if(!error) {
+    for(i = 0; i != count; ++i) {
+      const LodePNGCompressSettings* tasksettings = budgets ? &segments.tasksettings[i] : settings;
+      segments.outs[i] = ucvector_init_with(NULL, 0, &tasksettings->allocator);
+    }
+    settings->parallel_for(deflateSegmentTask, &segments, count, settings->parallel_context);
+    if(budgets) {
+      /*the outputs of the segments are now counted by the budget of settings*/
+      error = budget_join(&settings->allocator, budgets, count);
+      budgets = 0;
+      for(i = 0; i != count; ++i) segments.outs[i].allocator = &settings->allocator;
+    }
+    for(i = 0; i != count && !error; ++i) {
+      error = segments.errors[i];
+      if(!error && !ucvector_resize(out, out->size + segments.outs[i].size)) error = 83; /*alloc fail*/
+      if(!error) {
+        lodepng_memcpy(out->data + out->size - segments.outs[i].size, segments.outs[i].data, segments.outs[i].size);
+      }
+    }
+    for(i = 0; i != count; ++i) ucvector_cleanup(&segments.outs[i]);
+  }
+
+  if(budgets) budget_join(&settings->allocator, budgets, count);
+  allocator_free(&settings->allocator, segments.tasksettings);
+  allocator_free(&settings->allocator, segments.errors);
+  allocator_free(&settings->allocator, segments.outs);
+  return error;
+}
+
+/*deflates with the tables of hash if it's not 0, which is not used by the multithreaded path*/
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings, Hash* hash) {
+  size_t blocksize;
+
+  if(settings->btype > 2) return 61;
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 1) blocksize = insize;
+  else /*if(settings->btype == 2)*/ {
+    /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
+    blocksize = insize / 8u + 8;
+    if(blocksize < 65536) blocksize = 65536;
+    if(blocksize > 262144) blocksize = 262144;
+  }
+
+  if(settings->parallel_for && settings->parallel_segment_size && insize > settings->parallel_segment_size) {
+    /*fixed huffman blocks have no tree to share, so a segment needs no more than one*/
+    if(settings->btype == 1) blocksize = settings->parallel_segment_size;
+    return deflateParallel(out, in, insize, blocksize, settings);
   }
+  return deflateRange(out, in, 0, insize, blocksize, 1, settings, hash);
+}
+
+unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
+                         const unsigned char* in, size_t insize,
+                         const LodePNGCompressSettings* settings) {
+  ucvector v = ucvector_init_with(*out, *outsize, &settings->allocator);
+  unsigned error = lodepng_deflatev(&v, in, insize, settings, 0);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
 }
 
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -2138,16 +3074,70 @@ static unsigned adler32(const unsigned char* data, unsigned len) {
   return update_adler32(1u, data, len);
 }
 
+#ifdef LODEPNG_COMPILE_ENCODER
+/*the adler32 of two parts of data together, from the adler32 of each part and the length of the second*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2) {
+  unsigned rem = (unsigned)(len2 % 65521u);
+  unsigned s1 = adler1 & 0xffffu;
+  unsigned s2 = (rem * s1) % 65521u; /*fits in 32 bits since both are below 65521*/
+  s1 += (adler2 & 0xffffu) + 65521u - 1u;
+  s2 += ((adler1 >> 16u) & 0xffffu) + ((adler2 >> 16u) & 0xffffu) + 65521u - rem;
+  if(s1 >= 65521u) s1 -= 65521u;
+  if(s1 >= 65521u) s1 -= 65521u;
+  if(s2 >= 2u * 65521u) s2 -= 2u * 65521u;
+  if(s2 >= 65521u) s2 -= 65521u;
+  return (s2 << 16u) | s1;
+}
+
+/*the input segments of which the adler32 is computed on multiple threads, see parallel_for*/
+typedef struct Adler32Segments {
+  const unsigned char* data;
+  size_t size;
+  size_t segmentsize;
+  unsigned* adlers;
+} Adler32Segments;
+
+static void adler32SegmentTask(void* data, size_t i) {
+  Adler32Segments* segments = (Adler32Segments*)data;
+  size_t start = i * segments->segmentsize;
+  size_t end = LODEPNG_MIN(start + segments->segmentsize, segments->size);
+  segments->adlers[i] = adler32(segments->data + start, (unsigned)(end - start));
+}
+
+/*adler32 of the data, computed in segments with parallel_for if the settings have it*/
+static unsigned adler32Parallel(unsigned* result, const unsigned char* data, size_t size,
+                                const LodePNGCompressSettings* settings) {
+  size_t i, count;
+  Adler32Segments segments;
+  if(!settings->parallel_for || !settings->parallel_segment_size || size <= settings->parallel_segment_size) {
+    *result = adler32(data, (unsigned)size);
+    return 0;
+  }
+  count = (size + settings->parallel_segment_size - 1) / settings->parallel_segment_size;
+  segments.data = data;
+  segments.size = size;
+  segments.segmentsize = settings->parallel_segment_size;
+  segments.adlers = (unsigned*)allocator_malloc(&settings->allocator, count * sizeof(*segments.adlers));
+  if(!segments.adlers) return 83; /*alloc fail*/
+  settings->parallel_for(adler32SegmentTask, &segments, count, settings->parallel_context);
+  *result = segments.adlers[0];
+  for(i = 1; i != count; ++i) {
+    size_t len = LODEPNG_MIN(segments.segmentsize, size - i * segments.segmentsize);
+    *result = adler32_combine(*result, segments.adlers[i], len);
+  }
+  allocator_free(&settings->allocator, segments.adlers);
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-static unsigned lodepng_zlib_decompressv(ucvector* out,
-                                         const unsigned char* in, size_t insize,
-                                         const LodePNGDecompressSettings* settings) {
-  unsigned error = 0;
+/*checks the 2-byte zlib header at the start of in, returns error code*/
+static unsigned zlib_check_header(const unsigned char* in, size_t insize) {
   unsigned CM, CINFO, FDICT;
 
   if(insize < 2) return 53; /*error, size of zlib data too small*/
@@ -2172,6 +3162,14 @@ static unsigned lodepng_zlib_decompressv(ucvector* out,
       "The additional flags shall not specify a preset dictionary."*/
     return 26;
   }
+  return 0;
+}
+
+static unsigned lodepng_zlib_decompressv(ucvector* out,
+                                         const unsigned char* in, size_t insize,
+                                         const LodePNGDecompressSettings* settings) {
+  unsigned error = zlib_check_header(in, insize);
+  if(error) return error;
 
   error = inflatev(out, in + 2, insize - 2, settings);
   if(error) return error;
@@ -2188,7 +3186,7 @@ static unsigned lodepng_zlib_decompressv(ucvector* out,
 
 unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                  size_t insize, const LodePNGDecompressSettings* settings) {
-  ucvector v = ucvector_init(*out, *outsize);
+  ucvector v = ucvector_init_with(*out, *outsize, &settings->allocator);
   unsigned error = lodepng_zlib_decompressv(&v, in, insize, settings);
   *out = v.data;
   *outsize = v.size;
@@ -2208,7 +3206,7 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t exp
       if(settings->max_output_size && *outsize > settings->max_output_size) error = 109;
     }
   } else {
-    ucvector v = ucvector_init(*out, *outsize);
+    ucvector v = ucvector_init_with(*out, *outsize, &settings->allocator);
     if(expected_size) {
       /*reserve the memory to avoid intermediate reallocations*/
       ucvector_resize(&v, *outsize + expected_size);
@@ -2225,52 +3223,65 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t exp
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
-unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                               size_t insize, const LodePNGCompressSettings* settings) {
-  size_t i;
-  unsigned error;
-  unsigned char* deflatedata = 0;
-  size_t deflatesize = 0;
-
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+/*lodepng_zlib_compress, deflating with the tables of hash if it's not 0. The built-in deflate writes its
+output directly after the zlib header, a custom deflate gets copied there.*/
+static unsigned zlibCompressWithHash(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                     size_t insize, const LodePNGCompressSettings* settings, Hash* hash) {
+  unsigned error = 0;
+  unsigned ADLER32 = 0;
+  ucvector v = ucvector_init_with(NULL, 0, &settings->allocator);
+  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
 
   *out = NULL;
   *outsize = 0;
-  if(!error) {
-    *outsize = deflatesize + 6;
-    *out = (unsigned char*)lodepng_malloc(*outsize);
-    if(!*out) error = 83; /*alloc fail*/
+  if(!ucvector_resize(&v, 2)) return 83; /*alloc fail*/
+  v.data[0] = (unsigned char)(CMFFLG >> 8);
+  v.data[1] = (unsigned char)(CMFFLG & 255);
+
+  if(settings->custom_deflate) {
+    unsigned char* deflatedata = 0;
+    size_t deflatesize = 0;
+    /*the custom deflate is allowed to have its own error codes, however, we translate it to code 111*/
+    if(settings->custom_deflate(&deflatedata, &deflatesize, in, insize, settings)) error = 111;
+    if(!error && !ucvector_resize(&v, 2 + deflatesize)) error = 83; /*alloc fail*/
+    if(!error) lodepng_memcpy(v.data + 2, deflatedata, deflatesize);
+    allocator_free(&settings->allocator, deflatedata);
+  } else {
+    error = lodepng_deflatev(&v, in, insize, settings, hash);
   }
+  if(!error) error = adler32Parallel(&ADLER32, in, insize, settings);
+  if(!error && !ucvector_resize(&v, v.size + 4)) error = 83; /*alloc fail*/
 
-  if(!error) {
-    unsigned ADLER32 = adler32(in, (unsigned)insize);
-    /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-    unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-    unsigned FLEVEL = 0;
-    unsigned FDICT = 0;
-    unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-    unsigned FCHECK = 31 - CMFFLG % 31;
-    CMFFLG += FCHECK;
-
-    (*out)[0] = (unsigned char)(CMFFLG >> 8);
-    (*out)[1] = (unsigned char)(CMFFLG & 255);
-    for(i = 0; i != deflatesize; ++i) (*out)[i + 2] = deflatedata[i];
-    lodepng_set32bitInt(&(*out)[*outsize - 4], ADLER32);
-  }
-
-  lodepng_free(deflatedata);
-  return error;
+  if(error) {
+    ucvector_cleanup(&v);
+    return error;
+  }
+  lodepng_set32bitInt(&v.data[v.size - 4], ADLER32);
+  *out = v.data;
+  *outsize = v.size;
+  return 0;
+}
+
+unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                               size_t insize, const LodePNGCompressSettings* settings) {
+  return zlibCompressWithHash(out, outsize, in, insize, settings, 0);
 }
 
-/* compress using the default or custom zlib function */
+/* compress using the default or custom zlib function, the default one with the tables of hash if not 0 */
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                              size_t insize, const LodePNGCompressSettings* settings) {
+                              size_t insize, const LodePNGCompressSettings* settings, Hash* hash) {
   if(settings->custom_zlib) {
     unsigned error = settings->custom_zlib(out, outsize, in, insize, settings);
     /*the custom zlib is allowed to have its own error codes, however, we translate it to code 111*/
     return error ? 111 : 0;
   } else {
-    return lodepng_zlib_compress(out, outsize, in, insize, settings);
+    return zlibCompressWithHash(out, outsize, in, insize, settings, hash);
   }
 }
 
@@ -2288,10 +3299,23 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, size_t exp
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                              size_t insize, const LodePNGCompressSettings* settings) {
+                              size_t insize, const LodePNGCompressSettings* settings, Hash* hash) {
+  (void)hash; /*only used by the built-in deflate*/
   if(!settings->custom_zlib) return 87; /*no custom zlib function provided */
   return settings->custom_zlib(out, outsize, in, insize, settings);
 }
+
+#ifdef LODEPNG_COMPILE_PNG
+/*there are no hash tables to keep without the built-in deflate*/
+static Hash* hash_create(const LodePNGAllocator* allocator) {
+  (void)allocator;
+  return 0;
+}
+
+static void hash_destroy(Hash* hash) {
+  (void)hash;
+}
+#endif /*LODEPNG_COMPILE_PNG*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #endif /*LODEPNG_COMPILE_ZLIB*/
@@ -2315,9 +3339,19 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
+
+  settings->parallel_for = 0;
+  settings->parallel_context = 0;
+  settings->parallel_segment_size = 1048576;
+
+  settings->allocator.malloc_func = 0;
+  settings->allocator.realloc_func = 0;
+  settings->allocator.free_func = 0;
+  settings->allocator.context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0,
+                                                                   0, 0, 1048576, {0, 0, 0, 0}};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2332,9 +3366,19 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings) {
   settings->custom_zlib = 0;
   settings->custom_inflate = 0;
   settings->custom_context = 0;
+
+  settings->parallel_for = 0;
+  settings->parallel_context = 0;
+  settings->parallel_segment_size = 1048576;
+
+  settings->allocator.malloc_func = 0;
+  settings->allocator.realloc_func = 0;
+  settings->allocator.free_func = 0;
+  settings->allocator.context = 0;
 }
 
-const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0, 0};
+const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0, 0, 0, 0, 1048576,
+                                                                       {0, 0, 0, 0}};
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -2633,10 +3677,10 @@ static const unsigned lodepng_crc32_table7[256] = {
   0x2c8e0fffu, 0xe0240f61u, 0x6eab0882u, 0xa201081cu, 0xa8c40105u, 0x646e019bu, 0xeae10678u, 0x264b06e6u
 };
 
-/* Computes the cyclic redundancy check as used by PNG chunks*/
-unsigned lodepng_crc32(const unsigned char* data, size_t length) {
+/*Updates the CRC register r with data, without the initial and final inversion of the CRC.
+This allows computing the CRC of data that arrives in pieces.*/
+static unsigned lodepng_crc32_update(unsigned r, const unsigned char* data, size_t length) {
   /*Using the Slicing by Eight algorithm*/
-  unsigned r = 0xffffffffu;
   while(length >= 8) {
     r = lodepng_crc32_table7[(data[0] ^ (r & 0xffu))] ^
         lodepng_crc32_table6[(data[1] ^ ((r >> 8) & 0xffu))] ^
@@ -2652,7 +3696,12 @@ unsigned lodepng_crc32(const unsigned char* data, size_t length) {
   while(length--) {
     r = lodepng_crc32_table0[(r ^ *data++) & 0xffu] ^ (r >> 8);
   }
-  return r ^ 0xffffffffu;
+  return r;
+}
+
+/* Computes the cyclic redundancy check as used by PNG chunks*/
+unsigned lodepng_crc32(const unsigned char* data, size_t length) {
+  return lodepng_crc32_update(0xffffffffu, data, length) ^ 0xffffffffu;
 }
 #else /* LODEPNG_COMPILE_CRC */
 /*in this case, the function is only declared here, and must be defined externally
@@ -2675,8 +3724,88 @@ unsigned lodepng_crc32(const unsigned char* data, size_t length) {
 }
 */
 unsigned lodepng_crc32(const unsigned char* data, size_t length);
+
+#ifdef LODEPNG_COMPILE_DECODER
+/*Updates the CRC register r with data, without the initial and final inversion of the CRC.
+Bitwise version without table, used by the stream decoder for IDAT chunks that arrive in pieces.*/
+static unsigned lodepng_crc32_update(unsigned r, const unsigned char* data, size_t length) {
+  while(length--) {
+    unsigned i;
+    r ^= *data++;
+    for(i = 0; i != 8; ++i) r = (r >> 1u) ^ (0xedb88320u & (0u - (r & 1u)));
+  }
+  return r;
+}
+#endif /*LODEPNG_COMPILE_DECODER*/
 #endif /* LODEPNG_COMPILE_CRC */
 
+/*Multiplies a and b modulo the CRC polynomial, with the bits in the reflected order of the CRC. a must not be 0.*/
+static unsigned crc32_multmodp(unsigned a, unsigned b) {
+  unsigned m = 1u << 31u, p = 0;
+  for(;;) {
+    if(a & m) {
+      p ^= b;
+      if((a & (m - 1u)) == 0) break;
+    }
+    m >>= 1u;
+    b = (b >> 1u) ^ (0xedb88320u & (0u - (b & 1u)));
+  }
+  return p;
+}
+
+/*the CRC of two parts of data together, from the CRC of each part and the length of the second*/
+static unsigned crc32_combine(unsigned crc1, unsigned crc2, size_t len2) {
+  unsigned x8n = 1u << 31u; /*x^0, becomes x^(8 * len2): the effect on crc1 of appending len2 bytes*/
+  unsigned power = 1u << 23u; /*x^8, squared for each bit of len2*/
+  while(len2) {
+    if(len2 & 1u) x8n = crc32_multmodp(power, x8n);
+    power = crc32_multmodp(power, power);
+    len2 >>= 1u;
+  }
+  return crc32_multmodp(x8n, crc1) ^ crc2;
+}
+
+/*the segments of data of which the CRC is computed on multiple threads, see parallel_for*/
+typedef struct CRC32Segments {
+  const unsigned char* data;
+  size_t length;
+  size_t segmentsize;
+  unsigned* crcs;
+} CRC32Segments;
+
+static void crc32SegmentTask(void* data, size_t i) {
+  CRC32Segments* segments = (CRC32Segments*)data;
+  size_t start = i * segments->segmentsize;
+  size_t end = LODEPNG_MIN(start + segments->segmentsize, segments->length);
+  segments->crcs[i] = lodepng_crc32(segments->data + start, end - start);
+}
+
+/*CRC of the data, computed in segments with parallel_for if it is given and the data is large enough. The
+CRCs of the segments are stored in memory of allocator.*/
+static unsigned crc32Parallel(unsigned* result, const unsigned char* data, size_t length,
+                              void (*parallel_for)(void (*task)(void*, size_t), void*, size_t, void*),
+                              void* parallel_context, size_t segmentsize, const LodePNGAllocator* allocator) {
+  size_t i, count;
+  CRC32Segments segments;
+  if(!parallel_for || !segmentsize || length <= segmentsize) {
+    *result = lodepng_crc32(data, length);
+    return 0;
+  }
+  count = (length + segmentsize - 1) / segmentsize;
+  segments.data = data;
+  segments.length = length;
+  segments.segmentsize = segmentsize;
+  segments.crcs = (unsigned*)allocator_malloc(allocator, count * sizeof(*segments.crcs));
+  if(!segments.crcs) return 83; /*alloc fail*/
+  parallel_for(crc32SegmentTask, &segments, count, parallel_context);
+  *result = segments.crcs[0];
+  for(i = 1; i != count; ++i) {
+    *result = crc32_combine(*result, segments.crcs[i], LODEPNG_MIN(segmentsize, length - i * segmentsize));
+  }
+  allocator_free(allocator, segments.crcs);
+  return 0;
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Reading and writing PNG color channel bits                             / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2826,10 +3955,8 @@ const unsigned char* lodepng_chunk_find_const(const unsigned char* chunk, const
   }
 }
 
-unsigned lodepng_chunk_append(unsigned char** out, size_t* outsize, const unsigned char* chunk) {
-  unsigned i;
+static unsigned lodepng_chunk_appendv(ucvector* out, const unsigned char* chunk) {
   size_t total_chunk_length, new_length;
-  unsigned char *chunk_start, *new_buffer;
 
   if(!lodepng_chunk_type_name_valid(chunk)) {
     return 121; /* invalid chunk type name */
@@ -2839,19 +3966,22 @@ unsigned lodepng_chunk_append(unsigned char** out, size_t* outsize, const unsign
   }
 
   if(lodepng_addofl(lodepng_chunk_length(chunk), 12, &total_chunk_length)) return 77;
-  if(lodepng_addofl(*outsize, total_chunk_length, &new_length)) return 77;
-
-  new_buffer = (unsigned char*)lodepng_realloc(*out, new_length);
-  if(!new_buffer) return 83; /*alloc fail*/
-  (*out) = new_buffer;
-  (*outsize) = new_length;
-  chunk_start = &(*out)[new_length - total_chunk_length];
+  if(lodepng_addofl(out->size, total_chunk_length, &new_length)) return 77;
 
-  for(i = 0; i != total_chunk_length; ++i) chunk_start[i] = chunk[i];
+  if(!ucvector_resize(out, new_length)) return 83; /*alloc fail*/
+  lodepng_memcpy(&out->data[new_length - total_chunk_length], chunk, total_chunk_length);
 
   return 0;
 }
 
+unsigned lodepng_chunk_append(unsigned char** out, size_t* outsize, const unsigned char* chunk) {
+  ucvector v = ucvector_init(*out, *outsize);
+  unsigned error = lodepng_chunk_appendv(&v, chunk);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
 /*Sets length and name and allocates the space for data and crc but does not
 set data or crc yet. Returns the start of the chunk in chunk. The start of
 the data is at chunk + 8. To finalize chunk, add the data, then use
@@ -2943,6 +4073,8 @@ void lodepng_color_mode_init(LodePNGColorMode* info) {
   info->bitdepth = 8;
   info->palette = 0;
   info->palettesize = 0;
+  info->order = LCO_RGBA;
+  info->premultiplied = 0;
 }
 
 /*allocates palette memory if needed, and initializes all colors to black*/
@@ -2996,6 +4128,8 @@ static int lodepng_color_mode_equal(const LodePNGColorMode* a, const LodePNGColo
     if(a->key_g != b->key_g) return 0;
     if(a->key_b != b->key_b) return 0;
   }
+  if(a->order != b->order) return 0;
+  if(a->premultiplied != b->premultiplied) return 0;
   if(a->palettesize != b->palettesize) return 0;
   for(i = 0; i != a->palettesize * 4; ++i) {
     if(a->palette[i] != b->palette[i]) return 0;
@@ -3135,8 +4269,10 @@ static unsigned LodePNGUnknownChunks_copy(LodePNGInfo* dest, const LodePNGInfo*
   for(i = 0; i != 3; ++i) {
     size_t j;
     dest->unknown_chunks_size[i] = src->unknown_chunks_size[i];
+    dest->unknown_chunks_data[i] = 0;
+    if(!src->unknown_chunks_size[i]) continue; /*nothing to copy, so nothing to allocate*/
     dest->unknown_chunks_data[i] = (unsigned char*)lodepng_malloc(src->unknown_chunks_size[i]);
-    if(!dest->unknown_chunks_data[i] && dest->unknown_chunks_size[i]) return 83; /*alloc fail*/
+    if(!dest->unknown_chunks_data[i]) return 83; /*alloc fail*/
     for(j = 0; j < src->unknown_chunks_size[i]; ++j) {
       dest->unknown_chunks_data[i][j] = src->unknown_chunks_data[i][j];
     }
@@ -3436,73 +4572,73 @@ static void addColorBits(unsigned char* out, size_t index, unsigned bits, unsign
   else out[index * bits / 8u] |= in;
 }
 
-typedef struct ColorTree ColorTree;
+/*the number of slots of a ColorTable, a power of two, at least twice the 257 colors it ever needs to hold*/
+#define LODEPNG_COLOR_TABLE_SIZE 512u
 
 /*
-One node of a color tree
-This is the data structure used to count the number of unique colors and to get a palette
-index for a color. It's like an octree, but because the alpha channel is used too, each
-node has 16 instead of 8 children.
+The data structure used to count the number of unique colors and to get a palette index for
+a color: an open addressing hash table of the colors packed as 32-bit RGBA values. It only
+ever holds up to 257 colors, the palette size plus one to know that there are more, so it
+has a fixed size and needs no allocations.
 */
-struct ColorTree {
-  ColorTree* children[16]; /*up to 16 pointers to ColorTree of next level*/
-  int index; /*the payload. Only has a meaningful value if this is in the last level*/
-};
+typedef struct ColorTable {
+  unsigned colors[LODEPNG_COLOR_TABLE_SIZE]; /*the RGBA colors, with r in the most significant byte*/
+  short indices[LODEPNG_COLOR_TABLE_SIZE]; /*the index of each color, -1 for an empty slot*/
+  unsigned count; /*number of colors in the table*/
+} ColorTable;
 
-static void color_tree_init(ColorTree* tree) {
-  lodepng_memset(tree->children, 0, 16 * sizeof(*tree->children));
-  tree->index = -1;
+static void color_table_init(ColorTable* table) {
+  unsigned i;
+  for(i = 0; i != LODEPNG_COLOR_TABLE_SIZE; ++i) table->indices[i] = -1;
+  table->count = 0;
 }
 
-static void color_tree_cleanup(ColorTree* tree) {
-  int i;
-  for(i = 0; i != 16; ++i) {
-    if(tree->children[i]) {
-      color_tree_cleanup(tree->children[i]);
-      lodepng_free(tree->children[i]);
-    }
+/*returns the slot of the color, or the empty slot where it would go*/
+static unsigned color_table_slot(const ColorTable* table, unsigned color) {
+  /*multiplicative hashing, the top bits depend on all bits of the color*/
+  unsigned slot = ((color * 2654435761u) & 0xffffffffu) >> 23u;
+  while(table->indices[slot] >= 0 && table->colors[slot] != color) {
+    slot = (slot + 1u) & (LODEPNG_COLOR_TABLE_SIZE - 1u);
   }
+  return slot;
+}
+
+static unsigned color_table_pack(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+  return ((unsigned)r << 24u) | ((unsigned)g << 16u) | ((unsigned)b << 8u) | (unsigned)a;
 }
 
 /*returns -1 if color not present, its index otherwise*/
-static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
-  int bit = 0;
-  for(bit = 0; bit < 8; ++bit) {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) return -1;
-    else tree = tree->children[i];
-  }
-  return tree ? tree->index : -1;
+static int color_table_get(const ColorTable* table,
+                           unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+  return table->indices[color_table_slot(table, color_table_pack(r, g, b, a))];
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
-  return color_tree_get(tree, r, g, b, a) >= 0;
+static int color_table_has(const ColorTable* table,
+                           unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+  return color_table_get(table, r, g, b, a) >= 0;
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
-/*color is not allowed to already exist.
-Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")
+/*Sets the index of the color, replacing it if the color already exists. index must be below 257.
 Returns error code, or 0 if ok*/
-static unsigned color_tree_add(ColorTree* tree,
-                               unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index) {
-  int bit;
-  for(bit = 0; bit < 8; ++bit) {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) {
-      tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-      if(!tree->children[i]) return 83; /*alloc fail*/
-      color_tree_init(tree->children[i]);
-    }
-    tree = tree->children[i];
-  }
-  tree->index = (int)index;
+static unsigned color_table_add(ColorTable* table,
+                                unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index) {
+  unsigned color = color_table_pack(r, g, b, a);
+  unsigned slot = color_table_slot(table, color);
+  if(table->indices[slot] < 0) {
+    /*an empty slot must remain to end the searches*/
+    if(table->count + 2u > LODEPNG_COLOR_TABLE_SIZE) return 83;
+    table->colors[slot] = color;
+    ++table->count;
+  }
+  table->indices[slot] = (short)index;
   return 0;
 }
 
 /*put a pixel, given its RGBA color, into image of any color type*/
 static unsigned rgba8ToPixel(unsigned char* out, size_t i,
-                             const LodePNGColorMode* mode, ColorTree* tree /*for palette*/,
+                             const LodePNGColorMode* mode, const ColorTable* table /*for palette*/,
                              unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
   if(mode->colortype == LCT_GREY) {
     unsigned char gray = r; /*((unsigned short)r + g + b) / 3u;*/
@@ -3524,7 +4660,7 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
       out[i * 6 + 4] = out[i * 6 + 5] = b;
     }
   } else if(mode->colortype == LCT_PALETTE) {
-    int index = color_tree_get(tree, r, g, b, a);
+    int index = color_table_get(table, r, g, b, a);
     if(index < 0) return 82; /*color not in palette*/
     if(mode->bitdepth == 8) out[i] = index;
     else addColorBits(out, i, mode->bitdepth, (unsigned)index);
@@ -3724,11 +4860,15 @@ static void getPixelColorsRGBA8(unsigned char* LODEPNG_RESTRICT buffer, size_t n
         lodepng_memcpy(buffer, &mode->palette[index * 4], 4);
       }
     } else {
-      size_t j = 0;
-      for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        unsigned index = readBitsFromReversedStream(&j, in, mode->bitdepth);
-        /*out of bounds of palette not checked: see lodepng_color_mode_alloc_palette.*/
-        lodepng_memcpy(buffer, &mode->palette[index * 4], 4);
+      /*all pixels of each input byte at once*/
+      unsigned bits = mode->bitdepth, mask = (1u << mode->bitdepth) - 1u;
+      for(i = 0; i != numpixels; ++in) {
+        unsigned shift = 8;
+        for(; shift != 0 && i != numpixels; ++i, buffer += num_channels) {
+          shift -= bits;
+          /*out of bounds of palette not checked: see lodepng_color_mode_alloc_palette.*/
+          lodepng_memcpy(buffer, &mode->palette[((*in >> shift) & mask) * 4], 4);
+        }
       }
     }
   } else if(mode->colortype == LCT_GREY_ALPHA) {
@@ -3793,16 +4933,26 @@ static void getPixelColorsRGB8(unsigned char* LODEPNG_RESTRICT buffer, size_t nu
   } else if(mode->colortype == LCT_PALETTE) {
     if(mode->bitdepth == 8) {
       for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        unsigned index = in[i];
         /*out of bounds of palette not checked: see lodepng_color_mode_alloc_palette.*/
-        lodepng_memcpy(buffer, &mode->palette[index * 4], 3);
+        const unsigned char* color = &mode->palette[in[i] * 4];
+        buffer[0] = color[0];
+        buffer[1] = color[1];
+        buffer[2] = color[2];
       }
     } else {
-      size_t j = 0;
-      for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        unsigned index = readBitsFromReversedStream(&j, in, mode->bitdepth);
-        /*out of bounds of palette not checked: see lodepng_color_mode_alloc_palette.*/
-        lodepng_memcpy(buffer, &mode->palette[index * 4], 3);
+      /*all pixels of each input byte at once*/
+      unsigned bits = mode->bitdepth, mask = (1u << mode->bitdepth) - 1u;
+      for(i = 0; i != numpixels; ++in) {
+        unsigned shift = 8;
+        for(; shift != 0 && i != numpixels; ++i, buffer += num_channels) {
+          const unsigned char* color;
+          shift -= bits;
+          /*out of bounds of palette not checked: see lodepng_color_mode_alloc_palette.*/
+          color = &mode->palette[((*in >> shift) & mask) * 4];
+          buffer[0] = color[0];
+          buffer[1] = color[1];
+          buffer[2] = color[2];
+        }
       }
     }
   } else if(mode->colortype == LCT_GREY_ALPHA) {
@@ -3818,7 +4968,9 @@ static void getPixelColorsRGB8(unsigned char* LODEPNG_RESTRICT buffer, size_t nu
   } else if(mode->colortype == LCT_RGBA) {
     if(mode->bitdepth == 8) {
       for(i = 0; i != numpixels; ++i, buffer += num_channels) {
-        lodepng_memcpy(buffer, &in[i * 4], 3);
+        buffer[0] = in[i * 4 + 0];
+        buffer[1] = in[i * 4 + 1];
+        buffer[2] = in[i * 4 + 2];
       }
     } else {
       for(i = 0; i != numpixels; ++i, buffer += num_channels) {
@@ -3830,6 +4982,42 @@ static void getPixelColorsRGB8(unsigned char* LODEPNG_RESTRICT buffer, size_t nu
   }
 }
 
+/*
+Converts between 8-bit and 16-bit of the same color type, and from 8-bit RGBA, RGB or grey alpha to 8-bit grey
+or grey alpha, by copying the bytes of the channels instead of going through the RGBA color of each pixel.
+Returns 0 without converting anything if the modes are not one of these cases.
+*/
+static unsigned getPixelColorsPlain(unsigned char* LODEPNG_RESTRICT out, size_t numpixels,
+                                    const unsigned char* LODEPNG_RESTRICT in,
+                                    const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in) {
+  size_t i;
+  if(mode_in->colortype == LCT_PALETTE || mode_out->colortype == LCT_PALETTE) return 0;
+  if(mode_in->colortype == mode_out->colortype) {
+    /*the color key of the input does not matter, the output has no alpha channel if the input has a key*/
+    size_t numbytes = numpixels * getNumColorChannels(mode_in->colortype);
+    if(mode_in->bitdepth == 16 && mode_out->bitdepth == 8) {
+      for(i = 0; i != numbytes; ++i) out[i] = in[i * 2];
+    } else if(mode_in->bitdepth == 8 && mode_out->bitdepth == 16) {
+      for(i = 0; i != numbytes; ++i) out[i * 2] = out[i * 2 + 1] = in[i];
+    } else {
+      return 0;
+    }
+  } else if(mode_in->bitdepth != 8 || mode_out->bitdepth != 8) {
+    return 0;
+  } else if(mode_out->colortype == LCT_GREY) {
+    size_t channels = getNumColorChannels(mode_in->colortype);
+    for(i = 0; i != numpixels; ++i) out[i] = in[i * channels];
+  } else if(mode_out->colortype == LCT_GREY_ALPHA && mode_in->colortype == LCT_RGBA) {
+    for(i = 0; i != numpixels; ++i) {
+      out[i * 2 + 0] = in[i * 4 + 0];
+      out[i * 2 + 1] = in[i * 4 + 3];
+    }
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
 /*Get RGBA16 color of pixel with index i (y * width + x) from the raw image with
 given color type, but the given color type must be 16-bit itself.*/
 static void getPixelColorRGBA16(unsigned short* r, unsigned short* g, unsigned short* b, unsigned short* a,
@@ -3858,17 +5046,388 @@ static void getPixelColorRGBA16(unsigned short* r, unsigned short* g, unsigned s
   }
 }
 
+/*converts the pixels one by one through their RGBA color, 16-bit if both modes are 16-bit and 8-bit otherwise*/
+static unsigned convertPixels(unsigned char* out, const unsigned char* in, size_t numpixels,
+                              const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                              const ColorTable* table) {
+  size_t i;
+  if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16) {
+    for(i = 0; i != numpixels; ++i) {
+      unsigned short r = 0, g = 0, b = 0, a = 0;
+      getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
+      rgba16ToPixel(out, i, mode_out, r, g, b, a);
+    }
+  } else {
+    unsigned char r = 0, g = 0, b = 0, a = 0;
+    for(i = 0; i != numpixels; ++i) {
+      unsigned error;
+      getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
+      error = rgba8ToPixel(out, i, mode_out, table, r, g, b, a);
+      if(error) return error;
+    }
+  }
+  return 0;
+}
+
+#ifdef LODEPNG_COMPILE_CPP
+/*
+With C++, convertPixels has a kernel for each pair of input and output color type and bit depth, instantiated
+from templates. The color modes are then constants of each kernel instead of branches for every pixel, which
+leaves loops that the compiler can optimize and vectorize. They give the same result as convertPixels.
+*/
+
+/*the bytes of a channel, 1 for 8-bit and less, 2 for 16-bit*/
+template<unsigned BD> struct ChannelBytes { enum { value = BD == 16 ? 2 : 1 }; };
+
+/*the number of channels of color type CT, like getNumColorChannels*/
+template<LodePNGColorType CT> struct ColorChannels {
+  enum { value = CT == LCT_RGBA ? 4 : CT == LCT_RGB ? 3 : CT == LCT_GREY_ALPHA ? 2 : 1 };
+};
+
+/*the value of pixel i of 1, 2, 4 or 8 bits, like readBitsFromReversedStream*/
+template<unsigned BD>
+static unsigned readPixelBits(const unsigned char* in, size_t i) {
+  const unsigned bits = BD < 8 ? BD : 8;
+  return (in[i * bits / 8u] >> (8u - bits - i * bits % 8u)) & ((1u << bits) - 1u);
+}
+
+/*the value of a channel of 8 or 16 bits, of which p points to the first byte*/
+template<unsigned BD>
+static unsigned readChannel16(const unsigned char* p) {
+  return BD == 16 ? 256u * p[0] + p[ChannelBytes<BD>::value - 1] : p[0];
+}
+
+/*getPixelColorRGBA8 of color type CT and bit depth BD, c is the RGBA color*/
+template<LodePNGColorType CT, unsigned BD>
+static void getPixelColorRGBA8T(unsigned char* c, const unsigned char* in, size_t i, const LodePNGColorMode* mode) {
+  const unsigned bytes = ChannelBytes<BD>::value;
+  const unsigned char* p = &in[i * ColorChannels<CT>::value * bytes];
+  if(CT == LCT_PALETTE) {
+    /*out of bounds of palette not checked: see lodepng_color_mode_alloc_palette.*/
+    lodepng_memcpy(c, &mode->palette[readPixelBits<BD>(in, i) * 4], 4);
+  } else if(CT == LCT_GREY && BD < 8) {
+    unsigned value = readPixelBits<BD>(in, i);
+    c[0] = c[1] = c[2] = (unsigned char)(value * 255u / ((1u << BD) - 1u));
+    c[3] = mode->key_defined && value == mode->key_r ? 0 : 255;
+  } else if(CT == LCT_GREY) {
+    c[0] = c[1] = c[2] = p[0];
+    c[3] = mode->key_defined && readChannel16<BD>(p) == mode->key_r ? 0 : 255;
+  } else if(CT == LCT_RGB) {
+    c[0] = p[0];
+    c[1] = p[bytes];
+    c[2] = p[bytes * 2];
+    c[3] = mode->key_defined && readChannel16<BD>(p) == mode->key_r && readChannel16<BD>(p + bytes) == mode->key_g
+        && readChannel16<BD>(p + bytes * 2) == mode->key_b ? 0 : 255;
+  } else if(CT == LCT_GREY_ALPHA) {
+    c[0] = c[1] = c[2] = p[0];
+    c[3] = p[bytes];
+  } else {
+    c[0] = p[0];
+    c[1] = p[bytes];
+    c[2] = p[bytes * 2];
+    c[3] = p[bytes * 3];
+  }
+}
+
+/*getPixelColorRGBA16 of 16-bit color type CT*/
+template<LodePNGColorType CT>
+static void getPixelColorRGBA16T(unsigned short* c, const unsigned char* in, size_t i, const LodePNGColorMode* mode) {
+  const unsigned char* p = &in[i * ColorChannels<CT>::value * 2];
+  if(CT == LCT_GREY || CT == LCT_GREY_ALPHA) {
+    c[0] = c[1] = c[2] = 256u * p[0] + p[1];
+    if(CT == LCT_GREY) c[3] = mode->key_defined && c[0] == mode->key_r ? 0 : 65535;
+    else c[3] = 256u * p[2] + p[3];
+  } else {
+    c[0] = 256u * p[0] + p[1];
+    c[1] = 256u * p[2] + p[3];
+    c[2] = 256u * p[4] + p[5];
+    if(CT == LCT_RGB) {
+      c[3] = mode->key_defined && c[0] == mode->key_r && c[1] == mode->key_g && c[2] == mode->key_b ? 0 : 65535;
+    } else {
+      c[3] = 256u * p[6] + p[7];
+    }
+  }
+}
+
+/*rgba8ToPixel of color type CT and bit depth BD, c is the RGBA color*/
+template<LodePNGColorType CT, unsigned BD>
+static unsigned rgba8ToPixelT(unsigned char* out, size_t i, const ColorTable* table, const unsigned char* c) {
+  const unsigned bytes = ChannelBytes<BD>::value;
+  unsigned char* p = &out[i * ColorChannels<CT>::value * bytes];
+  if(CT == LCT_PALETTE) {
+    int index = color_table_get(table, c[0], c[1], c[2], c[3]);
+    if(index < 0) return 82; /*color not in palette*/
+    if(BD == 8) out[i] = (unsigned char)index;
+    else addColorBits(out, i, BD, (unsigned)index);
+  } else if(CT == LCT_GREY && BD < 8) {
+    /*take the most significant bits of gray*/
+    addColorBits(out, i, BD, (unsigned)c[0] >> (8u - (BD < 8 ? BD : 8)));
+  } else {
+    /*grey is r, grey alpha is r and a*/
+    const unsigned channels = ColorChannels<CT>::value;
+    unsigned j;
+    for(j = 0; j != channels; ++j) {
+      unsigned char v = c[channels == 2 && j == 1 ? 3 : j];
+      p[j * bytes] = p[j * bytes + bytes - 1] = v;
+    }
+  }
+  return 0;
+}
+
+/*rgba16ToPixel of 16-bit color type CT*/
+template<LodePNGColorType CT>
+static void rgba16ToPixelT(unsigned char* out, size_t i, const unsigned short* c) {
+  const unsigned channels = ColorChannels<CT>::value;
+  unsigned char* p = &out[i * channels * 2];
+  unsigned j;
+  for(j = 0; j != channels; ++j) {
+    unsigned short v = c[channels == 2 && j == 1 ? 3 : j];
+    p[j * 2 + 0] = (v >> 8) & 255;
+    p[j * 2 + 1] = v & 255;
+  }
+}
+
+/*convertPixels from color type CTI and bit depth BDI to color type CTO and bit depth BDO*/
+template<LodePNGColorType CTI, unsigned BDI, LodePNGColorType CTO, unsigned BDO>
+static unsigned convertPixelsT(unsigned char* out, const unsigned char* in, size_t numpixels,
+                               const LodePNGColorMode* mode_in, const ColorTable* table) {
+  size_t i;
+  if(BDI == 16 && BDO == 16) {
+    unsigned short c[4];
+    for(i = 0; i != numpixels; ++i) {
+      getPixelColorRGBA16T<CTI>(c, in, i, mode_in);
+      rgba16ToPixelT<CTO>(out, i, c);
+    }
+  } else {
+    unsigned char c[4];
+    for(i = 0; i != numpixels; ++i) {
+      unsigned error;
+      getPixelColorRGBA8T<CTI, BDI>(c, in, i, mode_in);
+      error = rgba8ToPixelT<CTO, BDO>(out, i, table, c);
+      if(error) return error;
+    }
+  }
+  return 0;
+}
+
+/*selects the kernel for the output color mode, the RGBA8 and RGB8 outputs already have getPixelColorsRGBA8 and
+getPixelColorsRGB8*/
+template<LodePNGColorType CTI, unsigned BDI>
+static unsigned convertPixelsFrom(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                  const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                                  const ColorTable* table) {
+  switch(mode_out->colortype * 32u + mode_out->bitdepth) {
+    case LCT_GREY * 32u + 1: return convertPixelsT<CTI, BDI, LCT_GREY, 1>(out, in, numpixels, mode_in, table);
+    case LCT_GREY * 32u + 2: return convertPixelsT<CTI, BDI, LCT_GREY, 2>(out, in, numpixels, mode_in, table);
+    case LCT_GREY * 32u + 4: return convertPixelsT<CTI, BDI, LCT_GREY, 4>(out, in, numpixels, mode_in, table);
+    case LCT_GREY * 32u + 8: return convertPixelsT<CTI, BDI, LCT_GREY, 8>(out, in, numpixels, mode_in, table);
+    case LCT_GREY * 32u + 16: return convertPixelsT<CTI, BDI, LCT_GREY, 16>(out, in, numpixels, mode_in, table);
+    case LCT_RGB * 32u + 16: return convertPixelsT<CTI, BDI, LCT_RGB, 16>(out, in, numpixels, mode_in, table);
+    case LCT_PALETTE * 32u + 1: return convertPixelsT<CTI, BDI, LCT_PALETTE, 1>(out, in, numpixels, mode_in, table);
+    case LCT_PALETTE * 32u + 2: return convertPixelsT<CTI, BDI, LCT_PALETTE, 2>(out, in, numpixels, mode_in, table);
+    case LCT_PALETTE * 32u + 4: return convertPixelsT<CTI, BDI, LCT_PALETTE, 4>(out, in, numpixels, mode_in, table);
+    case LCT_PALETTE * 32u + 8: return convertPixelsT<CTI, BDI, LCT_PALETTE, 8>(out, in, numpixels, mode_in, table);
+    case LCT_GREY_ALPHA * 32u + 8:
+      return convertPixelsT<CTI, BDI, LCT_GREY_ALPHA, 8>(out, in, numpixels, mode_in, table);
+    case LCT_GREY_ALPHA * 32u + 16:
+      return convertPixelsT<CTI, BDI, LCT_GREY_ALPHA, 16>(out, in, numpixels, mode_in, table);
+    case LCT_RGBA * 32u + 16: return convertPixelsT<CTI, BDI, LCT_RGBA, 16>(out, in, numpixels, mode_in, table);
+    default: return convertPixels(out, in, numpixels, mode_out, mode_in, table);
+  }
+}
+
+/*convertPixels with the kernel for the input and output color mode, or convertPixels itself if there is none*/
+static unsigned convertPixelsSpecialized(unsigned char* out, const unsigned char* in, size_t numpixels,
+                                         const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                                         const ColorTable* table) {
+  switch(mode_in->colortype * 32u + mode_in->bitdepth) {
+    case LCT_GREY * 32u + 1: return convertPixelsFrom<LCT_GREY, 1>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_GREY * 32u + 2: return convertPixelsFrom<LCT_GREY, 2>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_GREY * 32u + 4: return convertPixelsFrom<LCT_GREY, 4>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_GREY * 32u + 8: return convertPixelsFrom<LCT_GREY, 8>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_GREY * 32u + 16: return convertPixelsFrom<LCT_GREY, 16>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_RGB * 32u + 8: return convertPixelsFrom<LCT_RGB, 8>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_RGB * 32u + 16: return convertPixelsFrom<LCT_RGB, 16>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_PALETTE * 32u + 1:
+      return convertPixelsFrom<LCT_PALETTE, 1>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_PALETTE * 32u + 2:
+      return convertPixelsFrom<LCT_PALETTE, 2>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_PALETTE * 32u + 4:
+      return convertPixelsFrom<LCT_PALETTE, 4>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_PALETTE * 32u + 8:
+      return convertPixelsFrom<LCT_PALETTE, 8>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_GREY_ALPHA * 32u + 8:
+      return convertPixelsFrom<LCT_GREY_ALPHA, 8>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_GREY_ALPHA * 32u + 16:
+      return convertPixelsFrom<LCT_GREY_ALPHA, 16>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_RGBA * 32u + 8: return convertPixelsFrom<LCT_RGBA, 8>(out, in, numpixels, mode_out, mode_in, table);
+    case LCT_RGBA * 32u + 16: return convertPixelsFrom<LCT_RGBA, 16>(out, in, numpixels, mode_out, mode_in, table);
+    default: return convertPixels(out, in, numpixels, mode_out, mode_in, table);
+  }
+}
+#endif /*LODEPNG_COMPILE_CPP*/
+
+/*whether the mode has a channel order or premultiplied alpha, which only the output of conversions supports*/
+static unsigned hasRawLayout(const LodePNGColorMode* mode) {
+  return mode->order != LCO_RGBA || mode->premultiplied;
+}
+
+/*Returns error code 128 if the channel order or premultiplied alpha of the mode is not supported.*/
+static unsigned checkRawLayout(const LodePNGColorMode* mode) {
+  if(mode->order != LCO_RGBA && mode->colortype != LCT_RGB && mode->colortype != LCT_RGBA) return 128;
+  if(mode->order > LCO_ARGB) return 128;
+  if(mode->premultiplied && mode->colortype != LCT_GREY_ALPHA && mode->colortype != LCT_RGBA) return 128;
+  return 0;
+}
+
+#ifdef LODEPNG_SSE2
+/*(c * a + 127) / 255 for the colors c of two 16-bit RGBA pixels, alpha stays the same*/
+static __m128i sse2_premultiply16(__m128i v) {
+  const __m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+  /*multiplies each color with the alpha of its pixel, and alpha with 255*/
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff);
+  __m128i m = _mm_or_si128(_mm_andnot_si128(alpha, a), _mm_and_si128(alpha, _mm_set1_epi16(255)));
+  __m128i x = _mm_add_epi16(_mm_mullo_epi16(v, m), _mm_set1_epi16(127));
+  /*x / 255 is (x + 1 + (x >> 8)) >> 8 for all x up to 255 * 255 + 127*/
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+#endif /*LODEPNG_SSE2*/
+
+/*whether the modes are equal apart from their channel order and premultiplied alpha*/
+static int colorModeEqualIgnoringLayout(const LodePNGColorMode* a, const LodePNGColorMode* b) {
+  LodePNGColorMode mode = *a; /*shares the palette, no cleanup needed*/
+  mode.order = b->order;
+  mode.premultiplied = b->premultiplied;
+  return lodepng_color_mode_equal(&mode, b);
+}
+
+/*Multiplies the color channels of 8-bit or 16-bit RGBA or grey alpha pixels with their alpha, rounded. Returns
+whether it also put the channels in the order of the mode.*/
+static unsigned premultiplyAlpha(unsigned char* p, size_t numpixels, const LodePNGColorMode* mode) {
+  size_t i;
+  unsigned j, channels = getNumColorChannels(mode->colortype);
+  if(mode->bitdepth == 8 && channels == 4) {
+    /*the common case of 8-bit RGBA also gets its channel order here, in the same loop*/
+    LodePNGChannelOrder order = mode->order; /*not read from mode in the loop, which p could alias*/
+    i = 0;
+#ifdef LODEPNG_SSE2
+    for(; i + 4u <= numpixels; i += 4u, p += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)p);
+      __m128i lo = sse2_premultiply16(_mm_unpacklo_epi8(v, _mm_setzero_si128()));
+      __m128i hi = sse2_premultiply16(_mm_unpackhi_epi8(v, _mm_setzero_si128()));
+      /*each half of lo and hi is a pixel, _MM_SHUFFLE(3, 0, 1, 2) gives B, G, R, A and (2, 1, 0, 3) A, R, G, B*/
+      if(order == LCO_BGRA) {
+        lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xc6), 0xc6);
+        hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xc6), 0xc6);
+      } else if(order == LCO_ARGB) {
+        lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0x93), 0x93);
+        hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0x93), 0x93);
+      }
+      _mm_storeu_si128((__m128i*)p, _mm_packus_epi16(lo, hi));
+    }
+#endif /*LODEPNG_SSE2*/
+    for(; i != numpixels; ++i, p += 4) {
+      unsigned a = p[3];
+      unsigned char r = (p[0] * a + 127u) / 255u, g = (p[1] * a + 127u) / 255u, b = (p[2] * a + 127u) / 255u;
+      if(order == LCO_BGRA) {
+        p[0] = b;
+        p[1] = g;
+        p[2] = r;
+      } else if(order == LCO_ARGB) {
+        p[0] = a;
+        p[1] = r;
+        p[2] = g;
+        p[3] = b;
+      } else {
+        p[0] = r;
+        p[1] = g;
+        p[2] = b;
+      }
+    }
+  } else if(mode->bitdepth == 8) {
+    for(i = 0; i != numpixels; ++i, p += 2) p[0] = (p[0] * p[1] + 127u) / 255u;
+  } else {
+    for(i = 0; i != numpixels; ++i, p += channels * 2u) {
+      unsigned a = 256u * p[channels * 2u - 2u] + p[channels * 2u - 1u];
+      for(j = 0; j + 1u != channels; ++j) {
+        unsigned c = ((256u * p[j * 2u] + p[j * 2u + 1u]) * a + 32767u) / 65535u;
+        p[j * 2u + 0u] = (c >> 8) & 255u;
+        p[j * 2u + 1u] = c & 255u;
+      }
+    }
+  }
+  return mode->bitdepth == 8 && channels == 4;
+}
+
+/*Puts the channels of 8-bit or 16-bit RGB or RGBA pixels in the channel order of the mode.*/
+static void reorderChannels(unsigned char* p, size_t numpixels, const LodePNGColorMode* mode) {
+  size_t i;
+  unsigned k, bytes = mode->bitdepth / 8u, size = lodepng_get_bpp(mode) / 8u;
+  if(mode->order == LCO_BGRA && bytes == 1) {
+    for(i = 0; i != numpixels; ++i, p += size) {
+      unsigned char r = p[0];
+      p[0] = p[2];
+      p[2] = r;
+    }
+  } else if(mode->order == LCO_BGRA) {
+    for(i = 0; i != numpixels; ++i, p += size) {
+      for(k = 0; k != bytes; ++k) {
+        unsigned char r = p[k];
+        p[k] = p[bytes * 2u + k];
+        p[bytes * 2u + k] = r;
+      }
+    }
+  } else if(mode->order == LCO_ARGB && mode->colortype == LCT_RGBA) {
+    for(i = 0; i != numpixels; ++i, p += size) {
+      for(k = 0; k != bytes; ++k) {
+        unsigned char a = p[bytes * 3u + k];
+        p[bytes * 3u + k] = p[bytes * 2u + k];
+        p[bytes * 2u + k] = p[bytes + k];
+        p[bytes + k] = p[k];
+        p[k] = a;
+      }
+    }
+  }
+}
+
+/*the pixels that lodepng_convert converts at once to an output with a channel order or premultiplied alpha,
+before changing their layout while they are still in the cache. A multiple of 8 for the input to start at a byte*/
+#define LODEPNG_LAYOUT_CHUNK 1024u
+
 unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
                          const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
                          unsigned w, unsigned h) {
   size_t i;
-  ColorTree tree;
+  ColorTable table;
   size_t numpixels = (size_t)w * (size_t)h;
   unsigned error = 0;
 
   if(mode_in->colortype == LCT_PALETTE && !mode_in->palette) {
     return 107; /* error: must provide palette if input mode is palette */
   }
+  if(hasRawLayout(mode_in)) return 128; /*the layout is only supported for the output*/
+
+  if(hasRawLayout(mode_out)) {
+    LodePNGColorMode mode = *mode_out; /*the same without the layout, shares the palette*/
+    size_t bytes = lodepng_get_bpp(mode_out) / 8u, bits_in = lodepng_get_bpp(mode_in);
+    /*if only the layout changes, out may also be the same as in, which the decoder uses to change it in place*/
+    unsigned same = colorModeEqualIgnoringLayout(mode_out, mode_in);
+    CERROR_TRY_RETURN(checkRawLayout(mode_out));
+    mode.order = LCO_RGBA;
+    mode.premultiplied = 0;
+    for(i = 0; i < numpixels; i += LODEPNG_LAYOUT_CHUNK) {
+      size_t n = LODEPNG_MIN(LODEPNG_LAYOUT_CHUNK, numpixels - i);
+      if(!same) {
+        CERROR_TRY_RETURN(lodepng_convert(out + i * bytes, in + i / 8u * bits_in, &mode, mode_in, (unsigned)n, 1));
+      } else if(out != in) {
+        lodepng_memcpy(out + i * bytes, in + i * bytes, n * bytes);
+      }
+      if(!(mode_out->premultiplied && premultiplyAlpha(out + i * bytes, n, mode_out))) {
+        reorderChannels(out + i * bytes, n, mode_out);
+      }
+    }
+    return 0;
+  }
 
   if(lodepng_color_mode_equal(mode_out, mode_in)) {
     size_t numbytes = lodepng_get_raw_size(w, h, mode_in);
@@ -3896,39 +5455,83 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
       }
     }
     if(palettesize < palsize) palsize = palettesize;
-    color_tree_init(&tree);
+    color_table_init(&table);
     for(i = 0; i != palsize; ++i) {
       const unsigned char* p = &palette[i * 4];
-      error = color_tree_add(&tree, p[0], p[1], p[2], p[3], (unsigned)i);
+      error = color_table_add(&table, p[0], p[1], p[2], p[3], (unsigned)i);
       if(error) break;
     }
   }
 
   if(!error) {
-    if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16) {
-      for(i = 0; i != numpixels; ++i) {
-        unsigned short r = 0, g = 0, b = 0, a = 0;
-        getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
-        rgba16ToPixel(out, i, mode_out, r, g, b, a);
-      }
-    } else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGBA) {
+    if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGBA) {
       getPixelColorsRGBA8(out, numpixels, in, mode_in);
     } else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGB) {
       getPixelColorsRGB8(out, numpixels, in, mode_in);
-    } else {
-      unsigned char r = 0, g = 0, b = 0, a = 0;
-      for(i = 0; i != numpixels; ++i) {
-        getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
-        error = rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a);
-        if(error) break;
-      }
+    } else if(!getPixelColorsPlain(out, numpixels, in, mode_out, mode_in)) {
+#ifdef LODEPNG_COMPILE_CPP
+      error = convertPixelsSpecialized(out, in, numpixels, mode_out, mode_in, &table);
+#else /*LODEPNG_COMPILE_CPP*/
+      error = convertPixels(out, in, numpixels, mode_out, mode_in, &table);
+#endif /*LODEPNG_COMPILE_CPP*/
     }
   }
 
-  if(mode_out->colortype == LCT_PALETTE) {
-    color_tree_cleanup(&tree);
-  }
+  return error;
+}
 
+/*the number of pixels of bpp bits in segmentsize bytes, a multiple of 8 so that each segment starts at a byte*/
+static size_t pixelSegmentSize(size_t segmentsize, unsigned bpp) {
+  size_t pixels = segmentsize / bpp * 8u;
+  return pixels ? pixels : 8u;
+}
+
+/*the segments of the pixels that are converted on multiple threads, see parallel_for*/
+typedef struct ConvertSegments {
+  unsigned char* out;
+  const unsigned char* in;
+  const LodePNGColorMode* mode_out;
+  const LodePNGColorMode* mode_in;
+  size_t numpixels;
+  size_t segmentpixels;
+  unsigned* errors; /*the error of each segment*/
+} ConvertSegments;
+
+static void convertSegmentTask(void* data, size_t i) {
+  ConvertSegments* segments = (ConvertSegments*)data;
+  size_t start = i * segments->segmentpixels;
+  size_t n = LODEPNG_MIN(segments->segmentpixels, segments->numpixels - start);
+  segments->errors[i] = lodepng_convert(segments->out + start / 8u * lodepng_get_bpp(segments->mode_out),
+                                        segments->in + start / 8u * lodepng_get_bpp(segments->mode_in),
+                                        segments->mode_out, segments->mode_in, (unsigned)n, 1);
+}
+
+/*lodepng_convert, in segments with parallel_for if it is given and the image is large enough. The errors of
+the segments are stored in memory of allocator.*/
+static unsigned convertParallel(unsigned char* out, const unsigned char* in,
+                                const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                                unsigned w, unsigned h,
+                                void (*parallel_for)(void (*task)(void*, size_t), void*, size_t, void*),
+                                void* parallel_context, size_t segmentsize, const LodePNGAllocator* allocator) {
+  unsigned error = 0;
+  unsigned bpp = LODEPNG_MAX(lodepng_get_bpp(mode_out), lodepng_get_bpp(mode_in));
+  size_t i, count;
+  ConvertSegments segments;
+  segments.numpixels = (size_t)w * (size_t)h;
+  if(!parallel_for || !segmentsize || bpp == 0 || segments.numpixels <= pixelSegmentSize(segmentsize, bpp)) {
+    return lodepng_convert(out, in, mode_out, mode_in, w, h);
+  }
+  segments.out = out;
+  segments.in = in;
+  segments.mode_out = mode_out;
+  segments.mode_in = mode_in;
+  segments.segmentpixels = pixelSegmentSize(segmentsize, bpp);
+  count = (segments.numpixels + segments.segmentpixels - 1u) / segments.segmentpixels;
+  segments.errors = (unsigned*)allocator_malloc(allocator, count * sizeof(*segments.errors));
+  if(!segments.errors) return 83; /*alloc fail*/
+  parallel_for(convertSegmentTask, &segments, count, parallel_context);
+  for(i = 0; i != count && !error; ++i) error = segments.errors[i];
+  allocator_free(allocator, segments.errors);
   return error;
 }
 
@@ -4025,12 +5628,47 @@ static unsigned getValueRequiredBits(unsigned char value) {
   return 8;
 }
 
+/*
+Returns the first pixel from pixel i on of the 8-bit RGB (channels 3) or RGBA (channels 4) image that is not
+grey if grey is set, or not opaque if opaque is set, numpixels if there is none. Once only colored and alpha
+remain to be found, the pixels in between can't change the stats and are skipped in bulk.
+*/
+static size_t findColorStatsPixel(const unsigned char* in, size_t i, size_t numpixels, unsigned channels,
+                                  unsigned grey, unsigned opaque) {
+#ifdef LODEPNG_SSE2
+  /*16 pixels at a time. r == g and g == b of a pixel are found by comparing with the bytes shifted by one.
+  RGB is loaded 12 bytes apart, 4 pixels per load, so the last load reads 4 bytes past 16 pixels*/
+  const __m128i notalpha = _mm_set1_epi32(0x00ffffff);
+  const __m128i ones = _mm_set1_epi8(-1);
+  const int greymask = channels == 4 ? 0x3333 : 0x06db; /*the r == g and g == b bytes of each pixel*/
+  while(i + 18u <= numpixels) {
+    int ok = 0xffff, k;
+    for(k = 0; k != 4; ++k) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(in + (i + 4u * k) * channels));
+      if(grey) ok &= _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_srli_si128(v, 1))) | (0xffff ^ greymask);
+      if(opaque) ok &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(v, notalpha), ones));
+    }
+    if(ok != 0xffff) break; /*the pixel is found below*/
+    i += 16u;
+  }
+#endif /*LODEPNG_SSE2*/
+  for(; i != numpixels; ++i) {
+    const unsigned char* p = &in[i * channels];
+    if(grey && (p[0] != p[1] || p[0] != p[2])) break;
+    if(opaque && p[3] != 255) break;
+  }
+  return i;
+}
+
+/*how many pixels lodepng_compute_color_stats samples to find out early that there are too many colors*/
+#define LODEPNG_COLOR_SAMPLES 1024u
+
 /*stats must already have been inited. */
 unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
                                      const unsigned char* in, unsigned w, unsigned h,
                                      const LodePNGColorMode* mode_in) {
   size_t i;
-  ColorTree tree;
+  ColorTable table;
   size_t numpixels = (size_t)w * (size_t)h;
   unsigned error = 0;
 
@@ -4042,28 +5680,33 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
   unsigned bits_done = (stats->bits == 1 && bpp == 1) ? 1 : 0;
   unsigned sixteen = 0; /* whether the input image is 16 bit */
   unsigned maxnumcolors = 257;
+  /*the pixels of 8-bit RGB and RGBA are plain bytes, which allows the bulk checks of findColorStatsPixel*/
+  unsigned plain = mode_in->bitdepth == 8 &&
+                   (mode_in->colortype == LCT_RGBA || (mode_in->colortype == LCT_RGB && !mode_in->key_defined));
   if(bpp <= 8) maxnumcolors = LODEPNG_MIN(257, stats->numcolors + (1u << bpp));
 
+  if(hasRawLayout(mode_in)) return 128; /*the layout is only supported for the output of conversions*/
+
   stats->numpixels += numpixels;
 
   /*if palette not allowed, no need to compute numcolors*/
   if(!stats->allow_palette) numcolors_done = 1;
 
-  color_tree_init(&tree);
+  color_table_init(&table);
 
-  /*If the stats was already filled in from previous data, fill its palette in tree
+  /*If the stats was already filled in from previous data, fill its palette in table
   and mark things as done already if we know they are the most expensive case already*/
   if(stats->alpha) alpha_done = 1;
   if(stats->colored) colored_done = 1;
   if(stats->bits == 16) numcolors_done = 1;
-  if(stats->bits >= bpp) bits_done = 1;
+  if(stats->bits >= LODEPNG_MIN(bpp, 8u)) bits_done = 1; /*16 bits is found separately below*/
   if(stats->numcolors >= maxnumcolors) numcolors_done = 1;
 
   if(!numcolors_done) {
     for(i = 0; i < stats->numcolors; i++) {
       const unsigned char* color = &stats->palette[i * 4];
-      error = color_tree_add(&tree, color[0], color[1], color[2], color[3], (unsigned)i);
-      if(error) goto cleanup;
+      error = color_table_add(&table, color[0], color[1], color[2], color[3], (unsigned)i);
+      if(error) return error;
     }
   }
 
@@ -4129,11 +5772,43 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
   } else /* < 16-bit */ {
     unsigned char r = 0, g = 0, b = 0, a = 0;
     unsigned char pr = 0, pg = 0, pb = 0, pa = 0;
+
+    /*An image with more colors than a palette can have, such as a photo, usually already shows that in a sample
+    of its pixels, so that the colors of all pixels don't need to be counted. Otherwise the sampled colors are
+    discarded, the palette must have the colors in the order in which they first appear in the image.*/
+    if(plain && !numcolors_done && stats->numcolors == 0 && numpixels >= LODEPNG_COLOR_SAMPLES * 4u) {
+      size_t step = numpixels / LODEPNG_COLOR_SAMPLES;
+      for(i = 0; i < numpixels && !numcolors_done; i += step) {
+        getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
+        if(color_table_has(&table, r, g, b, a)) continue;
+        error = color_table_add(&table, r, g, b, a, stats->numcolors);
+        if(error) return error;
+        if(stats->numcolors < 256) {
+          unsigned char* p = &stats->palette[stats->numcolors * 4];
+          p[0] = r;
+          p[1] = g;
+          p[2] = b;
+          p[3] = a;
+        }
+        ++stats->numcolors;
+        numcolors_done = stats->numcolors >= maxnumcolors;
+      }
+      if(!numcolors_done) {
+        stats->numcolors = 0;
+        color_table_init(&table);
+      }
+    }
+
     for(i = 0; i != numpixels; ++i) {
+      if(plain && numcolors_done && bits_done && (alpha_done || !stats->key)) {
+        i = findColorStatsPixel(in, i, numpixels, mode_in->colortype == LCT_RGBA ? 4 : 3,
+                                !colored_done, !alpha_done);
+        if(i == numpixels) break;
+      }
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
 
       /*skip if color same as before, this speeds up large non-photographic
-      images with many same colors by avoiding 'color_tree_has' below */
+      images with many same colors by avoiding 'color_table_has' below */
       if(i != 0 && r == pr && g == pg && b == pb && a == pa) continue;
       pr = r;
       pg = g;
@@ -4145,7 +5820,7 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
         unsigned bits = getValueRequiredBits(r);
         if(bits > stats->bits) stats->bits = bits;
       }
-      bits_done = (stats->bits >= bpp);
+      bits_done = (stats->bits >= LODEPNG_MIN(bpp, 8u));
 
       if(!colored_done && (r != g || r != b)) {
         stats->colored = 1;
@@ -4175,9 +5850,9 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
       }
 
       if(!numcolors_done) {
-        if(!color_tree_has(&tree, r, g, b, a)) {
-          error = color_tree_add(&tree, r, g, b, a, stats->numcolors);
-          if(error) goto cleanup;
+        if(!color_table_has(&table, r, g, b, a)) {
+          error = color_table_add(&table, r, g, b, a, stats->numcolors);
+          if(error) return error;
           if(stats->numcolors < 256) {
             unsigned char* p = stats->palette;
             unsigned n = stats->numcolors;
@@ -4213,8 +5888,147 @@ unsigned lodepng_compute_color_stats(LodePNGColorStats* stats,
     stats->key_b += (stats->key_b << 8);
   }
 
-cleanup:
-  color_tree_cleanup(&tree);
+  return error;
+}
+
+/*the segments of the image of which the color stats are computed on multiple threads, see parallel_for*/
+typedef struct ColorStatsSegments {
+  const unsigned char* in;
+  const LodePNGColorMode* mode_in;
+  size_t numpixels;
+  size_t segmentpixels;
+  LodePNGColorStats* stats; /*the stats of each segment*/
+  unsigned* errors; /*the error of each segment*/
+  unsigned* keyused; /*whether each segment has a pixel with the key color that is not fully transparent*/
+  const LodePNGColorStats* key; /*the stats with the key color, for colorKeySegmentTask*/
+} ColorStatsSegments;
+
+static void colorStatsSegmentTask(void* data, size_t i) {
+  ColorStatsSegments* segments = (ColorStatsSegments*)data;
+  size_t start = i * segments->segmentpixels;
+  size_t n = LODEPNG_MIN(segments->segmentpixels, segments->numpixels - start);
+  segments->errors[i] = lodepng_compute_color_stats(&segments->stats[i],
+                                                    segments->in + start / 8u * lodepng_get_bpp(segments->mode_in),
+                                                    (unsigned)n, 1, segments->mode_in);
+}
+
+static void colorKeySegmentTask(void* data, size_t i) {
+  ColorStatsSegments* segments = (ColorStatsSegments*)data;
+  const LodePNGColorStats* key = segments->key;
+  size_t j, start = i * segments->segmentpixels;
+  size_t end = start + LODEPNG_MIN(segments->segmentpixels, segments->numpixels - start);
+  segments->keyused[i] = 0;
+  if(segments->mode_in->bitdepth == 16) {
+    unsigned short r = 0, g = 0, b = 0, a = 0;
+    for(j = start; j != end && !segments->keyused[i]; ++j) {
+      getPixelColorRGBA16(&r, &g, &b, &a, segments->in, j, segments->mode_in);
+      segments->keyused[i] = a != 0 && r == key->key_r && g == key->key_g && b == key->key_b;
+    }
+  } else {
+    unsigned char r = 0, g = 0, b = 0, a = 0;
+    for(j = start; j != end && !segments->keyused[i]; ++j) {
+      getPixelColorRGBA8(&r, &g, &b, &a, segments->in, j, segments->mode_in);
+      segments->keyused[i] = a != 0 && r == (key->key_r & 255u) && g == (key->key_g & 255u) &&
+                             b == (key->key_b & 255u);
+    }
+  }
+}
+
+/*
+Merges the stats of the segments, in order, into stats, with the same result as computing stats of the
+whole image at once. The palettes are merged in order, so the colors keep the order in which they
+first appear in the image. Whether the color key can be used, which depends on all pixels, is
+checked by the caller afterwards.
+*/
+static unsigned mergeColorStats(LodePNGColorStats* stats, const LodePNGColorStats* parts, size_t count) {
+  unsigned error = 0;
+  size_t i;
+  unsigned j;
+  ColorTable table;
+  color_table_init(&table);
+  for(i = 0; i != count && !error; ++i) {
+    const LodePNGColorStats* part = &parts[i];
+    stats->numpixels += part->numpixels;
+    if(part->colored) stats->colored = 1;
+    if(part->bits > stats->bits) stats->bits = part->bits;
+    if(part->alpha) {
+      stats->alpha = 1;
+    } else if(part->key) {
+      if(!stats->key) {
+        stats->key = 1;
+        stats->key_r = part->key_r;
+        stats->key_g = part->key_g;
+        stats->key_b = part->key_b;
+      } else if(part->key_r != stats->key_r || part->key_g != stats->key_g || part->key_b != stats->key_b) {
+        stats->alpha = 1; /*fully transparent pixels with different colors*/
+      }
+    }
+    for(j = 0; j != LODEPNG_MIN(part->numcolors, 256u) && stats->numcolors < 257u; ++j) {
+      const unsigned char* p = &part->palette[j * 4];
+      if(color_table_has(&table, p[0], p[1], p[2], p[3])) continue;
+      error = color_table_add(&table, p[0], p[1], p[2], p[3], stats->numcolors);
+      if(error) break;
+      if(stats->numcolors < 256) lodepng_memcpy(&stats->palette[stats->numcolors * 4], p, 4);
+      ++stats->numcolors;
+    }
+    if(part->numcolors > 256) stats->numcolors = 257; /*the part alone has more colors than a palette can have*/
+  }
+
+  if(stats->alpha) stats->key = 0;
+  if(stats->bits == 16) stats->numcolors = 0; /*not counted for 16-bit images*/
+  /*PNG has no colored or alphachannel modes with less than 8-bit per channel*/
+  if((stats->colored || stats->alpha) && stats->bits < 8) stats->bits = 8;
+  return error;
+}
+
+/*lodepng_compute_color_stats of newly inited stats, in segments with parallel_for if it is given and the
+image is large enough*/
+static unsigned computeColorStatsParallel(LodePNGColorStats* stats, const unsigned char* in, unsigned w, unsigned h,
+                                          const LodePNGColorMode* mode_in, const LodePNGCompressSettings* settings) {
+  unsigned error = 0;
+  unsigned bpp = lodepng_get_bpp(mode_in);
+  size_t i, count;
+  ColorStatsSegments segments;
+  segments.numpixels = (size_t)w * (size_t)h;
+  if(!settings->parallel_for || !settings->parallel_segment_size || bpp == 0 ||
+     segments.numpixels <= pixelSegmentSize(settings->parallel_segment_size, bpp)) {
+    return lodepng_compute_color_stats(stats, in, w, h, mode_in);
+  }
+  segments.in = in;
+  segments.mode_in = mode_in;
+  segments.segmentpixels = pixelSegmentSize(settings->parallel_segment_size, bpp);
+  segments.key = stats;
+  count = (segments.numpixels + segments.segmentpixels - 1u) / segments.segmentpixels;
+  segments.stats = (LodePNGColorStats*)allocator_malloc(&settings->allocator, count * sizeof(*segments.stats));
+  segments.errors = (unsigned*)allocator_malloc(&settings->allocator, count * sizeof(*segments.errors));
+  segments.keyused = (unsigned*)allocator_malloc(&settings->allocator, count * sizeof(*segments.keyused));
+  if(!segments.stats || !segments.errors || !segments.keyused) error = 83; /*alloc fail*/
+
+  if(!error) {
+    for(i = 0; i != count; ++i) {
+      lodepng_color_stats_init(&segments.stats[i]);
+      segments.stats[i].allow_palette = stats->allow_palette;
+      segments.stats[i].allow_greyscale = stats->allow_greyscale;
+    }
+    settings->parallel_for(colorStatsSegmentTask, &segments, count, settings->parallel_context);
+    for(i = 0; i != count && !error; ++i) error = segments.errors[i];
+  }
+  if(!error) error = mergeColorStats(stats, segments.stats, count);
+  if(!error && stats->key) {
+    /* Color key cannot be used if an opaque pixel also has that RGB color. */
+    settings->parallel_for(colorKeySegmentTask, &segments, count, settings->parallel_context);
+    for(i = 0; i != count; ++i) {
+      if(segments.keyused[i]) {
+        stats->alpha = 1;
+        stats->key = 0;
+        if(stats->bits < 8) stats->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
+      }
+    }
+  }
+
+  allocator_free(&settings->allocator, segments.keyused);
+  allocator_free(&settings->allocator, segments.errors);
+  allocator_free(&settings->allocator, segments.stats);
   return error;
 }
 
@@ -4325,6 +6139,32 @@ static unsigned char paethPredictor(unsigned char a, unsigned char b, unsigned c
   return (pc < pa) ? c : a;
 }
 
+#ifdef LODEPNG_SSE2
+/*returns the bytes of x where mask is set, those of y elsewhere*/
+static __m128i sse2_select(__m128i mask, __m128i x, __m128i y) {
+  return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+static __m128i sse2_abs16(__m128i v) {
+  return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+/*paethPredictor on eight 16-bit values at once, with the same tie breaking*/
+static __m128i sse2_paeth16(__m128i a, __m128i b, __m128i c) {
+  __m128i pa = sse2_abs16(_mm_sub_epi16(b, c));
+  __m128i pb = sse2_abs16(_mm_sub_epi16(a, c));
+  __m128i pc = sse2_abs16(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+  __m128i pred = sse2_select(_mm_cmplt_epi16(pb, pa), b, a);
+  pa = _mm_min_epi16(pa, pb);
+  return sse2_select(_mm_cmplt_epi16(pc, pa), c, pred);
+}
+
+/*(a + b) >> 1 for unsigned bytes. _mm_avg_epu8 rounds up, subtracting the lowest bit of a ^ b rounds down*/
+static __m128i sse2_average8(__m128i a, __m128i b) {
+  return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+#endif /*LODEPNG_SSE2*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -4443,6 +6283,120 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+#ifdef LODEPNG_SSE2
+/*loads a pixel of n = 3, 4, 6 or 8 bytes into the low bytes of a vector, the other bytes are zero*/
+static __m128i sse2_load(const unsigned char* p, size_t n) {
+  if(n == 8) return _mm_loadl_epi64((const __m128i*)p);
+  if(n == 3) return _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16));
+  {
+    __m128i v = _mm_cvtsi32_si128((int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24)));
+    return n == 6 ? _mm_insert_epi16(v, p[4] | (p[5] << 8), 2) : v;
+  }
+}
+
+/*stores the low n = 3, 4, 6 or 8 bytes of the vector*/
+static void sse2_store(unsigned char* p, __m128i v, size_t n) {
+  unsigned x;
+  if(n == 8) {
+    _mm_storel_epi64((__m128i*)p, v);
+    return;
+  }
+  x = (unsigned)_mm_cvtsi128_si32(v);
+  p[0] = (unsigned char)x; p[1] = (unsigned char)(x >> 8); p[2] = (unsigned char)(x >> 16);
+  if(n == 3) return;
+  p[3] = (unsigned char)(x >> 24);
+  if(n == 6) {
+    x = (unsigned)_mm_extract_epi16(v, 2);
+    p[4] = (unsigned char)x; p[5] = (unsigned char)(x >> 8);
+  }
+}
+
+/*
+Each pixel of the Sub, Average and Paeth filters depends on the previous reconstructed
+pixel, so these work one pixel (up to 8 bytes) per vector. Starting with a and c as zero
+vectors gives the correct result for the first pixel, which has no left neighbor.
+*/
+static void unfilterSubSSE2(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length) {
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i + bytewidth <= length; i += bytewidth) {
+    a = _mm_add_epi8(sse2_load(&scanline[i], bytewidth), a);
+    sse2_store(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterAverageSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, size_t length) {
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i + bytewidth <= length; i += bytewidth) {
+    __m128i avg = sse2_average8(a, sse2_load(&precon[i], bytewidth));
+    a = _mm_add_epi8(sse2_load(&scanline[i], bytewidth), avg);
+    sse2_store(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterPaethSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t bytewidth, size_t length) {
+  size_t i;
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero; /*as 16-bit values*/
+  for(i = 0; i + bytewidth <= length; i += bytewidth) {
+    __m128i b = _mm_unpacklo_epi8(sse2_load(&precon[i], bytewidth), zero);
+    __m128i pred = sse2_paeth16(a, b, c);
+    pred = _mm_add_epi8(sse2_load(&scanline[i], bytewidth), _mm_packus_epi16(pred, pred));
+    sse2_store(&recon[i], pred, bytewidth);
+    a = _mm_unpacklo_epi8(pred, zero);
+    c = b;
+  }
+}
+
+/*returns 1 if the scanline was handled, 0 if the portable code must do it instead.
+Same parameters as unfilterScanline.*/
+static int unfilterScanlineSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, unsigned char filterType, size_t length) {
+  /*the Up filter has no dependency between bytes and works on any bytewidth*/
+  if(filterType == 2 && precon) {
+    size_t i;
+    for(i = 0; i + 16 <= length; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+      __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+      _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+    }
+    for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+    return 1;
+  }
+  /*the constant bytewidths let the compiler specialize the small loads and stores*/
+  switch(bytewidth) {
+    case 3: case 4: case 6: case 8: break;
+    default: return 0;
+  }
+  if(filterType == 1) {
+    if(bytewidth == 3) unfilterSubSSE2(recon, scanline, 3, length);
+    else if(bytewidth == 4) unfilterSubSSE2(recon, scanline, 4, length);
+    else if(bytewidth == 6) unfilterSubSSE2(recon, scanline, 6, length);
+    else unfilterSubSSE2(recon, scanline, 8, length);
+    return 1;
+  }
+  if(!precon) return 0;
+  if(filterType == 3) {
+    if(bytewidth == 3) unfilterAverageSSE2(recon, scanline, precon, 3, length);
+    else if(bytewidth == 4) unfilterAverageSSE2(recon, scanline, precon, 4, length);
+    else if(bytewidth == 6) unfilterAverageSSE2(recon, scanline, precon, 6, length);
+    else unfilterAverageSSE2(recon, scanline, precon, 8, length);
+    return 1;
+  }
+  if(filterType == 4) {
+    if(bytewidth == 3) unfilterPaethSSE2(recon, scanline, precon, 3, length);
+    else if(bytewidth == 4) unfilterPaethSSE2(recon, scanline, precon, 4, length);
+    else if(bytewidth == 6) unfilterPaethSSE2(recon, scanline, precon, 6, length);
+    else unfilterPaethSSE2(recon, scanline, precon, 8, length);
+    return 1;
+  }
+  return 0;
+}
+#endif /*LODEPNG_SSE2*/
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length) {
   /*
@@ -4455,6 +6409,9 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#ifdef LODEPNG_SSE2
+  if(unfilterScanlineSSE2(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif /*LODEPNG_SSE2*/
   switch(filterType) {
     case 0:
       for(i = 0; i != length; ++i) recon[i] = scanline[i];
@@ -4664,6 +6621,40 @@ static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w
   return 0;
 }
 
+/*
+Writes the rows y0 to y1 of the reduced image of one Adam7 pass to their pixels in out, see Adam7_deinterlace.
+in is the reduced image of the pass, with rows of ilinebits bits, which for bpp >= 8 must be a multiple of 8.
+*/
+static void Adam7_deinterlacePass(unsigned char* out, const unsigned char* in, unsigned w, unsigned bpp,
+                                  unsigned pass, unsigned passw, size_t ilinebits, unsigned y0, unsigned y1) {
+  unsigned x, y, b;
+  if(bpp >= 8) {
+    size_t bytewidth = bpp / 8u;
+    for(y = y0; y < y1; ++y)
+    for(x = 0; x < passw; ++x) {
+      size_t pixelinstart = y * (ilinebits / 8u) + x * bytewidth;
+      size_t pixeloutstart = ((ADAM7_IY[pass] + (size_t)y * ADAM7_DY[pass]) * (size_t)w
+                           + ADAM7_IX[pass] + (size_t)x * ADAM7_DX[pass]) * bytewidth;
+      for(b = 0; b < bytewidth; ++b) {
+        out[pixeloutstart + b] = in[pixelinstart + b];
+      }
+    }
+  } else /*bpp < 8: Adam7 with pixels < 8 bit is a bit trickier: with bit pointers*/ {
+    size_t olinebits = (size_t)bpp * w;
+    size_t obp, ibp; /*bit pointers (for out and in buffer)*/
+    for(y = y0; y < y1; ++y)
+    for(x = 0; x < passw; ++x) {
+      ibp = y * ilinebits + (size_t)x * bpp;
+      obp = (ADAM7_IY[pass] + (size_t)y * ADAM7_DY[pass]) * olinebits
+          + (ADAM7_IX[pass] + (size_t)x * ADAM7_DX[pass]) * bpp;
+      for(b = 0; b < bpp; ++b) {
+        unsigned char bit = readBitFromReversedStream(&ibp, in);
+        setBitOfReversedStream(&obp, out, bit);
+      }
+    }
+  }
+}
+
 /*
 in: Adam7 interlaced image, with no padding bits between scanlines, but between
  reduced images so that each reduced image starts at a byte.
@@ -4682,30 +6673,41 @@ static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsig
 
   Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
-  if(bpp >= 8) {
-    for(i = 0; i != 7; ++i) {
-      unsigned x, y, b;
-      size_t bytewidth = bpp / 8u;
-      for(y = 0; y < passh[i]; ++y)
-      for(x = 0; x < passw[i]; ++x) {
-        size_t pixelinstart = passstart[i] + (y * passw[i] + x) * bytewidth;
-        size_t pixeloutstart = ((ADAM7_IY[i] + (size_t)y * ADAM7_DY[i]) * (size_t)w
-                             + ADAM7_IX[i] + (size_t)x * ADAM7_DX[i]) * bytewidth;
-        for(b = 0; b < bytewidth; ++b) {
-          out[pixeloutstart + b] = in[pixelinstart + b];
-        }
-      }
-    }
-  } else /*bpp < 8: Adam7 with pixels < 8 bit is a bit trickier: with bit pointers*/ {
-    for(i = 0; i != 7; ++i) {
-      unsigned x, y, b;
-      unsigned ilinebits = bpp * passw[i];
-      unsigned olinebits = bpp * w;
-      size_t obp, ibp; /*bit pointers (for out and in buffer)*/
-      for(y = 0; y < passh[i]; ++y)
-      for(x = 0; x < passw[i]; ++x) {
-        ibp = (8 * passstart[i]) + (y * ilinebits + x * bpp);
-        obp = (ADAM7_IY[i] + (size_t)y * ADAM7_DY[i]) * olinebits + (ADAM7_IX[i] + (size_t)x * ADAM7_DX[i]) * bpp;
+  for(i = 0; i != 7; ++i) {
+    Adam7_deinterlacePass(out, &in[passstart[i]], w, bpp, i, passw[i], (size_t)passw[i] * bpp, 0, passh[i]);
+  }
+}
+
+/*width and height of the block of pixels a pixel of each pass covers in a preview, until later passes fill it in*/
+static const unsigned ADAM7_BW[7] = { 8, 4, 4, 2, 2, 1, 1 };
+static const unsigned ADAM7_BH[7] = { 8, 8, 4, 4, 2, 2, 1 };
+
+/*
+Writes the pixels of one Adam7 pass to the image out, of w * h pixels without padding bits between rows, with
+each pixel repeated over its block of pixels that only the later passes have, so that after the passes
+0 to i the image is a preview with the resolution those passes give. in is the unfiltered reduced image of
+the pass, of passw * passh pixels, with its rows starting at a byte boundary.
+*/
+static void Adam7_preview(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp,
+                          unsigned pass, unsigned passw, unsigned passh) {
+  size_t ilinebits = ((size_t)passw * bpp + 7u) / 8u * 8u;
+  unsigned x, y, bx, by;
+  for(y = 0; y < passh; ++y)
+  for(x = 0; x < passw; ++x) {
+    size_t px = ADAM7_IX[pass] + (size_t)x * ADAM7_DX[pass];
+    size_t py = ADAM7_IY[pass] + (size_t)y * ADAM7_DY[pass];
+    unsigned bw = px + ADAM7_BW[pass] > w ? (unsigned)(w - px) : ADAM7_BW[pass];
+    unsigned bh = py + ADAM7_BH[pass] > h ? (unsigned)(h - py) : ADAM7_BH[pass];
+    for(by = 0; by < bh; ++by)
+    for(bx = 0; bx < bw; ++bx) {
+      if(bpp >= 8) {
+        size_t bytewidth = bpp / 8u;
+        lodepng_memcpy(&out[((py + by) * w + px + bx) * bytewidth],
+                       &in[y * (ilinebits / 8u) + x * bytewidth], bytewidth);
+      } else {
+        unsigned b;
+        size_t ibp = y * ilinebits + (size_t)x * bpp;
+        size_t obp = ((py + by) * w + px + bx) * bpp;
         for(b = 0; b < bpp; ++b) {
           unsigned char bit = readBitFromReversedStream(&ibp, in);
           setBitOfReversedStream(&obp, out, bit);
@@ -4742,14 +6744,82 @@ static void removePaddingBits(unsigned char* out, const unsigned char* in,
 /*out must be buffer big enough to contain full image, and in must contain the full decompressed data from
 the IDAT chunks (with filter index bytes and possible padding bits)
 return value is error*/
-static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
-                                     unsigned w, unsigned h, const LodePNGInfo* info_png) {
+/*the passes and rows of an interlaced image that are post-processed on multiple threads, see parallel_for*/
+typedef struct Adam7Tasks {
+  unsigned char* out;
+  const unsigned char* in; /*the filtered passes*/
+  unsigned char* passes; /*the unfiltered passes, with padding bits at the end of rows if bpp < 8*/
+  unsigned w, h, bpp;
+  unsigned passw[7], passh[7];
+  size_t filter_passstart[8], padded_passstart[8], passstart[8];
+  unsigned bandheight; /*rows of out per band, a multiple of 8 so that each band starts at a byte for any bpp*/
+  unsigned errors[7]; /*the error of each pass*/
+} Adam7Tasks;
+
+static void adam7UnfilterTask(void* data, size_t i) {
+  Adam7Tasks* tasks = (Adam7Tasks*)data;
+  tasks->errors[i] = unfilter(&tasks->passes[tasks->padded_passstart[i]], &tasks->in[tasks->filter_passstart[i]],
+                              tasks->passw[i], tasks->passh[i], tasks->bpp);
+}
+
+static void adam7DeinterlaceTask(void* data, size_t band) {
+  Adam7Tasks* tasks = (Adam7Tasks*)data;
+  unsigned y0 = (unsigned)band * tasks->bandheight;
+  unsigned y1 = tasks->h - y0 > tasks->bandheight ? y0 + tasks->bandheight : tasks->h;
+  unsigned i;
+  for(i = 0; i != 7; ++i) {
+    /*the rows of the pass in the band: y0 is a multiple of ADAM7_DY, which is larger than ADAM7_IY*/
+    unsigned py0 = y0 / ADAM7_DY[i];
+    unsigned py1 = y1 > ADAM7_IY[i] ? (y1 - ADAM7_IY[i] + ADAM7_DY[i] - 1u) / ADAM7_DY[i] : 0;
+    if(py1 > tasks->passh[i]) py1 = tasks->passh[i];
+    if(py0 >= py1) continue;
+    Adam7_deinterlacePass(tasks->out, &tasks->passes[tasks->padded_passstart[i]], tasks->w, tasks->bpp, i,
+                          tasks->passw[i], ((size_t)tasks->passw[i] * tasks->bpp + 7u) / 8u * 8u, py0, py1);
+  }
+}
+
+/*
+postProcessScanlines for Adam7 with parallel_for: the seven passes are unfiltered at the same time, into a
+separate buffer since in place each pass would overwrite the end of the previous one, and then bands of rows
+of out are deinterlaced at the same time, directly from the padded rows of the passes.
+*/
+static unsigned postProcessAdam7Parallel(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                                         unsigned bpp, const LodePNGDecompressSettings* settings) {
+  unsigned i, error = 0;
+  size_t linebytes = ((size_t)w * bpp + 7u) / 8u;
+  size_t bandheight = settings->parallel_segment_size / linebytes / 8u * 8u;
+  Adam7Tasks tasks;
+  tasks.out = out;
+  tasks.in = in;
+  tasks.w = w;
+  tasks.h = h;
+  tasks.bpp = bpp;
+  tasks.bandheight = (unsigned)LODEPNG_MIN(LODEPNG_MAX(bandheight, 8u), h);
+  Adam7_getpassvalues(tasks.passw, tasks.passh, tasks.filter_passstart, tasks.padded_passstart, tasks.passstart,
+                      w, h, bpp);
+  tasks.passes = (unsigned char*)allocator_malloc(&settings->allocator, tasks.padded_passstart[7]);
+  if(!tasks.passes) return 83; /*alloc fail*/
+
+  settings->parallel_for(adam7UnfilterTask, &tasks, 7, settings->parallel_context);
+  for(i = 0; i != 7 && !error; ++i) error = tasks.errors[i];
+  if(!error) {
+    settings->parallel_for(adam7DeinterlaceTask, &tasks, (h + tasks.bandheight - 1u) / tasks.bandheight,
+                           settings->parallel_context);
+  }
+
+  allocator_free(&settings->allocator, tasks.passes);
+  return error;
+}
+
+static unsigned postProcessScanlines(unsigned char* out, unsigned char* in, unsigned w, unsigned h,
+                                     const LodePNGInfo* info_png, const LodePNGDecompressSettings* settings) {
   /*
   This function converts the filtered-padded-interlaced data into pure 2D image buffer with the PNG's colortype.
   Steps:
   *) if no Adam7: 1) unfilter 2) remove padding bits (= possible extra bits per scanline if bpp < 8)
   *) if adam7: 1) 7x unfilter 2) 7x remove padding bits 3) Adam7_deinterlace
   NOTE: the in buffer will be overwritten with intermediate data!
+  settings gives the parallel_for to use for large Adam7 images.
   */
   unsigned bpp = lodepng_get_bpp(&info_png->color);
   if(bpp == 0) return 31; /*error: invalid colortype*/
@@ -4765,6 +6835,11 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
     unsigned passw[7], passh[7]; size_t filter_passstart[8], padded_passstart[8], passstart[8];
     unsigned i;
 
+    if(settings->parallel_for && settings->parallel_segment_size &&
+       ((size_t)w * (size_t)h * bpp + 7u) / 8u > settings->parallel_segment_size) {
+      return postProcessAdam7Parallel(out, in, w, h, bpp, settings);
+    }
+
     Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
     for(i = 0; i != 7; ++i) {
@@ -4785,6 +6860,289 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
   return 0;
 }
 
+/*
+Unfilters the scanlines of a non-interlaced image one at a time as they get decompressed, and converts
+each row to the output color mode immediately, so that no buffer for the whole filtered or unconverted
+image is needed. The rows are written into an image, or given to a callback. Optionally only a region
+of the image is output, then decompression can stop after its last row.
+*/
+typedef struct RowPipeline {
+  const LodePNGColorMode* mode_png; /*color mode of the scanlines*/
+  const LodePNGColorMode* mode_out; /*color mode to convert the rows to, 0 for no conversion*/
+  unsigned w, h;
+  unsigned y; /*next row*/
+  unsigned x0, y0; /*first column and row of the region to output, rows above it are only unfiltered*/
+  unsigned outw; /*width of the region to output*/
+  unsigned y_end; /*row below the region to output, no more scanlines are needed from there*/
+  size_t linebytes; /*bytes of a scanline, excluding the filter type byte*/
+  unsigned char* line; /*current unfiltered scanline*/
+  unsigned char* prevline; /*previous unfiltered scanline*/
+  unsigned char* converted; /*current row converted to mode_out*/
+  unsigned char* memory; /*allocation of line, prevline and converted, 0 if they are in a buffer of the caller*/
+  unsigned char* cropped; /*columns of the region of the current row, if they don't start at a byte boundary*/
+  unsigned char* image; /*the output image, or 0 to use callback*/
+  /*bytes from the start of one row of image to the next, or 0 if the rows have no padding bits in between*/
+  size_t stride;
+  void (*callback)(void* context, unsigned y, const unsigned char* row);
+  void* context;
+
+  /*downscaling: every block of 2^shift * 2^shift pixels of the region becomes one output pixel, their average*/
+  unsigned shift;
+  LodePNGColorMode mode_box; /*RGBA color mode in which the pixels are averaged*/
+  unsigned char* box; /*the current row in mode_box, and then the averaged output row*/
+  unsigned* sums; /*per output pixel, the sums of its channels over the rows of the current block row*/
+  const LodePNGAllocator* allocator; /*allocator of memory, cropped, box and sums*/
+} RowPipeline;
+
+static void RowPipeline_cleanup(RowPipeline* rows) {
+  allocator_free(rows->allocator, rows->sums);
+  allocator_free(rows->allocator, rows->box);
+  allocator_free(rows->allocator, rows->cropped);
+  allocator_free(rows->allocator, rows->memory);
+  rows->line = rows->prevline = rows->converted = rows->memory = rows->cropped = rows->box = 0;
+  rows->sums = 0;
+}
+
+/*mode_out is 0 if no conversion is needed. The row buffers are placed in buffer, which is resized as
+needed, or allocated with allocator if buffer is 0. The other buffers are allocated with allocator, which
+may be 0. Returns error code.*/
+static unsigned RowPipeline_init(RowPipeline* rows, unsigned w, unsigned h, const LodePNGColorMode* mode_png,
+                                 const LodePNGColorMode* mode_out, unsigned char* image, ucvector* buffer,
+                                 const LodePNGAllocator* allocator) {
+  size_t convertedsize = lodepng_get_raw_size(w, 1, mode_out ? mode_out : mode_png);
+  unsigned char* data;
+  rows->mode_png = mode_png;
+  rows->mode_out = mode_out;
+  rows->w = w;
+  rows->h = h;
+  rows->y = 0;
+  rows->x0 = rows->y0 = 0;
+  rows->outw = w;
+  rows->y_end = h;
+  rows->linebytes = lodepng_get_raw_size_idat(w, 1, lodepng_get_bpp(mode_png)) - 1u;
+  rows->image = image;
+  rows->stride = 0;
+  rows->callback = 0;
+  rows->context = 0;
+  rows->shift = 0;
+  rows->line = rows->prevline = rows->converted = rows->memory = rows->cropped = rows->box = 0;
+  rows->sums = 0;
+  rows->allocator = allocator;
+  if(buffer) {
+    if(!ucvector_resize(buffer, 2u * rows->linebytes + convertedsize)) return 83; /*alloc fail*/
+    data = buffer->data;
+  } else {
+    data = rows->memory = (unsigned char*)allocator_malloc(allocator, 2u * rows->linebytes + convertedsize);
+    if(!data) return 83; /*alloc fail*/
+  }
+  rows->line = data;
+  rows->prevline = data + rows->linebytes;
+  rows->converted = data + 2u * rows->linebytes;
+  return 0;
+}
+
+/*Only outputs the region of w * h pixels at x0, y0, which must be inside the image. Returns error code.*/
+static unsigned RowPipeline_region(RowPipeline* rows, unsigned x0, unsigned y0, unsigned w, unsigned h) {
+  rows->x0 = x0;
+  rows->y0 = y0;
+  rows->outw = w;
+  rows->y_end = y0 + h;
+  if((size_t)x0 * lodepng_get_bpp(rows->mode_png) % 8u != 0) {
+    rows->cropped = (unsigned char*)allocator_malloc(rows->allocator, rows->linebytes);
+    if(!rows->cropped) return 83; /*alloc fail*/
+  }
+  return 0;
+}
+
+/*Outputs the region downscaled by 2^shift in both directions, with a box filter. Must be used after
+RowPipeline_region, and the output color mode can't be palette. Returns error code.*/
+static unsigned RowPipeline_scale(RowPipeline* rows, unsigned shift) {
+  size_t outw = ((size_t)rows->outw + (1u << shift) - 1u) >> shift;
+  if(!rows->mode_out) rows->mode_out = rows->mode_png; /*the averages are converted back*/
+  rows->shift = shift;
+  rows->mode_box = lodepng_color_mode_make(LCT_RGBA, rows->mode_out->bitdepth == 16 ? 16 : 8);
+  rows->box = (unsigned char*)allocator_malloc(rows->allocator, lodepng_get_raw_size(rows->outw, 1, &rows->mode_box));
+  rows->sums = (unsigned*)allocator_malloc(rows->allocator, outw * 4u * sizeof(unsigned));
+  if(!rows->box || !rows->sums) return 83; /*alloc fail*/
+  lodepng_memset(rows->sums, 0, outw * 4u * sizeof(unsigned));
+  return 0;
+}
+
+/*outputs row y of the output, of w pixels in mode, which is mode_png unless the row was downscaled*/
+static unsigned RowPipeline_emit(RowPipeline* rows, size_t y, const unsigned char* row,
+                                 const LodePNGColorMode* mode, unsigned w) {
+  size_t linebits = (size_t)w * lodepng_get_bpp(rows->mode_out ? rows->mode_out : mode);
+  /*whether the row can go in the image directly, rather than moving its bits to the right position*/
+  unsigned aligned = rows->image && (rows->stride || linebits % 8u == 0);
+  size_t stride = rows->stride ? rows->stride : linebits / 8u;
+  if(rows->mode_out) {
+    unsigned char* dest = aligned ? &rows->image[y * stride] : rows->converted;
+    CERROR_TRY_RETURN(lodepng_convert(dest, row, rows->mode_out, mode, w, 1));
+    if(aligned) return 0;
+    row = dest;
+  }
+  if(!rows->image) {
+    rows->callback(rows->context, (unsigned)y, row);
+  } else if(aligned) {
+    lodepng_memcpy(&rows->image[y * stride], row, (linebits + 7u) / 8u);
+  } else {
+    size_t x, ibp = 0, obp = y * linebits;
+    for(x = 0; x < linebits; ++x) {
+      unsigned char bit = readBitFromReversedStream(&ibp, row);
+      setBitOfReversedStream(&obp, rows->image, bit);
+    }
+  }
+  return 0;
+}
+
+/*adds row y of the region, in mode_png, to the sums of the box filter, and outputs the averages once the
+last row of a block is added*/
+static unsigned RowPipeline_box(RowPipeline* rows, unsigned y, const unsigned char* row) {
+  unsigned shift = rows->shift, size = 1u << shift;
+  unsigned outw = (rows->outw + size - 1u) >> shift;
+  unsigned blockh = (y & (size - 1u)) + 1u; /*rows of the current block so far*/
+  unsigned x, c;
+  unsigned char* box = rows->box;
+  CERROR_TRY_RETURN(lodepng_convert(box, row, &rows->mode_box, rows->mode_png, rows->outw, 1));
+  if(rows->mode_box.bitdepth == 16) {
+    for(x = 0; x != rows->outw; ++x) {
+      for(c = 0; c != 4; ++c) {
+        rows->sums[(x >> shift) * 4u + c] += 256u * box[x * 8u + c * 2u] + box[x * 8u + c * 2u + 1u];
+      }
+    }
+  } else {
+    for(x = 0; x != rows->outw; ++x) {
+      for(c = 0; c != 4; ++c) rows->sums[(x >> shift) * 4u + c] += box[x * 4u + c];
+    }
+  }
+  /*the block row is complete at its last row, or at the last row of the region*/
+  if(blockh != size && y + 1u != rows->y_end - rows->y0) return 0;
+
+  for(x = 0; x != outw; ++x) {
+    unsigned blockw = (x + 1u) << shift > rows->outw ? rows->outw - (x << shift) : size;
+    unsigned count = blockw * blockh;
+    for(c = 0; c != 4; ++c) {
+      unsigned* sum = &rows->sums[x * 4u + c];
+      unsigned value = (*sum + count / 2u) / count;
+      if(rows->mode_box.bitdepth == 16) {
+        box[x * 8u + c * 2u] = (unsigned char)(value >> 8u);
+        box[x * 8u + c * 2u + 1u] = (unsigned char)(value & 255u);
+      } else {
+        box[x * 4u + c] = (unsigned char)value;
+      }
+      *sum = 0;
+    }
+  }
+  return RowPipeline_emit(rows, y >> shift, box, &rows->mode_box, outw);
+}
+
+/*outputs the next row, given in mode_png starting at a byte boundary*/
+static unsigned RowPipeline_output(RowPipeline* rows, const unsigned char* row) {
+  size_t y = rows->y++;
+  if(y < rows->y0) return 0; /*above the region*/
+  y -= rows->y0;
+  if(rows->x0) {
+    size_t bpp = lodepng_get_bpp(rows->mode_png), ibp = rows->x0 * bpp;
+    if(!rows->cropped) {
+      row += ibp / 8u;
+    } else {
+      size_t x, obp = 0;
+      for(x = 0; x < rows->outw * bpp; ++x) {
+        unsigned char bit = readBitFromReversedStream(&ibp, row);
+        setBitOfReversedStream(&obp, rows->cropped, bit);
+      }
+      row = rows->cropped;
+    }
+  }
+  if(rows->shift) return RowPipeline_box(rows, (unsigned)y, row);
+  return RowPipeline_emit(rows, y, row, rows->mode_png, rows->outw);
+}
+
+/*Unfilters and outputs the complete scanlines (each with its filter type byte) that are in the insize bytes
+of in, as long as rows remain. Stores the amount of bytes used in *used. Returns error code.*/
+static unsigned RowPipeline_scanlines(RowPipeline* rows, const unsigned char* in, size_t insize, size_t* used) {
+  size_t bytewidth = (lodepng_get_bpp(rows->mode_png) + 7u) / 8u;
+  size_t linebytes = rows->linebytes;
+  size_t stride = rows->stride ? rows->stride : linebytes;
+  /*if the rows of the image need no conversion or cropping and start at a byte boundary, unfilter into it
+  directly*/
+  unsigned direct = rows->image && !rows->mode_out && !rows->x0 && !rows->y0 && rows->outw == rows->w
+                 && (rows->stride || (size_t)rows->w * lodepng_get_bpp(rows->mode_png) % 8u == 0);
+  *used = 0;
+  while(rows->y < rows->y_end && insize - *used >= linebytes + 1u) {
+    const unsigned char* scanline = &in[*used];
+    *used += linebytes + 1u;
+    if(direct) {
+      unsigned char* recon = &rows->image[rows->y * stride];
+      CERROR_TRY_RETURN(unfilterScanline(recon, scanline + 1, rows->y ? recon - stride : 0,
+                                         bytewidth, scanline[0], linebytes));
+      ++rows->y;
+    } else {
+      unsigned char* temp;
+      CERROR_TRY_RETURN(unfilterScanline(rows->line, scanline + 1, rows->y ? rows->prevline : 0,
+                                         bytewidth, scanline[0], linebytes));
+      CERROR_TRY_RETURN(RowPipeline_output(rows, rows->line));
+      temp = rows->prevline;
+      rows->prevline = rows->line;
+      rows->line = temp;
+    }
+  }
+  return 0;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*removes the first amount bytes of the vector*/
+static void ucvector_drop(ucvector* p, size_t amount) {
+  if(amount >= p->size - amount) {
+    lodepng_memcpy(p->data, p->data + amount, p->size - amount); /*the two ranges don't overlap*/
+  } else {
+    size_t i;
+    for(i = amount; i < p->size; ++i) p->data[i - amount] = p->data[i];
+  }
+  p->size -= amount;
+}
+
+/*the amount of bytes to decompress at once before giving the complete scanlines to a RowPipeline*/
+#define ROW_PIPELINE_PIECE 65536u
+
+/*Gives the complete scanlines in window, from *pos on, to rows, and then removes the data from
+window that is used and no longer needed for backward distances of the inflator. Returns error code.*/
+static unsigned RowPipeline_window(RowPipeline* rows, ucvector* window, size_t* pos) {
+  size_t used;
+  CERROR_TRY_RETURN(RowPipeline_scanlines(rows, window->data + *pos, window->size - *pos, &used));
+  *pos += used;
+  /*keep the last 32768 bytes, which backward distances can refer to*/
+  if(*pos >= ROW_PIPELINE_PIECE && window->size >= 32768u) {
+    size_t amount = window->size - 32768u;
+    if(amount > *pos) amount = *pos;
+    ucvector_drop(window, amount);
+    *pos -= amount;
+  }
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+/*Checks whether the decoded image must be converted to info_raw, in *convert. If color_convert is
+disabled, sets info_raw to the color mode of the PNG instead. Returns error code.*/
+static unsigned decodeColorMode(LodePNGState* state, unsigned* convert) {
+  *convert = 0;
+  if(!state->decoder.color_convert) {
+    /*store the info_png color settings on the info_raw so that the info_raw still reflects what colortype
+    the raw image has to the end user*/
+    return lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+  }
+  if(lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)) return 0;
+  CERROR_TRY_RETURN(checkRawLayout(&state->info_raw));
+  /*TODO: check if this works according to the statement in the documentation: "The converter can convert
+  from grayscale input color type, to 8-bit grayscale or grayscale with alpha"*/
+  if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+     && !(state->info_raw.bitdepth == 8)) {
+    return 56; /*unsupported color mode conversion*/
+  }
+  *convert = 1;
+  return 0;
+}
+
 static unsigned readChunk_PLTE(LodePNGColorMode* color, const unsigned char* data, size_t chunkLength) {
   unsigned pos = 0, i;
   color->palettesize = chunkLength / 3u;
@@ -4867,9 +7225,12 @@ static unsigned readChunk_bKGD(LodePNGInfo* info, const unsigned char* data, siz
 }
 
 /*text chunk (tEXt)*/
-static unsigned readChunk_tEXt(LodePNGInfo* info, const unsigned char* data, size_t chunkLength) {
+static unsigned readChunk_tEXt(LodePNGInfo* info, const LodePNGDecoderSettings* decoder,
+                               const unsigned char* data, size_t chunkLength) {
   unsigned error = 0;
   char *key = 0, *str = 0;
+  /*the key and string are copied into info, only the temporary copies here use the allocator of the call*/
+  const LodePNGAllocator* allocator = &decoder->zlibsettings.allocator;
 
   while(!error) /*not really a while loop, only used to break on error*/ {
     unsigned length, string2_begin;
@@ -4880,7 +7241,7 @@ static unsigned readChunk_tEXt(LodePNGInfo* info, const unsigned char* data, siz
     there's no null termination char, if the text is empty*/
     if(length < 1 || length > 79) CERROR_BREAK(error, 89); /*keyword too short or long*/
 
-    key = (char*)lodepng_malloc(length + 1);
+    key = (char*)allocator_malloc(allocator, length + 1);
     if(!key) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(key, data, length);
@@ -4889,7 +7250,7 @@ static unsigned readChunk_tEXt(LodePNGInfo* info, const unsigned char* data, siz
     string2_begin = length + 1; /*skip keyword null terminator*/
 
     length = (unsigned)(chunkLength < string2_begin ? 0 : chunkLength - string2_begin);
-    str = (char*)lodepng_malloc(length + 1);
+    str = (char*)allocator_malloc(allocator, length + 1);
     if(!str) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(str, data + string2_begin, length);
@@ -4900,8 +7261,8 @@ static unsigned readChunk_tEXt(LodePNGInfo* info, const unsigned char* data, siz
     break;
   }
 
-  lodepng_free(key);
-  lodepng_free(str);
+  allocator_free(allocator, str);
+  allocator_free(allocator, key);
 
   return error;
 }
@@ -4924,7 +7285,7 @@ static unsigned readChunk_zTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     if(length + 2 >= chunkLength) CERROR_BREAK(error, 75); /*no null termination, corrupt?*/
     if(length < 1 || length > 79) CERROR_BREAK(error, 89); /*keyword too short or long*/
 
-    key = (char*)lodepng_malloc(length + 1);
+    key = (char*)allocator_malloc(&zlibsettings.allocator, length + 1);
     if(!key) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(key, data, length);
@@ -4947,8 +7308,8 @@ static unsigned readChunk_zTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     break;
   }
 
-  lodepng_free(key);
-  lodepng_free(str);
+  allocator_free(&zlibsettings.allocator, str);
+  allocator_free(&zlibsettings.allocator, key);
 
   return error;
 }
@@ -4975,7 +7336,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     if(length + 3 >= chunkLength) CERROR_BREAK(error, 75); /*no null termination char, corrupt?*/
     if(length < 1 || length > 79) CERROR_BREAK(error, 89); /*keyword too short or long*/
 
-    key = (char*)lodepng_malloc(length + 1);
+    key = (char*)allocator_malloc(&zlibsettings.allocator, length + 1);
     if(!key) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(key, data, length);
@@ -4993,7 +7354,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     length = 0;
     for(i = begin; i < chunkLength && data[i] != 0; ++i) ++length;
 
-    langtag = (char*)lodepng_malloc(length + 1);
+    langtag = (char*)allocator_malloc(&zlibsettings.allocator, length + 1);
     if(!langtag) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(langtag, data + begin, length);
@@ -5004,7 +7365,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     length = 0;
     for(i = begin; i < chunkLength && data[i] != 0; ++i) ++length;
 
-    transkey = (char*)lodepng_malloc(length + 1);
+    transkey = (char*)allocator_malloc(&zlibsettings.allocator, length + 1);
     if(!transkey) CERROR_BREAK(error, 83); /*alloc fail*/
 
     lodepng_memcpy(transkey, data + begin, length);
@@ -5025,7 +7386,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
       /*error: compressed text larger than  decoder->max_text_size*/
       if(error && size > zlibsettings.max_output_size) error = 112;
       if(!error) error = lodepng_add_itext_sized(info, key, langtag, transkey, (char*)str, size);
-      lodepng_free(str);
+      allocator_free(&zlibsettings.allocator, str);
     } else {
       error = lodepng_add_itext_sized(info, key, langtag, transkey, (const char*)(data + begin), length);
     }
@@ -5033,9 +7394,9 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecoderSettings*
     break;
   }
 
-  lodepng_free(key);
-  lodepng_free(langtag);
-  lodepng_free(transkey);
+  allocator_free(&zlibsettings.allocator, transkey);
+  allocator_free(&zlibsettings.allocator, langtag);
+  allocator_free(&zlibsettings.allocator, key);
 
   return error;
 }
@@ -5128,6 +7489,8 @@ static unsigned readChunk_iCCP(LodePNGInfo* info, const LodePNGDecoderSettings*
 
   length = (unsigned)chunkLength - string2_begin;
   zlibsettings.max_output_size = decoder->max_icc_size;
+  /*the profile is kept in info, which is freed with lodepng_free*/
+  zlibsettings.allocator = lodepng_default_decompress_settings.allocator;
   error = zlib_decompress(&info->iccp_profile, &size, 0,
                           &data[string2_begin],
                           length, &zlibsettings);
@@ -5228,6 +7591,18 @@ static unsigned readChunk_sBIT(LodePNGInfo* info, const unsigned char* data, siz
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*returns 57 if the CRC of the chunk is wrong, like lodepng_chunk_check_crc but using the parallel_for of the
+settings for large chunks*/
+static unsigned checkChunkCRC(const unsigned char* chunk, const LodePNGDecompressSettings* settings) {
+  unsigned length = lodepng_chunk_length(chunk);
+  unsigned crc = lodepng_read32bitInt(&chunk[length + 8]);
+  unsigned checksum = 0;
+  /*the CRC is taken of the data and the 4 chunk type letters, not the length*/
+  CERROR_TRY_RETURN(crc32Parallel(&checksum, &chunk[4], length + 4, settings->parallel_for,
+                                  settings->parallel_context, settings->parallel_segment_size, &settings->allocator));
+  return crc != checksum ? 57 : 0; /*invalid CRC*/
+}
+
 unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
                                const unsigned char* in, size_t insize) {
   const unsigned char* chunk = in + pos;
@@ -5250,7 +7625,7 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
   } else if(lodepng_chunk_type_equals(chunk, "bKGD")) {
     error = readChunk_bKGD(&state->info_png, data, chunkLength);
   } else if(lodepng_chunk_type_equals(chunk, "tEXt")) {
-    error = readChunk_tEXt(&state->info_png, data, chunkLength);
+    error = readChunk_tEXt(&state->info_png, &state->decoder, data, chunkLength);
   } else if(lodepng_chunk_type_equals(chunk, "zTXt")) {
     error = readChunk_zTXt(&state->info_png, &state->decoder, data, chunkLength);
   } else if(lodepng_chunk_type_equals(chunk, "iTXt")) {
@@ -5284,30 +7659,527 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
   }
 
   if(!error && !unhandled && !state->decoder.ignore_crc) {
-    if(lodepng_chunk_check_crc(chunk)) return 57; /*invalid CRC*/
+    error = checkChunkCRC(chunk, &state->decoder.zlibsettings);
   }
 
   return error;
 }
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize) {
+/*Position in the data of the IDAT chunks of a PNG file. The chunks are decompressed
+where they are in the file, rather than first concatenating their data.*/
+typedef struct IdatCursor {
+  const unsigned char* chunk; /*current IDAT chunk, 0 at the end of the IDAT data*/
+  const unsigned char* last; /*the last IDAT chunk*/
+  size_t pos; /*position in the data of the current chunk*/
+} IdatCursor;
+
+/*if at the end of the current chunk, goes to the start of the next non-empty IDAT chunk, if any.
+The chunks from the current one to last must have been checked to be in bounds.*/
+static void IdatCursor_normalize(IdatCursor* cursor) {
+  while(cursor->chunk && cursor->pos == lodepng_chunk_length(cursor->chunk)) {
+    if(cursor->chunk == cursor->last) {
+      cursor->chunk = 0;
+      break;
+    }
+    do {
+      cursor->chunk += (size_t)lodepng_chunk_length(cursor->chunk) + 12u;
+    } while(!lodepng_chunk_type_equals(cursor->chunk, "IDAT"));
+    cursor->pos = 0;
+  }
+}
+
+/*Reads up to amount bytes of IDAT data into out, or skips them if out is 0. Returns the amount.*/
+static size_t IdatCursor_read(IdatCursor* cursor, unsigned char* out, size_t amount) {
+  size_t done = 0;
+  IdatCursor_normalize(cursor);
+  while(done < amount && cursor->chunk) {
+    size_t available = lodepng_chunk_length(cursor->chunk) - cursor->pos;
+    size_t part = amount - done < available ? amount - done : available;
+    if(out) lodepng_memcpy(out + done, lodepng_chunk_data_const(cursor->chunk) + cursor->pos, part);
+    cursor->pos += part;
+    done += part;
+    IdatCursor_normalize(cursor);
+  }
+  return done;
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*size of the buffer for symbols that are split over multiple IDAT chunks. Must be larger than
+twice the largest possible dynamic block header (which is less than 300 bytes).*/
+#define IDAT_STITCH_SIZE 1024u
+
+/*Like lodepng_zlib_decompressv, but reads the zlib data from the IDAT chunks, idatsize bytes in total,
+starting at cursor. Only symbols that are split over chunks are copied, to a small stitch buffer.
+If rows is not 0, the scanlines are given to it while decompressing, and out only keeps a window of the
+most recent data. If needed is not 0, decompression stops once that many bytes are decompressed, without
+checking the adler32. The total decompressed size is stored in *total. The inflator is reset first, it can
+keep the memory of its tables from earlier use.*/
+static unsigned inflateIdat(ucvector* out, size_t* total, IdatCursor cursor, size_t idatsize,
+                            const LodePNGDecompressSettings* settings, RowPipeline* rows, size_t needed,
+                            Inflator* inflator) {
+  unsigned error = 0;
+  unsigned adler = 1u; /*adler32 of the decompressed data so far*/
+  size_t adler_pos = out->size; /*position in out up to which the adler32 is computed*/
+  size_t rows_pos = out->size; /*position in out of the first scanline not given to rows yet*/
+  unsigned char stitch[IDAT_STITCH_SIZE]; /*unused input of the inflator, followed by the next IDAT data*/
+  size_t stitch_own = 0; /*bytes at the start of stitch that came from earlier input*/
+  IdatCursor stitch_src; /*where the IDAT data in stitch after the stitch_own bytes comes from*/
+  IdatCursor tail = cursor;
+  const unsigned char* data; /*input of the inflator: the data of an IDAT chunk, or stitch*/
+  size_t size, bp = 0;
+  unsigned char bytes[4];
+
+  if(idatsize < 2) return 53; /*error, size of zlib data too small*/
+  IdatCursor_read(&cursor, bytes, 2);
+  CERROR_TRY_RETURN(zlib_check_header(bytes, idatsize));
+
+  /*the cursor is always at the first IDAT data that is not given to the inflator yet*/
+  IdatCursor_normalize(&cursor);
+  data = cursor.chunk ? lodepng_chunk_data_const(cursor.chunk) + cursor.pos : 0;
+  size = cursor.chunk ? lodepng_chunk_length(cursor.chunk) - cursor.pos : 0;
+  IdatCursor_read(&cursor, 0, size);
+
+  *total = 0;
+  inflator_reset(inflator);
+  for(;;) {
+    LodePNGBitReader reader;
+    size_t used, limit = rows ? out->size + ROW_PIPELINE_PIECE : 0;
+    unsigned starved;
+    if(needed && (!limit || needed - *total < ROW_PIPELINE_PIECE)) limit = out->size + (needed - *total);
+    error = LodePNGBitReader_init(&reader, data, size);
+    if(error) break;
+    reader.bp = bp;
+    error = inflator_run(inflator, out, &reader, limit, cursor.chunk != 0, settings);
+    starved = !limit || out->size < limit;
+    adler = update_adler32(adler, out->data + adler_pos, (unsigned)(out->size - adler_pos));
+    *total += out->size - adler_pos;
+    adler_pos = out->size;
+    if(!error && rows) {
+      /*more data than the scanlines of the image, which rows would not use*/
+      if(*total > (size_t)rows->h * (rows->linebytes + 1u)) CERROR_BREAK(error, 91);
+      error = RowPipeline_window(rows, out, &rows_pos);
+      adler_pos = out->size;
+    }
+    if(error || inflator->mode == INFLATE_DONE) break;
+    if(needed && *total >= needed) break; /*the remaining data is not needed*/
+    if(!starved) {
+      /*the output limit is reached, continue with the same input*/
+      bp = reader.bp;
+      continue;
+    }
+
+    /*the input ran out in the middle of a symbol or block header*/
+    used = reader.bp >> 3u;
+    bp = reader.bp & 7u;
+    if(data == stitch && used >= stitch_own) {
+      /*passed the chunk boundary, continue directly in the IDAT data*/
+      if(used == 0 && size == IDAT_STITCH_SIZE) CERROR_BREAK(error, 52); /*cannot happen with valid data*/
+      cursor = stitch_src;
+      IdatCursor_read(&cursor, 0, used - stitch_own);
+      data = lodepng_chunk_data_const(cursor.chunk) + cursor.pos;
+      size = lodepng_chunk_length(cursor.chunk) - cursor.pos;
+      IdatCursor_read(&cursor, 0, size);
+      continue;
+    }
+    if(data == stitch) {
+      size_t i;
+      for(i = used; i < stitch_own; ++i) stitch[i - used] = stitch[i];
+      stitch_own -= used;
+      cursor = stitch_src;
+    } else {
+      if(size - used > IDAT_STITCH_SIZE / 2u) CERROR_BREAK(error, 52); /*cannot happen with valid data*/
+      stitch_own = size - used;
+      lodepng_memcpy(stitch, data + used, stitch_own);
+    }
+    stitch_src = cursor;
+    size = stitch_own + IdatCursor_read(&cursor, stitch + stitch_own, IDAT_STITCH_SIZE - stitch_own);
+    data = stitch;
+  }
+  if(error) return error;
+
+  if(!settings->ignore_adler32 && !needed) {
+    /*the last 4 bytes of the IDAT data, like lodepng_zlib_decompressv uses the last 4 bytes*/
+    if(idatsize < 4) return 58;
+    IdatCursor_read(&tail, 0, idatsize - 4u);
+    IdatCursor_read(&tail, bytes, 4);
+    if(adler != lodepng_read32bitInt(bytes)) {
+      return 58; /*error, adler checksum not correct, data must be corrupted*/
+    }
+  }
+
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+/*Buffers of the decoder that a LodePNGDecoderContext keeps from one image to the next, so that decoding
+many small images doesn't allocate them again for each image. They only grow.*/
+typedef struct DecoderScratch {
+#ifdef LODEPNG_COMPILE_ZLIB
+  Inflator inflator; /*keeps its huffman trees and tables*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  ucvector zdata; /*the decompressed data: a window of it for decodeRows, all of it for interlaced images*/
+  ucvector rows; /*the row buffers of the RowPipeline of decodeRows*/
+} DecoderScratch;
+
+/*allocator is used for the buffers, it may be 0*/
+static void DecoderScratch_init(DecoderScratch* scratch, const LodePNGAllocator* allocator) {
+#ifdef LODEPNG_COMPILE_ZLIB
+  inflator_init(&scratch->inflator, allocator);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  scratch->zdata = ucvector_init_with(0, 0, allocator);
+  scratch->rows = ucvector_init_with(0, 0, allocator);
+}
+
+static void DecoderScratch_cleanup(DecoderScratch* scratch) {
+#ifdef LODEPNG_COMPILE_ZLIB
+  inflator_cleanup(&scratch->inflator);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  ucvector_cleanup(&scratch->rows);
+  ucvector_cleanup(&scratch->zdata);
+}
+
+/*whether memory of one allocator may be resized and freed by the other*/
+static unsigned allocator_same(const LodePNGAllocator* a, const LodePNGAllocator* b) {
+  if(!a || !a->malloc_func) return !b || !b->malloc_func;
+  return b && a->malloc_func == b->malloc_func && a->context == b->context;
+}
+
+/*Decompresses the IDAT data, idatsize bytes starting at cursor, to the filtered scanlines in scratch->zdata,
+the size of which is set to the decompressed size. expected_size is the expected output size, to avoid
+intermediate allocations. If needed is not 0, only at least that many bytes are decompressed if possible,
+and the adler32 is not checked.*/
+static unsigned decompressIdat(DecoderScratch* scratch, size_t expected_size, size_t needed,
+                               IdatCursor cursor, size_t idatsize, const LodePNGDecompressSettings* settings) {
+  unsigned error;
+  ucvector* out = &scratch->zdata;
+  out->size = 0;
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(!settings->custom_zlib && !settings->custom_inflate) {
+    size_t total;
+    /*reserve the memory to avoid intermediate reallocations*/
+    if(!ucvector_reserve(out, needed ? needed : expected_size)) return 83; /*alloc fail*/
+    return inflateIdat(out, &total, cursor, idatsize, settings, 0, needed, &scratch->inflator);
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  (void)needed; /*custom decompressors decompress all data*/
+  {
+    /*custom decompressors need all IDAT data concatenated*/
+    unsigned char* idat = (unsigned char*)allocator_malloc(&settings->allocator, idatsize);
+    unsigned char* data = 0;
+    size_t size = 0;
+    if(!idat && idatsize) return 83; /*alloc fail*/
+    IdatCursor_read(&cursor, idat, idatsize);
+    error = zlib_decompress(&data, &size, expected_size, idat, idatsize, settings);
+    allocator_free(&settings->allocator, idat);
+    if(allocator_same(out->allocator, &settings->allocator)) {
+      const LodePNGAllocator* allocator = out->allocator;
+      ucvector_cleanup(out);
+      *out = ucvector_init_with(data, size, allocator);
+    } else {
+      /*the buffers of a LodePNGDecoderContext have another allocator than the output of the call*/
+      if(!error && !ucvector_resize(out, size)) error = 83; /*alloc fail*/
+      if(!error) lodepng_memcpy(out->data, data, size);
+      allocator_free(&settings->allocator, data);
+    }
+  }
+  return error;
+}
+
+/*Reads the information of one entire chunk into the state and checks its CRC. The compressed data of IDAT
+chunks is not handled here. critical_pos is 1 after IHDR, 2 after PLTE, 3 after IDAT, and is updated here.*/
+static unsigned decodeChunk(LodePNGState* state, const unsigned char* chunk, unsigned* critical_pos) {
+  unsigned error = 0;
+  unsigned chunkLength = lodepng_chunk_length(chunk);
+  const unsigned char* data = lodepng_chunk_data_const(chunk);
+  unsigned unknown = 0;
+
+  if(lodepng_chunk_type_equals(chunk, "IDAT")) {
+    /*IDAT chunk, the compressed image data itself is handled by the caller*/
+    *critical_pos = 3;
+  } else if(lodepng_chunk_type_equals(chunk, "IEND")) {
+    /*IEND chunk, nothing to read*/
+  } else if(lodepng_chunk_type_equals(chunk, "PLTE")) {
+    /*palette chunk (PLTE)*/
+    error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
+    *critical_pos = 2;
+  } else if(lodepng_chunk_type_equals(chunk, "tRNS")) {
+    /*palette transparency chunk (tRNS). Even though this one is an ancillary chunk , it is still compiled
+    in without 'LODEPNG_COMPILE_ANCILLARY_CHUNKS' because it contains essential color information that
+    affects the alpha channel of pixels. */
+    error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    /*background color chunk (bKGD)*/
+  } else if(lodepng_chunk_type_equals(chunk, "bKGD")) {
+    error = readChunk_bKGD(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "tEXt")) {
+    /*text chunk (tEXt)*/
+    if(state->decoder.read_text_chunks) {
+      error = readChunk_tEXt(&state->info_png, &state->decoder, data, chunkLength);
+    }
+  } else if(lodepng_chunk_type_equals(chunk, "zTXt")) {
+    /*compressed text chunk (zTXt)*/
+    if(state->decoder.read_text_chunks) {
+      error = readChunk_zTXt(&state->info_png, &state->decoder, data, chunkLength);
+    }
+  } else if(lodepng_chunk_type_equals(chunk, "iTXt")) {
+    /*international text chunk (iTXt)*/
+    if(state->decoder.read_text_chunks) {
+      error = readChunk_iTXt(&state->info_png, &state->decoder, data, chunkLength);
+    }
+  } else if(lodepng_chunk_type_equals(chunk, "tIME")) {
+    error = readChunk_tIME(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "pHYs")) {
+    error = readChunk_pHYs(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "gAMA")) {
+    error = readChunk_gAMA(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "cHRM")) {
+    error = readChunk_cHRM(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "sRGB")) {
+    error = readChunk_sRGB(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "iCCP")) {
+    error = readChunk_iCCP(&state->info_png, &state->decoder, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "cICP")) {
+    error = readChunk_cICP(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "mDCV")) {
+    error = readChunk_mDCV(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "cLLI")) {
+    error = readChunk_cLLI(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "eXIf")) {
+    error = readChunk_eXIf(&state->info_png, data, chunkLength);
+  } else if(lodepng_chunk_type_equals(chunk, "sBIT")) {
+    error = readChunk_sBIT(&state->info_png, data, chunkLength);
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  } else /*it's not an implemented chunk type, so ignore it: skip over the data*/ {
+    if(!lodepng_chunk_type_name_valid(chunk)) {
+      return 121; /* invalid chunk type name */
+    }
+    if(lodepng_chunk_reserved(chunk)) {
+      return 122; /* invalid third lowercase character */
+    }
+
+    /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
+    if(!state->decoder.ignore_critical && !lodepng_chunk_ancillary(chunk)) {
+      return 69;
+    }
+
+    unknown = 1;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    if(state->decoder.remember_unknown_chunks) {
+      error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[*critical_pos - 1],
+                                   &state->info_png.unknown_chunks_size[*critical_pos - 1], chunk);
+    }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  }
+
+  if(!error && !state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/ {
+    error = checkChunkCRC(chunk, &state->decoder.zlibsettings);
+  }
+
+  return error;
+}
+
+/*Where the decoder writes the image: either a buffer it allocates, or one given by the user with its own
+distance between rows.*/
+typedef struct DecodeTarget {
+  unsigned char* image; /*buffer of the user, or 0 to allocate the output*/
+  size_t stride; /*bytes from the start of one row of image to the next*/
+  size_t size; /*size of image in bytes*/
+  unsigned x0, y0, w, h; /*region of the PNG image to output, w and h are 0 for the whole image*/
+  unsigned shift; /*if not 0, the output is downscaled by 2^shift, only used without image and region*/
+  DecoderScratch* scratch; /*buffers kept between images, or 0 to use temporary ones*/
+} DecodeTarget;
+
+static void DecodeTarget_init(DecodeTarget* target) {
+  target->image = 0;
+  target->stride = target->size = 0;
+  target->x0 = target->y0 = target->w = target->h = 0;
+  target->shift = 0;
+  target->scratch = 0;
+}
+
+/*Copies the region of target from the image of w * h pixels, which has no padding bits between rows, to the
+rows of target, or to *out, which gets allocated with allocator, if target has no image. Returns error code.*/
+static unsigned copyToTarget(unsigned char** out, const DecodeTarget* target, const unsigned char* image,
+                             unsigned w, unsigned h, const LodePNGColorMode* mode,
+                             const LodePNGAllocator* allocator) {
+  size_t y, bpp = lodepng_get_bpp(mode), linebits = (size_t)w * bpp;
+  unsigned rw = target->w ? target->w : w, rh = target->h ? target->h : h;
+  size_t outbits = (size_t)rw * bpp; /*bits of a row of the output*/
+  size_t stridebits = target->image ? target->stride * 8u : outbits;
+  unsigned char* dest = target->image;
+  if(!dest) {
+    size_t outsize = lodepng_get_raw_size(rw, rh, mode);
+    dest = *out = (unsigned char*)allocator_malloc(allocator, outsize);
+    if(!*out) return 83; /*alloc fail*/
+    if(bpp < 8) lodepng_memset(*out, 0, outsize);
+  }
+  for(y = 0; y != rh; ++y) {
+    size_t ibp = (y + target->y0) * linebits + target->x0 * bpp, obp = y * stridebits;
+    if(ibp % 8u == 0 && obp % 8u == 0 && outbits % 8u == 0) {
+      lodepng_memcpy(&dest[obp / 8u], &image[ibp / 8u], outbits / 8u);
+    } else {
+      size_t x;
+      for(x = 0; x < outbits; ++x) {
+        unsigned char bit = readBitFromReversedStream(&ibp, image);
+        setBitOfReversedStream(&obp, dest, bit);
+      }
+    }
+  }
+  return 0;
+}
+
+/*Decodes the image data of a non-interlaced PNG into *out, which gets allocated unless target has an image,
+with a RowPipeline that writes every row to the output as soon as it is decompressed, already converted to
+info_raw if convert is true. If target has a region, decompression stops after its last row. A custom zlib
+or inflate function decompresses all data first. target must have a scratch.*/
+static unsigned decodeRows(unsigned char** out, unsigned w, unsigned h, LodePNGState* state, unsigned convert,
+                           IdatCursor idat, size_t idatsize, size_t expected_size, const DecodeTarget* target) {
+  unsigned error;
+  RowPipeline rows;
+  ucvector* window = &target->scratch->zdata; /*the most recent decompressed data*/
+  size_t total = 0, needed = 0;
+  const LodePNGColorMode* mode = convert ? &state->info_raw : &state->info_png.color;
+  const LodePNGDecompressSettings* settings = &state->decoder.zlibsettings;
+  unsigned char* image = target->image;
+  unsigned rw = target->w ? target->w : w, rh = target->h ? target->h : h;
+
+  if(!image) {
+    unsigned outw = (rw + (1u << target->shift) - 1u) >> target->shift;
+    unsigned outh = (rh + (1u << target->shift) - 1u) >> target->shift;
+    size_t outsize = lodepng_get_raw_size(outw, outh, mode);
+    image = *out = (unsigned char*)allocator_malloc(&settings->allocator, outsize);
+    if(!*out) return 83; /*alloc fail*/
+    /*rows with less than 8 bits per pixel don't fill the last byte entirely*/
+    if(lodepng_get_bpp(mode) < 8) lodepng_memset(*out, 0, outsize);
+  }
+
+  window->size = 0;
+  error = RowPipeline_init(&rows, w, h, &state->info_png.color, convert ? &state->info_raw : 0, image,
+                           &target->scratch->rows, &settings->allocator);
+  rows.stride = target->image ? target->stride : 0;
+  if(!error) error = RowPipeline_region(&rows, target->x0, target->y0, rw, rh);
+  if(!error && target->shift) error = RowPipeline_scale(&rows, target->shift);
+  /*if the region ends above the bottom of the image, the scanlines below it are not needed*/
+  if(rows.y_end < h) needed = (size_t)rows.y_end * (rows.linebytes + 1u);
+  if(!error) {
+    unsigned custom = 1;
+#ifdef LODEPNG_COMPILE_ZLIB
+    custom = settings->custom_zlib || settings->custom_inflate;
+    if(!custom) {
+      error = inflateIdat(window, &total, idat, idatsize, settings, &rows, needed, &target->scratch->inflator);
+    }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+    if(custom) {
+      size_t used;
+      error = decompressIdat(target->scratch, expected_size, needed, idat, idatsize, settings);
+      total = window->size;
+      if(!error) error = RowPipeline_scanlines(&rows, window->data, total, &used);
+    }
+    /*decompressed size doesn't match prediction*/
+    if(!error && (rows.y != rows.y_end || (!needed && total != expected_size))) error = 91;
+  }
+  RowPipeline_cleanup(&rows);
+  if(error) {
+    allocator_free(&settings->allocator, *out);
+    *out = 0;
+  }
+  return error;
+}
+
+/*Decodes an Adam7 interlaced image downscaled by 2^shift into *out, which gets allocated, converted to
+info_raw if convert is true. Each output pixel is the top left pixel of its block of the image. The first
+passes have the top left pixels of all blocks, so only their data is decompressed, into scratch.*/
+static unsigned decodeAdam7Scaled(unsigned char** out, unsigned w, unsigned h, LodePNGState* state,
+                                  unsigned convert, IdatCursor idat, size_t idatsize, size_t expected_size,
+                                  unsigned shift, DecoderScratch* scratch) {
+  const LodePNGColorMode* mode_png = &state->info_png.color;
+  const LodePNGAllocator* allocator = &state->decoder.zlibsettings.allocator;
+  unsigned bpp = lodepng_get_bpp(mode_png), size = 1u << shift;
+  unsigned sw = (w + size - 1u) >> shift, sh = (h + size - 1u) >> shift;
+  unsigned numpasses = shift == 3 ? 1 : (shift == 2 ? 3 : 5); /*passes with the top left pixels of all blocks*/
+  unsigned passw[7], passh[7];
+  size_t filter_passstart[8], padded_passstart[8], passstart[8];
+  unsigned char* scanlines;
+  unsigned char* image = 0;
+  size_t scanlines_size, needed;
+  unsigned error, i;
+
+  Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+  needed = filter_passstart[numpasses] < expected_size ? filter_passstart[numpasses] : 0;
+  error = decompressIdat(scratch, expected_size, needed, idat, idatsize, &state->decoder.zlibsettings);
+  scanlines = scratch->zdata.data;
+  scanlines_size = scratch->zdata.size;
+  /*decompressed size doesn't match prediction*/
+  if(!error && (needed ? scanlines_size < needed : scanlines_size != expected_size)) error = 91;
+  if(!error) {
+    size_t imagesize = lodepng_get_raw_size(sw, sh, mode_png);
+    image = (unsigned char*)allocator_malloc(allocator, imagesize);
+    if(!image) error = 83; /*alloc fail*/
+    else lodepng_memset(image, 0, imagesize);
+  }
+
+  for(i = 0; !error && i != numpasses; ++i) {
+    unsigned x, y;
+    size_t linebits = ((size_t)passw[i] * bpp + 7u) / 8u * 8u;
+    unsigned char* reduced = &scanlines[padded_passstart[i]];
+    error = unfilter(reduced, &scanlines[filter_passstart[i]], passw[i], passh[i], bpp);
+    for(y = 0; !error && y < passh[i]; ++y) {
+      size_t py = ADAM7_IY[i] + (size_t)y * ADAM7_DY[i];
+      if(py & (size - 1u)) continue; /*not the top row of a block*/
+      for(x = 0; x < passw[i]; ++x) {
+        size_t px = ADAM7_IX[i] + (size_t)x * ADAM7_DX[i];
+        size_t ibp = y * linebits + (size_t)x * bpp, obp = ((py >> shift) * sw + (px >> shift)) * bpp;
+        if(px & (size - 1u)) continue; /*not the left column of a block*/
+        if(bpp >= 8) {
+          lodepng_memcpy(&image[obp / 8u], &reduced[ibp / 8u], bpp / 8u);
+        } else {
+          unsigned b;
+          for(b = 0; b < bpp; ++b) {
+            unsigned char bit = readBitFromReversedStream(&ibp, reduced);
+            setBitOfReversedStream(&obp, image, bit);
+          }
+        }
+      }
+    }
+  }
+
+  if(!error && convert) {
+    /*if only the layout differs, it is changed in place rather than into a second image*/
+    unsigned inplace = colorModeEqualIgnoringLayout(&state->info_raw, mode_png);
+    *out = inplace ? image
+                   : (unsigned char*)allocator_malloc(allocator, lodepng_get_raw_size(sw, sh, &state->info_raw));
+    if(!*out) error = 83; /*alloc fail*/
+    else {
+      const LodePNGDecompressSettings* zlibsettings = &state->decoder.zlibsettings;
+      error = convertParallel(*out, image, &state->info_raw, mode_png, sw, sh, zlibsettings->parallel_for,
+                              zlibsettings->parallel_context, zlibsettings->parallel_segment_size, allocator);
+    }
+    if(!inplace) allocator_free(allocator, image);
+  } else {
+    *out = image;
+  }
+  if(error) {
+    allocator_free(allocator, *out);
+    *out = 0;
+  }
+  return error;
+}
+
+/*decodeGeneric with the buffers in target->scratch, which may not be 0*/
+static void decodeWithScratch(unsigned char** out, unsigned* w, unsigned* h,
+                              LodePNGState* state,
+                              const unsigned char* in, size_t insize, const DecodeTarget* target) {
   unsigned char IEND = 0;
   const unsigned char* chunk; /*points to beginning of next chunk*/
-  unsigned char* idat; /*the data from idat chunks, zlib compressed*/
+  IdatCursor idat; /*the data from idat chunks, zlib compressed, is read where it is in the file*/
   size_t idatsize = 0;
-  unsigned char* scanlines = 0;
-  size_t scanlines_size = 0, expected_size = 0;
+  size_t expected_size = 0;
   size_t outsize = 0;
+  unsigned convert = 0; /*whether the image must be converted to info_raw*/
+  const LodePNGAllocator* allocator = &state->decoder.zlibsettings.allocator;
 
   /*for unknown chunk order*/
-  unsigned unknown = 0;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-
 
   /* safe output values in case error happens */
   *out = 0;
@@ -5320,17 +8192,15 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     CERROR_RETURN(state->error, 92); /*overflow possible due to amount of pixels*/
   }
 
-  /*the input filesize is a safe upper bound for the sum of idat chunks size*/
-  idat = (unsigned char*)lodepng_malloc(insize);
-  if(!idat) CERROR_RETURN(state->error, 83); /*alloc fail*/
+  idat.chunk = idat.last = 0;
+  idat.pos = 0;
 
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
-  IDAT data is put at the start of the in buffer*/
+  The position of the IDAT chunks is remembered*/
   while(!IEND && !state->error) {
     unsigned chunkLength;
-    const unsigned char* data; /*the data in the chunk*/
     size_t pos = (size_t)(chunk - in);
 
     /*error: next chunk out of bounds of the in buffer*/
@@ -5351,119 +8221,20 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       CERROR_BREAK(state->error, 64); /*error: size of the in buffer too small to contain next chunk (or int overflow)*/
     }
 
-    data = lodepng_chunk_data_const(chunk);
-
-    unknown = 0;
-
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT")) {
       size_t newsize;
       if(lodepng_addofl(idatsize, chunkLength, &newsize)) CERROR_BREAK(state->error, 95);
       if(newsize > insize) CERROR_BREAK(state->error, 95);
-      lodepng_memcpy(idat + idatsize, data, chunkLength);
-      idatsize += chunkLength;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      critical_pos = 3;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+      idatsize = newsize;
+      if(!idat.chunk) idat.chunk = chunk;
+      idat.last = chunk;
     } else if(lodepng_chunk_type_equals(chunk, "IEND")) {
-      /*IEND chunk*/
       IEND = 1;
-    } else if(lodepng_chunk_type_equals(chunk, "PLTE")) {
-      /*palette chunk (PLTE)*/
-      state->error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      critical_pos = 2;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    } else if(lodepng_chunk_type_equals(chunk, "tRNS")) {
-      /*palette transparency chunk (tRNS). Even though this one is an ancillary chunk , it is still compiled
-      in without 'LODEPNG_COMPILE_ANCILLARY_CHUNKS' because it contains essential color information that
-      affects the alpha channel of pixels. */
-      state->error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      /*background color chunk (bKGD)*/
-    } else if(lodepng_chunk_type_equals(chunk, "bKGD")) {
-      state->error = readChunk_bKGD(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "tEXt")) {
-      /*text chunk (tEXt)*/
-      if(state->decoder.read_text_chunks) {
-        state->error = readChunk_tEXt(&state->info_png, data, chunkLength);
-        if(state->error) break;
-      }
-    } else if(lodepng_chunk_type_equals(chunk, "zTXt")) {
-      /*compressed text chunk (zTXt)*/
-      if(state->decoder.read_text_chunks) {
-        state->error = readChunk_zTXt(&state->info_png, &state->decoder, data, chunkLength);
-        if(state->error) break;
-      }
-    } else if(lodepng_chunk_type_equals(chunk, "iTXt")) {
-      /*international text chunk (iTXt)*/
-      if(state->decoder.read_text_chunks) {
-        state->error = readChunk_iTXt(&state->info_png, &state->decoder, data, chunkLength);
-        if(state->error) break;
-      }
-    } else if(lodepng_chunk_type_equals(chunk, "tIME")) {
-      state->error = readChunk_tIME(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "pHYs")) {
-      state->error = readChunk_pHYs(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "gAMA")) {
-      state->error = readChunk_gAMA(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "cHRM")) {
-      state->error = readChunk_cHRM(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "sRGB")) {
-      state->error = readChunk_sRGB(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "iCCP")) {
-      state->error = readChunk_iCCP(&state->info_png, &state->decoder, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "cICP")) {
-      state->error = readChunk_cICP(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "mDCV")) {
-      state->error = readChunk_mDCV(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "cLLI")) {
-      state->error = readChunk_cLLI(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "eXIf")) {
-      state->error = readChunk_eXIf(&state->info_png, data, chunkLength);
-      if(state->error) break;
-    } else if(lodepng_chunk_type_equals(chunk, "sBIT")) {
-      state->error = readChunk_sBIT(&state->info_png, data, chunkLength);
-      if(state->error) break;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    } else /*it's not an implemented chunk type, so ignore it: skip over the data*/ {
-      if(!lodepng_chunk_type_name_valid(chunk)) {
-        CERROR_BREAK(state->error, 121); /* invalid chunk type name */
-      }
-      if(lodepng_chunk_reserved(chunk)) {
-        CERROR_BREAK(state->error, 122); /* invalid third lowercase character */
-      }
-
-      /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
-      if(!state->decoder.ignore_critical && !lodepng_chunk_ancillary(chunk)) {
-        CERROR_BREAK(state->error, 69);
-      }
-
-      unknown = 1;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      if(state->decoder.remember_unknown_chunks) {
-        state->error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[critical_pos - 1],
-                                            &state->info_png.unknown_chunks_size[critical_pos - 1], chunk);
-        if(state->error) break;
-      }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     }
 
-    if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/ {
-      if(lodepng_chunk_check_crc(chunk)) CERROR_BREAK(state->error, 57); /*invalid CRC*/
-    }
+    state->error = decodeChunk(state, chunk, &critical_pos);
+    if(state->error) break;
 
     if(!IEND) chunk = lodepng_chunk_next_const(chunk, in + insize);
   }
@@ -5472,6 +8243,30 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     state->error = 106; /* error: PNG file must have PLTE chunk if color type is palette */
   }
 
+  if(!state->error) state->error = decodeColorMode(state, &convert);
+
+  if(!state->error && target->w) {
+    if(target->x0 > *w || target->w > *w - target->x0 || target->y0 > *h || target->h > *h - target->y0) {
+      state->error = 125; /*region outside the image*/
+    }
+  }
+
+  if(!state->error && target->shift) {
+    /*averaged colors generally don't exist in a palette*/
+    if((convert ? &state->info_raw : &state->info_png.color)->colortype == LCT_PALETTE) state->error = 126;
+  }
+
+  if(!state->error && target->image && *h) {
+    const LodePNGColorMode* mode = convert ? &state->info_raw : &state->info_png.color;
+    unsigned rh = target->h ? target->h : *h;
+    size_t rowsize = lodepng_get_raw_size(target->w ? target->w : *w, 1, mode);
+    /*the rows must fit in the buffer of the user, the last one is not padded up to the stride*/
+    if(target->stride < rowsize || target->size < rowsize
+       || (target->size - rowsize) / target->stride < rh - 1u) {
+      state->error = 124;
+    }
+  }
+
   if(!state->error) {
     /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
     If the decompressed size does not match the prediction, the image must be corrupt.*/
@@ -5490,61 +8285,194 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
       if(*w > 1) expected_size += lodepng_get_raw_size_idat((*w + 0) >> 1, (*h + 1) >> 1, bpp);
       expected_size += lodepng_get_raw_size_idat((*w + 0), (*h + 0) >> 1, bpp);
     }
+  }
+
+  if(!state->error && state->info_png.interlace_method == 0) {
+    /*decode row by row, without buffers for the entire decompressed data or unconverted image*/
+    state->error = decodeRows(out, *w, *h, state, convert, idat, idatsize, expected_size, target);
+    return;
+  }
+
+  if(!state->error && target->shift) {
+    state->error = decodeAdam7Scaled(out, *w, *h, state, convert, idat, idatsize, expected_size, target->shift,
+                                     target->scratch);
+    return;
+  }
 
-    state->error = zlib_decompress(&scanlines, &scanlines_size, expected_size, idat, idatsize, &state->decoder.zlibsettings);
+  if(!state->error) {
+    state->error = decompressIdat(target->scratch, expected_size, 0, idat, idatsize, &state->decoder.zlibsettings);
+  }
+  /*decompressed size doesn't match prediction*/
+  if(!state->error && target->scratch->zdata.size != expected_size) state->error = 91;
+
+  if(!state->error) {
+    outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
+    *out = (unsigned char*)allocator_malloc(allocator, outsize);
+    if(!*out) state->error = 83; /*alloc fail*/
+  }
+  if(!state->error) {
+    lodepng_memset(*out, 0, outsize);
+    state->error = postProcessScanlines(*out, target->scratch->zdata.data, *w, *h, &state->info_png,
+                                        &state->decoder.zlibsettings);
+  }
+
+  if(!state->error && convert) {
+    unsigned char* data = *out;
+    /*if only the layout differs, it is changed in place rather than into a second image*/
+    unsigned inplace = colorModeEqualIgnoringLayout(&state->info_raw, &state->info_png.color);
+    outsize = lodepng_get_raw_size(*w, *h, &state->info_raw);
+    *out = inplace ? data : (unsigned char*)allocator_malloc(allocator, outsize);
+    if(!(*out)) {
+      state->error = 83; /*alloc fail*/
+    }
+    else {
+      const LodePNGDecompressSettings* zlibsettings = &state->decoder.zlibsettings;
+      state->error = convertParallel(*out, data, &state->info_raw, &state->info_png.color, *w, *h,
+                                     zlibsettings->parallel_for, zlibsettings->parallel_context,
+                                     zlibsettings->parallel_segment_size, allocator);
+    }
+    if(!inplace) allocator_free(allocator, data);
   }
-  if(!state->error && scanlines_size != expected_size) state->error = 91; /*decompressed size doesn't match prediction*/
-  lodepng_free(idat);
 
-  if(!state->error) {
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!*out) state->error = 83; /*alloc fail*/
+  if(!state->error && (target->image || target->w)) {
+    unsigned char* image = *out;
+    *out = 0;
+    state->error = copyToTarget(out, target, image, *w, *h, convert ? &state->info_raw : &state->info_png.color,
+                                allocator);
+    allocator_free(allocator, image);
   }
-  if(!state->error) {
-    lodepng_memset(*out, 0, outsize);
-    state->error = postProcessScanlines(*out, scanlines, *w, *h, &state->info_png);
+  if(state->error && target->image) {
+    allocator_free(allocator, *out);
+    *out = 0;
+  }
+}
+
+/*read a PNG, the result will be in the color mode of info_raw, or of the PNG if color_convert is disabled.
+The result is written to target if it has an image, otherwise to *out, which gets allocated. If target has a
+region, only that part of the image is output. If target has no scratch, temporary buffers are used.*/
+static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
+                          LodePNGState* state,
+                          const unsigned char* in, size_t insize, const DecodeTarget* target) {
+  DecoderScratch scratch;
+  DecodeTarget temp;
+  LodePNGAllocator allocator = state->decoder.zlibsettings.allocator;
+  MemoryBudget budget;
+  /*during the call, the allocator of the settings counts what it allocates, see max_memory*/
+  budget_init(&budget, &allocator, state->decoder.max_memory);
+  state->decoder.zlibsettings.allocator = budget_allocator(&budget);
+  if(target->scratch) {
+    decodeWithScratch(out, w, h, state, in, insize, target);
+  } else {
+    DecoderScratch_init(&scratch, &state->decoder.zlibsettings.allocator);
+    temp = *target;
+    temp.scratch = &scratch;
+    decodeWithScratch(out, w, h, state, in, insize, &temp);
+    DecoderScratch_cleanup(&scratch);
   }
-  lodepng_free(scanlines);
+  state->decoder.zlibsettings.allocator = allocator;
+  if(state->error && budget.exceeded) state->error = 127;
+  state->peak_memory = budget.peak;
+  budget_cleanup(&budget);
 }
 
 unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize) {
+  DecodeTarget target;
+  DecodeTarget_init(&target);
   *out = 0;
-  decodeGeneric(out, w, h, state, in, insize);
-  if(state->error) return state->error;
-  if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)) {
-    /*same color type, no copying or converting of data needed*/
-    /*store the info_png color settings on the info_raw so that the info_raw still reflects what colortype
-    the raw image has to the end user*/
-    if(!state->decoder.color_convert) {
-      state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
-      if(state->error) return state->error;
-    }
-  } else { /*color conversion needed*/
-    unsigned char* data = *out;
-    size_t outsize;
+  decodeGeneric(out, w, h, state, in, insize, &target);
+  return state->error;
+}
 
-    /*TODO: check if this works according to the statement in the documentation: "The converter can convert
-    from grayscale input color type, to 8-bit grayscale or grayscale with alpha"*/
-    if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
-       && !(state->info_raw.bitdepth == 8)) {
-      return 56; /*unsupported color mode conversion*/
-    }
+unsigned lodepng_decode_region(unsigned char** out, unsigned x0, unsigned y0, unsigned w, unsigned h,
+                               LodePNGState* state, const unsigned char* in, size_t insize) {
+  unsigned image_w, image_h;
+  DecodeTarget target;
+  DecodeTarget_init(&target);
+  *out = 0;
+  if(!w || !h) return 125; /*empty region*/
+  target.x0 = x0;
+  target.y0 = y0;
+  target.w = w;
+  target.h = h;
+  decodeGeneric(out, &image_w, &image_h, state, in, insize, &target);
+  return state->error;
+}
 
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_raw);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!(*out)) {
-      state->error = 83; /*alloc fail*/
-    }
-    else state->error = lodepng_convert(*out, data, &state->info_raw,
-                                        &state->info_png.color, *w, *h);
-    lodepng_free(data);
-  }
+unsigned lodepng_decode_scaled(unsigned char** out, unsigned* w, unsigned* h, unsigned shift,
+                               LodePNGState* state, const unsigned char* in, size_t insize) {
+  DecodeTarget target;
+  DecodeTarget_init(&target);
+  *out = 0;
+  *w = *h = 0;
+  if(shift < 1 || shift > 3) return 126; /*unsupported downscale factor*/
+  target.shift = shift;
+  decodeGeneric(out, w, h, state, in, insize, &target);
+  *w = (*w + (1u << shift) - 1u) >> shift;
+  *h = (*h + (1u << shift) - 1u) >> shift;
+  return state->error;
+}
+
+unsigned lodepng_decode_into(unsigned char* out, size_t stride, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize) {
+  unsigned char* temp = 0;
+  DecodeTarget target;
+  if(!out) return 124;
+  DecodeTarget_init(&target);
+  target.image = out;
+  target.stride = stride;
+  target.size = outsize;
+  decodeGeneric(&temp, w, h, state, in, insize, &target);
   return state->error;
 }
 
+void lodepng_decoder_context_init(LodePNGDecoderContext* context, LodePNGState* state) {
+  context->state = state;
+  context->internal = 0;
+}
+
+void lodepng_decoder_context_cleanup(LodePNGDecoderContext* context) {
+  DecoderScratch* scratch = (DecoderScratch*)context->internal;
+  if(scratch) {
+    DecoderScratch_cleanup(scratch);
+    lodepng_free(scratch);
+  }
+  context->internal = 0;
+}
+
+unsigned lodepng_decode_context(unsigned char** out, unsigned* w, unsigned* h, LodePNGDecoderContext* context,
+                                const unsigned char* in, size_t insize) {
+  DecodeTarget target;
+  *out = 0;
+  *w = *h = 0;
+  if(!context->internal) {
+    context->internal = lodepng_malloc(sizeof(DecoderScratch));
+    if(!context->internal) return 83; /*alloc fail*/
+    DecoderScratch_init((DecoderScratch*)context->internal, 0);
+  }
+  DecodeTarget_init(&target);
+  target.scratch = (DecoderScratch*)context->internal;
+  decodeGeneric(out, w, h, context->state, in, insize, &target);
+  return context->state->error;
+}
+
+unsigned lodepng_decode_batch(unsigned char** out, unsigned* w, unsigned* h, unsigned* errors,
+                              const unsigned char* const* in, const size_t* insize, size_t count,
+                              LodePNGState* state) {
+  unsigned first_error = 0;
+  size_t i;
+  LodePNGDecoderContext context;
+  lodepng_decoder_context_init(&context, state);
+  for(i = 0; i != count; ++i) {
+    unsigned error = lodepng_decode_context(&out[i], &w[i], &h[i], &context, in[i], insize[i]);
+    if(errors) errors[i] = error;
+    if(!first_error) first_error = error;
+  }
+  lodepng_decoder_context_cleanup(&context);
+  return first_error;
+}
+
 unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
                                size_t insize, LodePNGColorType colortype, unsigned bitdepth) {
   unsigned error;
@@ -5573,15 +8501,15 @@ unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const u
 #ifdef LODEPNG_COMPILE_DISK
 unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
                              LodePNGColorType colortype, unsigned bitdepth) {
-  unsigned char* buffer = 0;
+  const unsigned char* buffer = 0;
   size_t buffersize;
   unsigned error;
   /* safe output values in case error happens */
   *out = 0;
   *w = *h = 0;
-  error = lodepng_load_file(&buffer, &buffersize, filename);
+  error = lodepng_map_file(&buffer, &buffersize, filename);
   if(!error) error = lodepng_decode_memory(out, w, h, buffer, buffersize, colortype, bitdepth);
-  lodepng_free(buffer);
+  lodepng_unmap_file(buffer, buffersize);
   return error;
 }
 
@@ -5605,9 +8533,428 @@ void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings) {
   settings->ignore_crc = 0;
   settings->ignore_critical = 0;
   settings->ignore_end = 0;
+  settings->max_memory = 0;
   lodepng_decompress_settings_init(&settings->zlibsettings);
 }
 
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Stream Decoder                                                         / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*what the stream decoder is reading, see StreamDecoder*/
+#define STREAM_HEADER 0u /*signature and IHDR chunk*/
+#define STREAM_CHUNK_HEADER 1u /*length and type of a chunk*/
+#define STREAM_CHUNK 2u /*remainder of a chunk other than IDAT*/
+#define STREAM_IDAT 3u /*data of an IDAT chunk*/
+#define STREAM_IDAT_CRC 4u /*CRC of an IDAT chunk*/
+#define STREAM_END 5u /*after IEND, anything else is ignored*/
+
+/*what the zlib decompression in the stream decoder is reading*/
+#define STREAM_ZLIB_HEADER 0u
+#define STREAM_ZLIB_DATA 1u
+#define STREAM_ZLIB_ADLER32 2u
+#define STREAM_ZLIB_DONE 3u
+
+/*private state of a LodePNGStreamDecoder*/
+typedef struct StreamDecoder {
+  unsigned error; /*once an error happened, it is returned by all further calls*/
+  unsigned mode; /*one of the STREAM_ modes*/
+  ucvector buf; /*bytes collected for the header or current chunk, until their amount reaches buf_needed*/
+  size_t buf_needed;
+  size_t idat_left; /*remaining bytes of data of the current IDAT chunk*/
+  unsigned idat_crc; /*CRC register of the current IDAT chunk so far*/
+  unsigned critical_pos; /*for unknown chunk order, see decodeChunk*/
+  unsigned idat_started; /*whether the first IDAT chunk was seen*/
+
+  unsigned zlib_mode; /*one of the STREAM_ZLIB_ modes*/
+#ifdef LODEPNG_COMPILE_ZLIB
+  Inflator inflator;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  ucvector zin; /*compressed data that is not entirely used by the inflator yet*/
+  size_t zin_bp; /*bit position in zin where the inflator continues*/
+  ucvector zout; /*decompressed scanlines, and enough earlier decompressed data for backward distances*/
+  size_t zout_pos; /*position in zout of the first scanline that is not output yet*/
+  size_t zout_total; /*total amount of decompressed bytes so far*/
+  size_t expected_size; /*total amount of decompressed bytes the image must have*/
+  unsigned adler; /*adler32 of the decompressed bytes so far*/
+
+  RowPipeline rows; /*unfilters, converts and outputs the rows to the row_callback*/
+
+  unsigned pass; /*next Adam7 pass to give to the pass_callback*/
+  unsigned char* image; /*for the pass_callback: the image so far, in the color mode of the PNG*/
+  unsigned char* preview; /*for the pass_callback: the image so far converted to info_raw, if needed*/
+} StreamDecoder;
+
+static void StreamDecoder_cleanup(StreamDecoder* s) {
+  lodepng_free(s->buf.data);
+  lodepng_free(s->zin.data);
+  lodepng_free(s->zout.data);
+  lodepng_free(s->image);
+  lodepng_free(s->preview);
+  RowPipeline_cleanup(&s->rows);
+#ifdef LODEPNG_COMPILE_ZLIB
+  inflator_cleanup(&s->inflator);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+}
+
+/*Appends bytes from *in to s->buf until it has s->buf_needed bytes, and advances *in.
+Returns 1 if it has that amount now, 0 if all input is used and more is needed, 2 if alloc fail.*/
+static unsigned stream_collect(StreamDecoder* s, const unsigned char** in, size_t* insize) {
+  size_t amount = s->buf_needed - s->buf.size;
+  if(amount > *insize) amount = *insize;
+  /*only grows with the actual input, the chunk length may be corrupted*/
+  if(!ucvector_reserve(&s->buf, s->buf.size + amount)) return 2;
+  lodepng_memcpy(s->buf.data + s->buf.size, *in, amount);
+  s->buf.size += amount;
+  *in += amount;
+  *insize -= amount;
+  return s->buf.size == s->buf_needed;
+}
+
+/*row callback for when the stream decoder has none, the rows are still decoded to check for errors*/
+static void stream_ignore_row(void* context, unsigned y, const unsigned char* row) {
+  (void)context;
+  (void)y;
+  (void)row;
+}
+
+/*prepares for the image data when the first IDAT chunk is found, now that PLTE and tRNS are known*/
+static unsigned stream_start_idat(LodePNGStreamDecoder* decoder, StreamDecoder* s) {
+  LodePNGState* state = decoder->state;
+  LodePNGInfo* info_png = &state->info_png;
+  unsigned w = decoder->w, h = decoder->h;
+  unsigned bpp = lodepng_get_bpp(&info_png->color);
+  unsigned convert;
+
+  if(info_png->color.colortype == LCT_PALETTE && !info_png->color.palette) {
+    return 106; /* error: PNG file must have PLTE chunk if color type is palette */
+  }
+
+  CERROR_TRY_RETURN(decodeColorMode(state, &convert));
+
+  if(info_png->interlace_method == 0) {
+    s->expected_size = lodepng_get_raw_size_idat(w, h, bpp);
+  } else {
+    /*Adam-7 interlaced: expected size is the sum of the 7 sub-images sizes*/
+    unsigned passw[7], passh[7];
+    size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+    s->expected_size = filter_passstart[7];
+  }
+
+  /*the stream decoder keeps the rows from one feed to the next, so they use lodepng_malloc*/
+  CERROR_TRY_RETURN(RowPipeline_init(&s->rows, w, h, &info_png->color, convert ? &state->info_raw : 0, 0, 0, 0));
+  s->rows.callback = decoder->row_callback ? decoder->row_callback : stream_ignore_row;
+  s->rows.context = decoder->context;
+  s->idat_started = 1;
+  return 0;
+}
+
+/*for Adam7 interlaced images with a pass_callback, gives a preview of the image for each pass whose data is
+entirely decompressed now*/
+static unsigned stream_output_passes(LodePNGStreamDecoder* decoder, StreamDecoder* s) {
+  const LodePNGInfo* info_png = &decoder->state->info_png;
+  const LodePNGAllocator* allocator = &decoder->state->decoder.zlibsettings.allocator;
+  unsigned w = decoder->w, h = decoder->h;
+  unsigned bpp = lodepng_get_bpp(&info_png->color);
+  unsigned passw[7], passh[7];
+  size_t filter_passstart[8], padded_passstart[8], passstart[8];
+  Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+
+  if(!s->image) {
+    size_t size = lodepng_get_raw_size(w, h, &info_png->color);
+    s->image = (unsigned char*)lodepng_malloc(size);
+    if(!s->image) return 83; /*alloc fail*/
+    lodepng_memset(s->image, 0, size);
+    if(s->rows.mode_out) {
+      s->preview = (unsigned char*)lodepng_malloc(lodepng_get_raw_size(w, h, s->rows.mode_out));
+      if(!s->preview) return 83; /*alloc fail*/
+    }
+  }
+
+  while(s->pass < 7 && s->zout_total >= filter_passstart[s->pass + 1]) {
+    unsigned error, i = s->pass++;
+    unsigned char* reduced;
+    if(!passw[i]) continue; /*the image is too small to have pixels in this pass*/
+    /*only needed during this feed, so it uses the allocator of the settings*/
+    reduced = (unsigned char*)allocator_malloc(allocator, padded_passstart[i + 1] - padded_passstart[i]);
+    if(!reduced) return 83; /*alloc fail*/
+    error = unfilter(reduced, &s->zout.data[filter_passstart[i]], passw[i], passh[i], bpp);
+    if(!error) Adam7_preview(s->image, reduced, w, h, bpp, i, passw[i], passh[i]);
+    allocator_free(allocator, reduced);
+    if(error) return error;
+    if(s->preview) {
+      CERROR_TRY_RETURN(lodepng_convert(s->preview, s->image, s->rows.mode_out, &info_png->color, w, h));
+    }
+    decoder->pass_callback(decoder->context, i, s->preview ? s->preview : s->image);
+  }
+  return 0;
+}
+
+/*for Adam7 interlaced images, outputs all rows once all the image data is decompressed*/
+static unsigned stream_output_interlaced(LodePNGStreamDecoder* decoder, StreamDecoder* s) {
+  unsigned error = 0;
+  const LodePNGInfo* info_png = &decoder->state->info_png;
+  unsigned w = decoder->w, h = decoder->h;
+  size_t linebits = (size_t)w * lodepng_get_bpp(&info_png->color);
+  size_t y, size = lodepng_get_raw_size(w, h, &info_png->color);
+  const LodePNGAllocator* allocator = &decoder->state->decoder.zlibsettings.allocator;
+  unsigned char* image;
+  if(decoder->pass_callback) {
+    /*after the last pass, the preview is the image itself*/
+    CERROR_TRY_RETURN(stream_output_passes(decoder, s));
+    image = s->image;
+  } else {
+    image = (unsigned char*)allocator_malloc(allocator, size);
+    if(!image) return 83; /*alloc fail*/
+    lodepng_memset(image, 0, size);
+    error = postProcessScanlines(image, s->zout.data, w, h, info_png, &decoder->state->decoder.zlibsettings);
+  }
+  for(y = 0; !error && y < h; ++y) {
+    if(linebits % 8u == 0) {
+      error = RowPipeline_output(&s->rows, &image[y * (linebits / 8u)]);
+    } else {
+      /*rows of the image have no padding bits, but rows for the output start at a byte boundary*/
+      size_t x, ibp = y * linebits, obp = 0;
+      lodepng_memset(s->rows.line, 0, s->rows.linebytes);
+      for(x = 0; x < linebits; ++x) {
+        unsigned char bit = readBitFromReversedStream(&ibp, image);
+        setBitOfReversedStream(&obp, s->rows.line, bit);
+      }
+      error = RowPipeline_output(&s->rows, s->rows.line);
+    }
+  }
+  if(image != s->image) allocator_free(allocator, image);
+  return error;
+}
+
+/*decompresses all the zlib data at once, for custom_zlib or custom_inflate which need all data at once*/
+static unsigned stream_decompress_all(LodePNGStreamDecoder* decoder, StreamDecoder* s) {
+  unsigned char* scanlines = 0;
+  size_t scanlines_size = 0;
+  unsigned error;
+  LodePNGDecompressSettings zlibsettings = decoder->state->decoder.zlibsettings;
+  /*the buffers of the stream decoder are kept from one feed to the next, and use lodepng_malloc*/
+  zlibsettings.allocator = lodepng_default_decompress_settings.allocator;
+  error = zlib_decompress(&scanlines, &scanlines_size, s->expected_size, s->zin.data, s->zin.size, &zlibsettings);
+  lodepng_free(s->zout.data);
+  s->zout = ucvector_init(scanlines, scanlines_size);
+  s->zout_total = scanlines_size;
+  if(error) return error;
+  if(scanlines_size != s->expected_size) return 91; /*decompressed size doesn't match prediction*/
+  s->zlib_mode = STREAM_ZLIB_DONE;
+  if(decoder->state->info_png.interlace_method != 0) return stream_output_interlaced(decoder, s);
+  return RowPipeline_scanlines(&s->rows, s->zout.data, s->zout.size, &s->zout_pos);
+}
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*Decompresses as much of the zlib data in zin as possible with the inflator and outputs the complete rows.
+more_input indicates whether more data can still follow, if not, missing data is an error.*/
+static unsigned stream_inflate_builtin(LodePNGStreamDecoder* decoder, StreamDecoder* s, unsigned more_input) {
+  const LodePNGDecompressSettings* settings = &decoder->state->decoder.zlibsettings;
+  unsigned interlaced = decoder->state->info_png.interlace_method != 0;
+
+  if(s->zlib_mode == STREAM_ZLIB_HEADER) {
+    if(s->zin.size < 2 && more_input) return 0;
+    CERROR_TRY_RETURN(zlib_check_header(s->zin.data, s->zin.size));
+    s->zin_bp = 16;
+    s->zlib_mode = STREAM_ZLIB_DATA;
+  }
+
+  while(s->zlib_mode == STREAM_ZLIB_DATA) {
+    LodePNGBitReader reader;
+    size_t size = s->zout.size;
+    size_t limit = s->zout.size + ROW_PIPELINE_PIECE;
+    unsigned starved; /*whether the inflator stopped due to lack of input rather than the limit*/
+    CERROR_TRY_RETURN(LodePNGBitReader_init(&reader, s->zin.data, s->zin.size));
+    reader.bp = s->zin_bp;
+    CERROR_TRY_RETURN(inflator_run(&s->inflator, &s->zout, &reader, limit, more_input, settings));
+    s->zin_bp = reader.bp;
+    starved = s->zout.size < limit;
+
+    s->adler = update_adler32(s->adler, s->zout.data + size, (unsigned)(s->zout.size - size));
+    s->zout_total += s->zout.size - size;
+    if(s->zout_total > s->expected_size) return 91; /*decompressed size doesn't match prediction*/
+    if(s->inflator.mode == INFLATE_DONE) s->zlib_mode = STREAM_ZLIB_ADLER32;
+
+    if(!interlaced) {
+      CERROR_TRY_RETURN(RowPipeline_window(&s->rows, &s->zout, &s->zout_pos));
+    } else if(decoder->pass_callback) {
+      CERROR_TRY_RETURN(stream_output_passes(decoder, s));
+    }
+
+    if(starved) break;
+  }
+
+  /*remove the compressed data that was used*/
+  if((s->zin_bp >> 3u) * 2u >= s->zin.size) {
+    ucvector_drop(&s->zin, s->zin_bp >> 3u);
+    s->zin_bp &= 7u;
+  }
+
+  if(s->zlib_mode == STREAM_ZLIB_ADLER32) {
+    size_t pos = (s->zin_bp + 7u) >> 3u;
+    if(pos + 4u > s->zin.size) {
+      if(more_input) return 0;
+      if(!settings->ignore_adler32) return 58; /*error, missing adler checksum*/
+    } else if(!settings->ignore_adler32 && lodepng_read32bitInt(&s->zin.data[pos]) != s->adler) {
+      return 58; /*error, adler checksum not correct, data must be corrupted*/
+    }
+    s->zlib_mode = STREAM_ZLIB_DONE;
+    if(s->zout_total != s->expected_size) return 91; /*decompressed size doesn't match prediction*/
+    if(interlaced) CERROR_TRY_RETURN(stream_output_interlaced(decoder, s));
+  }
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+/*Decompresses as much of the zlib data in zin as possible and outputs the complete rows. more_input
+indicates whether more data can still follow, if not, missing data is an error.*/
+static unsigned stream_inflate(LodePNGStreamDecoder* decoder, StreamDecoder* s, unsigned more_input) {
+#ifdef LODEPNG_COMPILE_ZLIB
+  const LodePNGDecompressSettings* settings = &decoder->state->decoder.zlibsettings;
+  if(!settings->custom_zlib && !settings->custom_inflate) return stream_inflate_builtin(decoder, s, more_input);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  /*the custom decompressor needs all the data at once, so it's done in lodepng_stream_decoder_finish*/
+  return more_input ? 0 : stream_decompress_all(decoder, s);
+}
+
+/*reads the signature and IHDR chunk*/
+static unsigned stream_read_header(LodePNGStreamDecoder* decoder, StreamDecoder* s) {
+  LodePNGState* state = decoder->state;
+  unsigned w, h;
+  CERROR_TRY_RETURN(lodepng_inspect(&w, &h, state, s->buf.data, s->buf.size));
+  if(lodepng_pixel_overflow(w, h, &state->info_png.color, &state->info_raw)) {
+    return 92; /*overflow possible due to amount of pixels*/
+  }
+  decoder->w = w;
+  decoder->h = h;
+  return 0;
+}
+
+/*reads the length and type of a chunk, and decides how to read the rest of it*/
+static unsigned stream_read_chunk_header(LodePNGStreamDecoder* decoder, StreamDecoder* s) {
+  const unsigned char* chunk = s->buf.data;
+  unsigned chunkLength = lodepng_chunk_length(chunk);
+  /*error: chunk length larger than the max PNG chunk size*/
+  if(chunkLength > 2147483647) return 63;
+
+  if(lodepng_chunk_type_equals(chunk, "IDAT")) {
+    if(!s->idat_started) CERROR_TRY_RETURN(stream_start_idat(decoder, s));
+    s->critical_pos = 3;
+    s->idat_left = chunkLength;
+    s->idat_crc = lodepng_crc32_update(0xffffffffu, &chunk[4], 4);
+    s->mode = STREAM_IDAT;
+  } else {
+    /*the entire chunk, including length, type and CRC, is collected in buf*/
+    s->buf_needed = (size_t)chunkLength + 12u;
+    s->mode = STREAM_CHUNK;
+  }
+  return 0;
+}
+
+void lodepng_stream_decoder_init(LodePNGStreamDecoder* decoder, LodePNGState* state) {
+  decoder->state = state;
+  decoder->row_callback = 0;
+  decoder->context = 0;
+  decoder->pass_callback = 0;
+  decoder->w = decoder->h = 0;
+  decoder->internal = 0;
+}
+
+void lodepng_stream_decoder_cleanup(LodePNGStreamDecoder* decoder) {
+  StreamDecoder* s = (StreamDecoder*)decoder->internal;
+  if(s) {
+    StreamDecoder_cleanup(s);
+    lodepng_free(s);
+  }
+  decoder->internal = 0;
+}
+
+static unsigned stream_feed(LodePNGStreamDecoder* decoder, StreamDecoder* s, const unsigned char* in, size_t insize) {
+  while(insize && s->mode != STREAM_END) {
+    if(s->mode == STREAM_IDAT) {
+      size_t amount = s->idat_left < insize ? s->idat_left : insize;
+      if(!ucvector_reserve(&s->zin, s->zin.size + amount)) return 83; /*alloc fail*/
+      lodepng_memcpy(s->zin.data + s->zin.size, in, amount);
+      s->zin.size += amount;
+      s->idat_crc = lodepng_crc32_update(s->idat_crc, in, amount);
+      s->idat_left -= amount;
+      in += amount;
+      insize -= amount;
+      if(s->zlib_mode != STREAM_ZLIB_DONE) CERROR_TRY_RETURN(stream_inflate(decoder, s, 1));
+      if(s->idat_left == 0) {
+        s->buf.size = 0;
+        s->buf_needed = 4;
+        s->mode = STREAM_IDAT_CRC;
+      }
+    } else {
+      unsigned collected = stream_collect(s, &in, &insize);
+      if(collected == 2) return 83; /*alloc fail*/
+      if(!collected) break;
+      if(s->mode == STREAM_HEADER) {
+        CERROR_TRY_RETURN(stream_read_header(decoder, s));
+        s->mode = STREAM_CHUNK_HEADER;
+      } else if(s->mode == STREAM_CHUNK_HEADER) {
+        CERROR_TRY_RETURN(stream_read_chunk_header(decoder, s));
+        continue; /*buf is still in use for a chunk other than IDAT*/
+      } else if(s->mode == STREAM_IDAT_CRC) {
+        if(!decoder->state->decoder.ignore_crc && lodepng_read32bitInt(s->buf.data) != (s->idat_crc ^ 0xffffffffu)) {
+          return 57; /*invalid CRC*/
+        }
+        s->mode = STREAM_CHUNK_HEADER;
+      } else /*STREAM_CHUNK*/ {
+        CERROR_TRY_RETURN(decodeChunk(decoder->state, s->buf.data, &s->critical_pos));
+        s->mode = lodepng_chunk_type_equals(s->buf.data, "IEND") ? STREAM_END : STREAM_CHUNK_HEADER;
+      }
+      s->buf.size = 0;
+      s->buf_needed = 8;
+    }
+  }
+  return 0;
+}
+
+unsigned lodepng_stream_decoder_feed(LodePNGStreamDecoder* decoder, const unsigned char* in, size_t insize) {
+  StreamDecoder* s = (StreamDecoder*)decoder->internal;
+  if(!s) {
+    s = (StreamDecoder*)lodepng_malloc(sizeof(StreamDecoder));
+    if(!s) return 83; /*alloc fail*/
+    lodepng_memset(s, 0, sizeof(StreamDecoder));
+#ifdef LODEPNG_COMPILE_ZLIB
+    inflator_init(&s->inflator, 0);
+#endif /*LODEPNG_COMPILE_ZLIB*/
+    s->mode = STREAM_HEADER;
+    s->buf_needed = 33; /*signature and IHDR chunk*/
+    s->critical_pos = 1;
+    s->adler = 1u;
+    decoder->internal = s;
+  }
+  if(!s->error) s->error = stream_feed(decoder, s, in, insize);
+  return s->error;
+}
+
+unsigned lodepng_stream_decoder_finish(LodePNGStreamDecoder* decoder) {
+  StreamDecoder* s = (StreamDecoder*)decoder->internal;
+  const LodePNGDecoderSettings* settings = &decoder->state->decoder;
+  if(!s) return 48; /*error: the given data is empty*/
+  if(s->error) return s->error;
+  if(s->mode == STREAM_HEADER) {
+    /*let lodepng_inspect give the error for the too small input*/
+    s->error = lodepng_inspect(&decoder->w, &decoder->h, decoder->state, s->buf.data, s->buf.size);
+    if(!s->error) s->error = 27; /*error: the data length is smaller than the length of a PNG header*/
+  } else if(s->mode != STREAM_END && !settings->ignore_end) {
+    s->error = 30; /*error: missing IEND chunk*/
+  } else if(!s->idat_started) {
+    /*error: PNG file must have PLTE chunk if color type is palette, otherwise no image data*/
+    s->error = (decoder->state->info_png.color.colortype == LCT_PALETTE &&
+                !decoder->state->info_png.color.palette) ? 106 : 53;
+  } else if(s->zlib_mode != STREAM_ZLIB_DONE) {
+    s->error = stream_inflate(decoder, s, 0);
+  }
+  if(!s->error && s->rows.y != decoder->h) s->error = 91; /*decompressed size doesn't match prediction*/
+  return s->error;
+}
+
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
@@ -5621,6 +8968,7 @@ void lodepng_state_init(LodePNGState* state) {
 #endif /*LODEPNG_COMPILE_ENCODER*/
   lodepng_color_mode_init(&state->info_raw);
   lodepng_info_init(&state->info_png);
+  state->peak_memory = 0;
   state->error = 1;
 }
 
@@ -5735,8 +9083,9 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info) {
   return 0;
 }
 
+/*compresses the data with the tables of hash if not 0, and adds it as one or more IDAT chunks*/
 static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              const LodePNGCompressSettings* zlibsettings) {
+                              const LodePNGCompressSettings* zlibsettings, Hash* hash) {
   unsigned error = 0;
   unsigned char* zlib = 0;
   size_t pos = 0;
@@ -5744,17 +9093,23 @@ static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t d
   /* max chunk length allowed by the specification is 2147483647 bytes */
   const size_t max_chunk_length = 2147483647u;
 
-  error = zlib_compress(&zlib, &zlibsize, data, datasize, zlibsettings);
+  error = zlib_compress(&zlib, &zlibsize, data, datasize, zlibsettings, hash);
   while(!error) {
-    if(zlibsize - pos > max_chunk_length) {
-      error = lodepng_chunk_createv(out, max_chunk_length, "IDAT", zlib + pos);
-      pos += max_chunk_length;
-    } else {
-      error = lodepng_chunk_createv(out, zlibsize - pos, "IDAT", zlib + pos);
-      break;
-    }
+    size_t length = LODEPNG_MIN(zlibsize - pos, max_chunk_length);
+    unsigned char* chunk;
+    unsigned crc = 0;
+    error = lodepng_chunk_init(&chunk, out, length, "IDAT");
+    if(error) break;
+    lodepng_memcpy(chunk + 8, zlib + pos, length);
+    /*the CRC of the chunkname characters and the data, like lodepng_chunk_generate_crc*/
+    error = crc32Parallel(&crc, chunk + 4, length + 4, zlibsettings->parallel_for, zlibsettings->parallel_context,
+                          zlibsettings->parallel_segment_size, &zlibsettings->allocator);
+    if(error) break;
+    lodepng_set32bitInt(chunk + 8 + length, crc);
+    pos += length;
+    if(pos == zlibsize) break;
   }
-  lodepng_free(zlib);
+  allocator_free(&zlibsettings->allocator, zlib);
   return error;
 }
 
@@ -5788,7 +9143,7 @@ static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* te
   if(keysize < 1 || keysize > 79) return 89; /*error: invalid keyword size*/
 
   error = zlib_compress(&compressed, &compressedsize,
-                        (const unsigned char*)textstring, textsize, zlibsettings);
+                        (const unsigned char*)textstring, textsize, zlibsettings, 0);
   if(!error) {
     size_t size = keysize + 2 + compressedsize;
     error = lodepng_chunk_init(&chunk, out, size, "zTXt");
@@ -5801,7 +9156,7 @@ static unsigned addChunk_zTXt(ucvector* out, const char* keyword, const char* te
     lodepng_chunk_generate_crc(chunk);
   }
 
-  lodepng_free(compressed);
+  allocator_free(&zlibsettings->allocator, compressed);
   return error;
 }
 
@@ -5818,7 +9173,7 @@ static unsigned addChunk_iTXt(ucvector* out, unsigned compress, const char* keyw
 
   if(compress) {
     error = zlib_compress(&compressed, &compressedsize,
-                          (const unsigned char*)textstring, textsize, zlibsettings);
+                          (const unsigned char*)textstring, textsize, zlibsettings, 0);
   }
   if(!error) {
     size_t size = keysize + 3 + langsize + 1 + transsize + 1 + (compress ? compressedsize : textsize);
@@ -5845,7 +9200,7 @@ static unsigned addChunk_iTXt(ucvector* out, unsigned compress, const char* keyw
     lodepng_chunk_generate_crc(chunk);
   }
 
-  lodepng_free(compressed);
+  allocator_free(&zlibsettings->allocator, compressed);
   return error;
 }
 
@@ -5932,7 +9287,7 @@ static unsigned addChunk_iCCP(ucvector* out, const LodePNGInfo* info, const Lode
 
   if(keysize < 1 || keysize > 79) return 89; /*error: invalid keyword size*/
   error = zlib_compress(&compressed, &compressedsize,
-                        info->iccp_profile, info->iccp_profile_size, zlibsettings);
+                        info->iccp_profile, info->iccp_profile_size, zlibsettings, 0);
   if(!error) {
     size_t size = keysize + 2 + compressedsize;
     error = lodepng_chunk_init(&chunk, out, size, "iCCP");
@@ -5945,7 +9300,7 @@ static unsigned addChunk_iCCP(ucvector* out, const LodePNGInfo* info, const Lode
     lodepng_chunk_generate_crc(chunk);
   }
 
-  lodepng_free(compressed);
+  allocator_free(&zlibsettings->allocator, compressed);
   return error;
 }
 
@@ -6052,20 +9407,104 @@ static unsigned addChunk_sBIT(ucvector* out, const LodePNGInfo* info) {
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+#ifdef LODEPNG_SSE2
+/*Unlike unfiltering, filtering only reads the unfiltered input, so it works on 16 bytes at a time.
+These return the index up to which they filtered, the caller does the remaining bytes.*/
+
+/*filters bytes starting at index bytewidth with filter type 1 to 4, prevline may not be NULL*/
+static size_t filterScanlineSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t length, size_t bytewidth, unsigned char filterType) {
+  size_t i;
+  const __m128i zero = _mm_setzero_si128();
+  for(i = bytewidth; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+    __m128i pred;
+    if(filterType == 1) {
+      pred = a;
+    } else if(filterType == 2) {
+      pred = b;
+    } else if(filterType == 3) {
+      pred = sse2_average8(a, b);
+    } else {
+      __m128i c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+      __m128i lo = sse2_paeth16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+      __m128i hi = sse2_paeth16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+      pred = _mm_packus_epi16(lo, hi);
+    }
+    _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, pred));
+  }
+  return i;
+}
+
+/*adds the horizontal sum of the two 64-bit halves of v to *sum*/
+static void sse2_add_sum(size_t* sum, __m128i v) {
+  *sum += (unsigned)_mm_cvtsi128_si32(v) + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+}
+
+/*the SSE2 part of filterScanlineAll, starting at index bytewidth, prevline may not be NULL*/
+static size_t filterScanlineAllSSE2(unsigned char* attempt[5], size_t sums[5], const unsigned char* scanline,
+                                    const unsigned char* prevline, size_t length, size_t bytewidth) {
+  size_t i = bytewidth;
+  const __m128i zero = _mm_setzero_si128();
+  while(i + 16 <= length) {
+    /*the sums of absolute values are accumulated in 32-bit lanes, emptied often enough to not overflow*/
+    __m128i acc[5];
+    size_t type, n;
+    for(type = 0; type != 5; ++type) acc[type] = zero;
+    for(n = 0; n != 65536 && i + 16 <= length; ++n, i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+      __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+      __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+      __m128i c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+      __m128i lo = sse2_paeth16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+      __m128i hi = sse2_paeth16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+      __m128i d[5];
+      d[0] = x;
+      d[1] = _mm_sub_epi8(x, a);
+      d[2] = _mm_sub_epi8(x, b);
+      d[3] = _mm_sub_epi8(x, sse2_average8(a, b));
+      d[4] = _mm_sub_epi8(x, _mm_packus_epi16(lo, hi));
+      for(type = 0; type != 5; ++type) _mm_storeu_si128((__m128i*)&attempt[type][i], d[type]);
+      if(sums) {
+        acc[0] = _mm_add_epi32(acc[0], _mm_sad_epu8(d[0], zero));
+        for(type = 1; type != 5; ++type) {
+          /*the differences are signed, s ^ 255 is 255 - s for the negative ones*/
+          __m128i v = _mm_xor_si128(d[type], _mm_cmplt_epi8(d[type], zero));
+          acc[type] = _mm_add_epi32(acc[type], _mm_sad_epu8(v, zero));
+        }
+      }
+    }
+    if(sums) {
+      for(type = 0; type != 5; ++type) sse2_add_sum(&sums[type], acc[type]);
+    }
+  }
+  return i;
+}
+#endif /*LODEPNG_SSE2*/
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType) {
   size_t i;
+  size_t start = bytewidth; /*where the main loops start, the SSE2 code may already have done part of them*/
+#ifdef LODEPNG_SSE2
+  if(prevline && filterType >= 1 && filterType <= 4) {
+    start = filterScanlineSSE2(out, scanline, prevline, length, bytewidth, filterType);
+  }
+#endif /*LODEPNG_SSE2*/
   switch(filterType) {
     case 0: /*None*/
       for(i = 0; i != length; ++i) out[i] = scanline[i];
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+      for(i = start; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline) {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = start; i < length; ++i) out[i] = scanline[i] - prevline[i];
       } else {
         for(i = 0; i != length; ++i) out[i] = scanline[i];
       }
@@ -6073,7 +9512,7 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
     case 3: /*Average*/
       if(prevline) {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+        for(i = start; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
       } else {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
         for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - (scanline[i - bytewidth] >> 1);
@@ -6083,7 +9522,7 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       if(prevline) {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i) {
+        for(i = start; i < length; ++i) {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
       } else {
@@ -6096,6 +9535,70 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
   }
 }
 
+#ifdef LODEPNG_SSE2
+/*filters bytes begin to end of the scanline with all five filter types, see filterScanlineAll*/
+static void filterBytesAll(unsigned char* attempt[5], size_t sums[5], const unsigned char* scanline,
+                           const unsigned char* prevline, size_t bytewidth, size_t begin, size_t end) {
+  size_t i;
+  unsigned type;
+  for(i = begin; i < end; ++i) {
+    /*the neighbors outside of the image are 0*/
+    unsigned char x = scanline[i], a = 0, b = 0, c = 0;
+    unsigned char d[5];
+    if(i >= bytewidth) a = scanline[i - bytewidth];
+    if(prevline) {
+      b = prevline[i];
+      if(i >= bytewidth) c = prevline[i - bytewidth];
+    }
+    d[0] = x;
+    d[1] = x - a;
+    d[2] = x - b;
+    d[3] = x - ((a + b) >> 1);
+    d[4] = x - paethPredictor(a, b, c);
+    for(type = 0; type != 5; ++type) attempt[type][i] = d[type];
+    if(sums) {
+      sums[0] += x;
+      for(type = 1; type != 5; ++type) sums[type] += d[type] < 128 ? d[type] : (255U - d[type]);
+    }
+  }
+}
+#endif /*LODEPNG_SSE2*/
+
+/*
+Filters the scanline with all five filter types into attempt[type], the same as filterScanline does
+for each type. If sums is not NULL, it also outputs the score of each attempt for LFS_MINSUM into it:
+the sum of the absolute values of the bytes, which are taken as signed differences for all filter types
+except 0. With SSE2 this is done in one pass over the row. Otherwise it is a simple pass per filter type,
+followed by a pass summing that attempt, which costs as much as filtering and scoring each type separately
+but compilers optimize it better than one pass computing everything per byte.
+*/
+static void filterScanlineAll(unsigned char* attempt[5], size_t sums[5], const unsigned char* scanline,
+                              const unsigned char* prevline, size_t length, size_t bytewidth) {
+  size_t i;
+  unsigned char type;
+  if(sums) for(type = 0; type != 5; ++type) sums[type] = 0;
+#ifdef LODEPNG_SSE2
+  if(prevline) {
+    filterBytesAll(attempt, sums, scanline, prevline, bytewidth, 0, bytewidth);
+    i = filterScanlineAllSSE2(attempt, sums, scanline, prevline, length, bytewidth);
+    filterBytesAll(attempt, sums, scanline, prevline, bytewidth, i, length);
+    return;
+  }
+#endif /*LODEPNG_SSE2*/
+  for(type = 0; type != 5; ++type) {
+    filterScanline(attempt[type], scanline, prevline, length, bytewidth, type);
+    if(!sums) continue;
+    if(type == 0) {
+      for(i = 0; i != length; ++i) sums[type] += attempt[type][i];
+    } else {
+      for(i = 0; i != length; ++i) {
+        unsigned char s = attempt[type][i];
+        sums[type] += s < 128 ? s : (255U - s);
+      }
+    }
+  }
+}
+
 /* integer binary logarithm, max return value is 31 */
 static size_t ilog2(size_t i) {
   size_t result = 0;
@@ -6117,36 +9620,21 @@ static size_t ilog2i(size_t i) {
   return i * l + ((i - (((size_t)1) << l)) << 1u);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
-  the scanlines with 1 extra byte per scanline
-  */
-
-  unsigned bpp = lodepng_get_bpp(color);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
-
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7u) / 8u;
-  const unsigned char* prevline = 0;
+/*
+Filters the rows y0 to y1 with the given strategy. The filter of each row depends only on the
+unfiltered rows of the input, so separate ranges of rows can be filtered at the same time.
+*/
+static unsigned filterRows(unsigned char* out, const unsigned char* in, size_t linebytes, size_t bytewidth,
+                           unsigned y0, unsigned y1, LodePNGFilterStrategy strategy,
+                           const LodePNGEncoderSettings* settings) {
+  const unsigned char* prevline = y0 ? &in[(size_t)(y0 - 1u) * linebytes] : 0;
+  const LodePNGAllocator* allocator = &settings->zlibsettings.allocator;
   unsigned x, y;
   unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
-
-  if(settings->filter_palette_zero && (color->colortype == LCT_PALETTE || color->bitdepth < 8)) {
-    /*if the filter_palette_zero setting is enabled, override the filter strategy with
-    zero for all scanlines for palette and less-than-8-bitdepth images*/
-    strategy = LFS_ZERO;
-  }
-
-  if(bpp == 0) return 31; /*error: invalid color type*/
 
   if(strategy >= LFS_ZERO && strategy <= LFS_FOUR) {
     unsigned char type = (unsigned char)strategy;
-    for(y = 0; y != h; ++y) {
+    for(y = y0; y != y1; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       out[outindex] = type; /*filter type byte*/
@@ -6161,34 +9649,23 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     unsigned char type, bestType = 0;
 
     for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+      attempt[type] = (unsigned char*)allocator_malloc(allocator, linebytes);
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
-        /*try the 5 filter types*/
+      for(y = y0; y != y1; ++y) {
+        size_t sums[5];
+        /*try the 5 filter types and calculate the sums of their results in one pass. For differences, each
+        byte is treated as signed, values above 127 are negative (converted to signed char). Filtertype 0
+        isn't a difference though, so its sum is unsigned. This means filtertype 0 is almost never chosen,
+        but that is justified.*/
+        filterScanlineAll(attempt, sums, &in[y * linebytes], prevline, linebytes, bytewidth);
         for(type = 0; type != 5; ++type) {
-          size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          if(type == 0) {
-            for(x = 0; x != linebytes; ++x) sum += (unsigned char)(attempt[type][x]);
-          } else {
-            for(x = 0; x != linebytes; ++x) {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum += s < 128 ? s : (255U - s);
-            }
-          }
-
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum < smallest) {
+          if(type == 0 || sums[type] < smallest) {
             bestType = type;
-            smallest = sum;
+            smallest = sums[type];
           }
         }
 
@@ -6200,7 +9677,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       }
     }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    for(type = 0; type != 5; ++type) allocator_free(allocator, attempt[type]);
   } else if(strategy == LFS_ENTROPY) {
     unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t bestSum = 0;
@@ -6208,16 +9685,16 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     unsigned count[256];
 
     for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+      attempt[type] = (unsigned char*)allocator_malloc(allocator, linebytes);
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
 
     if(!error) {
-      for(y = 0; y != h; ++y) {
+      for(y = y0; y != y1; ++y) {
         /*try the 5 filter types*/
+        filterScanlineAll(attempt, 0, &in[y * linebytes], prevline, linebytes, bytewidth);
         for(type = 0; type != 5; ++type) {
           size_t sum = 0;
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
           lodepng_memset(count, 0, 256 * sizeof(*count));
           for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
           ++count[type]; /*the filter type itself is part of the scanline*/
@@ -6239,9 +9716,9 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       }
     }
 
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    for(type = 0; type != 5; ++type) allocator_free(allocator, attempt[type]);
   } else if(strategy == LFS_PREDEFINED) {
-    for(y = 0; y != h; ++y) {
+    for(y = y0; y != y1; ++y) {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
       unsigned char type = settings->predefined_filters[y];
@@ -6258,8 +9735,11 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     size_t smallest = 0;
     unsigned type = 0, bestType = 0;
     unsigned char* dummy;
+    Hash* hash = hash_create(allocator); /*shared by the attempts, or 0 to let each allocate its own*/
     LodePNGCompressSettings zlibsettings;
     lodepng_memcpy(&zlibsettings, &settings->zlibsettings, sizeof(LodePNGCompressSettings));
+    /*the rows are far too small to split up further, and this may already run inside parallel_for*/
+    zlibsettings.parallel_for = 0;
     /*use fixed tree on the attempts so that the tree is not adapted to the filtertype on purpose,
     to simulate the true case where the tree is the same for the whole image. Sometimes it gives
     better result with dynamic tree anyway. Using the fixed tree sometimes gives worse, but in rare
@@ -6270,11 +9750,11 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
     for(type = 0; type != 5; ++type) {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+      attempt[type] = (unsigned char*)allocator_malloc(allocator, linebytes);
       if(!attempt[type]) error = 83; /*alloc fail*/
     }
     if(!error) {
-      for(y = 0; y != h; ++y) /*try the 5 filter types*/ {
+      for(y = y0; y != y1; ++y) /*try the 5 filter types*/ {
         for(type = 0; type != 5; ++type) {
           unsigned testsize = (unsigned)linebytes;
           /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
@@ -6282,8 +9762,8 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
           filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
           size[type] = 0;
           dummy = 0;
-          zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
-          lodepng_free(dummy);
+          zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings, hash);
+          allocator_free(allocator, dummy);
           /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || size[type] < smallest) {
             bestType = type;
@@ -6295,13 +9775,107 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
         for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
       }
     }
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+    for(type = 0; type != 5; ++type) allocator_free(allocator, attempt[type]);
+    hash_destroy(hash);
   }
   else return 88; /* unknown filter strategy */
 
   return error;
 }
 
+/*the bands of rows that are filtered on multiple threads, see parallel_for*/
+typedef struct FilterBands {
+  unsigned char* out;
+  const unsigned char* in;
+  size_t linebytes;
+  size_t bytewidth;
+  unsigned h;
+  unsigned bandheight;
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+  LodePNGEncoderSettings* tasksettings; /*if not 0, the settings of each band, with its own allocator*/
+  unsigned* errors; /*the error of each band*/
+} FilterBands;
+
+static void filterBandTask(void* data, size_t i) {
+  FilterBands* bands = (FilterBands*)data;
+  unsigned y0 = (unsigned)i * bands->bandheight;
+  unsigned y1 = bands->h - y0 > bands->bandheight ? y0 + bands->bandheight : bands->h;
+  const LodePNGEncoderSettings* settings = bands->tasksettings ? &bands->tasksettings[i] : bands->settings;
+  bands->errors[i] = filterRows(bands->out, bands->in, bands->linebytes, bands->bytewidth,
+                                y0, y1, bands->strategy, settings);
+}
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* color, const LodePNGEncoderSettings* settings) {
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7u) / 8u, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(color);
+  /*the width of a scanline in bytes, not including the filter type*/
+  size_t linebytes = lodepng_get_raw_size_idat(w, 1, bpp) - 1u;
+
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7u) / 8u;
+  unsigned error = 0;
+  LodePNGFilterStrategy strategy = settings->filter_strategy;
+  const LodePNGCompressSettings* zlibsettings = &settings->zlibsettings;
+  size_t bandsize = zlibsettings->parallel_segment_size;
+
+  if(settings->filter_palette_zero && (color->colortype == LCT_PALETTE || color->bitdepth < 8)) {
+    /*if the filter_palette_zero setting is enabled, override the filter strategy with
+    zero for all scanlines for palette and less-than-8-bitdepth images*/
+    strategy = LFS_ZERO;
+  }
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+
+  /*brute force deflates every row five times, which takes far longer per row than the other strategies*/
+  if(strategy == LFS_BRUTE_FORCE) bandsize /= 16u;
+
+  if(zlibsettings->parallel_for && linebytes != 0 && bandsize / linebytes != 0 && bandsize / linebytes < h) {
+    size_t i, count;
+    FilterBands bands;
+    MemoryBudget* budgets;
+    bands.out = out;
+    bands.in = in;
+    bands.linebytes = linebytes;
+    bands.bytewidth = bytewidth;
+    bands.h = h;
+    bands.bandheight = (unsigned)(bandsize / linebytes);
+    bands.strategy = strategy;
+    bands.settings = settings;
+    bands.tasksettings = 0;
+    count = (h + bands.bandheight - 1u) / bands.bandheight;
+    bands.errors = (unsigned*)allocator_malloc(&zlibsettings->allocator, count * sizeof(*bands.errors));
+    if(!bands.errors) return 83; /*alloc fail*/
+    budgets = budget_fork(&zlibsettings->allocator, count, &error);
+    if(budgets) {
+      bands.tasksettings = (LodePNGEncoderSettings*)allocator_malloc(&zlibsettings->allocator,
+                                                                     count * sizeof(*bands.tasksettings));
+      if(!bands.tasksettings) error = 83; /*alloc fail*/
+      for(i = 0; i != count && !error; ++i) {
+        bands.tasksettings[i] = *settings;
+        bands.tasksettings[i].zlibsettings.allocator = budget_allocator(&budgets[i]);
+      }
+    }
+    if(!error) zlibsettings->parallel_for(filterBandTask, &bands, count, zlibsettings->parallel_context);
+    if(budgets) {
+      unsigned joinerror = budget_join(&zlibsettings->allocator, budgets, count);
+      if(!error) error = joinerror;
+    }
+    for(i = 0; i != count && !error; ++i) error = bands.errors[i];
+    allocator_free(&zlibsettings->allocator, bands.tasksettings);
+    allocator_free(&zlibsettings->allocator, bands.errors);
+    return error;
+  }
+
+  return filterRows(out, in, linebytes, bytewidth, 0, h, strategy, settings);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h) {
   /*The opposite of the removePaddingBits function
@@ -6382,23 +9956,24 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   *) if adam7: 1) Adam7_interlace 2) 7x add padding bits 3) 7x filter
   */
   size_t bpp = lodepng_get_bpp(&info_png->color);
+  const LodePNGAllocator* allocator = &settings->zlibsettings.allocator;
   unsigned error = 0;
   if(info_png->interlace_method == 0) {
     /*image size plus an extra byte per scanline + possible padding bits*/
     *outsize = (size_t)h + ((size_t)h * (((size_t)w * bpp + 7u) / 8u));
-    *out = (unsigned char*)lodepng_malloc(*outsize);
+    *out = (unsigned char*)allocator_malloc(allocator, *outsize);
     if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
 
     if(!error) {
       /*non multiple of 8 bits per scanline, padding bits needed per scanline*/
       if(bpp < 8 && (size_t)w * bpp != (((size_t)w * bpp + 7u) / 8u) * 8u) {
-        unsigned char* padded = (unsigned char*)lodepng_malloc(h * ((w * bpp + 7u) / 8u));
+        unsigned char* padded = (unsigned char*)allocator_malloc(allocator, h * ((w * bpp + 7u) / 8u));
         if(!padded) error = 83; /*alloc fail*/
         if(!error) {
           addPaddingBits(padded, in, (((size_t)w * bpp + 7u) / 8u) * 8u, (size_t)w * bpp, h);
           error = filter(*out, padded, w, h, &info_png->color, settings);
         }
-        lodepng_free(padded);
+        allocator_free(allocator, padded);
       } else {
         /*we can immediately filter into the out buffer, no other steps needed*/
         error = filter(*out, in, w, h, &info_png->color, settings);
@@ -6412,10 +9987,10 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
     Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, (unsigned)bpp);
 
     *outsize = filter_passstart[7]; /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
+    *out = (unsigned char*)allocator_malloc(allocator, *outsize);
     if(!(*out)) error = 83; /*alloc fail*/
 
-    adam7 = (unsigned char*)lodepng_malloc(passstart[7]);
+    adam7 = (unsigned char*)allocator_malloc(allocator, passstart[7]);
     if(!adam7 && passstart[7]) error = 83; /*alloc fail*/
 
     if(!error) {
@@ -6424,13 +9999,14 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
       Adam7_interlace(adam7, in, w, h, (unsigned)bpp);
       for(i = 0; i != 7; ++i) {
         if(bpp < 8) {
-          unsigned char* padded = (unsigned char*)lodepng_malloc(padded_passstart[i + 1] - padded_passstart[i]);
+          size_t paddedsize = padded_passstart[i + 1] - padded_passstart[i];
+          unsigned char* padded = (unsigned char*)allocator_malloc(allocator, paddedsize);
           if(!padded) ERROR_BREAK(83); /*alloc fail*/
           addPaddingBits(padded, &adam7[passstart[i]],
                          (((size_t)passw[i] * bpp + 7u) / 8u) * 8u, (size_t)passw[i] * bpp, passh[i]);
           error = filter(&(*out)[filter_passstart[i]], padded,
                          passw[i], passh[i], &info_png->color, settings);
-          lodepng_free(padded);
+          allocator_free(allocator, padded);
         } else {
           error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
                          passw[i], passh[i], &info_png->color, settings);
@@ -6440,7 +10016,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
       }
     }
 
-    lodepng_free(adam7);
+    allocator_free(allocator, adam7);
   }
 
   return error;
@@ -6450,8 +10026,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
 static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t datasize) {
   unsigned char* inchunk = data;
   while((size_t)(inchunk - data) < datasize) {
-    CERROR_TRY_RETURN(lodepng_chunk_append(&out->data, &out->size, inchunk));
-    out->allocsize = out->size; /*fix the allocsize again*/
+    CERROR_TRY_RETURN(lodepng_chunk_appendv(out, inchunk));
     inchunk = lodepng_chunk_next(inchunk, data + datasize);
   }
   return 0;
@@ -6478,12 +10053,14 @@ static unsigned isRGBICCProfile(const unsigned char* profile, unsigned size) {
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state) {
+/*lodepng_encode, compressing the image data with the tables of hash if it's not 0*/
+static unsigned encodeImage(unsigned char** out, size_t* outsize,
+                            const unsigned char* image, unsigned w, unsigned h,
+                            LodePNGState* state, Hash* hash) {
   unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
   size_t datasize = 0;
-  ucvector outv = ucvector_init(NULL, 0);
+  const LodePNGAllocator* allocator = &state->encoder.zlibsettings.allocator;
+  ucvector outv = ucvector_init_with(NULL, 0, allocator);
   LodePNGInfo info;
   const LodePNGInfo* info_png = &state->info_png;
   LodePNGColorMode auto_color;
@@ -6518,6 +10095,10 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   if(error) goto cleanup; /*error: invalid color type given*/
   error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
   if(error) goto cleanup; /*error: invalid color type given*/
+  if(hasRawLayout(&state->info_raw) || hasRawLayout(&info_png->color)) {
+    error = 128; /*error: channel order or premultiplied alpha is only supported for decoding*/
+    goto cleanup;
+  }
 
   /* color convert and compute scanline filter types */
   CERROR_TRY_RETURN(lodepng_info_copy(&info, &state->info_png));
@@ -6538,7 +10119,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
       stats.allow_greyscale = 0;
     }
 #endif /* LODEPNG_COMPILE_ANCILLARY_CHUNKS */
-    error = lodepng_compute_color_stats(&stats, image, w, h, &state->info_raw);
+    error = computeColorStatsParallel(&stats, image, w, h, &state->info_raw, &state->encoder.zlibsettings);
     if(error) goto cleanup;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     if(info_png->background_defined) {
@@ -6646,15 +10227,18 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     unsigned char* converted;
     size_t size = ((size_t)w * (size_t)h * (size_t)lodepng_get_bpp(&info.color) + 7u) / 8u;
 
-    converted = (unsigned char*)lodepng_malloc(size);
+    converted = (unsigned char*)allocator_malloc(allocator, size);
     if(!converted && size) error = 83; /*alloc fail*/
     if(!error) {
-      error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
+      const LodePNGCompressSettings* zlibsettings = &state->encoder.zlibsettings;
+      error = convertParallel(converted, image, &info.color, &state->info_raw, w, h, zlibsettings->parallel_for,
+                              zlibsettings->parallel_context, zlibsettings->parallel_segment_size,
+                              &zlibsettings->allocator);
     }
     if(!error) {
       error = preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
     }
-    lodepng_free(converted);
+    allocator_free(allocator, converted);
     if(error) goto cleanup;
   } else {
     error = preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
@@ -6747,7 +10331,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings, hash);
     if(error) goto cleanup;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
@@ -6819,7 +10403,7 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
 
 cleanup:
   lodepng_info_cleanup(&info);
-  lodepng_free(data);
+  allocator_free(allocator, data);
   lodepng_color_mode_cleanup(&auto_color);
 
   /*instead of cleaning the vector up, give it to the output*/
@@ -6831,6 +10415,62 @@ cleanup:
   return error;
 }
 
+/*encodeImage, with the allocations of the call counted, see max_memory*/
+static unsigned encodeWithHash(unsigned char** out, size_t* outsize,
+                               const unsigned char* image, unsigned w, unsigned h,
+                               LodePNGState* state, Hash* hash) {
+  LodePNGAllocator allocator = state->encoder.zlibsettings.allocator;
+  MemoryBudget budget;
+  unsigned error;
+  budget_init(&budget, &allocator, state->encoder.max_memory);
+  state->encoder.zlibsettings.allocator = budget_allocator(&budget);
+  error = encodeImage(out, outsize, image, w, h, state, hash);
+  state->encoder.zlibsettings.allocator = allocator;
+  if(error && budget.exceeded) state->error = error = 127;
+  state->peak_memory = budget.peak;
+  budget_cleanup(&budget);
+  return error;
+}
+
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state) {
+  return encodeWithHash(out, outsize, image, w, h, state, 0);
+}
+
+void lodepng_encoder_context_init(LodePNGEncoderContext* context, LodePNGState* state) {
+  context->state = state;
+  context->internal = 0;
+}
+
+void lodepng_encoder_context_cleanup(LodePNGEncoderContext* context) {
+  hash_destroy((Hash*)context->internal);
+  context->internal = 0;
+}
+
+unsigned lodepng_encode_context(unsigned char** out, size_t* outsize, const unsigned char* image,
+                                unsigned w, unsigned h, LodePNGEncoderContext* context) {
+  /*if this fails, the image is encoded with temporary tables, which will likely fail with error 83 too*/
+  if(!context->internal) context->internal = hash_create(0);
+  return encodeWithHash(out, outsize, image, w, h, context->state, (Hash*)context->internal);
+}
+
+unsigned lodepng_encode_batch(unsigned char** out, size_t* outsize, unsigned* errors,
+                              const unsigned char* const* images, const unsigned* w, const unsigned* h,
+                              size_t count, LodePNGState* state) {
+  unsigned first_error = 0;
+  size_t i;
+  LodePNGEncoderContext context;
+  lodepng_encoder_context_init(&context, state);
+  for(i = 0; i != count; ++i) {
+    unsigned error = lodepng_encode_context(&out[i], &outsize[i], images[i], w[i], h[i], &context);
+    if(errors) errors[i] = error;
+    if(!first_error) first_error = error;
+  }
+  lodepng_encoder_context_cleanup(&context);
+  return first_error;
+}
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth) {
   unsigned error;
@@ -6880,6 +10520,7 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings) {
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->max_memory = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -6976,7 +10617,7 @@ const char* lodepng_error_text(unsigned code) {
     case 76: return "iTXt chunk too short to contain required bytes";
     case 77: return "integer overflow in buffer size";
     case 78: return "failed to open file for reading"; /*file doesn't exist or couldn't be opened for reading*/
-    case 79: return "failed to open file for writing";
+    case 79: return "failed to open file for writing"; /*or writing to it failed, e.g. because the disk is full*/
     case 80: return "tried creating a tree of 0 symbols";
     case 81: return "lazy matching at pos 0 is impossible";
     case 82: return "color conversion to palette requested while a color isn't in palette, or index out of bounds";
@@ -7026,6 +10667,13 @@ const char* lodepng_error_text(unsigned code) {
     case 121: return "invalid chunk type name: may only contain [a-zA-Z]";
     case 122: return "invalid chunk type name: third character must be uppercase";
     case 123: return "invalid ICC profile size";
+    case 124: return "output buffer given to lodepng_decode_into is too small or its stride is smaller than a row";
+    case 125: return "region to decode is empty or not inside the image";
+    case 126: return "downscaled decoding only supports 1/2, 1/4 and 1/8, to a color mode without palette";
+    /*the allocations of the call would exceed max_memory of the decoder or encoder settings*/
+    case 127: return "memory budget exceeded";
+    /*see the order and premultiplied fields of LodePNGColorMode*/
+    case 128: return "channel order or premultiplied alpha not supported for this color type, or not for input";
   }
   return "unknown error code";
 }
@@ -7075,7 +10723,7 @@ unsigned decompress(std::vector<unsigned char>& out, const unsigned char* in, si
   unsigned error = zlib_decompress(&buffer, &buffersize, 0, in, insize, &settings);
   if(buffer) {
     out.insert(out.end(), buffer, &buffer[buffersize]);
-    lodepng_free(buffer);
+    allocator_free(&settings.allocator, buffer);
   }
   return error;
 }
@@ -7091,10 +10739,10 @@ unsigned compress(std::vector<unsigned char>& out, const unsigned char* in, size
                   const LodePNGCompressSettings& settings) {
   unsigned char* buffer = 0;
   size_t buffersize = 0;
-  unsigned error = zlib_compress(&buffer, &buffersize, in, insize, &settings);
+  unsigned error = zlib_compress(&buffer, &buffersize, in, insize, &settings, 0);
   if(buffer) {
     out.insert(out.end(), buffer, &buffer[buffersize]);
-    lodepng_free(buffer);
+    allocator_free(&settings.allocator, buffer);
   }
   return error;
 }
@@ -7158,7 +10806,7 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
     size_t buffersize = lodepng_get_raw_size(w, h, &state.info_raw);
     out.insert(out.end(), buffer, &buffer[buffersize]);
   }
-  lodepng_free(buffer);
+  allocator_free(&state.decoder.zlibsettings.allocator, buffer);
   return error;
 }
 
@@ -7171,12 +10819,14 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
 #ifdef LODEPNG_COMPILE_DISK
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h, const std::string& filename,
                 LodePNGColorType colortype, unsigned bitdepth) {
-  std::vector<unsigned char> buffer;
+  const unsigned char* buffer = 0;
+  size_t buffersize = 0;
   /* safe output values in case error happens */
   w = h = 0;
-  unsigned error = load_file(buffer, filename);
-  if(error) return error;
-  return decode(out, w, h, buffer, colortype, bitdepth);
+  unsigned error = lodepng_map_file(&buffer, &buffersize, filename.c_str());
+  if(!error) error = decode(out, w, h, buffer, buffersize, colortype, bitdepth);
+  lodepng_unmap_file(buffer, buffersize);
+  return error;
 }
 #endif /* LODEPNG_COMPILE_DECODER */
 #endif /* LODEPNG_COMPILE_DISK */
@@ -7209,7 +10859,7 @@ unsigned encode(std::vector<unsigned char>& out,
   unsigned error = lodepng_encode(&buffer, &buffersize, in, w, h, &state);
   if(buffer) {
     out.insert(out.end(), buffer, &buffer[buffersize]);
-    lodepng_free(buffer);
+    allocator_free(&state.encoder.zlibsettings.allocator, buffer);
   }
   return error;
 }
@@ -102,6 +102,20 @@ or comment out LODEPNG_COMPILE_CRC below*/
 #define LODEPNG_COMPILE_CRC
 #endif
 
+/*SSE2 versions of the PNG unfilter functions, used when the compiler targets SSE2 (always the case for
+x86-64). They give the exact same results as the portable C code, which is used otherwise.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+/*pass -DLODEPNG_NO_COMPILE_SIMD to the compiler to disable this, or comment out LODEPNG_COMPILE_SIMD below*/
+#define LODEPNG_COMPILE_SIMD
+#endif
+
+/*Memory mapping of files with mmap in lodepng_map_file, on unix-like systems, if LODEPNG_COMPILE_DISK is
+enabled. Without it, or on other systems, lodepng_map_file reads the file into memory like lodepng_load_file.*/
+#ifndef LODEPNG_NO_COMPILE_MMAP
+/*pass -DLODEPNG_NO_COMPILE_MMAP to the compiler to disable this, or comment out LODEPNG_COMPILE_MMAP below*/
+#define LODEPNG_COMPILE_MMAP
+#endif
+
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -132,6 +146,13 @@ typedef enum LodePNGColorType {
   LCT_MAX_OCTET_VALUE = 255
 } LodePNGColorType;
 
+/*The order of the channels of a raw RGB or RGBA image (not used in the PNG itself), see LodePNGColorMode.*/
+typedef enum LodePNGChannelOrder {
+  LCO_RGBA = 0, /*R, G, B, A: the order of PNG, and R, G, B for RGB*/
+  LCO_BGRA = 1, /*B, G, R, A, and B, G, R for RGB*/
+  LCO_ARGB = 2 /*A, R, G, B, and R, G, B for RGB, which has no alpha*/
+} LodePNGChannelOrder;
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*
 Converts PNG data in memory to raw pixel data.
@@ -308,6 +329,36 @@ unsigned encode(const std::string& filename,
 const char* lodepng_error_text(unsigned code);
 #endif /*LODEPNG_COMPILE_ERROR_TEXT*/
 
+/*Allocator callbacks for the memory of one call, with a context pointer, see the allocator field of
+LodePNGDecompressSettings and LodePNGCompressSettings. Either all three functions are set, or none.
+realloc_func with a null pointer must allocate, free_func with a null pointer must do nothing. With
+parallel_for, they are called from its threads at the same time, and must be thread safe then.*/
+typedef struct LodePNGAllocator {
+  void* (*malloc_func)(size_t size, void* context);
+  void* (*realloc_func)(void* ptr, size_t new_size, void* context);
+  void (*free_func)(void* ptr, void* context);
+  void* context; /*the context parameter given to the functions*/
+} LodePNGAllocator;
+
+/*A bump allocator in a buffer of the user. Allocations are taken from the buffer one after
+the other, and fail when it is full. Freeing or resizing the last allocation gives its memory
+back, freeing any other allocation does nothing until the arena is reset, which releases all
+of its allocations at once. An arena must only be used by one thread at a time, so not together
+with parallel_for.*/
+typedef struct LodePNGArena {
+  unsigned char* buffer;
+  size_t size; /*usable size of buffer*/
+  size_t used; /*bytes of buffer in use, including the bookkeeping of the allocations*/
+  size_t last; /*private: position of the last allocation*/
+} LodePNGArena;
+
+/*makes an arena of the size bytes at buffer, which must stay valid while the arena is used*/
+void lodepng_arena_init(LodePNGArena* arena, void* buffer, size_t size);
+/*releases all allocations of the arena at once*/
+void lodepng_arena_reset(LodePNGArena* arena);
+/*sets the functions and context of allocator to allocate from the arena*/
+void lodepng_arena_allocator(LodePNGAllocator* allocator, LodePNGArena* arena);
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Settings for zlib decompression*/
 typedef struct LodePNGDecompressSettings LodePNGDecompressSettings;
@@ -336,6 +387,22 @@ struct LodePNGDecompressSettings {
                              const LodePNGDecompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*Use multiple threads for large images (default: null, single threaded), see parallel_for in
+  LodePNGCompressSettings. The PNG decoder uses it for the color conversion and for the CRC of large
+  chunks, in segments of parallel_segment_size bytes. The result is the same as without it.*/
+  void (*parallel_for)(void (*task)(void* data, size_t i), void* data, size_t count, void* context);
+  void* parallel_context; /*the context parameter given to parallel_for*/
+  size_t parallel_segment_size; /*size in bytes of the segments of the work. Default: 1048576*/
+
+  /*Allocator for the output and all the working memory of one call, including the Huffman tables
+  (default: all null, use lodepng_malloc, lodepng_realloc and lodepng_free). Free the output of
+  lodepng_zlib_decompress, lodepng_inflate and the PNG decoder with allocator.free_func then. Only
+  these are always allocated with lodepng_malloc: the buffers that a LodePNGDecoderContext or a
+  LodePNGStreamDecoder keeps from one call to the next, and the palette and chunk data (text, iCCP,
+  eXIf, unknown chunks) stored in LodePNGInfo. A custom_zlib or custom_inflate must allocate its output
+  with this allocator if it is set.*/
+  LodePNGAllocator allocator;
 };
 
 extern const LodePNGDecompressSettings lodepng_default_decompress_settings;
@@ -369,6 +436,27 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
                              const LodePNGCompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*Use multiple threads for large inputs (default: null, single threaded). LodePNG does not create
+  threads itself, instead it gives independent tasks to parallel_for, which must call task(data, i)
+  once for every i from 0 to count - 1, in any order and on any threads, and return when all calls are
+  done. This way the thread pool of the application can be used. With this set, the input is split into
+  segments of parallel_segment_size bytes which are deflated at the same time. Each segment uses the end of
+  the previous one as dictionary, so this costs very little compression, but the result differs from
+  single threaded compression. The PNG encoder also uses it to filter bands of scanlines of about this
+  size at the same time, and for the color conversion, the color statistics of auto_convert and the CRC
+  of the IDAT chunks, which all give the same result as single threaded.*/
+  void (*parallel_for)(void (*task)(void* data, size_t i), void* data, size_t count, void* context);
+  void* parallel_context; /*the context parameter given to parallel_for*/
+  size_t parallel_segment_size; /*size in bytes of the segments of the input. Default: 1048576*/
+
+  /*Allocator for the output and the working memory of one call, like the one in LodePNGDecompressSettings.
+  Free the output of lodepng_zlib_compress, lodepng_deflate and the PNG encoder with allocator.free_func
+  then. Only these use lodepng_malloc: the hash tables that a LodePNGEncoderContext keeps between images,
+  and the copy of info_png that the encoder works on, when it has a palette or chunk data (text, iCCP,
+  eXIf, unknown chunks). A custom_zlib or custom_deflate must allocate its output with this allocator
+  if it is set.*/
+  LodePNGAllocator allocator;
 };
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
@@ -421,6 +509,20 @@ typedef struct LodePNGColorMode {
   unsigned key_r;       /*red/grayscale component of color key*/
   unsigned key_g;       /*green component of color key*/
   unsigned key_b;       /*blue component of color key*/
+
+  /*
+  layout of the raw image
+
+  Only for the raw image that the decoder outputs (info_raw) and the output of lodepng_convert: the
+  decoder converts to this layout directly, in the same pass as the rest of the color conversion.
+  The encoder and the input of lodepng_convert don't support it, and give error 128 if it is set.
+
+  The channel order is supported for color types 2 and 6. Premultiplied alpha is supported for color
+  types 4 and 6: the color channels are multiplied by alpha, rounded, so that fully transparent pixels
+  become all zero. Both are supported for 8-bit and 16-bit, and with any other color type give error 128.
+  */
+  LodePNGChannelOrder order; /*order of the channels, LCO_RGBA by default*/
+  unsigned premultiplied; /*are the color channels premultiplied with alpha? 0 = false (default), 1 = true*/
 } LodePNGColorMode;
 
 /*init, cleanup and copy functions to use with this struct*/
@@ -827,6 +929,12 @@ typedef struct LodePNGDecoderSettings {
 
   unsigned color_convert; /*whether to convert the PNG to the color type you want. Default: yes*/
 
+  /*Maximum bytes that may be allocated at the same time during one decode, including the output. The decoder
+  returns error 127 rather than go beyond it. Everything allocated with zlibsettings.allocator counts, which
+  does not include what decoder contexts, the stream decoder and LodePNGInfo keep. Set to 0 to impose no
+  limit (the default). See also peak_memory in LodePNGState.*/
+  size_t max_memory;
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned read_text_chunks; /*if false but remember_unknown_chunks is true, they're stored in the unknown chunks*/
 
@@ -932,6 +1040,14 @@ typedef struct LodePNGEncoderSettings {
   NOTE: enabling this may worsen compression if auto_convert is used to choose
   optimal color mode, because it cannot use grayscale color modes in this case*/
   unsigned force_palette;
+
+  /*Maximum bytes that may be allocated at the same time during one encode, including the output, like
+  max_memory of LodePNGDecoderSettings. Memory of encoder contexts and of the copy of info_png is not counted.
+  With parallel_for, all tasks count against this one limit, except with compilers that lack atomic
+  operations (other than GCC, Clang and Visual Studio): there each task may use an equal share of what is
+  left when the tasks start, so the encode can fail when the tasks use the memory unevenly. Set to 0 to
+  impose no limit (the default).*/
+  size_t max_memory;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   /*add LodePNG identifier and version as a text chunk, for debugging*/
   unsigned add_id;
@@ -965,6 +1081,10 @@ typedef struct LodePNGState {
 #endif /*LODEPNG_COMPILE_ENCODER*/
   LodePNGColorMode info_raw; /*specifies the format in which you would like to get the raw pixel buffer*/
   LodePNGInfo info_png; /*info of the PNG image obtained after decoding*/
+  /*the most bytes that were allocated at the same time during the last decode or encode, as counted for
+  max_memory, including the output. With parallel_for on compilers that lack atomic operations, the peaks of
+  the tasks are added up, as if they were at the same time, so this is an upper bound.*/
+  size_t peak_memory;
   unsigned error; /*deprecated, use the return value of the encode/decode functions to check errors instead*/
 } LodePNGState;
 
@@ -985,6 +1105,67 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize);
 
+/*
+Same as lodepng_decode, but decodes into the buffer out of the user, of outsize bytes, instead of
+allocating the output. Row y of the image starts at out + y * stride. The stride must be at least
+lodepng_get_raw_size(w, 1, &state->info_raw) (or of info_png.color if color_convert is disabled),
+so rows with less than 8 bits per pixel always start at a byte boundary, unlike with lodepng_decode.
+Bytes between rows are left untouched. Use lodepng_inspect first to get the size of the image.
+Returns error 124 if the image doesn't fit in the buffer.
+*/
+unsigned lodepng_decode_into(unsigned char* out, size_t stride, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize);
+
+/*
+Same as lodepng_decode, but outputs only the region of w * h pixels with its top left corner at x0, y0,
+which must be inside the image. For non-interlaced images, decompression stops after the last row of
+the region, and only its columns are converted, so this is faster than decoding the whole image. The
+adler32 checksum of the image data is then not checked. Interlaced images are decoded entirely and cropped.
+Returns error 125 if the region is empty or not inside the image.
+*/
+unsigned lodepng_decode_region(unsigned char** out, unsigned x0, unsigned y0, unsigned w, unsigned h,
+                               LodePNGState* state, const unsigned char* in, size_t insize);
+
+/*
+Same as lodepng_decode, but outputs the image downscaled by 2^shift in width and height, shift being 1, 2 or 3
+for 1/2, 1/4 or 1/8, e.g. for thumbnails. w and h get the downscaled size, rounded up. Each output pixel is
+the average of its block of pixels (blocks at the right and bottom edges can be smaller), computed row by row
+without a full size image. For Adam7 interlaced images, each output pixel is the top left pixel of its block
+instead, which is in the first 1, 3 or 5 passes, so the data of the other passes isn't decompressed.
+The output color mode can't be palette. Returns error 126 if shift or the color mode is not supported.
+*/
+unsigned lodepng_decode_scaled(unsigned char** out, unsigned* w, unsigned* h, unsigned shift,
+                               LodePNGState* state, const unsigned char* in, size_t insize);
+
+/*
+Decoder that keeps its internal buffers (huffman tables, decompressed data and scanline buffers) from one
+image to the next, so that decoding many small images, e.g. tiles or icons, doesn't allocate them again for
+every image. The buffers only grow, to the size needed by the largest image so far. A context can be used
+by only one thread at a time. See "Decoding many images" in the documentation below.
+*/
+typedef struct LodePNGDecoderContext {
+  LodePNGState* state; /*settings and output info, same meaning as for lodepng_decode. Not owned.*/
+  void* internal; /*private, do not use*/
+} LodePNGDecoderContext;
+
+/*state must stay valid until cleanup. The buffers are allocated by the first decode.*/
+void lodepng_decoder_context_init(LodePNGDecoderContext* context, LodePNGState* state);
+void lodepng_decoder_context_cleanup(LodePNGDecoderContext* context);
+/*Same as lodepng_decode with context->state, but with the buffers of the context.*/
+unsigned lodepng_decode_context(unsigned char** out, unsigned* w, unsigned* h, LodePNGDecoderContext* context,
+                                const unsigned char* in, size_t insize);
+
+/*
+Decodes count PNG images, in[i] of insize[i] bytes, with lodepng_decode_context and a temporary context,
+so the buffers are shared by all images. out[i], w[i] and h[i] get the result of image i, and errors[i] its
+error code, unless errors is 0. A failed image doesn't stop the others, its out[i] is 0. The info_png of
+state is that of the last image afterwards. Returns the error code of the first image that failed, 0 if
+all succeeded.
+*/
+unsigned lodepng_decode_batch(unsigned char** out, unsigned* w, unsigned* h, unsigned* errors,
+                              const unsigned char* const* in, const size_t* insize, size_t count,
+                              LodePNGState* state);
+
 /*
 Read the PNG header, but not the actual data. This returns only the information
 that is in the IHDR chunk of the PNG, such as width, height and color type. The
@@ -993,6 +1174,35 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Decoder that gets the PNG file in pieces of any size and outputs the image row by row,
+e.g. while the file is still being downloaded, without the whole file or image in memory
+(except for Adam7 interlaced images, whose rows are only complete at the end of the file).
+See "4. Decoding" in the documentation below.
+*/
+typedef struct LodePNGStreamDecoder {
+  LodePNGState* state; /*settings and output info, same meaning as for lodepng_decode. Not owned.*/
+  /*called with each decoded row in the color mode of state->info_raw, y going from 0 to h - 1*/
+  void (*row_callback)(void* context, unsigned y, const unsigned char* row);
+  void* context; /*passed to row_callback and pass_callback, can be used for any purpose*/
+  /*optional, for Adam7 interlaced images: called when the data of each of the 7 passes is decompressed, pass
+  going from 0 to 6 (empty passes of tiny images are skipped), with a preview of the whole image: w * h pixels
+  in the color mode of state->info_raw, in the layout of lodepng_decode. Pixels that later passes provide have
+  the color of a pixel of an earlier pass at their top left. After pass 6 it's the final image.*/
+  void (*pass_callback)(void* context, unsigned pass, const unsigned char* image);
+  unsigned w, h; /*width and height of the image, 0 until the header of the PNG was fed*/
+  void* internal; /*private, do not use*/
+} LodePNGStreamDecoder;
+
+/*state must stay valid until cleanup. Set row_callback and context after init.*/
+void lodepng_stream_decoder_init(LodePNGStreamDecoder* decoder, LodePNGState* state);
+void lodepng_stream_decoder_cleanup(LodePNGStreamDecoder* decoder);
+/*Feeds the next insize bytes of the PNG file. Returns error code. Once an error
+happened, all further calls return the same error.*/
+unsigned lodepng_stream_decoder_feed(LodePNGStreamDecoder* decoder, const unsigned char* in, size_t insize);
+/*Call after all bytes were fed, returns error code if the PNG file was incomplete or invalid.*/
+unsigned lodepng_stream_decoder_finish(LodePNGStreamDecoder* decoder);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
@@ -1015,6 +1225,34 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+Encoder that keeps the hash tables of its LZ77 compression (more than 256KB) from one image to the next,
+rather than allocating and filling them for every image, which for small images takes longer than the
+compression itself. Only the parts that an image used are reset for the next one. A context can be used
+by only one thread at a time. See "Encoding many images" in the documentation below.
+*/
+typedef struct LodePNGEncoderContext {
+  LodePNGState* state; /*settings and output info, same meaning as for lodepng_encode. Not owned.*/
+  void* internal; /*private, do not use*/
+} LodePNGEncoderContext;
+
+/*state must stay valid until cleanup. The tables are allocated by the first encode.*/
+void lodepng_encoder_context_init(LodePNGEncoderContext* context, LodePNGState* state);
+void lodepng_encoder_context_cleanup(LodePNGEncoderContext* context);
+/*Same as lodepng_encode with context->state, but with the tables of the context.*/
+unsigned lodepng_encode_context(unsigned char** out, size_t* outsize, const unsigned char* image,
+                                unsigned w, unsigned h, LodePNGEncoderContext* context);
+
+/*
+Encodes count images, images[i] of w[i] * h[i] pixels, with lodepng_encode_context and a temporary context,
+so the tables are shared by all images. out[i] and outsize[i] get the PNG of image i, and errors[i] its
+error code, unless errors is 0. A failed image doesn't stop the others. Returns the error code of the first
+image that failed, 0 if all succeeded.
+*/
+unsigned lodepng_encode_batch(unsigned char** out, size_t* outsize, unsigned* errors,
+                              const unsigned char* const* images, const unsigned* w, const unsigned* h,
+                              size_t count, LodePNGState* state);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -1190,6 +1428,26 @@ NOTE: Wide-character filenames are not supported, you can use an external method
 to handle such files and encode in-memory
 */
 unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const char* filename);
+
+/*
+Map a file from disk read-only into memory, with mmap if LODEPNG_COMPILE_MMAP is enabled on a system
+that has it. The contents are then not copied into allocated memory, so decoding a large PNG file does
+not need memory for the file besides the page cache, which processes mapping the same file share.
+Otherwise, this loads the file like lodepng_load_file. The file must not be truncated while mapped.
+out: output parameter, pointer to the contents of the file, 0 if the file is empty
+outsize: output parameter, size of the file
+filename: the path to the file to map
+return value: error code (0 means ok)
+
+After usage, release out with lodepng_unmap_file, not with free.
+
+NOTE: Wide-character filenames are not supported, you can use an external method
+to handle such files and decode in-memory.
+*/
+unsigned lodepng_map_file(const unsigned char** out, size_t* outsize, const char* filename);
+
+/*releases a file mapped with lodepng_map_file, buffersize must be the size it gave*/
+void lodepng_unmap_file(const unsigned char* buffer, size_t buffersize);
 #endif /*LODEPNG_COMPILE_DISK*/
 
 #ifdef LODEPNG_COMPILE_CPP
@@ -1280,7 +1538,7 @@ TODO:
 [ ] support all second edition public PNG chunk types (almost done except sPLT and hIST)
 [X] support non-animation third edition public PNG chunk types: eXIf, cICP, mDCV, cLLI
 [ ] make sure encoder generates no chunks with size > (2^31)-1
-[ ] partial decoding (stream processing)
+[X] partial decoding (stream processing)
 [X] let the "isFullyOpaque" function check color keys and transparent palettes too
 [X] better name for the variables "codes", "codesD", "codelengthcodes", "clcl" and "lldl"
 [ ] allow treating some errors like warnings, when image is recoverable (e.g. 69, 57, 58)
@@ -1424,6 +1682,21 @@ The C version uses buffers allocated with alloc that you need to free()
 yourself. You need to use init and cleanup functions for each struct whenever
 using a struct from the C version to avoid exploits and memory leaks.
 
+Instead of replacing lodepng_malloc, lodepng_realloc and lodepng_free for the
+whole program, the allocator of the zlib settings of the decoder or encoder can
+be set, which is used for the output and the temporary buffers of each call,
+with a context pointer. A LodePNGArena gives the memory of one request from a
+buffer, and releases it all at once:
+
+LodePNGArena arena;
+lodepng_arena_init(&arena, buffer, buffersize);
+lodepng_arena_allocator(&state.decoder.zlibsettings.allocator, &arena);
+error = lodepng_decode(&image, &w, &h, &state, png, pngsize);
+use image, then: lodepng_arena_reset(&arena);
+
+The palette and chunk data of LodePNGInfo, and the buffers that contexts keep
+between calls, still use lodepng_malloc, see the allocator field for details.
+
 The C++ version has extra functions with std::vectors in the interface and the
 lodepng::State class which is a LodePNGState with constructor and destructor.
 
@@ -1504,6 +1777,65 @@ is done, the resulting data will be as it was in the PNG (after decompression)
 and you'll have to puzzle the colors of the pixels together yourself using the
 color type information in the LodePNGInfo.
 
+Decoding into your own buffer
+-----------------------------
+
+lodepng_decode_into writes the image into a buffer you provide, e.g. pooled memory
+or a mapped region, instead of allocating it, with any distance (stride) between
+the starts of rows, which lets you align them:
+
+lodepng_inspect(&w, &h, &state, in, insize);
+stride = lodepng_get_raw_size(w, 1, &state.info_raw) rounded up as you like;
+error = lodepng_decode_into(buffer, stride, buffersize, &w, &h, &state, in, insize);
+
+For non-interlaced images, each row is written to the buffer as soon as it is
+decompressed, without any other buffer for the whole image.
+
+Decoding many images
+--------------------
+
+Decoding a small image takes a few allocations for the huffman tables and the
+scanline buffers, which can cost as much as the decoding itself when there are
+thousands of icons or tiles. A LodePNGDecoderContext keeps those buffers from one
+image to the next:
+
+LodePNGDecoderContext context;
+lodepng_decoder_context_init(&context, &state);
+for each image: error = lodepng_decode_context(&image, &w, &h, &context, in, insize);
+lodepng_decoder_context_cleanup(&context);
+
+lodepng_decode_batch does this for an array of images. The output images are
+still allocated per image. Use one context per thread.
+
+Stream decoding
+---------------
+
+If the PNG file arrives in pieces, e.g. from the network, LodePNGStreamDecoder can
+decode it while it arrives instead of waiting for the whole file:
+
+LodePNGStreamDecoder decoder;
+lodepng_stream_decoder_init(&decoder, &state);
+decoder.row_callback = my_row_callback;
+decoder.context = my_data;
+for each piece: error = lodepng_stream_decoder_feed(&decoder, piece, piece_size);
+error = lodepng_stream_decoder_finish(&decoder);
+lodepng_stream_decoder_cleanup(&decoder);
+
+The state is used the same way as by lodepng_decode. The row callback gets each row of
+the image, from top to bottom, in the color mode of info_raw. If that has less than 8
+bits per pixel, each row starts at a byte boundary, unlike the image of lodepng_decode.
+The row pointer is only valid during the callback. decoder.w and decoder.h are set once
+the header is fed, and the chunks before the first IDAT chunk are in info_png when the
+first row is given.
+
+Memory use does not depend on the image height: it's a few scanlines plus the 32KB
+window of the decompressor. Adam7 interlaced images are an exception, their rows are
+only complete at the end, so those are stored entirely and given at the end. For
+those, a pass_callback can be set to get a preview of the whole image after each of
+the 7 passes, with 1/64, 1/32, 1/16, 1/8, 1/4, 1/2 and finally all of the pixels, to
+show a progressively sharper image while the file arrives. With a
+custom_zlib or custom_inflate, all compressed data is stored as well.
+
 
 5. Encoding
 -----------
@@ -1577,6 +1909,23 @@ can encode the colors of all pixels without information loss.
   large texts but a larger result on small texts (such as a single program name).
   It's all tEXt or all zTXt though, there's no separate setting per text yet.
 
+Encoding many images
+--------------------
+
+The LZ77 compression uses hash tables of more than 256KB, which lodepng_encode
+allocates and fills for every image. For thousands of small images, such as
+icons or tiles, that costs more than compressing them. A LodePNGEncoderContext
+keeps the tables from one image to the next:
+
+LodePNGEncoderContext context;
+lodepng_encoder_context_init(&context, &state);
+for each image: error = lodepng_encode_context(&png, &pngsize, image, w, h, &context);
+lodepng_encoder_context_cleanup(&context);
+
+lodepng_encode_batch does this for an array of images. The output is the same as
+that of lodepng_encode. Use one context per thread. The brute force filter
+strategy shares one set of tables for all of its attempts in the same way.
+
 
 6. color conversions
 --------------------
@@ -1687,6 +2036,9 @@ Supported color conversions:
 -anything to a palette, as long as the palette has the requested colors in it
 -removing alpha channel
 -higher to smaller bitdepth, and vice versa
+-anything to RGB or RGBA in BGRA or ARGB channel order, or to RGBA or gray+alpha
+ with premultiplied alpha, with the order and premultiplied fields of the output
+ LodePNGColorMode. This is only for output, e.g. the info_raw of the decoder.
 
 If you want no color conversion to be done (e.g. for speed or control):
 -In the encoder, you can make it save a PNG with any color type by giving the
@@ -1979,6 +2331,7 @@ state.decoder.read_text_chunks: whether to read in text metadata chunks
 state.decoder.remember_unknown_chunks: whether to read in unknown chunks
 state.info_raw.colortype: desired color type for decoded image
 state.info_raw.bitdepth: desired bit depth for decoded image
+state.info_raw.order, premultiplied: desired channel order and premultiplied alpha for decoded image
 state.info_raw....: more color settings, see struct LodePNGColorMode
 state.info_png....: no settings for decoder but ouput, see struct LodePNGInfo
 
@@ -2018,6 +2371,39 @@ symbol.
 Not all changes are listed here, the commit history in github lists more:
 https://github.com/lvandeve/lodepng
 
+*) 16 oct 2026: added order and premultiplied to LodePNGColorMode, to decode to BGRA or ARGB and to
+   premultiplied alpha in the same pass as the color conversion.
+*) 16 oct 2026: with C++, the remaining lodepng_convert cases use a kernel instantiated from templates for each
+   pair of color types and bit depths.
+*) 16 oct 2026: faster lodepng_convert between 8-bit and 16-bit of the same color type, to grey and grey alpha,
+   and from palettes with less than 8 bits.
+*) 16 oct 2026: faster lodepng_compute_color_stats for 8-bit RGB and RGBA: a sample of the pixels finds out early
+   that there are too many colors for a palette, and grey and opaque pixels are then skipped in bulk.
+*) 16 oct 2026: faster color counting of auto_convert and conversion to palette, with a fixed-size hash table of
+   the colors instead of a tree with an allocation per node.
+*) 16 oct 2026: added lodepng_map_file, which lodepng_decode_file now uses to decode from a memory mapped file.
+   lodepng_save_file now returns error 79 if writing the file fails.
+*) 16 oct 2026: added max_memory to the decoder and encoder settings, a limit on the bytes allocated at the
+   same time during a call, and peak_memory to LodePNGState.
+*) 16 oct 2026: added an allocator with a context pointer to LodePNGDecompressSettings and
+   LodePNGCompressSettings, used for the output and the buffers of each call, and LodePNGArena.
+*) 16 oct 2026: added LodePNGEncoderContext and lodepng_encode_batch, which keep the
+   hash tables of the LZ77 encoder between images.
+*) 16 oct 2026: added LodePNGDecoderContext and lodepng_decode_batch, which keep the
+   huffman tables and scanline buffers between images.
+*) 16 oct 2026: added parallel_for to LodePNGCompressSettings, to deflate and filter on multiple threads.
+*) 16 oct 2026: added parallel_for to LodePNGDecompressSettings, and used it for color conversion,
+   color statistics and CRC as well.
+*) 16 oct 2026: added SSE2 versions of the filter and unfilter functions, disabled with
+   LODEPNG_NO_COMPILE_SIMD.
+*) 16 oct 2026: added lodepng_decode_scaled, for thumbnails.
+*) 16 oct 2026: added pass_callback to LodePNGStreamDecoder, for previews of Adam7
+   interlaced images.
+*) 16 oct 2026: added lodepng_decode_region, to decode only part of an image.
+*) 16 oct 2026: added lodepng_decode_into, to decode into a buffer of the user
+   with any row stride.
+*) 16 oct 2026: added LodePNGStreamDecoder, to decode a PNG that arrives in pieces
+   row by row.
 *) 6 may 2025 (!): renamed mDCv to mDCV and cLLi to cLLI as per the recent
    rename in the draft png third edition spec. Please note that as long as the
    third edition is not finalized, backwards-incompatible changes to its
@@ -1073,6 +1073,15 @@ void testColorConvert() {
   colorConvertTest("10110101", LCT_GREY, 8, "1011010110110101", LCT_GREY, 16);
   colorConvertTest("1011010110110101", LCT_GREY, 16, "10110101", LCT_GREY, 8);
 
+  //test the conversions that copy the bytes of the channels
+  colorConvertTest("01010101 00000000 00110011 10101010", LCT_RGBA, 8, "01010101 10101010", LCT_GREY_ALPHA, 8);
+  colorConvertTest("01010101 00000000 00110011 10101010", LCT_RGBA, 8, "01010101", LCT_GREY, 8);
+  colorConvertTest("01010101 00000000 00110011", LCT_RGB, 8, "01010101", LCT_GREY, 8);
+  colorConvertTest("10010101 11111110", LCT_GREY_ALPHA, 8, "10010101", LCT_GREY, 8);
+  colorConvertTest("10010101 00000001 11111110 00000001", LCT_GREY_ALPHA, 16, "10010101 11111110", LCT_GREY_ALPHA, 8);
+  colorConvertTest("01010101 00000000 00110011", LCT_RGB, 8, "01010101 01010101 00000000 00000000 00110011 00110011", LCT_RGB, 16);
+  colorConvertTest("01010101 00000000 00110011 10101010", LCT_RGBA, 8, "01010101 01010101 00000000 00000000 00110011 00110011 10101010 10101010", LCT_RGBA, 16);
+
   //others
   colorConvertTest("11111111 11111111 11111111 00000000 00000000 00000000", LCT_RGB, 8, "10", LCT_GREY, 1);
   colorConvertTest("11111111 11111111 11111111 11111111 11111111 11111111 00000000 00000000 00000000 00000000 00000000 00000000", LCT_RGB, 16, "10", LCT_GREY, 1);
@@ -1194,6 +1203,1096 @@ void testCompressZlib() {
   testCompressStringZlib("lodepng_zlib_decompress(&out2, &outsize2, out, outsize, &lodepng_default_decompress_settings);", true);
 }
 
+// Long inputs, so that most of the decoding goes through the fast path of the inflator, with skewed
+// symbol frequencies for a mix of short and long huffman codes, and matches of all distances.
+void testInflateLong() {
+  std::cout << "testInflateLong" << std::endl;
+  std::vector<unsigned char> in;
+  unsigned s = 1;
+  while(in.size() < 300000) {
+    s = s * 1103515245u + 12345u;
+    unsigned r = (s >> 16) & 1023;
+    if(r < 300) {
+      in.push_back((unsigned char)(r & 3)); // very frequent literals
+    } else if(r < 900 || in.size() < 40000) {
+      in.push_back((unsigned char)(r * 7)); // less frequent literals
+    } else {
+      // a match, possibly overlapping itself
+      size_t length = 3 + ((s >> 4) % (r < 1000 ? 10 : 256));
+      size_t distance = 1 + ((s >> 8) % (r < 950 ? 8 : 32768));
+      for(size_t i = 0; i < length; i++) in.push_back(in[in.size() - distance]);
+    }
+  }
+  for(unsigned btype = 1; btype < 3; btype++) {
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    settings.btype = btype;
+    unsigned char* out = 0;
+    size_t outsize = 0;
+    ASSERT_NO_PNG_ERROR(lodepng_zlib_compress(&out, &outsize, &in[0], in.size(), &settings));
+    std::vector<unsigned char> zlib(out, out + outsize);
+    free(out);
+
+    std::vector<unsigned char> decoded;
+    ASSERT_NO_PNG_ERROR(lodepng::decompress(decoded, zlib));
+    ASSERT_EQUALS(in, decoded);
+
+    // truncated or corrupted input must give an error rather than reading out of bounds
+    std::vector<unsigned char> truncated(zlib.begin(), zlib.begin() + zlib.size() / 2);
+    ASSERT_TRUE(lodepng::decompress(decoded, truncated) != 0);
+    std::vector<unsigned char> corrupted = zlib;
+    for(size_t i = 100; i < corrupted.size(); i += 997) corrupted[i] ^= 0x55;
+    ASSERT_TRUE(lodepng::decompress(decoded, corrupted) != 0);
+  }
+}
+
+// Repeating patterns of each short period, decoded as overlapping matches of all lengths
+void testInflateRepeats() {
+  std::cout << "testInflateRepeats" << std::endl;
+  for(size_t period = 1; period <= 20; period++) {
+    std::vector<unsigned char> in;
+    unsigned s = (unsigned)period;
+    for(size_t length = 1; length < 300; length += 7) {
+      for(size_t i = 0; i < period; i++) {
+        s = s * 1103515245u + 12345u;
+        in.push_back((unsigned char)(s >> 24));
+      }
+      for(size_t i = 0; i < length; i++) in.push_back(in[in.size() - period]);
+    }
+    std::vector<unsigned char> zlib, decoded;
+    ASSERT_NO_PNG_ERROR(lodepng::compress(zlib, in));
+    ASSERT_NO_PNG_ERROR(lodepng::decompress(decoded, zlib));
+    ASSERT_EQUALS(in, decoded);
+  }
+}
+
+// Runs the tasks in reverse order on a single thread, which any valid use of parallel_for must allow.
+void reverseParallelFor(void (*task)(void* data, size_t i), void* data, size_t count, void* context) {
+  (*(size_t*)context)++;
+  for(size_t i = count; i > 0; i--) task(data, i - 1);
+}
+
+// Deflating in segments with parallel_for, with matches that reach back into the previous segment
+void testParallelDeflate() {
+  std::cout << "testParallelDeflate" << std::endl;
+  std::vector<unsigned char> in;
+  unsigned s = 1;
+  while(in.size() < 100000) {
+    s = s * 1103515245u + 12345u;
+    if(in.size() < 1000 || (s >> 28) < 6) {
+      in.push_back((unsigned char)(s >> 24));
+    } else {
+      size_t length = 3 + ((s >> 4) % 100);
+      size_t distance = 1 + ((s >> 8) % std::min<size_t>(in.size(), 20000));
+      for(size_t i = 0; i < length; i++) in.push_back(in[in.size() - distance]);
+    }
+  }
+  const size_t segmentsizes[] = {4096, 10007, 65536};
+  for(unsigned btype = 0; btype < 3; btype++) {
+    for(size_t j = 0; j < 3; j++) {
+      size_t calls = 0;
+      LodePNGCompressSettings settings;
+      lodepng_compress_settings_init(&settings);
+      settings.btype = btype;
+      settings.windowsize = j == 1 ? 1024 : 32768;
+      settings.parallel_for = reverseParallelFor;
+      settings.parallel_context = &calls;
+      settings.parallel_segment_size = segmentsizes[j];
+      std::vector<unsigned char> zlib, decoded;
+      ASSERT_NO_PNG_ERROR(lodepng::compress(zlib, in, settings));
+      ASSERT_EQUALS(btype == 0 ? 1 : 2, calls); // deflate and adler32, or only adler32 without compression
+      ASSERT_NO_PNG_ERROR(lodepng::decompress(decoded, zlib)); // this also checks the adler32
+      ASSERT_EQUALS(in, decoded);
+      if(btype != 0) assertTrue(zlib.size() < in.size());
+    }
+  }
+
+  // a PNG encoded with parallel deflate
+  Image image;
+  generateTestImage(image, 300, 200, LCT_RGBA, 8);
+  size_t calls = 0;
+  lodepng::State state;
+  state.encoder.zlibsettings.parallel_for = reverseParallelFor;
+  state.encoder.zlibsettings.parallel_context = &calls;
+  state.encoder.zlibsettings.parallel_segment_size = 20000;
+  std::vector<unsigned char> png;
+  ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, image.width, image.height, state));
+  ASSERT_TRUE(calls > 0);
+  std::vector<unsigned char> decoded;
+  unsigned w, h;
+  ASSERT_NO_PNG_ERROR(lodepng::decode(decoded, w, h, png));
+  ASSERT_EQUALS(image.data, decoded);
+}
+
+// Filtering bands of rows with parallel_for must choose the same filters as filtering all rows at once
+void testParallelFilter() {
+  std::cout << "testParallelFilter" << std::endl;
+  std::vector<unsigned char> image(100 * 60 * 4);
+  unsigned s = 1;
+  for(size_t i = 0; i < image.size(); i++) {
+    s = s * 1103515245u + 12345u;
+    image[i] = (unsigned char)((i / 4 % 100) * (i % 4 + 1) + (i / 400) * 3 + (s >> 29)); // gradients with noise
+  }
+  const LodePNGFilterStrategy strategies[] = {LFS_ZERO, LFS_FOUR, LFS_MINSUM, LFS_ENTROPY, LFS_BRUTE_FORCE};
+  for(size_t i = 0; i < 5; i++) {
+    for(unsigned interlace = 0; interlace < 2; interlace++) {
+      std::vector<std::vector<unsigned char> > expected, types;
+      for(int parallel = 0; parallel < 2; parallel++) {
+        size_t calls = 0;
+        lodepng::State state;
+        state.info_png.interlace_method = interlace;
+        state.encoder.auto_convert = 0;
+        state.encoder.filter_strategy = strategies[i];
+        if(parallel) {
+          state.encoder.zlibsettings.parallel_for = reverseParallelFor;
+          state.encoder.zlibsettings.parallel_context = &calls;
+          state.encoder.zlibsettings.parallel_segment_size = 20000; // several rows per band, also for brute force
+        }
+        std::vector<unsigned char> png, decoded;
+        ASSERT_NO_PNG_ERROR(lodepng::encode(png, image, 100, 60, state));
+        if(parallel) ASSERT_TRUE(calls > (interlace ? 0u : 1u)); // without interlacing, both filter and deflate
+        ASSERT_NO_PNG_ERROR(lodepng::getFilterTypesInterlaced(parallel ? types : expected, png));
+        unsigned w, h;
+        ASSERT_NO_PNG_ERROR(lodepng::decode(decoded, w, h, png));
+        ASSERT_EQUALS(image, decoded);
+      }
+      ASSERT_EQUALS(expected.size(), types.size());
+      for(size_t pass = 0; pass < expected.size(); pass++) ASSERT_EQUALS(expected[pass], types[pass]);
+    }
+  }
+}
+
+// Encodes without compression, so that the PNG only differs if the color stats, color conversion or CRC do
+void doParallelColorTest(const std::vector<unsigned char>& image, unsigned w, unsigned h,
+                         LodePNGColorType colortype, unsigned bitdepth) {
+  std::vector<unsigned char> expected, png;
+  lodepng::State state;
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+  state.encoder.zlibsettings.btype = 0;
+  ASSERT_NO_PNG_ERROR(lodepng::encode(expected, image, w, h, state));
+  size_t calls = 0;
+  state.encoder.zlibsettings.parallel_for = reverseParallelFor;
+  state.encoder.zlibsettings.parallel_context = &calls;
+  state.encoder.zlibsettings.parallel_segment_size = 40;
+  ASSERT_NO_PNG_ERROR(lodepng::encode(png, image, w, h, state));
+  ASSERT_TRUE(calls > 0);
+  ASSERT_EQUALS(expected, png);
+
+  // decode to other color types, with and without parallel_for
+  for(unsigned i = 0; i < 3; i++) {
+    lodepng::State decoder;
+    decoder.info_raw.colortype = i == 0 ? LCT_RGBA : i == 1 ? LCT_GREY_ALPHA : LCT_RGB;
+    decoder.info_raw.bitdepth = i == 2 ? 16 : 8;
+    std::vector<unsigned char> decoded, decoded2;
+    unsigned w2, h2;
+    ASSERT_NO_PNG_ERROR(lodepng::decode(decoded, w2, h2, decoder, png));
+    calls = 0;
+    decoder.decoder.zlibsettings.parallel_for = reverseParallelFor;
+    decoder.decoder.zlibsettings.parallel_context = &calls;
+    decoder.decoder.zlibsettings.parallel_segment_size = 40;
+    ASSERT_NO_PNG_ERROR(lodepng::decode(decoded2, w2, h2, decoder, png));
+    ASSERT_TRUE(calls > 0);
+    ASSERT_EQUALS(decoded, decoded2);
+  }
+}
+
+// The color stats, conversion and CRC in segments with parallel_for must give the same result as without.
+void testParallelColor() {
+  std::cout << "testParallelColor" << std::endl;
+  const unsigned w = 37, h = 23; // so that segments end in the middle of rows and bytes
+  std::vector<unsigned char> image(w * h * 4);
+  unsigned s = 1;
+
+  // more than 256 colors, their order in the palette matters when there are fewer
+  for(size_t n = 200; n <= 400; n += 200) {
+    for(size_t i = 0; i < w * h; i++) {
+      s = s * 1103515245u + 12345u;
+      for(size_t c = 0; c < 3; c++) image[i * 4 + c] = (unsigned char)((s >> 16) % n * (c + 1));
+      image[i * 4 + 3] = 255;
+    }
+    doParallelColorTest(image, w, h, LCT_RGBA, 8);
+  }
+
+  // grey with 1, 2 or 4 bits needed depending on the segment
+  for(size_t i = 0; i < w * h; i++) {
+    unsigned char v = i < 300 ? 0 : i < 600 ? 85 : 17;
+    image[i * 4 + 0] = image[i * 4 + 1] = image[i * 4 + 2] = v;
+    image[i * 4 + 3] = 255;
+  }
+  doParallelColorTest(image, w, h, LCT_RGBA, 8);
+
+  // a color key in a late segment, with an opaque pixel of that color in an early one, or without it,
+  // or with fully transparent pixels of a different color in another segment
+  for(int variant = 0; variant < 3; variant++) {
+    for(size_t i = 0; i < w * h; i++) {
+      image[i * 4 + 0] = (unsigned char)(i % 50);
+      image[i * 4 + 1] = (unsigned char)(i % 7);
+      image[i * 4 + 2] = 0;
+      image[i * 4 + 3] = 255;
+    }
+    image[700 * 4 + 0] = 200, image[700 * 4 + 1] = 0, image[700 * 4 + 3] = 0;
+    image[800 * 4 + 0] = 200, image[800 * 4 + 1] = 0, image[800 * 4 + 3] = 0;
+    if(variant == 0) image[10 * 4 + 0] = 200, image[10 * 4 + 1] = 0;
+    if(variant == 2) image[20 * 4 + 3] = 0;
+    doParallelColorTest(image, w, h, LCT_RGBA, 8);
+  }
+
+  // 16-bit, truly 16-bit only in the last segment
+  std::vector<unsigned char> image16(w * h * 6);
+  for(size_t i = 0; i < image16.size(); i++) image16[i] = (unsigned char)(i / 2 % 3 * 60);
+  doParallelColorTest(image16, w, h, LCT_RGB, 16);
+  image16[image16.size() - 1] ^= 1;
+  doParallelColorTest(image16, w, h, LCT_RGB, 16);
+
+  // a wrong CRC in a large chunk is still found
+  std::vector<unsigned char> png;
+  ASSERT_NO_PNG_ERROR(lodepng::encode(png, image, w, h));
+  png[png.size() - 20] ^= 1; // in the data of the last IDAT chunk, before its CRC and IEND
+  lodepng::State decoder;
+  decoder.decoder.zlibsettings.parallel_for = reverseParallelFor;
+  size_t calls = 0;
+  decoder.decoder.zlibsettings.parallel_context = &calls;
+  decoder.decoder.zlibsettings.parallel_segment_size = 40;
+  std::vector<unsigned char> decoded;
+  unsigned w2, h2;
+  ASSERT_EQUALS(57, lodepng::decode(decoded, w2, h2, decoder, png));
+}
+
+// Unfiltering the passes of interlaced images and deinterlacing bands of rows with parallel_for
+void testParallelAdam7() {
+  std::cout << "testParallelAdam7" << std::endl;
+  const LodePNGColorType types[] = {LCT_GREY, LCT_GREY, LCT_GREY, LCT_PALETTE, LCT_GREY, LCT_RGB, LCT_RGBA};
+  const unsigned depths[] = {1, 2, 4, 4, 8, 8, 16};
+  const unsigned sizes[][2] = {{1, 40}, {3, 17}, {37, 23}, {64, 64}, {101, 9}};
+  unsigned s = 1;
+  for(size_t t = 0; t < 7; t++) {
+    for(size_t j = 0; j < 5; j++) {
+      unsigned w = sizes[j][0], h = sizes[j][1];
+      lodepng::State state;
+      state.info_raw.colortype = state.info_png.color.colortype = types[t];
+      state.info_raw.bitdepth = state.info_png.color.bitdepth = depths[t];
+      state.info_png.interlace_method = 1;
+      state.encoder.auto_convert = 0;
+      for(unsigned i = 0; i < 16 && types[t] == LCT_PALETTE; i++) {
+        unsigned char c[4] = {(unsigned char)(i * 16), (unsigned char)(i * 5), (unsigned char)(255 - i), 255};
+        lodepng_palette_add(&state.info_raw, c[0], c[1], c[2], c[3]);
+        lodepng_palette_add(&state.info_png.color, c[0], c[1], c[2], c[3]);
+      }
+      std::vector<unsigned char> image(lodepng_get_raw_size(w, h, &state.info_raw)), png;
+      for(size_t i = 0; i < image.size(); i++) {
+        s = s * 1103515245u + 12345u;
+        image[i] = (unsigned char)(i % 7 * 30 + (s >> 30)); // also some random for the filters
+      }
+      if(types[t] == LCT_PALETTE) {
+        for(size_t i = 0; i < image.size(); i++) image[i] &= 0x77; // stay below 8 palette indices
+      }
+      size_t bits = (size_t)w * h * lodepng_get_bpp(&state.info_raw);
+      if(bits % 8) image.back() &= (unsigned char)(0xff << (8 - bits % 8)); // the decoder outputs zero padding bits
+      ASSERT_NO_PNG_ERROR(lodepng::encode(png, image, w, h, state));
+
+      std::vector<unsigned char> decoded, decoded2;
+      unsigned w2, h2;
+      lodepng::State decoder;
+      ASSERT_NO_PNG_ERROR(lodepng_color_mode_copy(&decoder.info_raw, &state.info_raw));
+      ASSERT_NO_PNG_ERROR(lodepng::decode(decoded, w2, h2, decoder, png));
+      ASSERT_EQUALS(image, decoded);
+      size_t calls = 0;
+      decoder.decoder.zlibsettings.parallel_for = reverseParallelFor;
+      decoder.decoder.zlibsettings.parallel_context = &calls;
+      decoder.decoder.zlibsettings.parallel_segment_size = 8; // the smallest bands of 8 rows
+      ASSERT_NO_PNG_ERROR(lodepng::decode(decoded2, w2, h2, decoder, png));
+      ASSERT_TRUE(calls > 0);
+      ASSERT_EQUALS(image, decoded2);
+    }
+  }
+}
+
+// decodes many small images, of different sizes and color types, interlaced and not, and some
+// broken ones, with one LodePNGDecoderContext, which must give the same as decoding each on its own
+void testDecoderContext() {
+  std::cout << "testDecoderContext" << std::endl;
+  const LodePNGColorType types[] = {LCT_GREY, LCT_PALETTE, LCT_GREY_ALPHA, LCT_RGB, LCT_RGBA};
+  const unsigned depths[] = {1, 4, 8, 8, 16};
+  const unsigned sizes[][2] = {{1, 1}, {33, 5}, {7, 70}, {2, 2}, {64, 40}, {5, 3}};
+  std::vector<std::vector<unsigned char> > pngs;
+  unsigned s = 1;
+  for(size_t i = 0; i < 60; i++) {
+    unsigned t = i % 5, w = sizes[i % 6][0], h = sizes[i % 6][1];
+    lodepng::State state;
+    state.info_raw.colortype = state.info_png.color.colortype = types[t];
+    state.info_raw.bitdepth = state.info_png.color.bitdepth = depths[t];
+    state.info_png.interlace_method = (i / 5) % 2;
+    state.encoder.auto_convert = 0;
+    state.encoder.zlibsettings.btype = (unsigned)(i / 10 % 3);
+    for(unsigned j = 0; j < 16 && types[t] == LCT_PALETTE; j++) {
+      lodepng_palette_add(&state.info_raw, (unsigned char)(j * 16), (unsigned char)(j * 5), 0, 255);
+      lodepng_palette_add(&state.info_png.color, (unsigned char)(j * 16), (unsigned char)(j * 5), 0, 255);
+    }
+    std::vector<unsigned char> image(lodepng_get_raw_size(w, h, &state.info_raw)), png;
+    for(size_t j = 0; j < image.size(); j++) {
+      s = s * 1103515245u + 12345u;
+      image[j] = (unsigned char)(j % 5 * 40 + (s >> 29));
+      if(types[t] == LCT_PALETTE) image[j] &= 0x77; // stay below 8 palette indices
+    }
+    ASSERT_NO_PNG_ERROR(lodepng::encode(png, image, w, h, state));
+    if(i % 7 == 3) png.resize(png.size() - 20); // cut off in the IDAT chunk
+    if(i % 11 == 5) png[png.size() - 20] ^= 1; // wrong adler32 or data
+    pngs.push_back(png);
+  }
+
+  for(int convert = 0; convert < 2; convert++) {
+    lodepng::State state;
+    state.decoder.color_convert = convert;
+    LodePNGDecoderContext context;
+    lodepng_decoder_context_init(&context, &state);
+    std::vector<unsigned char*> out(pngs.size());
+    std::vector<unsigned> w(pngs.size()), h(pngs.size()), errors(pngs.size());
+    std::vector<const unsigned char*> in(pngs.size());
+    std::vector<size_t> insize(pngs.size());
+    unsigned first_error = 0, num_errors = 0;
+    for(size_t i = 0; i < pngs.size(); i++) {
+      in[i] = pngs[i].data();
+      insize[i] = pngs[i].size();
+      lodepng::State state2;
+      state2.decoder.color_convert = convert;
+      unsigned char* expected = 0;
+      unsigned char* image = 0;
+      unsigned w2, h2, w3, h3;
+      unsigned error = lodepng_decode(&expected, &w2, &h2, &state2, in[i], insize[i]);
+      unsigned error2 = lodepng_decode_context(&image, &w3, &h3, &context, in[i], insize[i]);
+      ASSERT_EQUALS(error, error2);
+      if(!first_error) first_error = error;
+      if(error) num_errors++;
+      if(!error) {
+        size_t size = lodepng_get_raw_size(w2, h2, convert ? &state2.info_raw : &state2.info_png.color);
+        ASSERT_EQUALS(w2, w3);
+        ASSERT_EQUALS(h2, h3);
+        ASSERT_EQUALS(std::vector<unsigned char>(expected, expected + size),
+                      std::vector<unsigned char>(image, image + size));
+      }
+      free(expected);
+      free(image);
+    }
+    lodepng_decoder_context_cleanup(&context);
+    ASSERT_TRUE(num_errors > 0 && num_errors < pngs.size());
+
+    ASSERT_EQUALS(first_error, lodepng_decode_batch(out.data(), w.data(), h.data(), errors.data(),
+                                                    in.data(), insize.data(), pngs.size(), &state));
+    for(size_t i = 0; i < pngs.size(); i++) {
+      lodepng::State state2;
+      state2.decoder.color_convert = convert;
+      unsigned char* expected = 0;
+      unsigned w2, h2;
+      ASSERT_EQUALS(lodepng_decode(&expected, &w2, &h2, &state2, in[i], insize[i]), errors[i]);
+      ASSERT_EQUALS(errors[i] == 0, out[i] != 0);
+      if(out[i]) {
+        size_t size = lodepng_get_raw_size(w2, h2, convert ? &state2.info_raw : &state2.info_png.color);
+        ASSERT_EQUALS(w2, w[i]);
+        ASSERT_EQUALS(std::vector<unsigned char>(expected, expected + size),
+                      std::vector<unsigned char>(out[i], out[i] + size));
+      }
+      free(expected);
+      free(out[i]);
+    }
+  }
+}
+
+// encodes images of different sizes with one LodePNGEncoderContext, also changing the settings in between,
+// which must give the same PNGs as encoding each on its own
+void testEncoderContext() {
+  std::cout << "testEncoderContext" << std::endl;
+  const unsigned sizes[][2] = {{1, 1}, {64, 64}, {3, 9}, {100, 30}, {17, 2}};
+  const unsigned windowsizes[] = {2048, 2048, 32768, 1024, 2048, 512};
+  std::vector<std::vector<unsigned char> > images;
+  std::vector<unsigned> ws, hs;
+  unsigned s = 1;
+  for(size_t i = 0; i < 30; i++) {
+    unsigned w = sizes[i % 5][0], h = sizes[i % 5][1];
+    std::vector<unsigned char> image(w * h * 4);
+    for(size_t j = 0; j < image.size(); j++) {
+      s = s * 1103515245u + 12345u;
+      image[j] = (unsigned char)(j % 3 == 0 ? 0 : (s >> (i % 2 ? 29 : 24))); // runs of zeros and repetitions
+    }
+    images.push_back(image);
+    ws.push_back(w);
+    hs.push_back(h);
+  }
+
+  lodepng::State state;
+  LodePNGEncoderContext context;
+  lodepng_encoder_context_init(&context, &state);
+  for(size_t i = 0; i < images.size(); i++) {
+    state.encoder.zlibsettings.windowsize = windowsizes[i % 6];
+    state.encoder.zlibsettings.btype = i % 7 == 6 ? 1 : 2;
+    state.encoder.filter_strategy = i % 4 == 3 ? LFS_BRUTE_FORCE : LFS_MINSUM;
+    lodepng::State state2;
+    state2.encoder = state.encoder;
+    unsigned char* expected = 0;
+    unsigned char* png = 0;
+    size_t expectedsize, pngsize;
+    ASSERT_NO_PNG_ERROR(lodepng_encode(&expected, &expectedsize, images[i].data(), ws[i], hs[i], &state2));
+    ASSERT_NO_PNG_ERROR(lodepng_encode_context(&png, &pngsize, images[i].data(), ws[i], hs[i], &context));
+    ASSERT_EQUALS(std::vector<unsigned char>(expected, expected + expectedsize),
+                  std::vector<unsigned char>(png, png + pngsize));
+    free(expected);
+    free(png);
+  }
+  lodepng_encoder_context_cleanup(&context);
+
+  std::vector<unsigned char*> out(images.size());
+  std::vector<size_t> outsize(images.size());
+  std::vector<unsigned> errors(images.size());
+  std::vector<const unsigned char*> in(images.size());
+  for(size_t i = 0; i < images.size(); i++) in[i] = images[i].data();
+  lodepng::State state3;
+  state3.encoder.zlibsettings.windowsize = 1024;
+  ASSERT_EQUALS(0u, lodepng_encode_batch(out.data(), outsize.data(), errors.data(), in.data(), ws.data(), hs.data(),
+                                         images.size(), &state3));
+  for(size_t i = 0; i < images.size(); i++) {
+    lodepng::State state2;
+    state2.encoder = state3.encoder;
+    unsigned char* expected = 0;
+    size_t expectedsize;
+    ASSERT_NO_PNG_ERROR(lodepng_encode(&expected, &expectedsize, images[i].data(), ws[i], hs[i], &state2));
+    ASSERT_EQUALS(0u, errors[i]);
+    ASSERT_EQUALS(std::vector<unsigned char>(expected, expected + expectedsize),
+                  std::vector<unsigned char>(out[i], out[i] + outsize[i]));
+    free(expected);
+    free(out[i]);
+  }
+}
+
+// counts the allocations of the allocator with this context that are not freed yet
+struct AllocationCounter {
+  size_t live;
+  size_t calls;
+};
+
+static void* countingMalloc(size_t size, void* context) {
+  AllocationCounter* counter = (AllocationCounter*)context;
+  counter->live++;
+  counter->calls++;
+  return malloc(size);
+}
+
+static void* countingRealloc(void* ptr, size_t new_size, void* context) {
+  AllocationCounter* counter = (AllocationCounter*)context;
+  void* result = realloc(ptr, new_size);
+  if(!ptr && result) counter->live++;
+  counter->calls++;
+  return result;
+}
+
+static void countingFree(void* ptr, void* context) {
+  AllocationCounter* counter = (AllocationCounter*)context;
+  if(ptr) counter->live--;
+  free(ptr);
+}
+
+static void setCountingAllocator(LodePNGAllocator* allocator, AllocationCounter* counter) {
+  counter->live = counter->calls = 0;
+  allocator->malloc_func = countingMalloc;
+  allocator->realloc_func = countingRealloc;
+  allocator->free_func = countingFree;
+  allocator->context = counter;
+}
+
+// a custom zlib that uses the built-in one, which allocates its output with the allocator of the settings
+static unsigned allocatorCustomZlib(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize,
+                                    const LodePNGDecompressSettings* settings) {
+  LodePNGDecompressSettings settings2 = *settings;
+  settings2.custom_zlib = 0;
+  return lodepng_zlib_decompress(out, outsize, in, insize, &settings2);
+}
+
+void testArena() {
+  std::cout << "testArena" << std::endl;
+  std::vector<unsigned char> buffer(1000);
+  LodePNGArena arena;
+  LodePNGAllocator allocator;
+  lodepng_arena_init(&arena, buffer.data() + 1, 999); // the allocations are aligned anyway
+  lodepng_arena_allocator(&allocator, &arena);
+  unsigned char* a = (unsigned char*)allocator.malloc_func(10, allocator.context);
+  ASSERT_TRUE(a != 0);
+  ASSERT_EQUALS(0u, (unsigned)((size_t)a % 16u));
+  for(int i = 0; i < 10; i++) a[i] = (unsigned char)i;
+  // the last allocation grows where it is
+  ASSERT_TRUE(allocator.realloc_func(a, 100, allocator.context) == a);
+  size_t used = arena.used;
+  unsigned char* b = (unsigned char*)allocator.malloc_func(20, allocator.context);
+  ASSERT_TRUE(b != 0 && b > a);
+  ASSERT_TRUE(arena.used > used);
+  // a is not the last allocation anymore, so it moves, keeping its contents
+  unsigned char* c = (unsigned char*)allocator.realloc_func(a, 200, allocator.context);
+  ASSERT_TRUE(c != 0 && c > b);
+  for(int i = 0; i < 10; i++) ASSERT_EQUALS(i, c[i]);
+  allocator.free_func(a, allocator.context); // does nothing, a is not the last one
+  size_t used2 = arena.used;
+  allocator.free_func(c, allocator.context);
+  allocator.free_func(b, allocator.context);
+  ASSERT_TRUE(arena.used < used2);
+  ASSERT_TRUE(allocator.malloc_func(2000, allocator.context) == 0);
+  ASSERT_TRUE(allocator.realloc_func(0, 2000, allocator.context) == 0);
+  lodepng_arena_reset(&arena);
+  ASSERT_EQUALS(0u, arena.used);
+  ASSERT_TRUE(allocator.malloc_func(900, allocator.context) != 0);
+}
+
+// decodes and encodes with the allocator in the settings, which must give the same as lodepng_malloc, with
+// only the output still allocated at the end, and with a LodePNGArena, which fails cleanly if too small
+void testAllocator() {
+  std::cout << "testAllocator" << std::endl;
+  testArena();
+  const unsigned sizes[][2] = {{1, 1}, {40, 30}, {9, 70}};
+  unsigned s = 1;
+  for(size_t i = 0; i < 12; i++) {
+    unsigned w = sizes[i % 3][0], h = sizes[i % 3][1];
+    lodepng::State state;
+    state.info_raw.bitdepth = i % 4 == 3 ? 16 : 8;
+    state.info_png.interlace_method = (i / 3) % 2;
+    state.encoder.filter_strategy = i % 5 == 2 ? LFS_BRUTE_FORCE : LFS_MINSUM;
+    state.encoder.zlibsettings.btype = i % 6 == 5 ? 0 : 2;
+    state.encoder.text_compression = 1;
+    lodepng_add_text(&state.info_png, "key", "a text that is long enough to be compressed, compressed, compressed");
+    lodepng_add_itext(&state.info_png, "key", "en", "key", "another text, text, text, text, text, text, text");
+    std::vector<unsigned char> image(lodepng_get_raw_size(w, h, &state.info_raw));
+    for(size_t j = 0; j < image.size(); j++) {
+      s = s * 1103515245u + 12345u;
+      image[j] = (unsigned char)(j % 4 == 3 ? 255 : (s >> 29) * 30);
+    }
+
+    lodepng::State plain = state;
+    unsigned char* expected = 0;
+    size_t expectedsize;
+    ASSERT_NO_PNG_ERROR(lodepng_encode(&expected, &expectedsize, image.data(), w, h, &plain));
+    std::vector<unsigned char> png(expected, expected + expectedsize);
+    free(expected);
+
+    AllocationCounter counter;
+    setCountingAllocator(&state.encoder.zlibsettings.allocator, &counter);
+    unsigned char* out = 0;
+    size_t outsize;
+    ASSERT_NO_PNG_ERROR(lodepng_encode(&out, &outsize, image.data(), w, h, &state));
+    ASSERT_TRUE(counter.calls > 2);
+    ASSERT_EQUALS(1u, counter.live);
+    ASSERT_EQUALS(png, std::vector<unsigned char>(out, out + outsize));
+    countingFree(out, &counter);
+
+    std::vector<unsigned char> arenabuffer(4 * image.size() + 8000000);
+    LodePNGArena arena;
+    lodepng_arena_init(&arena, arenabuffer.data(), arenabuffer.size());
+    lodepng_arena_allocator(&state.encoder.zlibsettings.allocator, &arena);
+    ASSERT_NO_PNG_ERROR(lodepng_encode(&out, &outsize, image.data(), w, h, &state));
+    ASSERT_TRUE(out >= arenabuffer.data() && out < arenabuffer.data() + arenabuffer.size());
+    ASSERT_EQUALS(png, std::vector<unsigned char>(out, out + outsize));
+    lodepng_arena_init(&arena, arenabuffer.data(), 1000);
+    ASSERT_EQUALS(83u, lodepng_encode(&out, &outsize, image.data(), w, h, &state));
+
+    for(int mode = 0; mode < 4; mode++) {
+      // plain decode, custom zlib, with a context, and downscaled
+      lodepng::State state2, state3;
+      state2.info_raw.bitdepth = state3.info_raw.bitdepth = 16;
+      if(mode == 1) {
+        state2.decoder.zlibsettings.custom_zlib = allocatorCustomZlib;
+        state3.decoder.zlibsettings.custom_zlib = allocatorCustomZlib;
+      }
+      unsigned w2, h2, w3, h3;
+      unsigned char* image2 = 0;
+      if(mode == 3) ASSERT_NO_PNG_ERROR(lodepng_decode_scaled(&image2, &w2, &h2, 1, &state2, png.data(), png.size()));
+      else ASSERT_NO_PNG_ERROR(lodepng_decode(&image2, &w2, &h2, &state2, png.data(), png.size()));
+      std::vector<unsigned char> decoded(image2, image2 + lodepng_get_raw_size(w2, h2, &state2.info_raw));
+      free(image2);
+
+      for(int arenas = 0; arenas < 2; arenas++) {
+        unsigned char* image3 = 0;
+        if(arenas) {
+          lodepng_arena_init(&arena, arenabuffer.data(), arenabuffer.size());
+          lodepng_arena_allocator(&state3.decoder.zlibsettings.allocator, &arena);
+        } else {
+          setCountingAllocator(&state3.decoder.zlibsettings.allocator, &counter);
+        }
+        LodePNGDecoderContext context;
+        lodepng_decoder_context_init(&context, &state3);
+        if(mode == 2) {
+          ASSERT_NO_PNG_ERROR(lodepng_decode_context(&image3, &w3, &h3, &context, png.data(), png.size()));
+        } else if(mode == 3) {
+          ASSERT_NO_PNG_ERROR(lodepng_decode_scaled(&image3, &w3, &h3, 1, &state3, png.data(), png.size()));
+        } else {
+          ASSERT_NO_PNG_ERROR(lodepng_decode(&image3, &w3, &h3, &state3, png.data(), png.size()));
+        }
+        lodepng_decoder_context_cleanup(&context);
+        ASSERT_EQUALS(w2, w3);
+        ASSERT_EQUALS(h2, h3);
+        ASSERT_EQUALS(decoded, std::vector<unsigned char>(image3, image3 + decoded.size()));
+        if(arenas) {
+          ASSERT_TRUE(image3 >= arenabuffer.data() && image3 < arenabuffer.data() + arenabuffer.size());
+          lodepng_arena_init(&arena, arenabuffer.data(), decoded.size() / 2);
+          image3 = 0;
+          // a failure of the custom zlib is reported as error 110 instead of 83
+          unsigned error = lodepng_decode(&image3, &w3, &h3, &state3, png.data(), png.size());
+          ASSERT_TRUE(error == 83 || (mode == 1 && error == 110));
+          ASSERT_TRUE(!image3);
+        } else {
+          ASSERT_TRUE(counter.calls > 0);
+          ASSERT_EQUALS(1u, counter.live);
+          countingFree(image3, &counter);
+        }
+      }
+    }
+  }
+
+  // the zlib functions
+  std::vector<unsigned char> data(100000);
+  for(size_t i = 0; i < data.size(); i++) data[i] = (unsigned char)(i % 251 * (i / 1000 % 3));
+  std::vector<unsigned char> arenabuffer(1000000);
+  LodePNGArena arena;
+  lodepng_arena_init(&arena, arenabuffer.data(), arenabuffer.size());
+  LodePNGCompressSettings compress;
+  lodepng_compress_settings_init(&compress);
+  lodepng_arena_allocator(&compress.allocator, &arena);
+  unsigned char* zlib = 0;
+  size_t zlibsize = 0;
+  ASSERT_NO_PNG_ERROR(lodepng_zlib_compress(&zlib, &zlibsize, data.data(), data.size(), &compress));
+  ASSERT_TRUE(zlib >= arenabuffer.data() && zlib < arenabuffer.data() + arenabuffer.size());
+  LodePNGDecompressSettings decompress;
+  lodepng_decompress_settings_init(&decompress);
+  AllocationCounter counter;
+  setCountingAllocator(&decompress.allocator, &counter);
+  unsigned char* result = 0;
+  size_t resultsize = 0;
+  ASSERT_NO_PNG_ERROR(lodepng_zlib_decompress(&result, &resultsize, zlib, zlibsize, &decompress));
+  ASSERT_EQUALS(1u, counter.live);
+  ASSERT_EQUALS(data, std::vector<unsigned char>(result, result + resultsize));
+  countingFree(result, &counter);
+}
+
+// peak_memory must cover the output and the buffers, and max_memory must fail with error 127 when set below it
+void testMemoryBudget() {
+  std::cout << "testMemoryBudget" << std::endl;
+  unsigned w = 100, h = 60, s = 1;
+  std::vector<unsigned char> image(w * h * 4);
+  for(size_t i = 0; i < image.size(); i++) {
+    s = s * 1103515245u + 12345u;
+    image[i] = (unsigned char)((i / 4 % 100) * (i % 4 + 1) + (s >> 29));
+  }
+  const LodePNGFilterStrategy strategies[] = {LFS_MINSUM, LFS_BRUTE_FORCE};
+  for(int i = 0; i < 8; i++) {
+    unsigned interlace = i & 1, parallel = (i >> 1) & 1;
+    size_t calls = 0;
+    lodepng::State state;
+    state.info_png.interlace_method = interlace;
+    state.encoder.filter_strategy = strategies[i >> 2];
+    state.decoder.zlibsettings.custom_zlib = i == 3 ? allocatorCustomZlib : 0;
+    if(parallel) {
+      state.encoder.zlibsettings.parallel_for = reverseParallelFor;
+      state.encoder.zlibsettings.parallel_context = &calls;
+      state.encoder.zlibsettings.parallel_segment_size = 4000; // several tasks for both filter and deflate
+      state.decoder.zlibsettings.parallel_for = reverseParallelFor;
+      state.decoder.zlibsettings.parallel_context = &calls;
+      state.decoder.zlibsettings.parallel_segment_size = 4000;
+    }
+
+    unsigned char* png = 0;
+    size_t pngsize = 0;
+    ASSERT_NO_PNG_ERROR(lodepng_encode(&png, &pngsize, image.data(), w, h, &state));
+    size_t peak = state.peak_memory;
+    ASSERT_TRUE(peak >= pngsize + w * h * 4); // at least the output and the filtered image
+    std::vector<unsigned char> expected(png, png + pngsize);
+    free(png);
+    // with parallel_for, the tasks count against the same limit, however unevenly they use it
+    state.encoder.max_memory = peak;
+    ASSERT_NO_PNG_ERROR(lodepng_encode(&png, &pngsize, image.data(), w, h, &state));
+    ASSERT_EQUALS(expected, std::vector<unsigned char>(png, png + pngsize));
+    ASSERT_EQUALS(peak, state.peak_memory);
+    free(png);
+    // brute force does without the hash table it shares between attempts if that does not fit, needing less
+    state.encoder.max_memory = strategies[i >> 2] == LFS_BRUTE_FORCE ? pngsize : peak - 1;
+    ASSERT_EQUALS(127, lodepng_encode(&png, &pngsize, image.data(), w, h, &state));
+    free(png);
+
+    unsigned char* decoded = 0;
+    unsigned w2, h2;
+    ASSERT_NO_PNG_ERROR(lodepng_decode(&decoded, &w2, &h2, &state, expected.data(), expected.size()));
+    ASSERT_EQUALS(image, std::vector<unsigned char>(decoded, decoded + image.size()));
+    free(decoded);
+    peak = state.peak_memory;
+    ASSERT_TRUE(peak >= image.size());
+    state.decoder.max_memory = peak;
+    ASSERT_NO_PNG_ERROR(lodepng_decode(&decoded, &w2, &h2, &state, expected.data(), expected.size()));
+    ASSERT_EQUALS(peak, state.peak_memory);
+    free(decoded);
+    state.decoder.max_memory = peak - 1;
+    ASSERT_EQUALS(127, lodepng_decode(&decoded, &w2, &h2, &state, expected.data(), expected.size()));
+    free(decoded);
+    state.decoder.max_memory = image.size() - 1; // the output alone does not fit
+    ASSERT_EQUALS(127, lodepng_decode(&decoded, &w2, &h2, &state, expected.data(), expected.size()));
+    free(decoded);
+
+    // the budget is per call, a context gives the same peak
+    state.decoder.max_memory = 0;
+    LodePNGDecoderContext context;
+    lodepng_decoder_context_init(&context, &state);
+    for(int j = 0; j < 2; j++) {
+      ASSERT_NO_PNG_ERROR(lodepng_decode_context(&decoded, &w2, &h2, &context, expected.data(), expected.size()));
+      ASSERT_TRUE(state.peak_memory >= image.size() && state.peak_memory <= peak);
+      free(decoded);
+    }
+    lodepng_decoder_context_cleanup(&context);
+  }
+}
+
+// lodepng_map_file must give the same contents as lodepng_load_file, also as used by lodepng_decode_file
+void testMapFile() {
+  std::cout << "testMapFile" << std::endl;
+  const char* filename = "lodepng_unittest_map.png";
+  unsigned w = 50, h = 30;
+  std::vector<unsigned char> image(w * h * 4);
+  for(size_t i = 0; i < image.size(); i++) image[i] = (unsigned char)(i * 7 + i / 200);
+  ASSERT_NO_PNG_ERROR(lodepng_encode32_file(filename, image.data(), w, h));
+
+  std::vector<unsigned char> loaded;
+  ASSERT_NO_PNG_ERROR(lodepng::load_file(loaded, filename));
+  const unsigned char* mapped = 0;
+  size_t mappedsize = 0;
+  ASSERT_NO_PNG_ERROR(lodepng_map_file(&mapped, &mappedsize, filename));
+  ASSERT_EQUALS(loaded.size(), mappedsize);
+  ASSERT_EQUALS(loaded, std::vector<unsigned char>(mapped, mapped + mappedsize));
+  lodepng_unmap_file(mapped, mappedsize);
+
+  unsigned char* decoded = 0;
+  unsigned w2, h2;
+  ASSERT_NO_PNG_ERROR(lodepng_decode32_file(&decoded, &w2, &h2, filename));
+  ASSERT_EQUALS(w, w2);
+  ASSERT_EQUALS(h, h2);
+  ASSERT_EQUALS(image, std::vector<unsigned char>(decoded, decoded + image.size()));
+  free(decoded);
+  std::vector<unsigned char> decoded2;
+  ASSERT_NO_PNG_ERROR(lodepng::decode(decoded2, w2, h2, std::string(filename)));
+  ASSERT_EQUALS(image, decoded2);
+
+  // an empty file maps to nothing, and a file that does not exist gives an error
+  ASSERT_NO_PNG_ERROR(lodepng_save_file(0, 0, filename));
+  ASSERT_NO_PNG_ERROR(lodepng_map_file(&mapped, &mappedsize, filename));
+  ASSERT_EQUALS(0u, mappedsize);
+  lodepng_unmap_file(mapped, mappedsize);
+  ASSERT_EQUALS(0, remove(filename));
+  ASSERT_EQUALS(78, lodepng_map_file(&mapped, &mappedsize, filename));
+  ASSERT_TRUE(!mapped);
+  ASSERT_EQUALS(78, lodepng_decode32_file(&decoded, &w2, &h2, filename));
+}
+
+// colors that only differ in one channel, or in the low bits, must be told apart by the color table, and
+// counting must stop after 257 colors
+void testColorTable() {
+  std::cout << "testColorTable" << std::endl;
+  std::vector<unsigned char> image;
+  for(unsigned i = 0; i < 300; i++) {
+    unsigned char c[4] = {0, 0, 0, 255};
+    c[i % 4] = (unsigned char)(i / 4 * 3 + 1);
+    if(i >= 256) c[0] = c[1] = c[2] = c[3] = (unsigned char)(i - 256); // gray, another 44 colors
+    image.insert(image.end(), c, c + 4);
+  }
+  LodePNGColorMode mode = lodepng_color_mode_make(LCT_RGBA, 8);
+  for(unsigned n = 255; n <= 258; n++) {
+    LodePNGColorStats stats;
+    lodepng_color_stats_init(&stats);
+    ASSERT_NO_PNG_ERROR(lodepng_compute_color_stats(&stats, image.data(), n, 1, &mode));
+    ASSERT_EQUALS(n < 257 ? n : 257u, stats.numcolors);
+    ASSERT_EQUALS(0, memcmp(stats.palette, image.data(), (n < 256 ? n : 256u) * 4));
+  }
+
+  // a palette with every color twice: the conversion uses the last index of a color, as it always has
+  LodePNGColorMode palette = lodepng_color_mode_make(LCT_PALETTE, 8);
+  for(unsigned i = 0; i < 256; i++) {
+    const unsigned char* c = &image[i % 128 * 4];
+    lodepng_palette_add(&palette, c[0], c[1], c[2], c[3]);
+  }
+  std::vector<unsigned char> indices(128);
+  ASSERT_NO_PNG_ERROR(lodepng_convert(indices.data(), image.data(), &palette, &mode, 128, 1));
+  for(unsigned i = 0; i < 128; i++) ASSERT_EQUALS(i + 128, indices[i]);
+  ASSERT_EQUALS(82, lodepng_convert(indices.data(), image.data(), &palette, &mode, 129, 1));
+  lodepng_color_mode_cleanup(&palette);
+}
+
+// the bulk checks and sampling for 8-bit RGB and RGBA must give the same stats as the pixel by pixel checks, which
+// are used for the same image as 16-bit with equal bytes
+void testColorStatsBulk() {
+  std::cout << "testColorStatsBulk" << std::endl;
+  const unsigned n = 5000;
+  const unsigned positions[] = {0, 15, 16, 17, 18, 1000, 1003, 4981, 4982, 4999};
+  for(unsigned base = 0; base < 3; base++) // many colors, grey, few colors
+  for(unsigned change = 0; change < 6; change++) // none, colored twice, translucent, transparent, key color opaque
+  for(unsigned pos = 0; pos < sizeof(positions) / sizeof(*positions); pos++)
+  for(unsigned channels = 3; channels <= 4; channels++)
+  for(unsigned palette = 0; palette < 2; palette++) {
+    if(change == 0 && pos != 0) continue;
+    if(channels == 3 && change >= 3) continue;
+    std::vector<unsigned char> image(n * channels);
+    for(unsigned i = 0; i < n; i++) {
+      unsigned char* p = &image[i * channels];
+      unsigned char v = (unsigned char)(i * 7 / 100);
+      p[0] = v;
+      p[1] = base == 0 ? (unsigned char)(i * 13) : v;
+      p[2] = base == 2 ? (unsigned char)(i / 2000 * 50) : v;
+      if(base == 2) p[0] = p[1] = 0;
+      if(channels == 4) p[3] = 255;
+    }
+    unsigned char* p = &image[positions[pos] * channels];
+    if(change == 1 || change == 2) p[change * 2 - 2] ^= 1; // r or b differs
+    if(change == 3) p[3] = 128;
+    if(change >= 4) p[3] = 0;
+    if(change == 5) memcpy(&image[(n - 1 - positions[pos]) * channels], p, 3); // opaque unless they're the same
+    std::vector<unsigned char> image16(image.size() * 2);
+    for(size_t i = 0; i < image.size(); i++) image16[i * 2] = image16[i * 2 + 1] = image[i];
+
+    LodePNGColorType type = channels == 4 ? LCT_RGBA : LCT_RGB;
+    LodePNGColorMode mode8 = lodepng_color_mode_make(type, 8), mode16 = lodepng_color_mode_make(type, 16);
+    LodePNGColorStats stats8, stats16;
+    lodepng_color_stats_init(&stats8);
+    lodepng_color_stats_init(&stats16);
+    stats8.allow_palette = stats16.allow_palette = palette; // without palette, grey images are skipped in bulk too
+    ASSERT_NO_PNG_ERROR(lodepng_compute_color_stats(&stats8, image.data(), n, 1, &mode8));
+    ASSERT_NO_PNG_ERROR(lodepng_compute_color_stats(&stats16, image16.data(), n, 1, &mode16));
+    ASSERT_EQUALS(stats16.colored, stats8.colored);
+    ASSERT_EQUALS(stats16.key, stats8.key);
+    ASSERT_EQUALS(stats16.key_r, stats8.key_r);
+    ASSERT_EQUALS(stats16.key_g, stats8.key_g);
+    ASSERT_EQUALS(stats16.key_b, stats8.key_b);
+    ASSERT_EQUALS(stats16.alpha, stats8.alpha);
+    ASSERT_EQUALS(stats16.bits, stats8.bits);
+    ASSERT_EQUALS(stats16.numcolors, stats8.numcolors);
+    if(stats8.numcolors <= 256) ASSERT_EQUALS(0, memcmp(stats16.palette, stats8.palette, stats8.numcolors * 4));
+  }
+}
+
+// palette images with less than 8 bits are converted to RGBA and RGB a byte at a time, including a last byte that
+// is not completely used
+void testPaletteBitsConvert() {
+  std::cout << "testPaletteBitsConvert" << std::endl;
+  for(unsigned bitdepth = 1; bitdepth <= 4; bitdepth *= 2) {
+    LodePNGColorMode mode = lodepng_color_mode_make(LCT_PALETTE, bitdepth);
+    LodePNGColorMode rgba = lodepng_color_mode_make(LCT_RGBA, 8), rgb = lodepng_color_mode_make(LCT_RGB, 8);
+    for(unsigned i = 0; i < (1u << bitdepth); i++) lodepng_palette_add(&mode, i, i * 3, i * 7, 255 - i);
+    for(unsigned n = 1; n <= 19; n++) {
+      std::vector<unsigned char> image((n * bitdepth + 7) / 8);
+      for(size_t i = 0; i < image.size(); i++) image[i] = (unsigned char)(i * 151 + 77);
+      std::vector<unsigned char> out4(n * 4), out3(n * 3);
+      ASSERT_NO_PNG_ERROR(lodepng_convert(out4.data(), image.data(), &rgba, &mode, n, 1));
+      ASSERT_NO_PNG_ERROR(lodepng_convert(out3.data(), image.data(), &rgb, &mode, n, 1));
+      for(unsigned i = 0; i < n; i++) {
+        size_t bit = (size_t)i * bitdepth;
+        unsigned index = (image[bit / 8] >> (8 - bitdepth - bit % 8)) & ((1u << bitdepth) - 1u);
+        ASSERT_EQUALS(0, memcmp(&out4[i * 4], &mode.palette[index * 4], 4));
+        ASSERT_EQUALS(0, memcmp(&out3[i * 3], &mode.palette[index * 4], 3));
+      }
+    }
+    lodepng_color_mode_cleanup(&mode);
+  }
+}
+
+// the value of channel k of pixel i, of any bit depth
+static unsigned referenceChannel(const unsigned char* in, size_t i, unsigned k, const LodePNGColorMode& mode) {
+  unsigned bitdepth = mode.bitdepth, channels = lodepng_get_channels(&mode), value = 0;
+  size_t bit = (i * channels + k) * bitdepth;
+  for(unsigned j = 0; j < bitdepth; j++, bit++) value = value * 2 + ((in[bit / 8] >> (7 - bit % 8)) & 1);
+  return value;
+}
+
+// the conversion of lodepng_convert written out per channel, with the colors as 16-bit RGBA
+static unsigned referenceConvert(std::vector<unsigned char>& out, const std::vector<unsigned char>& in, size_t n,
+                                 const LodePNGColorMode& mode_out, const LodePNGColorMode& mode_in) {
+  unsigned max_in = (1u << mode_in.bitdepth) - 1u, bits_out = mode_out.bitdepth;
+  unsigned channels_out = lodepng_get_channels(&mode_out);
+  bool sixteen = mode_in.bitdepth == 16 && mode_out.bitdepth == 16;
+  out.assign(lodepng_get_raw_size((unsigned)n, 1, &mode_out), 0);
+  for(size_t i = 0; i < n; i++) {
+    unsigned v[4], c[4];
+    for(unsigned k = 0; k < lodepng_get_channels(&mode_in); k++) v[k] = referenceChannel(in.data(), i, k, mode_in);
+    if(mode_in.colortype == LCT_PALETTE) {
+      for(unsigned k = 0; k < 4; k++) c[k] = mode_in.palette[v[0] * 4 + k] * 257u;
+    } else if(mode_in.colortype == LCT_GREY || mode_in.colortype == LCT_GREY_ALPHA) {
+      c[0] = c[1] = c[2] = v[0] * 65535u / max_in;
+      if(mode_in.colortype == LCT_GREY) c[3] = mode_in.key_defined && v[0] == mode_in.key_r ? 0 : 65535;
+      else c[3] = v[1] * 65535u / max_in;
+    } else {
+      for(unsigned k = 0; k < 3; k++) c[k] = v[k] * 65535u / max_in;
+      if(mode_in.colortype == LCT_RGBA) c[3] = v[3] * 65535u / max_in;
+      else c[3] = mode_in.key_defined && v[0] == mode_in.key_r && v[1] == mode_in.key_g &&
+                  v[2] == mode_in.key_b ? 0 : 65535;
+    }
+    if(!sixteen) for(unsigned k = 0; k < 4; k++) c[k] = (c[k] >> 8) * 257u; // through 8-bit RGBA
+    if(mode_out.colortype == LCT_PALETTE) {
+      unsigned index = 256;
+      for(unsigned j = 0; j < mode_out.palettesize && index == 256; j++) {
+        const unsigned char* p = &mode_out.palette[j * 4];
+        if(p[0] == c[0] >> 8 && p[1] == c[1] >> 8 && p[2] == c[2] >> 8 && p[3] == c[3] >> 8) index = j;
+      }
+      if(index == 256) return 82;
+      c[0] = index << (16 - bits_out);
+    } else if(mode_out.colortype == LCT_GREY_ALPHA) {
+      c[1] = c[3];
+    }
+    for(unsigned k = 0; k < channels_out; k++) {
+      unsigned value = c[k] >> (16 - bits_out);
+      size_t bit = (i * channels_out + k) * bits_out;
+      for(unsigned j = 0; j < bits_out; j++, bit++) {
+        if((value >> (bits_out - 1 - j)) & 1) out[bit / 8] |= (unsigned char)(1u << (7 - bit % 8));
+      }
+    }
+  }
+  return 0;
+}
+
+// every pair of color types and bit depths, with and without color key, must convert like referenceConvert. With
+// C++, these are the conversions of the templated kernels.
+void testConvertAllPairs() {
+  std::cout << "testConvertAllPairs" << std::endl;
+  const LodePNGColorType types[15] = {LCT_GREY, LCT_GREY, LCT_GREY, LCT_GREY, LCT_GREY, LCT_RGB, LCT_RGB,
+      LCT_PALETTE, LCT_PALETTE, LCT_PALETTE, LCT_PALETTE, LCT_GREY_ALPHA, LCT_GREY_ALPHA, LCT_RGBA, LCT_RGBA};
+  const unsigned depths[15] = {1, 2, 4, 8, 16, 8, 16, 1, 2, 4, 8, 8, 16, 8, 16};
+  const size_t n = 37;
+  for(unsigned i = 0; i < 15; i++)
+  for(unsigned j = 0; j < 15; j++)
+  for(unsigned key = 0; key < 2; key++) {
+    // key 1 tests the color key of grey and RGB, and a color missing in the palette
+    if(key && types[i] != LCT_GREY && types[i] != LCT_RGB && types[j] != LCT_PALETTE) continue;
+    LodePNGColorMode mode_in = lodepng_color_mode_make(types[i], depths[i]);
+    LodePNGColorMode mode_out = lodepng_color_mode_make(types[j], depths[j]);
+    std::vector<unsigned char> in(lodepng_get_raw_size((unsigned)n, 1, &mode_in));
+    for(size_t k = 0; k < in.size(); k++) in[k] = (unsigned char)((k * 2654435761u) >> (13 + i % 4));
+    if(types[i] == LCT_PALETTE) {
+      for(unsigned k = 0; k < 256; k++) lodepng_palette_add(&mode_in, k * 7, k * 13, k, k * 5 + 3);
+    }
+    if(key && (types[i] == LCT_GREY || types[i] == LCT_RGB)) {
+      mode_in.key_defined = 1;
+      mode_in.key_r = referenceChannel(in.data(), 3, 0, mode_in);
+      if(types[i] == LCT_RGB) {
+        mode_in.key_g = referenceChannel(in.data(), 3, 1, mode_in);
+        mode_in.key_b = referenceChannel(in.data(), 3, 2, mode_in);
+      }
+    }
+    if(types[j] == LCT_PALETTE) {
+      // the palette has the 8-bit RGBA colors of the input, except for the last pixel if key is set
+      LodePNGColorMode rgba = lodepng_color_mode_make(LCT_RGBA, 8);
+      std::vector<unsigned char> colors;
+      ASSERT_NO_PNG_ERROR(referenceConvert(colors, in, n, rgba, mode_in));
+      for(size_t k = 0; k + (key ? 1 : 0) < n && mode_out.palettesize < (1u << depths[j]); k++) {
+        const unsigned char* c = &colors[k * 4];
+        bool found = false;
+        for(size_t m = 0; m < mode_out.palettesize; m++) found = found || !memcmp(&mode_out.palette[m * 4], c, 4);
+        if(!found) lodepng_palette_add(&mode_out, c[0], c[1], c[2], c[3]);
+      }
+    }
+    std::vector<unsigned char> expected, actual(lodepng_get_raw_size((unsigned)n, 1, &mode_out));
+    unsigned expected_error = referenceConvert(expected, in, n, mode_out, mode_in);
+    unsigned error = lodepng_convert(actual.data(), in.data(), &mode_out, &mode_in, (unsigned)n, 1);
+    ASSERT_EQUALS(expected_error, error);
+    size_t bits = n * lodepng_get_bpp(&mode_out);
+    if(!error && bits % 8) { // the unused bits of the last byte are not defined
+      expected.back() &= (unsigned char)(0xff00u >> (bits % 8));
+      actual.back() &= (unsigned char)(0xff00u >> (bits % 8));
+    }
+    if(!error) assertEquals(expected, actual, "pair " + valtostr(i) + " " + valtostr(j));
+    lodepng_color_mode_cleanup(&mode_in);
+    lodepng_color_mode_cleanup(&mode_out);
+  }
+}
+
+// the pixels of image in mode (RGB, RGBA or grey alpha of 8 or 16 bits) as they are with the channel order and
+// premultiplied alpha of mode
+static std::vector<unsigned char> referenceLayout(const std::vector<unsigned char>& image,
+                                                  const LodePNGColorMode& mode) {
+  unsigned channels = lodepng_get_channels(&mode), bytes = mode.bitdepth / 8, max = (1u << mode.bitdepth) - 1u;
+  std::vector<unsigned char> result(image.size());
+  for(size_t i = 0; i < image.size() / (channels * bytes); i++) {
+    const unsigned char* p = &image[i * channels * bytes];
+    unsigned c[4];
+    for(unsigned k = 0; k < channels; k++) c[k] = bytes == 2 ? 256u * p[k * 2] + p[k * 2 + 1] : p[k];
+    if(mode.premultiplied) {
+      for(unsigned k = 0; k + 1 < channels; k++) c[k] = (unsigned)((c[k] * (double)c[channels - 1]) / max + 0.5);
+    }
+    unsigned order[4] = {0, 1, 2, 3};
+    if(channels >= 3 && mode.order == LCO_BGRA) order[0] = 2, order[2] = 0;
+    if(channels == 4 && mode.order == LCO_ARGB) order[0] = 3, order[1] = 0, order[2] = 1, order[3] = 2;
+    for(unsigned k = 0; k < channels; k++) {
+      unsigned v = c[order[k]];
+      if(bytes == 2) {
+        result[(i * channels + k) * 2] = v >> 8;
+        result[(i * channels + k) * 2 + 1] = v & 255;
+      } else {
+        result[i * channels + k] = v;
+      }
+    }
+  }
+  return result;
+}
+
+// conversion and decoding to a channel order and premultiplied alpha
+void testRawLayout() {
+  std::cout << "testRawLayout" << std::endl;
+  const LodePNGColorType types[3] = {LCT_RGB, LCT_RGBA, LCT_GREY_ALPHA};
+  for(unsigned t = 0; t < 3; t++)
+  for(unsigned bitdepth = 8; bitdepth <= 16; bitdepth += 8)
+  for(unsigned order = 0; order < 3; order++)
+  for(unsigned premultiplied = 0; premultiplied < 2; premultiplied++)
+  for(unsigned n = 1; n < 2100; n = n * 3 + 1) {
+    LodePNGColorMode plain = lodepng_color_mode_make(types[t], bitdepth), mode = plain;
+    mode.order = (LodePNGChannelOrder)order;
+    mode.premultiplied = premultiplied;
+    std::vector<unsigned char> image(lodepng_get_raw_size(n, 1, &plain)), out(image.size());
+    for(size_t i = 0; i < image.size(); i++) image[i] = (unsigned char)((i * 2654435761u) >> 11);
+    if(image.size() > 8) image[3] = image[7] = 0; // fully transparent and opaque pixels
+    if(image.size() > 8) image[2] = image[6] = 255;
+    bool supported = (!order || types[t] != LCT_GREY_ALPHA) && (!premultiplied || types[t] != LCT_RGB);
+    unsigned expected_error = supported ? 0 : 128;
+    ASSERT_EQUALS(expected_error, lodepng_convert(out.data(), image.data(), &mode, &plain, n, 1));
+    if(!expected_error) ASSERT_EQUALS(referenceLayout(image, mode), out);
+    if(order || premultiplied) ASSERT_EQUALS(128, lodepng_convert(out.data(), image.data(), &plain, &mode, n, 1));
+  }
+
+  // from a color type that needs conversion, and in place from the color type of the PNG
+  std::vector<unsigned char> image(64 * 48 * 4);
+  for(size_t i = 0; i < image.size(); i++) image[i] = (unsigned char)((i * 2654435761u) >> 11);
+  for(int palette = 0; palette < 2; palette++) {
+    std::vector<unsigned char> png, decoded, expected;
+    lodepng::State encstate;
+    if(palette) {
+      encstate.encoder.auto_convert = 0;
+      encstate.info_png.color.colortype = LCT_PALETTE;
+      for(unsigned i = 0; i < 16; i++) {
+        lodepng_palette_add(&encstate.info_png.color, i * 16, 255 - i * 16, i * 3, i * 17);
+        lodepng_palette_add(&encstate.info_raw, i * 16, 255 - i * 16, i * 3, i * 17);
+      }
+      encstate.info_raw.colortype = LCT_PALETTE;
+      encstate.info_png.color.bitdepth = encstate.info_raw.bitdepth = 4;
+    }
+    unsigned w, h;
+    std::vector<unsigned char> source(image.begin(), image.begin() + (palette ? 64 * 48 / 2 : image.size()));
+    ASSERT_NO_PNG_ERROR(lodepng::encode(png, source, 64, 48, encstate));
+    ASSERT_NO_PNG_ERROR(lodepng::decode(expected, w, h, png));
+    lodepng::State state;
+    state.info_raw.order = LCO_BGRA;
+    state.info_raw.premultiplied = 1;
+    ASSERT_NO_PNG_ERROR(lodepng::decode(decoded, w, h, state, png));
+    ASSERT_EQUALS(referenceLayout(expected, state.info_raw), decoded);
+  }
+
+  // encoding from a raw image with a layout is not supported
+  lodepng::State state;
+  state.info_raw.order = LCO_ARGB;
+  std::vector<unsigned char> png;
+  ASSERT_EQUALS(128, lodepng::encode(png, image, 64, 48, state));
+  LodePNGColorMode grey = lodepng_color_mode_make(LCT_GREY_ALPHA, 8);
+  grey.order = LCO_BGRA;
+  lodepng::State state2;
+  state2.info_raw = grey;
+  ASSERT_NO_PNG_ERROR(lodepng::encode(png, image, 8, 8, LCT_GREY_ALPHA, 8));
+  std::vector<unsigned char> decoded;
+  unsigned w, h;
+  ASSERT_EQUALS(128, lodepng::decode(decoded, w, h, state2, png));
+}
+
 void testDiskCompressZlib(const std::string& filename) {
   std::cout << "testDiskCompressZlib: File " << filename << std::endl;
 
@@ -1444,6 +2543,350 @@ void testInspectChunk() {
   ASSERT_EQUALS(2, info.text_num);
 }
 
+// Returns the png with its IDAT data split into IDAT chunks of the given size, and an empty IDAT chunk in between.
+// Optionally drops bytes from the end of the IDAT data.
+std::vector<unsigned char> splitIdat(const std::vector<unsigned char>& png, size_t size, size_t drop = 0) {
+  std::vector<unsigned char> idat, result(png.begin(), png.begin() + 8);
+  unsigned char* data = 0;
+  size_t datasize = 0;
+  const unsigned char* end = &png[0] + png.size();
+  bool written = false;
+  for(const unsigned char* chunk = &png[8]; chunk < end; chunk = lodepng_chunk_next_const(chunk, end)) {
+    if(lodepng_chunk_type_equals(chunk, "IDAT")) {
+      const unsigned char* d = lodepng_chunk_data_const(chunk);
+      idat.insert(idat.end(), d, d + lodepng_chunk_length(chunk));
+      continue;
+    }
+    if(!idat.empty() && !written) {
+      idat.resize(idat.size() - drop);
+      for(size_t pos = 0; pos < idat.size(); pos += size) {
+        size_t amount = std::min(size, idat.size() - pos);
+        ASSERT_NO_PNG_ERROR(lodepng_chunk_create(&data, &datasize, amount, "IDAT", &idat[pos]));
+        if(pos == 0) ASSERT_NO_PNG_ERROR(lodepng_chunk_create(&data, &datasize, 0, "IDAT", &idat[pos]));
+      }
+      written = true;
+    }
+    ASSERT_NO_PNG_ERROR(lodepng_chunk_append(&data, &datasize, chunk));
+  }
+  result.insert(result.end(), data, data + datasize);
+  free(data);
+  return result;
+}
+
+void testSplitIdat() {
+  std::cout << "testSplitIdat" << std::endl;
+  size_t sizes[6] = {1, 2, 3, 7, 100, 4000};
+  for(unsigned btype = 0; btype < 3; btype++) {
+    for(unsigned interlace = 0; interlace < 2; interlace++) {
+      Image image;
+      generateTestImage(image, 131, 97, LCT_RGBA, 8);
+      lodepng::State state;
+      state.info_png.interlace_method = interlace;
+      state.encoder.zlibsettings.btype = btype;
+      std::vector<unsigned char> png;
+      ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, image.width, image.height, state));
+      for(size_t i = 0; i < 6; i++) {
+        std::vector<unsigned char> split = splitIdat(png, sizes[i]), decoded;
+        unsigned w, h;
+        ASSERT_NO_PNG_ERROR(lodepng::decode(decoded, w, h, split));
+        ASSERT_EQUALS(image.data, decoded);
+        // truncated split data must give an error
+        std::vector<unsigned char> broken = splitIdat(png, sizes[i], 20);
+        ASSERT_TRUE(lodepng::decode(decoded, w, h, broken) != 0);
+      }
+    }
+  }
+}
+
+// the decoder unfilters and converts non-interlaced images row by row while decompressing, compare it to decoding
+// with a custom zlib decompressor, which gives all scanlines at once
+void testRowPipeline() {
+  std::cout << "testRowPipeline" << std::endl;
+  struct TestFun {
+    static unsigned custom_zlib(unsigned char** out, size_t* outsize,
+                                const unsigned char* in, size_t insize,
+                                const LodePNGDecompressSettings*) {
+      LodePNGDecompressSettings settings;
+      lodepng_decompress_settings_init(&settings);
+      return lodepng_zlib_decompress(out, outsize, in, insize, &settings);
+    }
+  };
+  LodePNGColorType colorTypes[5] = {LCT_GREY, LCT_RGB, LCT_PALETTE, LCT_GREY_ALPHA, LCT_RGBA};
+  unsigned bitDepths[5] = {2, 16, 4, 8, 8};
+  LodePNGColorType rawTypes[3] = {LCT_RGBA, LCT_RGB, LCT_GREY};
+  unsigned rawDepths[3] = {8, 16, 8};
+  for(size_t i = 0; i < 5; i++) {
+    // tall enough for the decompressed data to not fit in one piece of the row pipeline
+    Image image;
+    generateTestImage(image, 37, 3001, colorTypes[i], bitDepths[i]);
+    lodepng::State state;
+    state.info_raw.colortype = image.colorType;
+    state.info_raw.bitdepth = image.bitDepth;
+    state.encoder.auto_convert = 0;
+    state.info_png.color.colortype = image.colorType;
+    state.info_png.color.bitdepth = image.bitDepth;
+    if(image.colorType == LCT_PALETTE) {
+      for(size_t j = 0; j < 16; j++) {
+        lodepng_palette_add(&state.info_raw, j * 16, 255 - j * 16, j, 255);
+        lodepng_palette_add(&state.info_png.color, j * 16, 255 - j * 16, j, 255);
+      }
+    }
+    std::vector<unsigned char> png;
+    ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, image.width, image.height, state));
+    for(size_t j = 0; j < 4; j++) {
+      lodepng::State rowstate, fullstate;
+      fullstate.decoder.zlibsettings.custom_zlib = TestFun::custom_zlib;
+      if(j < 3) {
+        rowstate.info_raw.colortype = fullstate.info_raw.colortype = rawTypes[j];
+        rowstate.info_raw.bitdepth = fullstate.info_raw.bitdepth = rawDepths[j];
+      } else {
+        rowstate.decoder.color_convert = fullstate.decoder.color_convert = 0;
+      }
+      std::vector<unsigned char> rows, full;
+      unsigned w, h;
+      unsigned error = lodepng::decode(full, w, h, fullstate, png);
+      ASSERT_EQUALS(error, lodepng::decode(rows, w, h, rowstate, png));
+      ASSERT_EQUALS(full, rows);
+      if(j == 3 && bitDepths[i] >= 8) ASSERT_EQUALS(image.data, rows);
+    }
+    // a missing last row must give an error
+    lodepng::State cropped;
+    cropped.decoder.ignore_crc = 1;
+    std::vector<unsigned char> tall = png, decoded;
+    unsigned w, h;
+    tall[22]++; // height in IHDR
+    ASSERT_TRUE(lodepng::decode(decoded, w, h, cropped, tall) != 0);
+  }
+}
+
+void doDecodeIntoTest(const std::vector<unsigned char>& png, LodePNGColorType colorType, unsigned bitDepth,
+                      bool color_convert) {
+  lodepng::State state;
+  state.info_raw.colortype = colorType;
+  state.info_raw.bitdepth = bitDepth;
+  state.decoder.color_convert = color_convert;
+  std::vector<unsigned char> expected;
+  unsigned w, h;
+  ASSERT_NO_PNG_ERROR(lodepng::decode(expected, w, h, state, png));
+  size_t linebits = w * lodepng_get_bpp(&state.info_raw);
+  size_t stride = (linebits + 7) / 8 + 5;
+
+  lodepng::State intostate;
+  intostate.info_raw.colortype = colorType;
+  intostate.info_raw.bitdepth = bitDepth;
+  intostate.decoder.color_convert = color_convert;
+  std::vector<unsigned char> buffer(stride * h, 171);
+  unsigned into_w, into_h;
+  ASSERT_NO_PNG_ERROR(lodepng_decode_into(buffer.data(), stride, buffer.size(), &into_w, &into_h,
+                                          &intostate, png.data(), png.size()));
+  ASSERT_EQUALS(w, into_w);
+  ASSERT_EQUALS(h, into_h);
+  for(size_t y = 0; y < h; y++) {
+    for(size_t i = 0; i < linebits; i++) {
+      size_t a = y * linebits + i, b = y * stride * 8 + i;
+      ASSERT_EQUALS((expected[a >> 3] >> (7 - (a & 7))) & 1, (buffer[b >> 3] >> (7 - (b & 7))) & 1);
+    }
+    for(size_t i = (linebits + 7) / 8; i < stride; i++) ASSERT_EQUALS(171, buffer[y * stride + i]);
+  }
+
+  // the last row doesn't need padding up to the stride, but the buffer must have room for all rows
+  lodepng::State smallstate;
+  smallstate.info_raw.colortype = colorType;
+  smallstate.info_raw.bitdepth = bitDepth;
+  smallstate.decoder.color_convert = color_convert;
+  size_t needed = stride * (h - 1) + (linebits + 7) / 8;
+  ASSERT_NO_PNG_ERROR(lodepng_decode_into(buffer.data(), stride, needed, &into_w, &into_h,
+                                          &smallstate, png.data(), png.size()));
+  ASSERT_EQUALS(124, lodepng_decode_into(buffer.data(), stride, needed - 1, &into_w, &into_h,
+                                         &smallstate, png.data(), png.size()));
+  ASSERT_EQUALS(124, lodepng_decode_into(buffer.data(), (linebits + 7) / 8 - 1, buffer.size(), &into_w, &into_h,
+                                         &smallstate, png.data(), png.size()));
+}
+
+void testDecodeInto() {
+  std::cout << "testDecodeInto" << std::endl;
+  LodePNGColorType colorTypes[5] = {LCT_GREY, LCT_RGB, LCT_PALETTE, LCT_GREY_ALPHA, LCT_RGBA};
+  unsigned bitDepths[5] = {1, 16, 4, 8, 8};
+  for(size_t i = 0; i < 5; i++) {
+    for(unsigned interlace = 0; interlace < 2; interlace++) {
+      Image image;
+      generateTestImage(image, 53, 41, colorTypes[i], bitDepths[i]);
+      lodepng::State state;
+      state.info_raw.colortype = image.colorType;
+      state.info_raw.bitdepth = image.bitDepth;
+      state.info_png.interlace_method = interlace;
+      if(image.colorType == LCT_PALETTE) {
+        for(size_t j = 0; j < 16; j++) {
+          lodepng_palette_add(&state.info_raw, j * 16, 255 - j * 16, j, 255);
+        }
+      }
+      std::vector<unsigned char> png;
+      ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, image.width, image.height, state));
+      doDecodeIntoTest(png, LCT_RGBA, 8, true);
+      doDecodeIntoTest(png, LCT_RGB, 16, true);
+      doDecodeIntoTest(png, LCT_RGBA, 8, false);
+    }
+  }
+}
+
+void doDecodeRegionTest(const std::vector<unsigned char>& png, LodePNGColorType colorType, unsigned bitDepth,
+                        bool color_convert, unsigned x0, unsigned y0, unsigned rw, unsigned rh) {
+  lodepng::State state;
+  state.info_raw.colortype = colorType;
+  state.info_raw.bitdepth = bitDepth;
+  state.decoder.color_convert = color_convert;
+  std::vector<unsigned char> full;
+  unsigned w, h;
+  ASSERT_NO_PNG_ERROR(lodepng::decode(full, w, h, state, png));
+  size_t bpp = lodepng_get_bpp(&state.info_raw);
+
+  lodepng::State regionstate;
+  regionstate.info_raw.colortype = colorType;
+  regionstate.info_raw.bitdepth = bitDepth;
+  regionstate.decoder.color_convert = color_convert;
+  unsigned char* region = 0;
+  ASSERT_NO_PNG_ERROR(lodepng_decode_region(&region, x0, y0, rw, rh, &regionstate, png.data(), png.size()));
+  for(size_t y = 0; y < rh; y++) {
+    for(size_t i = 0; i < rw * bpp; i++) {
+      size_t a = (y + y0) * w * bpp + x0 * bpp + i, b = y * rw * bpp + i;
+      ASSERT_EQUALS((full[a >> 3] >> (7 - (a & 7))) & 1, (region[b >> 3] >> (7 - (b & 7))) & 1);
+    }
+  }
+  free(region);
+}
+
+void testDecodeRegion() {
+  std::cout << "testDecodeRegion" << std::endl;
+  LodePNGColorType colorTypes[5] = {LCT_GREY, LCT_RGB, LCT_PALETTE, LCT_GREY_ALPHA, LCT_RGBA};
+  unsigned bitDepths[5] = {1, 16, 4, 8, 8};
+  for(size_t i = 0; i < 5; i++) {
+    for(unsigned interlace = 0; interlace < 2; interlace++) {
+      Image image;
+      generateTestImage(image, 53, 1201, colorTypes[i], bitDepths[i]);
+      lodepng::State state;
+      state.info_raw.colortype = image.colorType;
+      state.info_raw.bitdepth = image.bitDepth;
+      state.info_png.interlace_method = interlace;
+      if(image.colorType == LCT_PALETTE) {
+        for(size_t j = 0; j < 16; j++) {
+          lodepng_palette_add(&state.info_raw, j * 16, 255 - j * 16, j, 255);
+        }
+      }
+      std::vector<unsigned char> png;
+      ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, image.width, image.height, state));
+      doDecodeRegionTest(png, LCT_RGBA, 8, true, 0, 0, 53, 1201);
+      doDecodeRegionTest(png, LCT_RGBA, 8, true, 3, 17, 20, 30);
+      doDecodeRegionTest(png, LCT_RGB, 16, true, 52, 1200, 1, 1);
+      doDecodeRegionTest(png, LCT_RGBA, 8, false, 5, 0, 47, 11);
+      doDecodeRegionTest(png, LCT_RGBA, 8, false, 0, 1000, 53, 201);
+    }
+  }
+
+  std::vector<unsigned char> png;
+  createComplexPNG(png);
+  unsigned char* region = 0;
+  lodepng::State state;
+  ASSERT_EQUALS(125, lodepng_decode_region(&region, 0, 0, 0, 1, &state, png.data(), png.size()));
+  ASSERT_EQUALS(125, lodepng_decode_region(&region, 1, 0, 16, 1, &state, png.data(), png.size()));
+  ASSERT_EQUALS(125, lodepng_decode_region(&region, 0, 17, 1, 1, &state, png.data(), png.size()));
+
+  // rows below the region are not decompressed, so missing data doesn't matter for the top rows
+  Image image;
+  generateTestImage(image, 64, 4000);
+  std::vector<unsigned char> big;
+  ASSERT_NO_PNG_ERROR(lodepng::encode(big, image.data, image.width, image.height));
+  std::vector<unsigned char> truncated = splitIdat(big, 10000, big.size() / 2);
+  std::vector<unsigned char> expected(image.data.begin(), image.data.begin() + 64 * 4 * 10);
+  lodepng::State truncstate;
+  ASSERT_NO_PNG_ERROR(lodepng_decode_region(&region, 0, 0, 64, 10, &truncstate, truncated.data(), truncated.size()));
+  ASSERT_EQUALS(expected, std::vector<unsigned char>(region, region + expected.size()));
+  free(region);
+}
+
+// decodes downscaled to RGBA with the given bit depth and compares with averaging or sampling the full image
+void doDecodeScaledTest(const std::vector<unsigned char>& png, unsigned bitDepth, unsigned shift, bool interlaced) {
+  lodepng::State state;
+  state.info_raw.bitdepth = bitDepth;
+  std::vector<unsigned char> full;
+  unsigned w, h;
+  ASSERT_NO_PNG_ERROR(lodepng::decode(full, w, h, state, png));
+  size_t bytes = bitDepth / 8; // per channel
+  unsigned size = 1u << shift;
+
+  lodepng::State scaledstate;
+  scaledstate.info_raw.bitdepth = bitDepth;
+  unsigned char* scaled = 0;
+  unsigned sw, sh;
+  ASSERT_NO_PNG_ERROR(lodepng_decode_scaled(&scaled, &sw, &sh, shift, &scaledstate, png.data(), png.size()));
+  ASSERT_EQUALS((w + size - 1) / size, sw);
+  ASSERT_EQUALS((h + size - 1) / size, sh);
+  for(size_t y = 0; y < sh; y++) {
+    for(size_t x = 0; x < sw; x++) {
+      for(size_t c = 0; c < 4; c++) {
+        unsigned expected;
+        if(interlaced) {
+          size_t i = ((y * size * w + x * size) * 4 + c) * bytes;
+          expected = bytes == 2 ? 256u * full[i] + full[i + 1] : full[i];
+        } else {
+          unsigned sum = 0, count = 0;
+          for(size_t by = y * size; by < std::min<size_t>(h, (y + 1) * size); by++) {
+            for(size_t bx = x * size; bx < std::min<size_t>(w, (x + 1) * size); bx++) {
+              size_t i = ((by * w + bx) * 4 + c) * bytes;
+              sum += bytes == 2 ? 256u * full[i] + full[i + 1] : full[i];
+              count++;
+            }
+          }
+          expected = (sum + count / 2) / count;
+        }
+        size_t i = ((y * sw + x) * 4 + c) * bytes;
+        ASSERT_EQUALS(expected, bytes == 2 ? 256u * scaled[i] + scaled[i + 1] : scaled[i]);
+      }
+    }
+  }
+  free(scaled);
+}
+
+void testDecodeScaled() {
+  std::cout << "testDecodeScaled" << std::endl;
+  LodePNGColorType colorTypes[4] = {LCT_GREY, LCT_RGB, LCT_PALETTE, LCT_RGBA};
+  unsigned bitDepths[4] = {1, 16, 4, 8};
+  for(size_t i = 0; i < 4; i++) {
+    for(unsigned interlace = 0; interlace < 2; interlace++) {
+      Image image;
+      generateTestImage(image, 53, 43, colorTypes[i], bitDepths[i]);
+      lodepng::State state;
+      state.info_raw.colortype = image.colorType;
+      state.info_raw.bitdepth = image.bitDepth;
+      state.info_png.interlace_method = interlace;
+      if(image.colorType == LCT_PALETTE) {
+        for(size_t j = 0; j < 16; j++) {
+          lodepng_palette_add(&state.info_raw, j * 16, 255 - j * 16, j, 255);
+        }
+      }
+      std::vector<unsigned char> png;
+      ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, image.width, image.height, state));
+      for(unsigned shift = 1; shift <= 3; shift++) {
+        doDecodeScaledTest(png, 8, shift, interlace != 0);
+        doDecodeScaledTest(png, 16, shift, interlace != 0);
+      }
+    }
+  }
+
+  Image image;
+  generateTestImage(image, 20, 20);
+  std::vector<unsigned char> png;
+  ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, image.width, image.height));
+  unsigned char* scaled = 0;
+  unsigned w, h;
+  lodepng::State state;
+  ASSERT_EQUALS(126, lodepng_decode_scaled(&scaled, &w, &h, 0, &state, png.data(), png.size()));
+  ASSERT_EQUALS(126, lodepng_decode_scaled(&scaled, &w, &h, 4, &state, png.data(), png.size()));
+  lodepng::State palettestate;
+  palettestate.info_raw.colortype = LCT_PALETTE;
+  lodepng_palette_add(&palettestate.info_raw, 0, 0, 0, 255);
+  ASSERT_EQUALS(126, lodepng_decode_scaled(&scaled, &w, &h, 1, &palettestate, png.data(), png.size()));
+}
+
 //test that, by default, it chooses filter type zero for all scanlines if the image has a palette
 void testPaletteFilterTypesZero() {
   std::cout << "testPaletteFilterTypesZero" << std::endl;
@@ -1802,6 +3245,221 @@ void testCustomInflate() {
 }
 
 
+struct StreamRows {
+  std::vector<unsigned char>* out;
+  LodePNGStreamDecoder* decoder;
+  unsigned numrows;
+};
+
+void streamRowCallback(void* context, unsigned y, const unsigned char* row) {
+  StreamRows* rows = (StreamRows*)context;
+  ASSERT_EQUALS(rows->numrows, y);
+  size_t rowbytes = lodepng_get_raw_size(rows->decoder->w, 1, &rows->decoder->state->info_raw);
+  rows->out->insert(rows->out->end(), row, row + rowbytes);
+  rows->numrows++;
+}
+
+// decodes with the stream decoder, feeding the png in pieces of the given size. The output
+// rows are concatenated, so the output color mode must have a multiple of 8 bits per row.
+unsigned streamDecode(std::vector<unsigned char>& out, unsigned& w, unsigned& h, lodepng::State& state,
+                      const std::vector<unsigned char>& png, size_t piece) {
+  LodePNGStreamDecoder decoder;
+  lodepng_stream_decoder_init(&decoder, &state);
+  StreamRows rows;
+  rows.out = &out;
+  rows.decoder = &decoder;
+  rows.numrows = 0;
+  out.clear();
+  decoder.row_callback = streamRowCallback;
+  decoder.context = &rows;
+  unsigned error = 0;
+  for(size_t pos = 0; !error && pos < png.size(); pos += piece) {
+    size_t amount = std::min(piece, png.size() - pos);
+    error = lodepng_stream_decoder_feed(&decoder, &png[pos], amount);
+  }
+  if(!error) error = lodepng_stream_decoder_finish(&decoder);
+  w = decoder.w;
+  h = decoder.h;
+  lodepng_stream_decoder_cleanup(&decoder);
+  return error;
+}
+
+void doStreamDecoderTest(const std::vector<unsigned char>& png, LodePNGColorType colorType, unsigned bitDepth, bool color_convert) {
+  lodepng::State state;
+  state.info_raw.colortype = colorType;
+  state.info_raw.bitdepth = bitDepth;
+  state.decoder.color_convert = color_convert;
+  std::vector<unsigned char> expected;
+  unsigned w, h;
+  ASSERT_NO_PNG_ERROR(lodepng::decode(expected, w, h, state, png));
+
+  size_t pieces[3] = {1, 7, png.size()};
+  for(size_t i = 0; i < 3; i++) {
+    lodepng::State streamstate;
+    streamstate.info_raw.colortype = colorType;
+    streamstate.info_raw.bitdepth = bitDepth;
+    streamstate.decoder.color_convert = color_convert;
+    std::vector<unsigned char> streamed;
+    unsigned stream_w, stream_h;
+    ASSERT_NO_PNG_ERROR(streamDecode(streamed, stream_w, stream_h, streamstate, png, pieces[i]));
+    ASSERT_EQUALS(w, stream_w);
+    ASSERT_EQUALS(h, stream_h);
+    ASSERT_EQUALS(expected, streamed);
+    ASSERT_EQUALS(state.info_raw.colortype, streamstate.info_raw.colortype);
+    ASSERT_EQUALS(state.info_raw.bitdepth, streamstate.info_raw.bitdepth);
+  }
+
+  // truncated input must give an error
+  std::vector<unsigned char> truncated(png.begin(), png.end() - 13);
+  std::vector<unsigned char> streamed;
+  lodepng::State streamstate;
+  ASSERT_TRUE(streamDecode(streamed, w, h, streamstate, truncated, 100) != 0);
+}
+
+void testStreamDecoder() {
+  std::cout << "testStreamDecoder" << std::endl;
+  LodePNGColorType colorTypes[5] = {LCT_GREY, LCT_RGB, LCT_PALETTE, LCT_GREY_ALPHA, LCT_RGBA};
+  unsigned bitDepths[5] = {1, 16, 4, 8, 8};
+  for(size_t i = 0; i < 5; i++) {
+    for(unsigned interlace = 0; interlace < 2; interlace++) {
+      for(unsigned btype = 0; btype < 3; btype += 2) {
+        Image image;
+        generateTestImage(image, 301, 257, colorTypes[i], bitDepths[i]);
+        lodepng::State state;
+        state.info_raw.colortype = image.colorType;
+        state.info_raw.bitdepth = image.bitDepth;
+        state.info_png.interlace_method = interlace;
+        state.encoder.zlibsettings.btype = btype;
+        if(image.colorType == LCT_PALETTE) {
+          for(size_t j = 0; j < 16; j++) {
+            lodepng_palette_add(&state.info_raw, j * 16, 255 - j * 16, j, 255);
+          }
+        }
+        std::vector<unsigned char> png;
+        ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, image.width, image.height, state));
+        doStreamDecoderTest(png, LCT_RGBA, 8, true);
+        doStreamDecoderTest(png, LCT_RGB, 16, true);
+        if(bitDepths[i] >= 8) doStreamDecoderTest(png, LCT_RGBA, 8, false);
+      }
+    }
+  }
+
+  std::vector<unsigned char> png;
+  createComplexPNG(png);
+  doStreamDecoderTest(png, LCT_RGBA, 8, true);
+  doStreamDecoderTest(png, LCT_PALETTE, 8, false);
+
+  // the chunks are read as well
+  lodepng::State state;
+  state.decoder.remember_unknown_chunks = 1;
+  std::vector<unsigned char> streamed;
+  unsigned w, h;
+  ASSERT_NO_PNG_ERROR(streamDecode(streamed, w, h, state, png, 5));
+  ASSERT_EQUALS(3, state.info_png.text_num);
+  ASSERT_STRING_EQUALS("key1", state.info_png.text_keys[1]);
+  ASSERT_STRING_EQUALS("istring1", state.info_png.itext_strings[1]);
+  ASSERT_EQUALS(2012, state.info_png.time.year);
+  ASSERT_EQUALS(30, state.info_png.unknown_chunks_size[0]);
+  ASSERT_EQUALS(15, state.info_png.unknown_chunks_size[1]);
+  ASSERT_EQUALS(15, state.info_png.unknown_chunks_size[2]);
+
+  // with a custom zlib decompressor, which gets all compressed data at once
+  struct TestFun {
+    static unsigned custom_zlib(unsigned char** out, size_t* outsize,
+                                const unsigned char* in, size_t insize,
+                                const LodePNGDecompressSettings*) {
+      custom_proof = 1;
+      LodePNGDecompressSettings settings;
+      lodepng_decompress_settings_init(&settings);
+      return lodepng_zlib_decompress(out, outsize, in, insize, &settings);
+    }
+  };
+  std::vector<unsigned char> expected;
+  ASSERT_NO_PNG_ERROR(lodepng::decode(expected, w, h, png));
+  lodepng::State customstate;
+  customstate.decoder.zlibsettings.custom_zlib = TestFun::custom_zlib;
+  custom_proof = 0;
+  ASSERT_NO_PNG_ERROR(streamDecode(streamed, w, h, customstate, png, 3));
+  ASSERT_EQUALS(1, custom_proof);
+  ASSERT_EQUALS(expected, streamed);
+}
+
+struct StreamPasses {
+  std::vector<unsigned> passes;
+  std::vector<std::vector<unsigned char> > images;
+  std::vector<size_t> fed; // amount of input fed when each pass was given
+  size_t pos;
+  size_t size; // size of the preview images in bytes
+};
+
+void streamPassCallback(void* context, unsigned pass, const unsigned char* image) {
+  StreamPasses* passes = (StreamPasses*)context;
+  passes->passes.push_back(pass);
+  passes->images.push_back(std::vector<unsigned char>(image, image + passes->size));
+  passes->fed.push_back(passes->pos);
+}
+
+void doStreamDecoderPassesTest(const std::vector<unsigned char>& png, LodePNGColorType colorType, unsigned bitDepth,
+                               bool color_convert) {
+  lodepng::State state;
+  state.info_raw.colortype = colorType;
+  state.info_raw.bitdepth = bitDepth;
+  state.decoder.color_convert = color_convert;
+  std::vector<unsigned char> expected;
+  unsigned w, h;
+  ASSERT_NO_PNG_ERROR(lodepng::decode(expected, w, h, state, png));
+
+  lodepng::State streamstate;
+  streamstate.info_raw.colortype = colorType;
+  streamstate.info_raw.bitdepth = bitDepth;
+  streamstate.decoder.color_convert = color_convert;
+  LodePNGStreamDecoder decoder;
+  lodepng_stream_decoder_init(&decoder, &streamstate);
+  StreamPasses passes;
+  passes.size = expected.size();
+  decoder.pass_callback = streamPassCallback;
+  decoder.context = &passes;
+  for(passes.pos = 0; passes.pos < png.size(); passes.pos += 100) {
+    ASSERT_NO_PNG_ERROR(lodepng_stream_decoder_feed(&decoder, &png[passes.pos], std::min<size_t>(100, png.size() - passes.pos)));
+  }
+  ASSERT_NO_PNG_ERROR(lodepng_stream_decoder_finish(&decoder));
+  lodepng_stream_decoder_cleanup(&decoder);
+
+  ASSERT_EQUALS(7, passes.passes.size());
+  for(unsigned i = 0; i < 7; i++) ASSERT_EQUALS(i, passes.passes[i]);
+  // the first pass is given before the end of the file
+  ASSERT_TRUE(passes.fed[0] < passes.fed[6]);
+  ASSERT_EQUALS(expected, passes.images[6]);
+  // the first preview has the pixels of the first pass repeated over 8x8 blocks
+  size_t bpp = lodepng_get_bpp(&streamstate.info_raw);
+  for(size_t y = 0; y < h; y++) {
+    for(size_t x = 0; x < w; x++) {
+      for(size_t i = 0; i < bpp; i++) {
+        size_t a = ((y & ~7u) * w + (x & ~7u)) * bpp + i, b = (y * w + x) * bpp + i;
+        ASSERT_EQUALS((expected[a >> 3] >> (7 - (a & 7))) & 1, (passes.images[0][b >> 3] >> (7 - (b & 7))) & 1);
+      }
+    }
+  }
+}
+
+void testStreamDecoderPasses() {
+  std::cout << "testStreamDecoderPasses" << std::endl;
+  LodePNGColorType colorTypes[3] = {LCT_GREY, LCT_RGB, LCT_RGBA};
+  unsigned bitDepths[3] = {1, 16, 8};
+  for(size_t i = 0; i < 3; i++) {
+    Image image;
+    generateTestImage(image, 123, 101, colorTypes[i], bitDepths[i]);
+    lodepng::State state;
+    state.info_raw.colortype = image.colorType;
+    state.info_raw.bitdepth = image.bitDepth;
+    state.info_png.interlace_method = 1;
+    std::vector<unsigned char> png;
+    ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, image.width, image.height, state));
+    doStreamDecoderPassesTest(png, LCT_RGBA, 8, true);
+    doStreamDecoderPassesTest(png, LCT_RGBA, 8, false);
+  }
+}
+
 void testChunkUtil() {
   std::cout << "testChunkUtil" << std::endl;
   std::vector<unsigned char> png;
@@ -1924,6 +3582,109 @@ void testPredefinedFilters() {
   for(size_t i = 0; i < h; i++) ASSERT_EQUALS(3, outfilters[i]);
 }
 
+// Encodes with each filter type for every bytewidth and checks the decoder unfilters it back exactly.
+void testUnfilterBytewidths() {
+  std::cout << "testUnfilterBytewidths" << std::endl;
+  LodePNGColorType colorTypes[6] = {LCT_GREY, LCT_GREY_ALPHA, LCT_RGB, LCT_RGBA, LCT_RGB, LCT_RGBA};
+  unsigned bitDepths[6] = {8, 8, 8, 8, 16, 16}; // bytewidths 1, 2, 3, 4, 6 and 8
+  for(size_t i = 0; i < 6; i++) {
+    for(unsigned interlace = 0; interlace < 2; interlace++) {
+      // odd width so rows are not a multiple of the vector size
+      unsigned w = 37, h = 13;
+      Image image;
+      generateTestImage(image, w, h, colorTypes[i], bitDepths[i]);
+      for(unsigned filter = 0; filter < 6; filter++) {
+        // filter 5 alternates all types, to have each one after each other one
+        std::vector<unsigned char> predefined(h);
+        for(size_t y = 0; y < predefined.size(); y++) predefined[y] = filter == 5 ? (y * 3) % 5 : filter;
+        lodepng::State state;
+        state.info_raw.colortype = state.info_png.color.colortype = image.colorType;
+        state.info_raw.bitdepth = state.info_png.color.bitdepth = image.bitDepth;
+        state.info_png.interlace_method = interlace;
+        state.encoder.auto_convert = 0;
+        state.encoder.filter_strategy = LFS_PREDEFINED;
+        state.encoder.predefined_filters = &predefined[0];
+        std::vector<unsigned char> png;
+        ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, w, h, state));
+        std::vector<unsigned char> decoded;
+        unsigned w2, h2;
+        lodepng::State decoder;
+        decoder.decoder.color_convert = 0;
+        ASSERT_NO_PNG_ERROR(lodepng::decode(decoded, w2, h2, decoder, png));
+        ASSERT_EQUALS(image.data, decoded);
+      }
+    }
+  }
+}
+
+// The filter type LFS_MINSUM chooses for the scanline, computed in the simplest way as reference
+static unsigned char minsumFilterType(const unsigned char* line, const unsigned char* prev, size_t length,
+                                      size_t bytewidth) {
+  unsigned char best = 0;
+  size_t smallest = 0;
+  for(unsigned char type = 0; type < 5; type++) {
+    size_t sum = 0;
+    for(size_t i = 0; i < length; i++) {
+      int a = i >= bytewidth ? line[i - bytewidth] : 0;
+      int b = prev ? prev[i] : 0;
+      int c = prev && i >= bytewidth ? prev[i - bytewidth] : 0;
+      int pred = 0;
+      if(type == 1) pred = a;
+      if(type == 2) pred = b;
+      if(type == 3) pred = (a + b) / 2;
+      if(type == 4) {
+        int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+      }
+      unsigned char d = (unsigned char)(line[i] - pred);
+      sum += type == 0 ? d : (d < 128 ? d : 256 - d - 1);
+    }
+    if(type == 0 || sum < smallest) {
+      best = type;
+      smallest = sum;
+    }
+  }
+  return best;
+}
+
+void testAdaptiveFilters() {
+  std::cout << "testAdaptiveFilters" << std::endl;
+  LodePNGColorType colorTypes[4] = {LCT_GREY, LCT_RGB, LCT_RGBA, LCT_RGBA};
+  unsigned bitDepths[4] = {8, 8, 8, 16};
+  for(size_t i = 0; i < 4; i++) {
+    // wide enough for the vectorized code, and not a multiple of the vector size
+    unsigned w = 71, h = 20;
+    Image image;
+    generateTestImage(image, w, h, colorTypes[i], bitDepths[i]);
+    for(int strategy = 0; strategy < 2; strategy++) {
+      lodepng::State state;
+      state.info_raw.colortype = state.info_png.color.colortype = image.colorType;
+      state.info_raw.bitdepth = state.info_png.color.bitdepth = image.bitDepth;
+      state.encoder.auto_convert = 0;
+      state.encoder.filter_palette_zero = 0;
+      state.encoder.filter_strategy = strategy == 0 ? LFS_MINSUM : LFS_ENTROPY;
+      std::vector<unsigned char> png;
+      ASSERT_NO_PNG_ERROR(lodepng::encode(png, image.data, w, h, state));
+      std::vector<unsigned char> decoded;
+      unsigned w2, h2;
+      lodepng::State decoder;
+      decoder.decoder.color_convert = 0;
+      ASSERT_NO_PNG_ERROR(lodepng::decode(decoded, w2, h2, decoder, png));
+      ASSERT_EQUALS(image.data, decoded);
+      if(strategy == 0) {
+        std::vector<unsigned char> types;
+        ASSERT_NO_PNG_ERROR(lodepng::getFilterTypes(types, png));
+        size_t bpp = lodepng_get_bpp(&state.info_png.color);
+        size_t linebytes = (w * bpp + 7) / 8, bytewidth = (bpp + 7) / 8;
+        for(size_t y = 0; y < h; y++) {
+          const unsigned char* prev = y == 0 ? 0 : &image.data[(y - 1) * linebytes];
+          ASSERT_EQUALS(minsumFilterType(&image.data[y * linebytes], prev, linebytes, bytewidth), types[y]);
+        }
+      }
+    }
+  }
+}
+
 void testEncoderErrors() {
   std::cout << "testEncoderErrors" << std::endl;
 
@@ -3470,10 +5231,18 @@ void testBase64Image(const std::string& png64, bool expect_error, unsigned expec
   std::vector<unsigned char> decoded;
   unsigned w, h;
   unsigned error = lodepng::decode(decoded, w, h, png);
+  std::vector<unsigned char> streamed;
+  lodepng::State streamstate;
+  unsigned stream_error = streamDecode(streamed, w, h, streamstate, png, 7);
   if(expect_error) {
     ASSERT_EQUALS(true, error != 0);
+    ASSERT_EQUALS(true, stream_error != 0);
     return;
   }
+  assertNoError(stream_error);
+  ASSERT_EQUALS(expect_w, w);
+  ASSERT_EQUALS(expect_h, h);
+  ASSERT_EQUALS(expect_md5, md5sum(streamed));
   assertNoError(error);
   ASSERT_EQUALS(expect_w, w);
   ASSERT_EQUALS(expect_h, h);
@@ -3942,7 +5711,16 @@ void doMain() {
   testPaletteFilterTypesZero();
   testComplexPNG();
   testInspectChunk();
+  testSplitIdat();
+  testRowPipeline();
+  testDecodeInto();
+  testDecodeRegion();
+  testDecodeScaled();
+  testStreamDecoder();
+  testStreamDecoderPasses();
   testPredefinedFilters();
+  testUnfilterBytewidths();
+  testAdaptiveFilters();
   testFuzzing();
   testEncoderErrors();
   testPaletteToPaletteDecode();
@@ -3972,6 +5750,22 @@ void doMain() {
 
   //Zlib
   testCompressZlib();
+  testInflateLong();
+  testInflateRepeats();
+  testParallelDeflate();
+  testParallelFilter();
+  testParallelColor();
+  testParallelAdam7();
+  testDecoderContext();
+  testEncoderContext();
+  testAllocator();
+  testMemoryBudget();
+  testMapFile();
+  testColorTable();
+  testColorStatsBulk();
+  testPaletteBitsConvert();
+  testConvertAllPairs();
+  testRawLayout();
   testHuffmanCodeLengths();
   testCustomZlibCompress();
   testCustomZlibCompress2();